@@ -0,0 +1,349 @@
+// Stage-by-stage benchmark on synthetic cubemaps. Build with "make bench";
+// see printUsage for the options.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "cubemap.hpp"
+#include "render.hpp"
+#include "row_writer.hpp"
+#include "sample_kernels.hpp"
+#include "stb_image_write.hpp"
+#include "thread_pool.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+template <typename T>
+inline typename T::value_type pop_from(T& container) {
+	typename T::value_type val = container.back();
+	container.pop_back();
+	return val;
+}
+
+void printUsage() {
+	std::cerr <<
+		"SpheremapBench v.GIT\n"
+		"\n"
+		"Usage:\n"
+		"  SpheremapBench [opts]\n"
+		"\n"
+		"Renders synthetic cubemaps to an equirect twice as wide as the faces and\n"
+		"times every stage on its own, then the whole render across thread counts.\n"
+		"\n"
+		"Available options:\n"
+		"  -face-size <int> Adds a face size to test; may be repeated. (Default: 256 and 512)\n"
+		"  -threads <int>   Highest thread count for the scaling runs.\n"
+		"                   (Default: number of CPU cores)\n"
+		"  -reps <int>      Runs per measurement; the fastest one counts. (Default: 3)\n"
+		"  -tmp <prefix>    Prefix for the temporary files used by the decode and encode\n"
+		"                   stages. (Default: \"spheremap_bench_\")\n"
+		"  -h / -help       Print this help text.\n"
+		"\n";
+}
+
+struct AaLevel {
+	int num_samples;
+	const float* pattern;
+};
+
+const AaLevel aa_levels[] = {
+	{ 1, aa_pattern_none },
+	{ 5, aa_pattern_5x },
+	{ 16, aa_pattern_16x }
+};
+
+const SampleKernel* const all_kernels[] = {
+	&sample_kernel_scalar,
+	&sample_kernel_sse2,
+	&sample_kernel_avx2,
+	&sample_kernel_neon
+};
+
+// A different hue per face with a checkerboard and gradients on top, so the
+// filter sees both hard edges and smooth ramps.
+void makeSyntheticFaces(int face_size, Image (&out_faces)[Cubemap::NUM_FACES]) {
+	static const u8 face_tints[Cubemap::NUM_FACES][3] = {
+		{ 255, 64, 64 }, { 64, 255, 255 },
+		{ 64, 255, 64 }, { 255, 64, 255 },
+		{ 64, 64, 255 }, { 255, 255, 64 }
+	};
+	const int checker_size = std::max(face_size / 16, 1);
+
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		Image face(face_size, face_size);
+		u32* pixels = reinterpret_cast<u32*>(face.data.get());
+
+		for (int y = 0; y < face_size; ++y) {
+			for (int x = 0; x < face_size; ++x) {
+				const bool dark = ((x / checker_size) ^ (y / checker_size)) & 1;
+				const int ramp = 128 + 127 * (x + y) / (2 * face_size);
+				const int level = dark ? ramp / 2 : ramp;
+				pixels[y * face_size + x] = makeColor(
+					static_cast<u8>(face_tints[f][0] * level / 255),
+					static_cast<u8>(face_tints[f][1] * level / 255),
+					static_cast<u8>(face_tints[f][2] * level / 255));
+			}
+		}
+		out_faces[f] = std::move(face);
+	}
+}
+
+void printResult(const std::string& label, double seconds, double pixels, double samples) {
+	std::cout << "  " << std::left << std::setw(36) << label << std::right << std::fixed
+		<< std::setw(10) << std::setprecision(1) << pixels / seconds * 1e-6 << " Mpixels/s"
+		<< std::setw(10) << std::setprecision(2) << seconds * 1e9 / samples << " ns/sample\n";
+}
+
+struct StageTimes {
+	double directions, project, sample, resolve;
+
+	StageTimes() : directions(0), project(0), sample(0), resolve(0) {}
+};
+
+// Runs the fixed-AA pipeline of renderRows over the whole image on one
+// thread, timing each step of every chunk separately.
+StageTimes timeStages(const Cubemap& cubemap, const RenderSettings& settings, std::vector<u32>& out_data) {
+	const int output_size = settings.output_size;
+	const int num_samples = settings.num_aa_samples;
+	const int chunk_pixels = 64;
+
+	SampleBuffers buffers(chunk_pixels * num_samples);
+	StageTimes times;
+
+	for (int y = 0; y < output_size; ++y) {
+		for (int chunk_x = 0; chunk_x < output_size; chunk_x += chunk_pixels) {
+			const int chunk_end = std::min(chunk_x + chunk_pixels, output_size);
+			const int count = (chunk_end - chunk_x) * num_samples;
+
+			Clock::time_point start = Clock::now();
+			settings.directions->generate(y, chunk_x, chunk_end, buffers.dir_x.data(), buffers.dir_y.data(), buffers.dir_z.data());
+			Clock::time_point generated = Clock::now();
+			buffers.project(*settings.kernel, settings.source, count);
+			Clock::time_point projected = Clock::now();
+			buffers.sampleProjected(cubemap, *settings.kernel, settings.filter, count);
+			Clock::time_point sampled = Clock::now();
+			for (int x = chunk_x; x < chunk_end; ++x)
+				out_data[size_t(y) * output_size + x] = averageSamples(settings.filter, &buffers.color[(x - chunk_x) * num_samples], num_samples);
+			Clock::time_point resolved = Clock::now();
+
+			times.directions += std::chrono::duration<double>(generated - start).count();
+			times.project += std::chrono::duration<double>(projected - generated).count();
+			times.sample += std::chrono::duration<double>(sampled - projected).count();
+			times.resolve += std::chrono::duration<double>(resolved - sampled).count();
+		}
+	}
+	return times;
+}
+
+void benchFaceSize(int face_size, int max_threads, int reps, const std::string& tmp_prefix) {
+	const int output_size = face_size * 2;
+	const double output_pixels = double(output_size) * output_size;
+
+	std::cout << "Faces " << face_size << "x" << face_size << ", output " << output_size << "x" << output_size << "\n";
+
+	Image face_images[Cubemap::NUM_FACES];
+	makeSyntheticFaces(face_size, face_images);
+
+	// Decode: goes through real PNG files, since that is what a run reads.
+	{
+		bool written = true;
+		for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+			const std::string filename = tmp_prefix + char('1' + f) + ".png";
+			written &= stbi_write_png(filename.c_str(), face_size, face_size, 4, face_images[f].data.get(), face_size * 4) != 0;
+		}
+
+		if (written) {
+			double best = 1e30;
+			for (int rep = 0; rep < reps; ++rep) {
+				Clock::time_point start = Clock::now();
+				Cubemap decoded(tmp_prefix, "png");
+				decoded.finishLoading();
+				best = std::min(best, secondsSince(start));
+			}
+			const double face_pixels = double(face_size) * face_size * Cubemap::NUM_FACES;
+			printResult("decode png (6 faces concurrently)", best, face_pixels, face_pixels);
+		} else {
+			std::cerr << "Failed to write temporary faces with prefix " << tmp_prefix << ".\n";
+		}
+
+		for (int f = 0; f < Cubemap::NUM_FACES; ++f)
+			std::remove((tmp_prefix + char('1' + f) + ".png").c_str());
+	}
+
+	const Cubemap cubemap(face_images);
+	std::vector<u32> out_data(size_t(output_size) * output_size);
+
+	for (const AaLevel& aa : aa_levels) {
+		const DirectionTables directions(MAPPING_EQUIRECT, output_size, output_size, aa.num_samples, aa.pattern);
+		const double num_samples = output_pixels * aa.num_samples;
+
+		RenderSettings settings;
+		settings.output_size = output_size;
+		settings.region = wholeOutput(MAPPING_EQUIRECT, output_size);
+		settings.source = MAPPING_CUBE;
+		settings.target = MAPPING_EQUIRECT;
+		settings.num_aa_samples = aa.num_samples;
+		settings.directions = &directions;
+		settings.kernel = &bestSampleKernel();
+		settings.filter = FILTER_FLOAT;
+		settings.mipmaps = false;
+		settings.corner_directions = nullptr;
+		settings.adaptive_aa = false;
+		settings.aa_threshold = 0;
+		settings.lut = nullptr;
+		settings.counters = nullptr;
+		settings.tile_faces = nullptr;
+
+		std::cout << " " << aa.num_samples << "x AA, 1 thread\n";
+
+		for (const SampleKernel* kernel : all_kernels) {
+			if (!isSampleKernelSupported(*kernel))
+				continue;
+
+			// The bench faces are 8-bit, which srgb reads as sRGB.
+			for (SampleFilter filter : { FILTER_FLOAT, FILTER_FIXED, FILTER_SRGB }) {
+				settings.kernel = kernel;
+				settings.filter = filter;
+
+				StageTimes best;
+				double best_total = 1e30;
+				for (int rep = 0; rep < reps; ++rep) {
+					StageTimes times = timeStages(cubemap, settings, out_data);
+					const double total = times.directions + times.project + times.sample + times.resolve;
+					if (total < best_total) {
+						best = times;
+						best_total = total;
+					}
+				}
+
+				const std::string name = std::string(kernel->name)
+					+ (filter == FILTER_FIXED ? "/fixed" : filter == FILTER_SRGB ? "/srgb" : "/float");
+				if (filter == FILTER_FLOAT) {
+					printResult(name + " directions", best.directions, output_pixels, num_samples);
+					printResult(name + " computeTexCoords", best.project, output_pixels, num_samples);
+				}
+				printResult(name + " sampleFace", best.sample, output_pixels, num_samples);
+				if (filter != FILTER_FIXED)
+					printResult(name + " AA resolve", best.resolve, output_pixels, num_samples);
+			}
+		}
+
+		// Whole renders, with the same scheduling as a real run.
+		settings.kernel = &bestSampleKernel();
+		settings.filter = FILTER_FLOAT;
+		std::cout << " " << aa.num_samples << "x AA, " << settings.kernel->name << "/float, full render\n";
+
+		for (int num_threads = 1; ; num_threads = std::min(num_threads * 2, max_threads)) {
+			ThreadPool thread_pool(num_threads);
+
+			double best = 1e30;
+			for (int rep = 0; rep < reps; ++rep) {
+				Clock::time_point start = Clock::now();
+				renderImage(thread_pool, cubemap, settings, out_data.data());
+				best = std::min(best, secondsSince(start));
+			}
+			printResult(std::to_string(num_threads) + (num_threads == 1 ? " thread" : " threads"), best, output_pixels, num_samples);
+
+			if (num_threads == max_threads)
+				break;
+		}
+	}
+
+	// Encode: the streaming writers on the last rendered image, PNG and QOI
+	// on every thread.
+	ThreadPool encode_pool(max_threads);
+	EncodeOptions encode;
+	encode.thread_pool = &encode_pool;
+	const char* const encode_formats[] = { "tga", "png", "qoi" };
+
+	for (const char* extension : encode_formats) {
+		const std::string filename = tmp_prefix + "out." + extension;
+		double best = 1e30;
+		bool written = true;
+
+		for (int rep = 0; rep < reps && written; ++rep) {
+			Clock::time_point start = Clock::now();
+			RowWriter writer;
+			written = writer.open(filename, RowWriter::formatFromFilename(filename), output_size, output_size, encode);
+			for (int y = 0; written && y < output_size; y += band_height)
+				writer.writeRows(&out_data[size_t(y) * output_size], std::min(band_height, output_size - y));
+			written = written && writer.close();
+			best = std::min(best, secondsSince(start));
+		}
+		std::remove(filename.c_str());
+
+		if (written)
+			printResult(std::string("encode ") + extension, best, output_pixels, output_pixels);
+		else
+			std::cerr << "Failed to write " << filename << ".\n";
+	}
+
+	std::cout << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+	std::vector<int> face_sizes;
+	int max_threads = ThreadPool::defaultThreadCount();
+	int reps = 3;
+	std::string tmp_prefix = "spheremap_bench_";
+
+	{
+		std::vector<std::string> input_params(std::reverse_iterator<char**>(argv+argc), std::reverse_iterator<char**>(argv+1));
+
+		while (!input_params.empty()) {
+			std::string opt = pop_from(input_params);
+
+			if (opt == "-face-size" && !input_params.empty()) {
+				const int face_size = std::stoi(pop_from(input_params));
+				if (face_size < 1) {
+					std::cerr << "Invalid face size.\n";
+					return 1;
+				}
+				face_sizes.push_back(face_size);
+			} else if (opt == "-threads" && !input_params.empty()) {
+				max_threads = std::stoi(pop_from(input_params));
+				if (max_threads < 1) {
+					std::cerr << "Invalid thread count.\n";
+					return 1;
+				}
+			} else if (opt == "-reps" && !input_params.empty()) {
+				reps = std::max(std::stoi(pop_from(input_params)), 1);
+			} else if (opt == "-tmp" && !input_params.empty()) {
+				tmp_prefix = pop_from(input_params);
+			} else if (opt == "-h" || opt == "-help") {
+				printUsage();
+				return 0;
+			} else {
+				std::cerr << "Unknown option " << opt << ". Try -help.\n";
+				return 1;
+			}
+		}
+	}
+
+	if (face_sizes.empty()) {
+		face_sizes.push_back(256);
+		face_sizes.push_back(512);
+	}
+
+	std::cout << "Best kernel: " << bestSampleKernel().name << ", up to " << max_threads << " threads\n\n";
+
+	for (int face_size : face_sizes)
+		benchFaceSize(face_size, max_threads, reps, tmp_prefix);
+
+	return 0;
+}
@@ -0,0 +1,215 @@
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+// Sits in front of every block, pooled or not, so release can tell where
+// it goes.
+struct PoolBlock {
+	BufferPool* pool;
+	size_t capacity;
+	PoolBlock* next;
+};
+
+namespace {
+
+const size_t header_bytes = (sizeof(PoolBlock) + alignof(std::max_align_t) - 1)
+	& ~(alignof(std::max_align_t) - 1);
+// Pooled blocks are rounded up to whole pages.
+const size_t block_granularity = 4096;
+
+thread_local BufferPool* current_pool = nullptr;
+std::atomic<uint64_t> num_direct_allocations(0);
+
+void* payload(PoolBlock* block) {
+	return reinterpret_cast<char*>(block) + header_bytes;
+}
+
+PoolBlock* header(void* p) {
+	return reinterpret_cast<PoolBlock*>(static_cast<char*>(p) - header_bytes);
+}
+
+PoolBlock* systemBlock(BufferPool* pool, size_t capacity) {
+	PoolBlock* block = static_cast<PoolBlock*>(std::malloc(header_bytes + capacity));
+	if (block == nullptr)
+		return nullptr;
+
+	block->pool = pool;
+	block->capacity = capacity;
+	block->next = nullptr;
+	return block;
+}
+
+void* allocateFrom(BufferPool* pool, size_t bytes) {
+	if (pool != nullptr)
+		return pool->allocate(bytes);
+
+	num_direct_allocations.fetch_add(1, std::memory_order_relaxed);
+	PoolBlock* block = systemBlock(nullptr, bytes);
+	return block != nullptr ? payload(block) : nullptr;
+}
+
+void* reallocateFrom(BufferPool* pool, void* p, size_t bytes) {
+	if (p == nullptr)
+		return allocateFrom(pool, bytes);
+
+	const size_t capacity = header(p)->capacity;
+	if (capacity >= bytes)
+		return p;
+
+	void* grown = allocateFrom(pool, bytes);
+	if (grown == nullptr)
+		return nullptr;
+	std::memcpy(grown, p, capacity);
+	BufferPool::release(p);
+	return grown;
+}
+
+} // namespace
+
+BufferPool::BufferPool() :
+	free_blocks(nullptr), free_bytes(0), used_bytes(0), peak_bytes(0), num_allocations(0), num_reuses(0)
+{}
+
+BufferPool::~BufferPool() {
+	assert(used_bytes == 0);
+	trim();
+}
+
+void* BufferPool::allocate(size_t bytes) {
+	if (bytes < min_pooled_bytes)
+		return allocateFrom(nullptr, bytes);
+
+	PoolBlock* unused = nullptr;
+	const size_t capacity = (bytes + block_granularity - 1) / block_granularity * block_granularity;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		PoolBlock** link = &free_blocks;
+		while (*link != nullptr && (*link)->capacity < bytes)
+			link = &(*link)->next;
+		if (*link != nullptr && (*link)->capacity / 2 <= bytes) {
+			PoolBlock* block = *link;
+			*link = block->next;
+			free_bytes -= block->capacity;
+			used_bytes += block->capacity;
+			++num_reuses;
+			return payload(block);
+		}
+
+		used_bytes += capacity;
+		peak_bytes = std::max(peak_bytes, used_bytes);
+		++num_allocations;
+
+		// Free blocks that don't fit make way, largest first.
+		while (used_bytes + free_bytes > peak_bytes) {
+			PoolBlock** last = &free_blocks;
+			while ((*last)->next != nullptr)
+				last = &(*last)->next;
+			PoolBlock* block = *last;
+			*last = nullptr;
+			free_bytes -= block->capacity;
+			block->next = unused;
+			unused = block;
+		}
+	}
+
+	while (unused != nullptr) {
+		PoolBlock* next = unused->next;
+		std::free(unused);
+		unused = next;
+	}
+
+	PoolBlock* block = systemBlock(this, capacity);
+	if (block == nullptr) {
+		std::lock_guard<std::mutex> lock(mutex);
+		used_bytes -= capacity;
+		return nullptr;
+	}
+	return payload(block);
+}
+
+void* BufferPool::reallocate(void* block, size_t bytes) {
+	return reallocateFrom(this, block, bytes);
+}
+
+void BufferPool::release(void* p) {
+	if (p == nullptr)
+		return;
+
+	PoolBlock* block = header(p);
+	BufferPool* pool = block->pool;
+	if (pool == nullptr) {
+		std::free(block);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(pool->mutex);
+	pool->used_bytes -= block->capacity;
+	pool->free_bytes += block->capacity;
+
+	PoolBlock** link = &pool->free_blocks;
+	while (*link != nullptr && (*link)->capacity < block->capacity)
+		link = &(*link)->next;
+	block->next = *link;
+	*link = block;
+}
+
+void BufferPool::trim() {
+	PoolBlock* unused;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		unused = free_blocks;
+		free_blocks = nullptr;
+		free_bytes = 0;
+	}
+
+	while (unused != nullptr) {
+		PoolBlock* next = unused->next;
+		std::free(unused);
+		unused = next;
+	}
+}
+
+uint64_t BufferPool::allocations() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return num_allocations;
+}
+
+uint64_t BufferPool::reuses() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return num_reuses;
+}
+
+uint64_t BufferPool::directAllocations() {
+	return num_direct_allocations.load(std::memory_order_relaxed);
+}
+
+BufferPool::Scope::Scope(BufferPool* pool) :
+	previous(current_pool)
+{
+	current_pool = pool;
+}
+
+BufferPool::Scope::~Scope() {
+	current_pool = previous;
+}
+
+BufferPool* BufferPool::current() {
+	return current_pool;
+}
+
+void* poolMalloc(size_t bytes) {
+	return allocateFrom(current_pool, bytes);
+}
+
+void* poolRealloc(void* block, size_t bytes) {
+	return reallocateFrom(current_pool, block, bytes);
+}
+
+void poolFree(void* block) {
+	BufferPool::release(block);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+struct PoolBlock;
+
+// Blocks of memory that go back on a free list when released instead of to
+// the system, so that jobs of the same sizes one after another stop
+// allocating once the first has run. Face storage, stb_image's decode
+// buffers and output stripes all come from the calling thread's pool; see
+// Scope. A block is reused for any request at least half its size. The pool
+// never holds on to more than the most it had handed out at once, and frees
+// unused blocks to stay under that.
+//
+// Safe to use from any thread. Blocks remember their pool, which must
+// outlive them.
+class BufferPool {
+public:
+	BufferPool();
+	~BufferPool();
+
+	// Blocks from a pool are aligned like malloc's; requests below
+	// min_pooled_bytes go straight to the system.
+	static const size_t min_pooled_bytes = 16 << 10;
+
+	void* allocate(size_t bytes);
+	// Keeps the block if it is already big enough, like realloc.
+	void* reallocate(void* block, size_t bytes);
+	// Releases a block from any pool, or null.
+	static void release(void* block);
+
+	// Frees every block not in use.
+	void trim();
+
+	// Blocks taken from the system, and freed ones handed out again, so far.
+	uint64_t allocations() const;
+	uint64_t reuses() const;
+
+	// Blocks any thread's poolMalloc and friends took straight from the
+	// system so far: requests below min_pooled_bytes, and those made outside
+	// any Scope.
+	static uint64_t directAllocations();
+
+	// Makes pool the calling thread's for the lifetime of the scope. A null
+	// pool sends the thread's allocations straight to the system.
+	class Scope {
+	public:
+		explicit Scope(BufferPool* pool);
+		~Scope();
+
+	private:
+		Scope(const Scope&);
+		Scope& operator= (const Scope&);
+
+		BufferPool* previous;
+	};
+
+	// The calling thread's pool, or nullptr outside any Scope.
+	static BufferPool* current();
+
+private:
+	BufferPool(const BufferPool&);
+	BufferPool& operator= (const BufferPool&);
+
+	mutable std::mutex mutex;
+	// Smallest first.
+	PoolBlock* free_blocks;
+	size_t free_bytes, used_bytes, peak_bytes;
+	uint64_t num_allocations, num_reuses;
+};
+
+// malloc, realloc and free on the calling thread's BufferPool, which
+// stb_image decodes through as well.
+void* poolMalloc(size_t bytes);
+void* poolRealloc(void* block, size_t bytes);
+void poolFree(void* block);
+
+// Uninitialized array of count T from the calling thread's pool, for
+// scratch that lives as long as a job.
+template <typename T>
+class PooledArray {
+public:
+	explicit PooledArray(size_t count) :
+		elements(static_cast<T*>(poolMalloc(count * sizeof(T)))), count(count)
+	{}
+	~PooledArray() { poolFree(elements); }
+
+	T* data() { return elements; }
+	const T* data() const { return elements; }
+	size_t size() const { return count; }
+
+	T& operator[] (size_t i) { return elements[i]; }
+	const T& operator[] (size_t i) const { return elements[i]; }
+
+private:
+	PooledArray(const PooledArray&);
+	PooledArray& operator= (const PooledArray&);
+
+	T* elements;
+	size_t count;
+};
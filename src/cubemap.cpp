@@ -0,0 +1,528 @@
+#include "cubemap.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <utility>
+
+#include "face_tiles.hpp"
+#include "mapped_file.hpp"
+#include "stats.hpp"
+
+namespace {
+
+// Faces that a face's border is taken from, and the face itself: all but
+// the opposite one.
+unsigned borderSources(Cubemap::CubeFace face) {
+	return Cubemap::all_faces & ~Cubemap::faceBit(Cubemap::CubeFace(face ^ 1));
+}
+
+} // namespace
+
+SrgbTables::SrgbTables() {
+	const auto decode = [](double encoded) {
+		return encoded <= 0.04045 ? encoded / 12.92 : std::pow((encoded + 0.055) / 1.055, 2.4);
+	};
+
+	for (int c = 0; c < 256; ++c)
+		to_linear[c] = static_cast<float>(decode(c / 255.0));
+
+	boundaries[0] = -1.f;
+	for (int c = 1; c < 256; ++c)
+		boundaries[c] = static_cast<float>(decode((c - 0.5) / 255.0));
+	boundaries[256] = 2.f;
+
+	u32 code = 0;
+	for (int bucket = 0; bucket < num_buckets; ++bucket) {
+		const float start = float(bucket) / num_buckets;
+		while (start >= boundaries[code + 1])
+			++code;
+		// The darkest codes are the closest together, still more than a
+		// bucket apart.
+		assert(code >= 255 || boundaries[code + 2] >= float(bucket + 1) / num_buckets);
+		bucket_codes[bucket] = static_cast<u8>(code);
+	}
+	std::fill(bucket_codes + num_buckets, bucket_codes + num_buckets + 3, u8(0));
+}
+
+const SrgbTables srgb_tables;
+
+// Keeps 8-bit inputs on the mapped fast path in HDR mode.
+void linearizeToRgbe(Image& img) {
+	static const struct LinearTable {
+		float values[256];
+		LinearTable() {
+			for (int i = 0; i < 256; ++i)
+				values[i] = std::pow(i / 255.f, 2.2f);
+		}
+	} linear;
+
+	u32* texel = img.pixel(-img.border, -img.border);
+	u32* const end = texel + size_t(img.stride()) * (img.height + 2 * img.border);
+	for (; texel != end; ++texel) {
+		const u32 c = *texel;
+		*texel = makeRgbe(linear.values[c & 0xFF], linear.values[c >> 8 & 0xFF], linear.values[c >> 16 & 0xFF]);
+	}
+}
+
+Image::Image(const std::string& filename, int border, TexelFormat format) :
+	width(-1), height(-1), border(0)
+{
+	if (format == TEXELS_RGBE && !hasExtension(filename, "hdr")) {
+		*this = Image(filename, border);
+		linearizeToRgbe(*this);
+		return;
+	}
+
+	if (format == TEXELS_RGBE) {
+		int comp;
+		const std::unique_ptr<float, void(*)(void*)> pixels(stbi_loadf(filename.c_str(), &width, &height, &comp, 3), stbi_image_free);
+
+		if (pixels == nullptr) {
+			std::cerr << "Failed to open " << filename << ".\n";
+			width = height = 1;
+			load_failed = true;
+		} else {
+			load_failed = false;
+		}
+
+		this->border = border;
+		data = allocatePixels(size_t(stride()) * (height + 2 * border));
+		for (int y = 0; y < height; ++y) {
+			u32* dst = pixel(0, y);
+			for (int x = 0; x < width; ++x) {
+				const float* src = pixels != nullptr ? &pixels.get()[(size_t(y) * width + x) * 3] : nullptr;
+				dst[x] = src != nullptr ? makeRgbe(src[0], src[1], src[2]) : 0;
+			}
+		}
+
+		repeatEdges();
+		return;
+	}
+
+	MappedFile file;
+	PixelView view;
+	if (file.open(filename) && view.open(filename, file)) {
+		width = view.width;
+		height = view.height;
+		this->border = border;
+		data = allocatePixels(size_t(stride()) * (height + 2 * border));
+
+		for (int y = 0; y < height; ++y)
+			view.readRow(y, pixel(0, y));
+
+		repeatEdges();
+		load_failed = false;
+		return;
+	}
+
+	int comp;
+	data = std::unique_ptr<u8, std::function<void(u8*)>>(
+		stbi_load(filename.c_str(), &width, &height, &comp, 4), stbi_image_free);
+
+	if (data == nullptr) {
+		std::cerr << "Failed to open " << filename << ".\n";
+		width = height = 1;
+		data = allocatePixels(1);
+		*pixel(0, 0) = 0;
+		load_failed = true;
+	} else {
+		load_failed = false;
+	}
+
+	if (border > 0)
+		addBorder(border);
+}
+
+void Image::addBorder(int new_border) {
+	assert(border == 0);
+
+	const size_t old_stride = width;
+	std::unique_ptr<u8, std::function<void(u8*)>> old_data;
+	old_data.swap(data);
+
+	border = new_border;
+	data = allocatePixels(size_t(stride()) * (height + 2 * border));
+
+	const u32* src = reinterpret_cast<const u32*>(old_data.get());
+	for (int y = 0; y < height; ++y)
+		std::copy(src + y * old_stride, src + (y + 1) * old_stride, pixel(0, y));
+
+	repeatEdges();
+}
+
+bool Image::readSize(const std::string& filename, int& out_width, int& out_height) {
+	MappedFile file;
+	PixelView view;
+	if (file.open(filename) && view.open(filename, file)) {
+		out_width = view.width;
+		out_height = view.height;
+		return true;
+	}
+
+	int comp;
+	return stbi_info(filename.c_str(), &out_width, &out_height, &comp) != 0;
+}
+
+void Image::repeatEdges() {
+	for (int y = 0; y < height; ++y) {
+		u32* row = pixel(0, y);
+		std::fill(row - border, row, row[0]);
+		std::fill(row + width, row + width + border, row[width - 1]);
+	}
+
+	for (int y = 1; y <= border; ++y) {
+		std::copy(pixel(-border, 0), pixel(-border, 0) + stride(), pixel(-border, -y));
+		std::copy(pixel(-border, height - 1), pixel(-border, height - 1) + stride(), pixel(-border, height - 1 + y));
+	}
+}
+
+Cubemap::Cubemap(const std::string& fname_prefix, const std::string& fname_extension, bool build_mips,
+	TexelFormat texel_format, Mapping layout, unsigned load_faces, u64 memory_budget) :
+	texel_format(texel_format), layout(layout),
+	skipped_mask(unusedFaces(layout) | (all_faces & ~load_faces)),
+	ready_mask(skipped_mask), decoded_mask(skipped_mask), border_claimed_mask(skipped_mask)
+{
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (FaceLoadStats& stats : load_stats) {
+		stats.wall_seconds = 0;
+		stats.cpu_seconds = 0;
+		stats.file_bytes = 0;
+	}
+
+	// The loaders decode into the constructing thread's pool.
+	BufferPool* const pool = BufferPool::current();
+
+	if (memory_budget != 0) {
+		assert(!build_mips);
+		paged_faces.reset(new FaceTiles);
+		paged_faces->open(memory_budget);
+		loaders[0] = std::thread([this, fname_prefix, fname_extension, start, pool] {
+			const BufferPool::Scope scope(pool);
+			loadPaged(fname_prefix, fname_extension, start);
+		});
+		return;
+	}
+
+	for (int i = 0; i < mappingFaces(layout); ++i) {
+		if (skipped_mask & faceBit(CubeFace(i)))
+			continue;
+
+		const std::string filename = inputFilename(fname_prefix, fname_extension, layout, i);
+
+		loaders[i] = std::thread([this, i, filename, start, build_mips, pool] {
+			const BufferPool::Scope scope(pool);
+			const double cpu_start = threadCpuSeconds();
+			faces[i] = Image(filename, face_border, this->texel_format);
+			if (build_mips)
+				buildMips(CubeFace(i));
+
+			FaceLoadStats& stats = load_stats[i];
+			stats.cpu_seconds = threadCpuSeconds() - cpu_start;
+			stats.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			std::ifstream file(filename, std::ios::binary | std::ios::ate);
+			stats.file_bytes = file ? u64(file.tellg()) : 0;
+
+			finishFace(CubeFace(i));
+		});
+	}
+}
+
+Cubemap::Cubemap(Image (&face_images)[NUM_FACES], bool build_mips, TexelFormat texel_format, Mapping layout) :
+	texel_format(texel_format), layout(layout),
+	skipped_mask(unusedFaces(layout)), ready_mask(all_faces), decoded_mask(all_faces), border_claimed_mask(all_faces)
+{
+	for (int i = 0; i < NUM_FACES; ++i) {
+		load_stats[i].wall_seconds = 0;
+		load_stats[i].cpu_seconds = 0;
+		load_stats[i].file_bytes = 0;
+		if (i >= mappingFaces(layout))
+			continue;
+		if (face_images[i].data == nullptr) {
+			skipped_mask |= faceBit(CubeFace(i));
+			continue;
+		}
+
+		faces[i] = std::move(face_images[i]);
+		if (faces[i].border == 0)
+			faces[i].addBorder(face_border);
+		assert(faces[i].border == face_border);
+		if (build_mips)
+			buildMips(CubeFace(i));
+	}
+
+	for (int i = 0; i < mappingFaces(layout); ++i) {
+		if (skipped_mask & faceBit(CubeFace(i)))
+			continue;
+		for (int level = 0; level < numLevels(CubeFace(i)); ++level)
+			fillBorder(CubeFace(i), level);
+	}
+}
+
+void Cubemap::loadPaged(const std::string& fname_prefix, const std::string& fname_extension,
+	std::chrono::steady_clock::time_point start)
+{
+	// One face at a time, so that at most one is decoded in memory.
+	for (int i = 0; i < mappingFaces(layout); ++i) {
+		if (skipped_mask & faceBit(CubeFace(i)))
+			continue;
+
+		const std::string filename = inputFilename(fname_prefix, fname_extension, layout, i);
+		const double cpu_start = threadCpuSeconds();
+		int width = 1, height = 1;
+		bool loaded = false;
+
+		// Uncompressed files stream from the mapping a row of tiles at a time
+		// and never are in memory whole. The rest decode whole first.
+		MappedFile file;
+		PixelView view;
+		if (!paged_faces->isOpen()) {
+			// Already reported; the faces render black.
+		} else if (texel_format != TEXELS_RGBE && file.open(filename) && view.open(filename, file)) {
+			width = view.width;
+			height = view.height;
+			loaded = paged_faces->addFace(i, width, height, [&](int y, u32* out) {
+				if (y % FaceTiles::tile_size == 0)
+					file.evict();
+				view.readRow(y, out);
+			});
+		} else {
+			const Image img(filename, 0, texel_format);
+			width = img.width;
+			height = img.height;
+			loaded = paged_faces->addFace(i, width, height, [&](int y, u32* out) {
+				std::copy(img.pixel(0, y), img.pixel(0, y) + img.width, out);
+			}) && img.loaded();
+		}
+		file.close();
+		faces[i] = Image::dimensionsOnly(width, height, face_border, loaded);
+
+		FaceLoadStats& stats = load_stats[i];
+		stats.cpu_seconds = threadCpuSeconds() - cpu_start;
+		stats.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::ifstream size_file(filename, std::ios::binary | std::ios::ate);
+		stats.file_bytes = size_file ? u64(size_file.tellg()) : 0;
+	}
+
+	if (paged_faces->isOpen()) {
+		for (int i = 0; i < mappingFaces(layout); ++i) {
+			if ((skipped_mask & faceBit(CubeFace(i))) == 0 && !fillPagedBorder(CubeFace(i)))
+				faces[i] = Image::dimensionsOnly(faces[i].width, faces[i].height, face_border, false);
+		}
+		paged_faces->dropCache();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(ready_mutex);
+		decoded_mask = border_claimed_mask = all_faces;
+		ready_mask.store(all_faces, std::memory_order_release);
+	}
+	ready_cv.notify_all();
+}
+
+Cubemap::~Cubemap() {
+	for (std::thread& loader : loaders) {
+		if (loader.joinable())
+			loader.join();
+	}
+}
+
+void Cubemap::waitForFaces(unsigned mask) const {
+	if ((readyFaces() & mask) == mask)
+		return;
+
+	std::unique_lock<std::mutex> lock(ready_mutex);
+	ready_cv.wait(lock, [&] { return (readyFaces() & mask) == mask; });
+}
+
+void Cubemap::waitForMoreFaces(unsigned known_ready) const {
+	std::unique_lock<std::mutex> lock(ready_mutex);
+	ready_cv.wait(lock, [&] {
+		unsigned ready = readyFaces();
+		return ready == all_faces || (ready & ~known_ready) != 0;
+	});
+}
+
+std::string Cubemap::inputFilename(const std::string& fname_prefix, const std::string& fname_extension,
+	Mapping layout, int face)
+{
+	if (layout != MAPPING_CUBE)
+		return fname_prefix + "." + fname_extension;
+	return fname_prefix + char('1' + face) + "." + fname_extension;
+}
+
+bool Cubemap::finishLoading() const {
+	waitForFaces(all_faces);
+
+	for (int i = 0; i < mappingFaces(layout); ++i) {
+		if ((skipped_mask & faceBit(CubeFace(i))) == 0 && !faces[i].loaded())
+			return false;
+	}
+	return paged_faces == nullptr || !paged_faces->readFailed();
+}
+
+float Cubemap::texelSolidAngle(const Image& face_img, float s, float t) const {
+	const float m_pi = 3.14159265358979f;
+	const float texel_area = 1.f / (float(face_img.width) * face_img.height);
+
+	switch (layout) {
+	case MAPPING_CUBE: {
+		const float sc = 2.f * s - 1.f;
+		const float tc = 2.f * t - 1.f;
+		const float d = 1.f + sc * sc + tc * tc;
+		return 4.f / (float(face_img.width) * face_img.height * d * std::sqrt(d));
+	}
+	case MAPPING_EQUIRECT:
+		return std::max(std::cos((0.5f - t) * m_pi), 1e-6f) * 2.f * m_pi * m_pi * texel_area;
+	case MAPPING_DOME:
+		return std::max(std::cos((1.f - t) * m_pi / 2.f), 1e-6f) * m_pi * m_pi * texel_area;
+	case MAPPING_DUAL_PARABOLOID: {
+		// 4 / (1 + r^2)^2 per unit of disc, which spans 2 x 2 in w x h / 2
+		// texels.
+		const float u = 2.f * s - 1.f;
+		const float v = t >= 0.5f ? 4.f * t - 3.f : 4.f * t - 1.f;
+		const float d = 1.f + u * u + v * v;
+		return 32.f * texel_area / (d * d);
+	}
+	default: {
+		// Like a cube face: a flat texel of area 4 / (w h) on the octahedron,
+		// seen from the centre at distance |p|, once its tilt is undone.
+		float x, y, z;
+		mappingDirection(layout, 0, s, t, x, y, z);
+		const float d = x * x + y * y + z * z;
+		return 4.f * texel_area / (d * std::sqrt(d));
+	}
+	}
+}
+
+void Cubemap::finishFace(CubeFace face) {
+	unsigned claimed = 0;
+	{
+		std::lock_guard<std::mutex> lock(ready_mutex);
+		decoded_mask |= faceBit(face);
+
+		for (int i = 0; i < NUM_FACES; ++i) {
+			const unsigned sources = borderSources(CubeFace(i));
+			if ((decoded_mask & sources) == sources && (border_claimed_mask & faceBit(CubeFace(i))) == 0)
+				claimed |= faceBit(CubeFace(i));
+		}
+		border_claimed_mask |= claimed;
+	}
+
+	// Only the interiors of the source faces are read, and nobody else reads
+	// a face before it is ready, so this can run unlocked.
+	for (int i = 0; i < NUM_FACES; ++i) {
+		if ((claimed & faceBit(CubeFace(i))) == 0)
+			continue;
+
+		for (int level = 0; level < numLevels(CubeFace(i)); ++level)
+			fillBorder(CubeFace(i), level);
+	}
+
+	if (claimed != 0) {
+		{
+			std::lock_guard<std::mutex> lock(ready_mutex);
+			ready_mask.fetch_or(claimed, std::memory_order_release);
+		}
+		ready_cv.notify_all();
+	}
+}
+
+void Cubemap::buildMips(CubeFace face) {
+	const Image* src = &faces[face];
+
+	while (src->width > 1 || src->height > 1) {
+		Image dst(std::max((src->width + 1) / 2, 1), std::max((src->height + 1) / 2, 1), face_border);
+
+		// Box filter over the 2x2 block below each texel, repeating the last
+		// row or column of odd-sized levels. Channels are summed in pairs in
+		// the 16-bit halves of a word, as in averageColors.
+		for (int y = 0; y < dst.height; ++y) {
+			const u32* row_0 = src->pixel(0, 2 * y);
+			const u32* row_1 = src->pixel(0, std::min(2 * y + 1, src->height - 1));
+			u32* out = dst.pixel(0, y);
+
+			for (int x = 0; x < dst.width; ++x) {
+				const int x_0 = 2 * x;
+				const int x_1 = std::min(2 * x + 1, src->width - 1);
+				const u32 taps[4] = { row_0[x_0], row_0[x_1], row_1[x_0], row_1[x_1] };
+
+				if (texel_format != TEXELS_RGBA8) {
+					Colorf sum(0.f, 0.f, 0.f);
+					for (u32 tap : taps) {
+						const Colorf col = Colorf::fromTexel(tap, texel_format);
+						sum = Colorf(sum.r + col.r, sum.g + col.g, sum.b + col.b);
+					}
+					out[x] = Colorf(sum.r * 0.25f, sum.g * 0.25f, sum.b * 0.25f).toTexel(texel_format);
+					continue;
+				}
+
+				u32 sum_rb = 0x00020002, sum_ga = 0x00020002;
+				for (u32 tap : taps) {
+					sum_rb += tap & 0x00FF00FF;
+					sum_ga += tap >> 8 & 0x00FF00FF;
+				}
+				out[x] = (sum_rb >> 2 & 0x00FF00FF) | (sum_ga >> 2 & 0x00FF00FF) << 8;
+			}
+		}
+
+		mips[face].push_back(std::move(dst));
+		src = &mips[face].back();
+	}
+}
+
+void Cubemap::borderSource(CubeFace face, int level, int x, int y, int& out_face, int& out_x, int& out_y) const {
+	const Image& face_img = this->level(face, level);
+
+	float dir_x, dir_y, dir_z;
+	mappingDirection(layout, face, (x + 0.5f) / face_img.width, (y + 0.5f) / face_img.height,
+		dir_x, dir_y, dir_z);
+
+	int src_face;
+	float s, t;
+	mappingCoords(layout, dir_x, dir_y, dir_z, src_face, s, t);
+
+	// Faces that were left out leave the texel to the face's own edge.
+	if (skipped_mask & faceBit(CubeFace(src_face))) {
+		out_face = face;
+		out_x = std::max(std::min(x, face_img.width - 1), 0);
+		out_y = std::max(std::min(y, face_img.height - 1), 0);
+		return;
+	}
+
+	const Image& src_img = this->level(CubeFace(src_face), std::min(level, numLevels(CubeFace(src_face)) - 1));
+	out_face = src_face;
+	out_x = std::max(std::min(static_cast<int>(s * src_img.width), src_img.width - 1), 0);
+	out_y = std::max(std::min(static_cast<int>(t * src_img.height), src_img.height - 1), 0);
+}
+
+void Cubemap::fillBorder(CubeFace face, int level) {
+	Image& face_img = level == 0 ? faces[face] : mips[face][level - 1];
+	const int border = face_img.border;
+
+	for (int y = -border; y < face_img.height + border; ++y) {
+		const bool edge_row = y < 0 || y >= face_img.height;
+
+		for (int x = -border; x < face_img.width + border; ++x) {
+			// Rows within the face only have border texels at either end.
+			if (!edge_row && x == 0)
+				x = face_img.width;
+
+			int src_face, src_x, src_y;
+			borderSource(face, level, x, y, src_face, src_x, src_y);
+			const Image& src_img = this->level(CubeFace(src_face), std::min(level, numLevels(CubeFace(src_face)) - 1));
+			*face_img.pixel(x, y) = *src_img.pixel(src_x, src_y);
+		}
+	}
+}
+
+bool Cubemap::fillPagedBorder(CubeFace face) {
+	return paged_faces->setBorder(face, [&](int x, int y) {
+		int src_face, src_x, src_y;
+		borderSource(face, 0, x, y, src_face, src_x, src_y);
+		return paged_faces->texel(src_face, src_x, src_y);
+	});
+}
@@ -0,0 +1,644 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "projection.hpp"
+#include "stb_image.hpp"
+
+class FaceTiles;
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+inline void splitColor(u32 col, u8& r, u8& g, u8& b) {
+	r = col >> 0  & 0xFF;
+	g = col >> 8  & 0xFF;
+	b = col >> 16 & 0xFF;
+}
+
+inline u32 makeColor(u8 r, u8 g, u8 b) {
+	return r | g << 8 | b << 16 | 0xFF << 24;
+}
+
+// Case-insensitive; extension is given without the dot.
+inline bool hasExtension(const std::string& filename, const char* extension) {
+	const std::string::size_type dot = filename.rfind('.');
+	if (dot == std::string::npos)
+		return false;
+
+	std::string ext = filename.substr(dot + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return static_cast<char>(std::tolower(c)); });
+	return ext == extension;
+}
+
+inline float lerp(float a, float b, float t) {
+	return a * (1.f - t) + b * t;
+}
+
+// Fixed-point bilinear filtering works on channels scaled to 8.8 and weights
+// in 0.16, where the weight pair for a fraction f is (65535 - w, w). Every
+// product keeps its high 16 bits, which is exactly what the 16-bit SIMD
+// multiply-high instructions do, so the vector kernels can match this bit for
+// bit.
+inline u32 fixedWeight(float fract) {
+	return static_cast<u32>(fract * 65535.f + 0.5f);
+}
+
+inline u32 mixFixed(u32 a, u32 b, u32 w) {
+	return (a * (65535 - w) >> 16) + (b * w >> 16);
+}
+
+inline float floatFromBits(u32 bits) {
+	float f;
+	std::memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+inline u32 bitsFromFloat(float f) {
+	u32 bits;
+	std::memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+// HDR texels are RGBE as in Radiance .hdr files: three 8-bit mantissas in
+// the colour channels and a shared exponent byte in place of alpha. They
+// take the same 32 bits as 8-bit RGBA, so they use the same storage,
+// borders and texel fetches. A channel is mantissa * 2^(exponent - 136).
+// Exponents below 10 decode to black, which loses nothing above 1e-36.
+// Both directions work on float bit patterns, which the vector kernels can
+// reproduce exactly.
+inline float rgbeScale(u32 texel) {
+	const u32 exponent = texel >> 24;
+	return exponent >= 10 ? floatFromBits((exponent - 9) << 23) : 0.f;
+}
+
+// Truncates the mantissas like Radiance does. Values below 1e-32 and NaNs
+// encode as black; inputs must stay below 2^127.
+inline u32 makeRgbe(float r, float g, float b) {
+	const float v = std::max(r, std::max(g, b));
+	if (!(v >= 1e-32f))
+		return 0;
+
+	// v is m * 2^(field - 126) with m in [0.5, 1), so scaling by
+	// 2^(134 - field) puts the largest channel in [128, 256).
+	const u32 exponent_field = bitsFromFloat(v) >> 23;
+	const float scale = floatFromBits((261 - exponent_field) << 23);
+	return static_cast<u32>(r * scale) | static_cast<u32>(g * scale) << 8 | static_cast<u32>(b * scale) << 16
+		| (exponent_field + 2) << 24;
+}
+
+// Conversions between 8-bit sRGB and linear light, both by table. Decoding
+// is a lookup per channel. Encoding rounds to the nearest code: a value's
+// bucket of 1/num_buckets gives the code at the bucket's start, and no two
+// boundaries between codes share a bucket, so at most the one after it
+// needs checking. bucket_codes has three bytes of padding at the end for
+// vector code that gathers it four bytes at a time.
+struct SrgbTables {
+	static const int num_buckets = 4096;
+
+	float to_linear[256];
+	// boundaries[c] is the linear value halfway between codes c - 1 and c;
+	// boundaries[256] is past 1.
+	float boundaries[257];
+	u8 bucket_codes[num_buckets + 3];
+
+	SrgbTables();
+};
+
+extern const SrgbTables srgb_tables;
+
+inline float srgbToLinear(u32 code) {
+	return srgb_tables.to_linear[code];
+}
+
+// Values outside [0, 1] clamp, and NaNs encode as 0.
+inline u32 linearToSrgb(float v) {
+	const float clamped = v > 0.f ? std::min(v, 1.f) : 0.f;
+	const int bucket = static_cast<int>(std::min(clamped * SrgbTables::num_buckets, SrgbTables::num_buckets - 1.f));
+	const u32 code = srgb_tables.bucket_codes[bucket];
+	return clamped >= srgb_tables.boundaries[code + 1] ? code + 1 : code;
+}
+
+// How the 32 bits of a texel are laid out.
+enum TexelFormat {
+	TEXELS_RGBA8,
+	TEXELS_RGBE,
+	// Stored like TEXELS_RGBA8, but sRGB-encoded and filtered in linear
+	// light.
+	TEXELS_SRGB8
+};
+
+struct Image {
+	int width, height;
+	// Texels of padding on every side. data holds rows of stride() pixels,
+	// border rows above and below the image.
+	int border;
+	std::unique_ptr<u8, std::function<void(u8*)>> data;
+
+	Image() :
+		width(-1), height(-1), border(0), load_failed(true)
+	{}
+
+	// Zero-filled image for the caller to draw into.
+	Image(int width, int height, int border = 0) :
+		width(width), height(height), border(border),
+		data(allocatePixels(size_t(width + 2 * border) * (height + 2 * border))),
+		load_failed(false)
+	{
+		std::memset(data.get(), 0, size_t(stride()) * (height + 2 * border) * 4);
+	}
+
+	// Uninitialized storage for count texels from the calling thread's
+	// BufferPool, which the images of a converter share.
+	static std::unique_ptr<u8, std::function<void(u8*)>> allocatePixels(size_t count) {
+		return std::unique_ptr<u8, std::function<void(u8*)>>(static_cast<u8*>(poolMalloc(count * 4)), poolFree);
+	}
+
+	// Just the dimensions of an image whose texels are kept elsewhere, as
+	// FaceTiles keeps paged faces. data stays empty.
+	static Image dimensionsOnly(int width, int height, int border, bool loaded) {
+		Image img;
+		img.width = width;
+		img.height = height;
+		img.border = border;
+		img.load_failed = !loaded;
+		return img;
+	}
+
+	// Loads filename with border texels of padding, as addBorder would add.
+	// Raw (headerless 8-bit RGBA with square dimensions), uncompressed TGA and
+	// uncompressed BMP files are memory-mapped and copied straight into
+	// place; everything else is decoded by stb_image. For TEXELS_RGBE,
+	// stb_image's float loader reads every file, .hdr at full range and 8-bit
+	// formats converted to linear. On failure this prints an error and leaves
+	// a 1x1 black placeholder, so the image can still be sampled safely.
+	// Check loaded() to tell.
+	Image(const std::string& filename, int border = 0, TexelFormat format = TEXELS_RGBA8);
+
+	// Reads just enough of filename to tell the dimensions loading it would
+	// give. Fails quietly.
+	static bool readSize(const std::string& filename, int& out_width, int& out_height);
+
+	bool loaded() const { return !load_failed; }
+
+	int stride() const { return width + 2 * border; }
+
+	// Pixel (x, y), where x and y may reach up to border texels past the
+	// edges.
+	u32* pixel(int x, int y) {
+		return reinterpret_cast<u32*>(data.get()) + size_t(y + border) * stride() + (x + border);
+	}
+
+	const u32* pixel(int x, int y) const {
+		return reinterpret_cast<const u32*>(data.get()) + size_t(y + border) * stride() + (x + border);
+	}
+
+	// Reallocates the image with new_border texels of padding on every side,
+	// each a copy of the nearest edge texel.
+	void addBorder(int new_border);
+
+	// Fills the border with copies of the nearest edge texels.
+	void repeatEdges();
+
+	Image(Image&& o) :
+		width(o.width), height(o.height), border(o.border),
+		data(std::move(o.data)),
+		load_failed(o.load_failed)
+	{}
+
+	Image& operator= (Image&& o) {
+		width = o.width;
+		height = o.height;
+		border = o.border;
+		data.swap(o.data);
+		load_failed = o.load_failed;
+
+		return *this;
+	}
+
+private:
+	Image(const Image&);
+	Image& operator= (const Image&);
+
+	bool load_failed;
+};
+
+// Re-encodes every texel of img, padding included, from 8-bit color to RGBE,
+// linearized with the same 2.2 gamma stb_image applies when it loads 8-bit
+// files as float.
+void linearizeToRgbe(Image& img);
+
+struct Colorf {
+	float r, g, b;
+
+	Colorf() { }
+	Colorf(float r, float g, float b) : r(r), g(g), b(b) { }
+
+	explicit Colorf(u32 col) {
+		u8 rb, gb, bb;
+		splitColor(col, rb, gb, bb);
+		r = rb / 255.f;
+		g = gb / 255.f;
+		b = bb / 255.f;
+	}
+
+	u32 toU32() const {
+		return makeColor(
+			static_cast<u8>(r * 255),
+			static_cast<u8>(g * 255),
+			static_cast<u8>(b * 255));
+	}
+
+	static Colorf fromRgbe(u32 texel) {
+		const float scale = rgbeScale(texel);
+		u8 rb, gb, bb;
+		splitColor(texel, rb, gb, bb);
+		return Colorf(rb * scale, gb * scale, bb * scale);
+	}
+
+	u32 toRgbe() const {
+		return makeRgbe(r, g, b);
+	}
+
+	static Colorf fromSrgb(u32 texel) {
+		return Colorf(srgbToLinear(texel & 0xFF), srgbToLinear(texel >> 8 & 0xFF), srgbToLinear(texel >> 16 & 0xFF));
+	}
+
+	u32 toSrgb() const {
+		return linearToSrgb(r) | linearToSrgb(g) << 8 | linearToSrgb(b) << 16 | 0xFFu << 24;
+	}
+
+	static Colorf fromTexel(u32 texel, TexelFormat format) {
+		switch (format) {
+		case TEXELS_RGBE:  return fromRgbe(texel);
+		case TEXELS_SRGB8: return fromSrgb(texel);
+		default:           return Colorf(texel);
+		}
+	}
+
+	u32 toTexel(TexelFormat format) const {
+		switch (format) {
+		case TEXELS_RGBE:  return toRgbe();
+		case TEXELS_SRGB8: return toSrgb();
+		default:           return toU32();
+		}
+	}
+
+	static Colorf mix(const Colorf& a, const Colorf& b, float t) {
+		return Colorf(
+			lerp(a.r, b.r, t),
+			lerp(a.g, b.g, t),
+			lerp(a.b, b.b, t));
+	}
+};
+
+// The input sphere. Despite the name it holds any source mapping: six faces
+// for MAPPING_CUBE, or one panorama in faces[0]. The other faces are then
+// left empty and count as ready from the start, since nothing projects onto
+// them.
+struct Cubemap {
+	enum CubeFace {
+		FACE_POS_X, FACE_NEG_X,
+		FACE_POS_Y, FACE_NEG_Y,
+		FACE_POS_Z, FACE_NEG_Z,
+		NUM_FACES
+	};
+
+	// Every face is padded by face_border texels taken from the neighbouring
+	// faces, so bilinear footprints that cross an edge blend with the texels
+	// on the other side of the seam and never need clamping.
+	static const int face_border = 1;
+	Image faces[NUM_FACES];
+
+	// Mip levels 1 and up of each face when built, each half the size of
+	// the one before, down to 1x1. They are padded like the faces, from the
+	// same level of the neighbours.
+	std::vector<Image> mips[NUM_FACES];
+
+	// Where the texels are with a memory budget: faces then only hold their
+	// dimensions. There are no mip levels.
+	std::unique_ptr<FaceTiles> paged_faces;
+
+	// Shared by all faces and mip levels.
+	TexelFormat texel_format;
+
+	Mapping layout;
+
+	// Filled in by each face's loader before the face is marked ready. Wall
+	// time counts from the start of loading.
+	struct FaceLoadStats {
+		double wall_seconds;
+		double cpu_seconds;
+		u64 file_bytes;
+	};
+	FaceLoadStats load_stats[NUM_FACES];
+
+	// Starts decoding all faces of layout in load_faces concurrently, each
+	// from inputFilename, and returns right away. Face data may only be
+	// touched once waitForFaces has returned for it. A face is ready once it
+	// and its four neighbours are decoded and its border has been filled in.
+	// Faces left out of load_faces stay empty and count as ready from the
+	// start, like the unused ones; border texels that would come from them
+	// repeat the face's own edge instead, so only leave out faces that no
+	// sample reads through a border either (see wholeOutputFaces and
+	// regionFaces). The faces take their memory from the calling thread's
+	// BufferPool.
+	// A non-zero memory_budget in bytes decodes the faces one at a time into
+	// tiles on disk instead, paged in through a cache of that size (see
+	// FaceTiles), and makes them all ready at once when the last is done.
+	// build_mips must be off then.
+	Cubemap(const std::string& fname_prefix, const std::string& fname_extension, bool build_mips = false,
+		TexelFormat texel_format = TEXELS_RGBA8, Mapping layout = MAPPING_CUBE, unsigned load_faces = all_faces,
+		u64 memory_budget = 0);
+
+	// Takes over faces that are already in memory; they are all ready at once.
+	// Only the first mappingFaces(layout) are used. Faces may come without a
+	// border or with face_border texels of it, whose contents are replaced.
+	// Empty faces are left out as with load_faces above.
+	explicit Cubemap(Image (&face_images)[NUM_FACES], bool build_mips = false,
+		TexelFormat texel_format = TEXELS_RGBA8, Mapping layout = MAPPING_CUBE);
+	~Cubemap();
+
+	static unsigned faceBit(CubeFace face) { return 1u << face; }
+	static const unsigned all_faces = (1u << NUM_FACES) - 1;
+
+	// <prefix>1.<extension> through <prefix>6.<extension> for cube faces, and
+	// <prefix>.<extension> for the single face of any other layout.
+	static std::string inputFilename(const std::string& fname_prefix, const std::string& fname_extension,
+		Mapping layout, int face);
+
+	// Faces that layout doesn't use.
+	static unsigned unusedFaces(Mapping layout) {
+		return all_faces & ~((1u << mappingFaces(layout)) - 1);
+	}
+
+	// Mask of faces that have finished loading (successfully or not).
+	unsigned readyFaces() const { return ready_mask.load(std::memory_order_acquire); }
+
+	void waitForFaces(unsigned mask) const;
+
+	// Blocks until some face not in known_ready has finished loading, or
+	// returns immediately if there is none left.
+	void waitForMoreFaces(unsigned known_ready) const;
+
+	// Waits for all faces and reports whether every one that was to be
+	// loaded did.
+	bool finishLoading() const;
+
+	// x and y may reach into the border.
+	u32 readTexel(CubeFace face, int x, int y) const {
+		assert(face < NUM_FACES);
+		const Image& face_img = faces[face];
+
+		assert(x >= -face_img.border && x < face_img.width  + face_img.border);
+		assert(y >= -face_img.border && y < face_img.height + face_img.border);
+		return *face_img.pixel(x, y);
+	}
+
+	int numLevels(CubeFace face) const { return 1 + static_cast<int>(mips[face].size()); }
+
+	const Image& level(CubeFace face, int level) const {
+		return level == 0 ? faces[face] : mips[face][level - 1];
+	}
+
+	// The 2x2 bilinear footprint whose top-left tap is (x, y), counted from
+	// the corner of the border. out is ordered 00, 10, 01, 11.
+	void readFootprint(CubeFace face, int x, int y, u32* out) const {
+		assert(face < NUM_FACES);
+		readFootprint(faces[face], x, y, out);
+	}
+
+	static void readFootprint(const Image& face_img, int x, int y, u32* out) {
+		assert(x >= 0 && x + 1 < face_img.stride());
+		assert(y >= 0 && y + 1 < face_img.height + 2 * face_img.border);
+
+		const u32* tap = face_img.pixel(x - face_img.border, y - face_img.border);
+		const size_t stride = face_img.stride();
+		out[0] = tap[0];
+		out[1] = tap[1];
+		out[2] = tap[stride];
+		out[3] = tap[stride + 1];
+	}
+
+	static void computeTexCoords(float x, float y, float z, CubeFace& out_face, float& out_s, float& out_t) {
+		int major_axis;
+
+		float v[3] = { x, y, z };
+		float a[3] = { std::abs(x), std::abs(y), std::abs(z) };
+
+		if (a[0] >= a[1] && a[0] >= a[2]) {
+			major_axis = 0;
+		} else if (a[1] >= a[0] && a[1] >= a[2]) {
+			major_axis = 1;
+		} else {
+			major_axis = 2;
+		}
+
+		if (v[major_axis] < 0.0f)
+			major_axis = major_axis * 2 + 1;
+		else
+			major_axis *= 2;
+
+		float tmp_s, tmp_t, m;
+		switch (major_axis) {
+			/* +X */ case 0: tmp_s = -z; tmp_t = -y; m = a[0]; break;
+			/* -X */ case 1: tmp_s =  z; tmp_t = -y; m = a[0]; break;
+			/* +Y */ case 2: tmp_s =  x; tmp_t =  z; m = a[1]; break;
+			/* -Y */ case 3: tmp_s =  x; tmp_t = -z; m = a[1]; break;
+			/* +Z */ case 4: tmp_s =  x; tmp_t = -y; m = a[2]; break;
+			/* -Z */ case 5: tmp_s = -x; tmp_t = -y; m = a[2]; break;
+		}
+
+		out_face = CubeFace(major_axis);
+		out_s = 0.5f * (tmp_s / m + 1.0f);
+		out_t = 0.5f * (tmp_t / m + 1.0f);
+	}
+
+	// Texel centres sit half a texel inside the grid lines, so the footprint
+	// for s = t = 0 is centred on the face's corner and needs the border
+	// texels on the other side. Adding face_border - 0.5 turns s and t into
+	// coordinates from the corner of the border, which stay positive for s
+	// and t in [0, 1] and truncate to the top-left tap.
+	static float borderCoord(float st, int size) {
+		return st * size + (face_border - 0.5f);
+	}
+
+	u32 sampleFace(CubeFace face, float s, float t) const {
+		return sampleLevel(faces[face], s, t).toU32();
+	}
+
+	// Float bilinear filtering of HDR faces, returning RGBE.
+	u32 sampleFaceRgbe(CubeFace face, float s, float t) const {
+		return sampleLevel(faces[face], s, t, TEXELS_RGBE).toRgbe();
+	}
+
+	// Float bilinear filtering of sRGB faces in linear light, returning sRGB.
+	u32 sampleFaceSrgb(CubeFace face, float s, float t) const {
+		return sampleLevel(faces[face], s, t, TEXELS_SRGB8).toSrgb();
+	}
+
+	static Colorf sampleLevel(const Image& face_img, float s, float t, TexelFormat format = TEXELS_RGBA8) {
+		const float x = borderCoord(s, face_img.width);
+		const float y = borderCoord(t, face_img.height);
+
+		const int x_base = static_cast<int>(x);
+		const int y_base = static_cast<int>(y);
+		const float x_fract = x - x_base;
+		const float y_fract = y - y_base;
+
+		u32 taps[4];
+		readFootprint(face_img, x_base, y_base, taps);
+		return filterFootprint(taps, x_fract, y_fract, format);
+	}
+
+	// The filters of sampleLevel and sampleLevelFixed on the taps that
+	// readFootprint gives.
+	static Colorf filterFootprint(const u32* taps, float x_fract, float y_fract, TexelFormat format) {
+		const Colorf sample_00 = Colorf::fromTexel(taps[0], format);
+		const Colorf sample_10 = Colorf::fromTexel(taps[1], format);
+		const Colorf sample_01 = Colorf::fromTexel(taps[2], format);
+		const Colorf sample_11 = Colorf::fromTexel(taps[3], format);
+
+		const Colorf mix_0 = Colorf::mix(sample_00, sample_10, x_fract);
+		const Colorf mix_1 = Colorf::mix(sample_01, sample_11, x_fract);
+
+		return Colorf::mix(mix_0, mix_1, y_fract);
+	}
+
+	// Same filter as sampleFace in 8.8 fixed point. Rounds where sampleFace
+	// truncates, so results differ from it by at most one per channel.
+	u32 sampleFaceFixed(CubeFace face, float s, float t) const {
+		return sampleLevelFixed(faces[face], s, t);
+	}
+
+	static u32 sampleLevelFixed(const Image& face_img, float s, float t) {
+		const float x = borderCoord(s, face_img.width);
+		const float y = borderCoord(t, face_img.height);
+
+		const int x_base = static_cast<int>(x);
+		const int y_base = static_cast<int>(y);
+		const u32 x_weight = fixedWeight(x - x_base);
+		const u32 y_weight = fixedWeight(y - y_base);
+
+		u32 taps[4];
+		readFootprint(face_img, x_base, y_base, taps);
+		return filterFootprintFixed(taps, x_weight, y_weight);
+	}
+
+	static u32 filterFootprintFixed(const u32* taps, u32 x_weight, u32 y_weight) {
+		const u32 sample_00 = taps[0];
+		const u32 sample_10 = taps[1];
+		const u32 sample_01 = taps[2];
+		const u32 sample_11 = taps[3];
+
+		u32 result = 0xFFu << 24;
+		for (int shift = 0; shift < 24; shift += 8) {
+			const u32 mix_0 = mixFixed((sample_00 >> shift & 0xFF) << 8, (sample_10 >> shift & 0xFF) << 8, x_weight);
+			const u32 mix_1 = mixFixed((sample_01 >> shift & 0xFF) << 8, (sample_11 >> shift & 0xFF) << 8, x_weight);
+			const u32 mix_final = mixFixed(mix_0, mix_1, y_weight);
+			result |= (mix_final + 0x80) >> 8 << shift;
+		}
+		return result;
+	}
+
+	// Level of detail for a sample at (s, t) that covers footprint
+	// steradians: how many halvings from the full-size face make one texel
+	// cover that much.
+	float mipLevel(CubeFace face, float s, float t, float footprint) const {
+		return 0.5f * std::log2(footprint / texelSolidAngle(faces[face], s, t));
+	}
+
+	// Solid angle of the full-size texel at (s, t). In a cube face w texels
+	// across, the texel at (sc, tc) subtends (2 / w)^2 / (1 + sc^2 + tc^2)^1.5.
+	// Never quite 0, even at the poles of the equirect mappings.
+	float texelSolidAngle(const Image& face_img, float s, float t) const;
+
+	// Blends the two mip levels around lod; see mipLevel. Anything at or
+	// below 0 is exactly sampleFace, and levels past the smallest one clamp
+	// to it.
+	// Float filtering in the cubemap's texel format.
+	u32 sampleFaceTrilinear(CubeFace face, float s, float t, float lod) const {
+		if (!(lod > 0.f))
+			return sampleLevel(faces[face], s, t, texel_format).toTexel(texel_format);
+
+		const int last_level = numLevels(face) - 1;
+		const int level_0 = static_cast<int>(lod);
+		if (level_0 >= last_level)
+			return sampleLevel(level(face, last_level), s, t, texel_format).toTexel(texel_format);
+
+		const Colorf sample_0 = sampleLevel(level(face, level_0), s, t, texel_format);
+		const Colorf sample_1 = sampleLevel(level(face, level_0 + 1), s, t, texel_format);
+		return Colorf::mix(sample_0, sample_1, lod - level_0).toTexel(texel_format);
+	}
+
+	u32 sampleFaceTrilinearFixed(CubeFace face, float s, float t, float lod) const {
+		if (!(lod > 0.f))
+			return sampleFaceFixed(face, s, t);
+
+		const int last_level = numLevels(face) - 1;
+		const int level_0 = static_cast<int>(lod);
+		if (level_0 >= last_level)
+			return sampleLevelFixed(level(face, last_level), s, t);
+
+		const u32 sample_0 = sampleLevelFixed(level(face, level_0), s, t);
+		const u32 sample_1 = sampleLevelFixed(level(face, level_0 + 1), s, t);
+		const u32 weight = fixedWeight(lod - level_0);
+
+		u32 result = 0xFFu << 24;
+		for (int shift = 0; shift < 24; shift += 8) {
+			const u32 mix = mixFixed((sample_0 >> shift & 0xFF) << 8, (sample_1 >> shift & 0xFF) << 8, weight);
+			result |= (mix + 0x80) >> 8 << shift;
+		}
+		return result;
+	}
+
+private:
+	Cubemap(const Cubemap&);
+	Cubemap& operator= (const Cubemap&);
+
+	// Marks face as decoded and fills the borders of every face that this
+	// completes the neighbourhood of.
+	void finishFace(CubeFace face);
+	void buildMips(CubeFace face);
+	// The texel that border texel (x, y) of level of face takes: the nearest
+	// texel of whichever face the direction through its centre lands on.
+	// That is always a neighbour, and for square faces of one size it is
+	// exactly the texel across the seam. Panoramas wrap the same way: around
+	// the sides and over the poles of the equirect mappings, along the folded
+	// edges of the octahedral one. Its level is level, or the neighbour's
+	// last one if that has fewer.
+	void borderSource(CubeFace face, int level, int x, int y, int& out_face, int& out_x, int& out_y) const;
+	void fillBorder(CubeFace face, int level);
+	// The memory_budget loader, which runs on loaders[0].
+	void loadPaged(const std::string& fname_prefix, const std::string& fname_extension,
+		std::chrono::steady_clock::time_point start);
+	bool fillPagedBorder(CubeFace face);
+
+	std::thread loaders[NUM_FACES];
+	// Faces that are never loaded: unused by the layout or left out.
+	unsigned skipped_mask;
+	std::atomic<unsigned> ready_mask;
+	// Guarded by ready_mutex.
+	unsigned decoded_mask;
+	unsigned border_claimed_mask;
+	mutable std::mutex ready_mutex;
+	mutable std::condition_variable ready_cv;
+};
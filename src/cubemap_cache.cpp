@@ -0,0 +1,132 @@
+#include "cubemap_cache.hpp"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace {
+
+// Size and modification time of filename, or false if it can't be read.
+bool fileStamp(const std::string& filename, long long& out_size, long long& out_modified) {
+#if defined(_WIN32)
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes))
+		return false;
+	out_size = (long long)attributes.nFileSizeHigh << 32 | attributes.nFileSizeLow;
+	out_modified = (long long)attributes.ftLastWriteTime.dwHighDateTime << 32 | attributes.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat file_stat;
+	if (stat(filename.c_str(), &file_stat) != 0)
+		return false;
+	out_size = file_stat.st_size;
+#if defined(__APPLE__)
+	out_modified = file_stat.st_mtimespec.tv_sec * 1000000000LL + file_stat.st_mtimespec.tv_nsec;
+#else
+	out_modified = file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec;
+#endif
+#endif
+	return true;
+}
+
+u64 imageBytes(const Image& img) {
+	if (img.data == nullptr)
+		return 0;
+	return u64(img.stride()) * (img.height + 2 * img.border) * 4;
+}
+
+u64 cubemapBytes(const Cubemap& cubemap) {
+	u64 bytes = 0;
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		bytes += imageBytes(cubemap.faces[f]);
+		for (const Image& mip : cubemap.mips[f])
+			bytes += imageBytes(mip);
+	}
+	return bytes;
+}
+
+// Whether the files of the faces in mask are the same for a and b.
+bool sameFiles(const CubemapCache::Input& a, const CubemapCache::Input& b, unsigned mask) {
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		if ((mask & Cubemap::faceBit(Cubemap::CubeFace(f))) != 0
+			&& (a.file_sizes[f] != b.file_sizes[f] || a.modified_times[f] != b.modified_times[f]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+} // namespace
+
+CubemapCache::CubemapCache(Mapping layout, u64 budget_bytes) :
+	layout(layout), budget_bytes(budget_bytes), used_bytes(0)
+{}
+
+CubemapCache::Input CubemapCache::describe(const std::string& fname_prefix, const std::string& fname_extension,
+	unsigned face_mask) const
+{
+	Input input;
+	input.fname_prefix = fname_prefix;
+	input.fname_extension = fname_extension;
+	input.face_mask = face_mask;
+
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		input.file_sizes[f] = input.modified_times[f] = -1;
+		if ((face_mask & Cubemap::faceBit(Cubemap::CubeFace(f))) != 0 && f < mappingFaces(layout))
+			fileStamp(Cubemap::inputFilename(fname_prefix, fname_extension, layout, f), input.file_sizes[f], input.modified_times[f]);
+	}
+	return input;
+}
+
+bool CubemapCache::covers(const Input& cached, const Input& wanted) {
+	if (cached.fname_prefix != wanted.fname_prefix || cached.fname_extension != wanted.fname_extension
+		|| (cached.face_mask & wanted.face_mask) != wanted.face_mask)
+	{
+		return false;
+	}
+	return sameFiles(cached, wanted, wanted.face_mask);
+}
+
+std::shared_ptr<const Cubemap> CubemapCache::find(const Input& input) {
+	for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
+		if (covers(entry->input, input)) {
+			entries.splice(entries.begin(), entries, entry);
+			return entry->cubemap;
+		}
+	}
+	return nullptr;
+}
+
+void CubemapCache::insert(const Input& input, const std::shared_ptr<const Cubemap>& cubemap) {
+	if (!cubemap->finishLoading() || cubemap->paged_faces != nullptr)
+		return;
+
+	// Entries of the same files that this one covers, or whose files changed
+	// since, are of no more use.
+	for (auto entry = entries.begin(); entry != entries.end(); ) {
+		if (entry->input.fname_prefix == input.fname_prefix && entry->input.fname_extension == input.fname_extension
+			&& (covers(input, entry->input) || !sameFiles(input, entry->input, input.face_mask & entry->input.face_mask)))
+		{
+			used_bytes -= entry->bytes;
+			entry = entries.erase(entry);
+		} else {
+			++entry;
+		}
+	}
+
+	const u64 bytes = cubemapBytes(*cubemap);
+	if (bytes > budget_bytes)
+		return;
+
+	while (used_bytes + bytes > budget_bytes) {
+		used_bytes -= entries.back().bytes;
+		entries.pop_back();
+	}
+
+	Entry entry = { input, cubemap, bytes };
+	entries.push_front(entry);
+	used_bytes += bytes;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <string>
+
+#include "cubemap.hpp"
+
+// Decoded inputs kept from one -serve request to the next, least recently
+// used going first once they add up to more than a budget. A cubemap is
+// only handed out again while its files keep the size and modification time
+// they had when it was decoded, and only to jobs reading no face it left
+// out.
+class CubemapCache {
+public:
+	// What a cubemap was, or is to be, decoded from.
+	struct Input {
+		std::string fname_prefix;
+		std::string fname_extension;
+		unsigned face_mask;
+
+		// Size and modification time of the file of each face in face_mask,
+		// or -1 for files that can't be read.
+		long long file_sizes[Cubemap::NUM_FACES];
+		long long modified_times[Cubemap::NUM_FACES];
+	};
+
+	CubemapCache(Mapping layout, u64 budget_bytes);
+
+	// Describes the faces in face_mask of the layout's input files as they
+	// are on disk now. Take it before decoding, so that files changing
+	// meanwhile aren't missed.
+	Input describe(const std::string& fname_prefix, const std::string& fname_extension, unsigned face_mask) const;
+
+	// Whether a cubemap decoded from cached serves a job reading wanted.
+	static bool covers(const Input& cached, const Input& wanted);
+
+	// The cubemap covering input, which then counts as just used, or
+	// nullptr.
+	std::shared_ptr<const Cubemap> find(const Input& input);
+
+	// Keeps cubemap, which was decoded from input and must be done loading,
+	// in place of any it covers. Cubemaps that failed to load, are paged
+	// or are over the budget on their own aren't kept.
+	void insert(const Input& input, const std::shared_ptr<const Cubemap>& cubemap);
+
+	size_t size() const { return entries.size(); }
+	u64 bytes() const { return used_bytes; }
+
+private:
+	CubemapCache(const CubemapCache&);
+	CubemapCache& operator= (const CubemapCache&);
+
+	struct Entry {
+		Input input;
+		std::shared_ptr<const Cubemap> cubemap;
+		u64 bytes;
+	};
+
+	Mapping layout;
+	u64 budget_bytes, used_bytes;
+	// Most recently used first.
+	std::list<Entry> entries;
+};
@@ -0,0 +1,638 @@
+#include "deflate.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstring>
+
+namespace {
+
+const int window_size = 1 << 15;
+const int hash_bits = 15;
+const int min_match = 3;
+const int max_match = 258;
+
+// Tokens collected before they're emitted as a block with its own codes.
+const size_t block_tokens = 1 << 14;
+
+const int num_lit_codes = 286;
+const int num_dist_codes = 30;
+// The fixed code has two more of each, which take part in numbering the codes.
+const int num_fixed_lit_codes = 288;
+const int num_fixed_dist_codes = 32;
+const int num_length_codes = 19;
+const int max_code_bits = 15;
+const int max_length_code_bits = 7;
+
+// zlib's tuning for its levels.
+struct LevelParams {
+	// Whether a match is passed over for a literal when the next position
+	// starts a longer one.
+	bool lazy;
+	// With lazy matching, the search at the next position tries a quarter
+	// as many entries after a match this long.
+	int good_length;
+	// With lazy matching, a match this long is taken without checking the
+	// next position. Otherwise, the positions inside longer matches aren't
+	// entered into the hash chains.
+	int lazy_length;
+	// A match this long ends the search.
+	int nice_length;
+	// Hash chain entries tried per position.
+	int max_chain;
+};
+
+const LevelParams level_params[10] = {
+	{ false, 0, 0, 0, 0 },
+	{ false, 4, 4, 8, 4 },
+	{ false, 4, 5, 16, 8 },
+	{ false, 4, 6, 32, 32 },
+	{ true, 4, 4, 16, 16 },
+	{ true, 8, 16, 32, 32 },
+	{ true, 8, 16, 128, 128 },
+	{ true, 8, 32, 128, 256 },
+	{ true, 32, 128, 258, 1024 },
+	{ true, 32, 258, 258, 4096 }
+};
+
+const u16 length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const u8 length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const u16 dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+	4097, 6145, 8193, 12289, 16385, 24577
+};
+const u8 dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+const u8 length_code_order[num_length_codes] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+const u8 length_code_extra[num_length_codes] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+
+u16 reverseBits(unsigned code, int num_bits) {
+	unsigned reversed = 0;
+	for (int i = 0; i < num_bits; ++i, code >>= 1)
+		reversed = reversed << 1 | (code & 1);
+	return static_cast<u16>(reversed);
+}
+
+// Canonical codes for lengths, bit-reversed since deflate sends Huffman
+// codes starting from their top bit.
+void canonicalCodes(const u8* lengths, int count, u16* out_codes) {
+	int length_count[max_code_bits + 1] = { 0 };
+	for (int i = 0; i < count; ++i)
+		++length_count[lengths[i]];
+	length_count[0] = 0;
+
+	unsigned next_code[max_code_bits + 1] = { 0 };
+	unsigned code = 0;
+	for (int bits = 1; bits <= max_code_bits; ++bits) {
+		code = (code + length_count[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+
+	for (int i = 0; i < count; ++i)
+		out_codes[i] = lengths[i] != 0 ? reverseBits(next_code[lengths[i]]++, lengths[i]) : 0;
+}
+
+// Lookup tables built once: code numbers for match lengths and distances,
+// the fixed Huffman code and the CRC-32 table.
+struct Tables {
+	u8 length_code[max_match + 1];
+	// Distances 1 to 256 by distance - 1, longer ones by 256 + (distance - 1) / 128.
+	u8 dist_code[512];
+	u8 fixed_lit_lengths[num_fixed_lit_codes];
+	u16 fixed_lit_codes[num_fixed_lit_codes];
+	u8 fixed_dist_lengths[num_fixed_dist_codes];
+	u16 fixed_dist_codes[num_fixed_dist_codes];
+	u32 crc[256];
+
+	Tables() {
+		for (int code = 0; code < 29; ++code) {
+			const int end = code == 28 ? max_match + 1 : length_base[code + 1];
+			for (int length = length_base[code]; length < end; ++length)
+				length_code[length] = static_cast<u8>(code);
+		}
+		for (int code = 0; code < num_dist_codes; ++code) {
+			for (int d = dist_base[code] - 1; d < dist_base[code] - 1 + (1 << dist_extra[code]); ++d)
+				dist_code[d < 256 ? d : 256 + (d >> 7)] = static_cast<u8>(code);
+		}
+
+		for (int i = 0; i < num_fixed_lit_codes; ++i)
+			fixed_lit_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+		std::fill(fixed_dist_lengths, fixed_dist_lengths + num_fixed_dist_codes, 5);
+		canonicalCodes(fixed_lit_lengths, num_fixed_lit_codes, fixed_lit_codes);
+		canonicalCodes(fixed_dist_lengths, num_fixed_dist_codes, fixed_dist_codes);
+
+		for (u32 i = 0; i < 256; ++i) {
+			u32 c = i;
+			for (int bit = 0; bit < 8; ++bit)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			crc[i] = c;
+		}
+	}
+
+	int distCode(int distance) const {
+		const int d = distance - 1;
+		return dist_code[d < 256 ? d : 256 + (d >> 7)];
+	}
+};
+
+const Tables& tables() {
+	static const Tables instance;
+	return instance;
+}
+
+// Builds an unrestricted Huffman code with the two-queue method; fails if
+// a code gets longer than max_bits.
+bool huffmanLengthsUnlimited(const std::vector<u32>& weights, int max_bits, u8* out_lengths) {
+	std::vector<int> symbols;
+	for (int i = 0; i < int(weights.size()); ++i) {
+		out_lengths[i] = 0;
+		if (weights[i] != 0)
+			symbols.push_back(i);
+	}
+	std::stable_sort(symbols.begin(), symbols.end(), [&](int a, int b) { return weights[a] < weights[b]; });
+
+	// Leaves come first in weight order; merged nodes follow and are made in
+	// weight order too, so the two lightest are always at the queue fronts.
+	const int num_leaves = int(symbols.size());
+	const int num_nodes = 2 * num_leaves - 1;
+	std::vector<u64> node_weight(num_nodes);
+	std::vector<int> parent(num_nodes, -1);
+	for (int i = 0; i < num_leaves; ++i)
+		node_weight[i] = weights[symbols[i]];
+
+	int leaf = 0, inner = num_leaves;
+	for (int next = num_leaves; next < num_nodes; ++next) {
+		int pair[2];
+		for (int& node : pair)
+			node = leaf < num_leaves && (inner == next || node_weight[leaf] <= node_weight[inner]) ? leaf++ : inner++;
+		node_weight[next] = node_weight[pair[0]] + node_weight[pair[1]];
+		parent[pair[0]] = parent[pair[1]] = next;
+	}
+
+	std::vector<int> depth(num_nodes, 0);
+	for (int i = num_nodes - 2; i >= 0; --i)
+		depth[i] = depth[parent[i]] + 1;
+
+	for (int i = 0; i < num_leaves; ++i) {
+		if (depth[i] > max_bits)
+			return false;
+		out_lengths[symbols[i]] = static_cast<u8>(depth[i]);
+	}
+	return true;
+}
+
+// Code lengths of at most max_bits for symbols of freq. Unused symbols get
+// no code, except that at least two symbols always get one: some decoders
+// reject a code of a single symbol. Codes that come out too long are
+// rebuilt from halved frequencies, which flattens them.
+void huffmanLengths(const u32* freq, int count, int max_bits, u8* out_lengths) {
+	std::vector<u32> weights(freq, freq + count);
+	int used = static_cast<int>(std::count_if(weights.begin(), weights.end(), [](u32 w) { return w != 0; }));
+	for (int i = 0; used < 2 && i < count; ++i) {
+		if (weights[i] == 0) {
+			weights[i] = 1;
+			++used;
+		}
+	}
+
+	while (!huffmanLengthsUnlimited(weights, max_bits, out_lengths)) {
+		for (u32& w : weights)
+			w = (w + 1) / 2;
+	}
+}
+
+// Appends bits starting from the lowest, as a deflate stream is packed.
+class BitWriter {
+public:
+	explicit BitWriter(std::vector<u8>& out) : out(out), bits(0), num_bits(0) {}
+
+	void put(u32 value, int count) {
+		bits |= u64(value) << num_bits;
+		num_bits += count;
+		while (num_bits >= 8) {
+			out.push_back(static_cast<u8>(bits));
+			bits >>= 8;
+			num_bits -= 8;
+		}
+	}
+
+	void alignToByte() {
+		if (num_bits > 0)
+			put(0, 8 - num_bits);
+	}
+
+	void putBytes(const u8* data, size_t size) {
+		assert(num_bits == 0);
+		out.insert(out.end(), data, data + size);
+	}
+
+private:
+	std::vector<u8>& out;
+	u64 bits;
+	int num_bits;
+};
+
+class Deflater {
+public:
+	Deflater(const u8* data, int size, const LevelParams& params, std::vector<u8>& out) :
+		data(data), size(size), params(params), bits(out), block_start(0)
+	{}
+
+	void compress();
+
+private:
+	Deflater(const Deflater&);
+	Deflater& operator= (const Deflater&);
+
+	static int hash(const u8* p) {
+		return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << hash_bits) - 1);
+	}
+
+	void insert(int pos) {
+		const int h = hash(data + pos);
+		prev[pos & (window_size - 1)] = head[h];
+		head[h] = pos;
+	}
+
+	int findMatch(int pos, int prev_length, int& out_distance) const;
+	void addLiteral(int pos);
+	void addMatch(int length, int distance);
+	void compressGreedy();
+	void compressLazy();
+	void flushBlock(int block_end);
+	void writeStored(int begin, int end);
+
+	const u8* data;
+	const int size;
+	const LevelParams& params;
+	BitWriter bits;
+
+	std::vector<int> head, prev;
+	// Literals as their byte, matches as distance << 16 | length.
+	std::vector<u32> tokens;
+	int block_start;
+};
+
+// Longest earlier match for the bytes at pos that is longer than
+// prev_length and at least min_match bytes, or 0. Needs min_match bytes
+// left at pos.
+int Deflater::findMatch(int pos, int prev_length, int& out_distance) const {
+	const u8* cur = data + pos;
+	const int max_length = std::min(max_match, size - pos);
+	if (prev_length >= max_length)
+		return 0;
+
+	int best = std::max(prev_length, min_match - 1);
+	int chain = prev_length >= params.good_length ? params.max_chain >> 2 : params.max_chain;
+
+	for (int candidate = head[hash(cur)]; candidate >= 0 && pos - candidate <= window_size && chain-- > 0;
+		candidate = prev[candidate & (window_size - 1)])
+	{
+		const u8* match = data + candidate;
+		if (match[best] != cur[best] || match[0] != cur[0] || match[1] != cur[1])
+			continue;
+
+		int length = 2;
+		for (; length + 8 <= max_length; length += 8) {
+			u64 a, b;
+			std::memcpy(&a, match + length, 8);
+			std::memcpy(&b, cur + length, 8);
+			if (a != b)
+				break;
+		}
+		while (length < max_length && match[length] == cur[length])
+			++length;
+		if (length > best) {
+			best = length;
+			out_distance = pos - candidate;
+			if (length >= params.nice_length || length >= max_length)
+				break;
+		}
+	}
+	return best > prev_length && best >= min_match ? best : 0;
+}
+
+void Deflater::addLiteral(int pos) {
+	tokens.push_back(data[pos]);
+	if (tokens.size() >= block_tokens)
+		flushBlock(pos + 1);
+}
+
+// Adds a match that ends at the current position once it's been stepped past.
+void Deflater::addMatch(int length, int distance) {
+	tokens.push_back(u32(distance) << 16 | length);
+}
+
+void Deflater::writeStored(int begin, int end) {
+	while (begin < end) {
+		const int count = std::min(end - begin, 0xFFFF);
+		bits.put(0, 3);
+		bits.alignToByte();
+		bits.put(count, 16);
+		bits.put(~count & 0xFFFF, 16);
+		bits.putBytes(data + begin, count);
+		begin += count;
+	}
+}
+
+// Emits the collected tokens, which cover [block_start, block_end), as
+// whichever of a dynamic, fixed or stored block comes out smallest.
+void Deflater::flushBlock(int block_end) {
+	if (tokens.empty())
+		return;
+
+	const Tables& t = tables();
+	u32 lit_freq[num_lit_codes] = { 0 };
+	u32 dist_freq[num_dist_codes] = { 0 };
+	u64 extra_bits = 0;
+	for (u32 token : tokens) {
+		if (token < 0x10000) {
+			++lit_freq[token];
+			continue;
+		}
+		const int length_code = t.length_code[token & 0xFFFF];
+		const int dist_code = t.distCode(token >> 16);
+		++lit_freq[257 + length_code];
+		++dist_freq[dist_code];
+		extra_bits += length_extra[length_code] + dist_extra[dist_code];
+	}
+	lit_freq[256] = 1;
+
+	u8 lit_lengths[num_lit_codes];
+	u8 dist_lengths[num_dist_codes];
+	huffmanLengths(lit_freq, num_lit_codes, max_code_bits, lit_lengths);
+	huffmanLengths(dist_freq, num_dist_codes, max_code_bits, dist_lengths);
+
+	int num_lit = num_lit_codes;
+	while (num_lit > 257 && lit_lengths[num_lit - 1] == 0)
+		--num_lit;
+	int num_dist = num_dist_codes;
+	while (num_dist > 1 && dist_lengths[num_dist - 1] == 0)
+		--num_dist;
+
+	// Both code length lists run together, with runs of a repeated length
+	// (16) or of zeros (17, 18) folded.
+	u8 all_lengths[num_lit_codes + num_dist_codes];
+	std::copy(lit_lengths, lit_lengths + num_lit, all_lengths);
+	std::copy(dist_lengths, dist_lengths + num_dist, all_lengths + num_lit);
+	const int num_all = num_lit + num_dist;
+
+	std::vector<u16> length_symbols; // symbol | extra << 5
+	for (int i = 0; i < num_all;) {
+		const u8 length = all_lengths[i];
+		int run = 1;
+		while (i + run < num_all && all_lengths[i + run] == length)
+			++run;
+
+		if (length == 0 && run >= 3) {
+			for (int left = run; left >= 3;) {
+				const int count = std::min(left, 138);
+				length_symbols.push_back(static_cast<u16>(count >= 11 ? 18 | (count - 11) << 5 : 17 | (count - 3) << 5));
+				left -= count;
+				i += count;
+			}
+		} else if (length != 0 && run >= 4) {
+			length_symbols.push_back(length);
+			++i;
+			for (int left = run - 1; left >= 3;) {
+				const int count = std::min(left, 6);
+				length_symbols.push_back(static_cast<u16>(16 | (count - 3) << 5));
+				left -= count;
+				i += count;
+			}
+		} else {
+			length_symbols.push_back(length);
+			++i;
+		}
+	}
+
+	u32 length_freq[num_length_codes] = { 0 };
+	for (u16 symbol : length_symbols)
+		++length_freq[symbol & 31];
+	u8 length_lengths[num_length_codes];
+	huffmanLengths(length_freq, num_length_codes, max_length_code_bits, length_lengths);
+	int num_length = num_length_codes;
+	while (num_length > 4 && length_lengths[length_code_order[num_length - 1]] == 0)
+		--num_length;
+
+	u64 dynamic_bits = 3 + 5 + 5 + 4 + 3 * num_length + extra_bits;
+	u64 fixed_bits = 3 + extra_bits;
+	for (u16 symbol : length_symbols)
+		dynamic_bits += length_lengths[symbol & 31] + length_code_extra[symbol & 31];
+	for (int i = 0; i < num_lit_codes; ++i) {
+		dynamic_bits += u64(lit_freq[i]) * lit_lengths[i];
+		fixed_bits += u64(lit_freq[i]) * t.fixed_lit_lengths[i];
+	}
+	for (int i = 0; i < num_dist_codes; ++i) {
+		dynamic_bits += u64(dist_freq[i]) * dist_lengths[i];
+		fixed_bits += u64(dist_freq[i]) * t.fixed_dist_lengths[i];
+	}
+	const int block_bytes = block_end - block_start;
+	const u64 stored_bits = (u64(block_bytes) + 5 * ((block_bytes + 0xFFFE) / 0xFFFF)) * 8 + 7;
+
+	if (stored_bits <= std::min(dynamic_bits, fixed_bits)) {
+		writeStored(block_start, block_end);
+	} else {
+		const u8* lit_code_lengths = t.fixed_lit_lengths;
+		const u16* lit_codes = t.fixed_lit_codes;
+		const u8* dist_code_lengths = t.fixed_dist_lengths;
+		const u16* dist_codes = t.fixed_dist_codes;
+		u16 dynamic_lit_codes[num_lit_codes];
+		u16 dynamic_dist_codes[num_dist_codes];
+
+		if (fixed_bits <= dynamic_bits) {
+			bits.put(1 << 1, 3);
+		} else {
+			bits.put(2 << 1, 3);
+			bits.put(num_lit - 257, 5);
+			bits.put(num_dist - 1, 5);
+			bits.put(num_length - 4, 4);
+			for (int i = 0; i < num_length; ++i)
+				bits.put(length_lengths[length_code_order[i]], 3);
+
+			u16 length_codes[num_length_codes];
+			canonicalCodes(length_lengths, num_length_codes, length_codes);
+			for (u16 symbol : length_symbols) {
+				bits.put(length_codes[symbol & 31], length_lengths[symbol & 31]);
+				if (length_code_extra[symbol & 31] != 0)
+					bits.put(symbol >> 5, length_code_extra[symbol & 31]);
+			}
+
+			canonicalCodes(lit_lengths, num_lit_codes, dynamic_lit_codes);
+			canonicalCodes(dist_lengths, num_dist_codes, dynamic_dist_codes);
+			lit_code_lengths = lit_lengths;
+			lit_codes = dynamic_lit_codes;
+			dist_code_lengths = dist_lengths;
+			dist_codes = dynamic_dist_codes;
+		}
+
+		for (u32 token : tokens) {
+			if (token < 0x10000) {
+				bits.put(lit_codes[token], lit_code_lengths[token]);
+				continue;
+			}
+			const int length = token & 0xFFFF;
+			const int distance = token >> 16;
+			const int length_code = t.length_code[length];
+			const int dist_code = t.distCode(distance);
+			bits.put(lit_codes[257 + length_code], lit_code_lengths[257 + length_code]);
+			bits.put(length - length_base[length_code], length_extra[length_code]);
+			bits.put(dist_codes[dist_code], dist_code_lengths[dist_code]);
+			bits.put(distance - dist_base[dist_code], dist_extra[dist_code]);
+		}
+		bits.put(lit_codes[256], lit_code_lengths[256]);
+	}
+
+	tokens.clear();
+	block_start = block_end;
+}
+
+// zlib's deflate_fast: takes every match as it comes.
+void Deflater::compressGreedy() {
+	for (int pos = 0; pos < size;) {
+		int length = 0, distance = 0;
+		if (pos + min_match <= size) {
+			length = findMatch(pos, 0, distance);
+			insert(pos);
+		}
+
+		if (length == 0) {
+			addLiteral(pos);
+			++pos;
+			continue;
+		}
+
+		addMatch(length, distance);
+		if (length <= params.lazy_length) {
+			for (int p = pos + 1; p < pos + length && p + min_match <= size; ++p)
+				insert(p);
+		}
+		pos += length;
+		if (tokens.size() >= block_tokens)
+			flushBlock(pos);
+	}
+}
+
+// zlib's deflate_slow: a match found at one position is held back while the
+// next is searched, and dropped for a literal if that finds a longer one.
+void Deflater::compressLazy() {
+	int prev_length = 0, prev_distance = 0;
+	bool literal_pending = false;
+
+	for (int pos = 0; pos < size;) {
+		int length = 0, distance = 0;
+		if (pos + min_match <= size && prev_length < params.lazy_length) {
+			length = findMatch(pos, prev_length, distance);
+			insert(pos);
+		} else if (pos + min_match <= size) {
+			insert(pos);
+		}
+
+		if (prev_length != 0 && length == 0) {
+			// The match held back from pos - 1 stands; the positions it covers
+			// from pos + 1 on still go into the hash chains.
+			addMatch(prev_length, prev_distance);
+			const int end = pos - 1 + prev_length;
+			for (int p = pos + 1; p < end && p + min_match <= size; ++p)
+				insert(p);
+			pos = end;
+			prev_length = 0;
+			literal_pending = false;
+			if (tokens.size() >= block_tokens)
+				flushBlock(pos);
+			continue;
+		}
+
+		if (literal_pending)
+			addLiteral(pos - 1);
+		literal_pending = true;
+		prev_length = length;
+		prev_distance = distance;
+		++pos;
+	}
+
+	if (literal_pending)
+		addLiteral(size - 1);
+}
+
+void Deflater::compress() {
+	if (params.max_chain == 0) {
+		writeStored(0, size);
+	} else {
+		head.assign(1 << hash_bits, -1);
+		prev.assign(window_size, -1);
+		tokens.reserve(block_tokens);
+
+		if (params.lazy)
+			compressLazy();
+		else
+			compressGreedy();
+		flushBlock(size);
+	}
+
+	// An empty stored block brings the chunk to a byte boundary without
+	// ending the stream.
+	bits.put(0, 3);
+	bits.alignToByte();
+	bits.put(0, 16);
+	bits.put(0xFFFF, 16);
+}
+
+} // namespace
+
+const u8 deflate_end_of_stream[2] = { 0x03, 0x00 };
+
+void deflateChunk(const u8* data, size_t size, int level, std::vector<u8>& out) {
+	assert(level >= 0 && level <= 9 && size <= size_t(INT_MAX));
+	Deflater deflater(data, static_cast<int>(size), level_params[level], out);
+	deflater.compress();
+}
+
+u32 adler32(const u8* data, size_t size, u32 adler) {
+	const u32 base = 65521;
+	u32 a = adler & 0xFFFF, b = adler >> 16;
+	while (size > 0) {
+		// The most bytes before b can overflow 32 bits.
+		const size_t count = std::min<size_t>(size, 5552);
+		for (size_t i = 0; i < count; ++i) {
+			a += data[i];
+			b += a;
+		}
+		a %= base;
+		b %= base;
+		data += count;
+		size -= count;
+	}
+	return b << 16 | a;
+}
+
+u32 crc32(const u8* data, size_t size, u32 crc) {
+	const u32* table = tables().crc;
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+u32 adler32Combine(u32 first, u32 second, u64 second_size) {
+	const u32 base = 65521;
+	const u32 rem = static_cast<u32>(second_size % base);
+	u32 sum1 = first & 0xFFFF;
+	u32 sum2 = static_cast<u32>(u64(rem) * sum1 % base);
+	sum1 += (second & 0xFFFF) + base - 1;
+	sum2 += (first >> 16) + (second >> 16) + base - rem;
+	if (sum1 >= base)
+		sum1 -= base;
+	if (sum1 >= base)
+		sum1 -= base;
+	if (sum2 >= 2 * base)
+		sum2 -= 2 * base;
+	if (sum2 >= base)
+		sum2 -= base;
+	return sum2 << 16 | sum1;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "cubemap.hpp"
+
+// Compresses size bytes of data and appends them to out as raw deflate
+// blocks (RFC 1951). None of the blocks is final and the chunk ends on a
+// byte boundary, so chunks compressed independently, say on different
+// threads, concatenate into one stream once deflate_end_of_stream follows
+// the last of them. Matches never reach back before data.
+//
+// level 0 only stores; 1 to 9 trade speed for size like zlib's levels.
+void deflateChunk(const u8* data, size_t size, int level, std::vector<u8>& out);
+
+// An empty final block, which closes a stream of chunks.
+extern const u8 deflate_end_of_stream[2];
+
+// Running checksums: pass the result of the previous call to continue one.
+u32 adler32(const u8* data, size_t size, u32 adler = 1);
+u32 crc32(const u8* data, size_t size, u32 crc = 0);
+
+// Adler-32 of two buffers one after the other, from the checksums of each
+// and the size of the second, so chunks can be checksummed in parallel.
+u32 adler32Combine(u32 first, u32 second, u64 second_size);
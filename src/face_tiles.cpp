@@ -0,0 +1,350 @@
+#include "face_tiles.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const int tile_row = FaceTiles::tile_size + 1;
+
+} // namespace
+
+FaceTiles::FaceTiles() :
+	num_tiles(0),
+#if defined(_WIN32)
+	file_handle(INVALID_HANDLE_VALUE),
+#else
+	file_descriptor(-1),
+#endif
+	capacity(0), tile_loads(0), read_failed(false)
+{
+	for (FaceLayout& layout : faces)
+		layout = FaceLayout();
+}
+
+FaceTiles::~FaceTiles() {
+#if defined(_WIN32)
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+#else
+	if (file_descriptor >= 0)
+		::close(file_descriptor);
+#endif
+}
+
+bool FaceTiles::open(u64 cache_bytes) {
+	capacity = std::max<size_t>(static_cast<size_t>(cache_bytes / tile_bytes), 1);
+
+#if defined(_WIN32)
+	char dir[MAX_PATH + 1], path[MAX_PATH + 1];
+	if (GetTempPathA(sizeof(dir), dir) == 0 || GetTempFileNameA(dir, "smt", 0, path) == 0) {
+		std::cerr << "Failed to create a face tile file in the temp folder.\n";
+		return false;
+	}
+
+	file_handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		DeleteFileA(path);
+		std::cerr << "Failed to create " << path << ".\n";
+		return false;
+	}
+#else
+	const char* tmpdir = std::getenv("TMPDIR");
+	std::string path = std::string(tmpdir != nullptr && *tmpdir != '\0' ? tmpdir : "/tmp") + "/SpheremapTool-XXXXXX";
+	file_descriptor = mkstemp(&path[0]);
+	if (file_descriptor < 0) {
+		std::cerr << "Failed to create a face tile file like " << path << ".\n";
+		return false;
+	}
+
+	// Gone once closed, even if the process dies first.
+	unlink(path.c_str());
+#endif
+	return true;
+}
+
+bool FaceTiles::isOpen() const {
+#if defined(_WIN32)
+	return file_handle != INVALID_HANDLE_VALUE;
+#else
+	return file_descriptor >= 0;
+#endif
+}
+
+bool FaceTiles::readTile(int tile, u32* out) const {
+	const u64 offset = u64(tile) * tile_bytes;
+#if defined(_WIN32)
+	OVERLAPPED overlapped = OVERLAPPED();
+	overlapped.Offset = static_cast<DWORD>(offset);
+	overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+	DWORD bytes_read;
+	return ReadFile(file_handle, out, DWORD(tile_bytes), &bytes_read, &overlapped) && bytes_read == tile_bytes;
+#else
+	u8* dst = reinterpret_cast<u8*>(out);
+	for (size_t done = 0; done < tile_bytes; ) {
+		const ssize_t bytes_read = pread(file_descriptor, dst + done, tile_bytes - done, off_t(offset + done));
+		if (bytes_read <= 0)
+			return false;
+		done += size_t(bytes_read);
+	}
+	return true;
+#endif
+}
+
+bool FaceTiles::writeTile(int tile, const u32* texels) {
+	const u64 offset = u64(tile) * tile_bytes;
+#if defined(_WIN32)
+	OVERLAPPED overlapped = OVERLAPPED();
+	overlapped.Offset = static_cast<DWORD>(offset);
+	overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+	DWORD bytes_written;
+	return WriteFile(file_handle, texels, DWORD(tile_bytes), &bytes_written, &overlapped) && bytes_written == tile_bytes;
+#else
+	const u8* src = reinterpret_cast<const u8*>(texels);
+	for (size_t done = 0; done < tile_bytes; ) {
+		const ssize_t bytes_written = pwrite(file_descriptor, src + done, tile_bytes - done, off_t(offset + done));
+		if (bytes_written <= 0)
+			return false;
+		done += size_t(bytes_written);
+	}
+	return true;
+#endif
+}
+
+bool FaceTiles::addFace(int face, int width, int height, const RowReader& read_row) {
+	const int border = Cubemap::face_border;
+	const int stride = width + 2 * border;
+
+	// The top-left taps of footprints reach from the corner of the border to
+	// one texel short of the far edge, just as far as these tiles.
+	FaceLayout& layout = faces[face];
+	layout.width = width;
+	layout.height = height;
+	layout.tiles_x = (stride - 2) / tile_size + 1;
+	layout.tiles_y = (height + 2 * border - 2) / tile_size + 1;
+	layout.first_tile = num_tiles;
+	num_tiles += layout.tiles_x * layout.tiles_y;
+	tile_slots.resize(num_tiles, -1);
+
+	// One row of tiles at a time, padded with black past the border.
+	const int band_width = layout.tiles_x * tile_size + 1;
+	std::vector<u32> band(size_t(band_width) * tile_row, 0);
+	std::vector<u32> tile_texels(size_t(tile_row) * tile_row);
+
+	for (int tile_y = 0; tile_y < layout.tiles_y; ++tile_y) {
+		for (int row = 0; row < tile_row; ++row) {
+			const int y = tile_y * tile_size + row - border;
+			u32* out = &band[size_t(row) * band_width];
+			if (y >= height + border) {
+				std::fill(out, out + band_width, 0);
+				continue;
+			}
+
+			read_row(std::max(std::min(y, height - 1), 0), out + border);
+			std::fill(out, out + border, out[border]);
+			std::fill(out + border + width, out + stride, out[border + width - 1]);
+		}
+
+		for (int tile_x = 0; tile_x < layout.tiles_x; ++tile_x) {
+			for (int row = 0; row < tile_row; ++row) {
+				const u32* src = &band[size_t(row) * band_width + tile_x * tile_size];
+				std::copy(src, src + tile_row, &tile_texels[size_t(row) * tile_row]);
+			}
+
+			if (!writeTile(layout.first_tile + tile_y * layout.tiles_x + tile_x, tile_texels.data())) {
+				std::cerr << "Failed to write the face tile file.\n";
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+u32 FaceTiles::texel(int face, int x, int y) const {
+	const FaceLayout& layout = faces[face];
+	const int border_x = x + Cubemap::face_border;
+	const int border_y = y + Cubemap::face_border;
+	const int tile_x = border_x / tile_size;
+	const int tile_y = border_y / tile_size;
+
+	int slot;
+	const u32* texels = pin(layout.first_tile + tile_y * layout.tiles_x + tile_x, slot);
+	const u32 value = texels[size_t(border_y - tile_y * tile_size) * tile_row + (border_x - tile_x * tile_size)];
+	unpin(slot);
+	return value;
+}
+
+bool FaceTiles::setBorder(int face, const std::function<u32(int x, int y)>& border_texel) {
+	const FaceLayout& layout = faces[face];
+	const int border = Cubemap::face_border;
+	std::vector<u32> tile_texels(size_t(tile_row) * tile_row);
+
+	for (int tile_y = 0; tile_y < layout.tiles_y; ++tile_y) {
+		for (int tile_x = 0; tile_x < layout.tiles_x; ++tile_x) {
+			// Texels of the tile, counted from the corner of the border.
+			const int x_begin = tile_x * tile_size;
+			const int y_begin = tile_y * tile_size;
+			const int x_end = std::min(x_begin + tile_row, layout.width + 2 * border);
+			const int y_end = std::min(y_begin + tile_row, layout.height + 2 * border);
+			if (x_begin >= border && x_end <= layout.width + border && y_begin >= border && y_end <= layout.height + border)
+				continue;
+
+			const int tile = layout.first_tile + tile_y * layout.tiles_x + tile_x;
+			if (!readTile(tile, tile_texels.data())) {
+				std::cerr << "Failed to read the face tile file.\n";
+				return false;
+			}
+
+			for (int y = y_begin; y < y_end; ++y) {
+				const bool edge_row = y < border || y >= layout.height + border;
+				u32* row = &tile_texels[size_t(y - y_begin) * tile_row];
+				for (int x = x_begin; x < x_end; ++x) {
+					// Rows within the face only have border texels at either end.
+					if (!edge_row && x >= border && x < layout.width + border) {
+						x = layout.width + border - 1;
+						continue;
+					}
+					row[x - x_begin] = border_texel(x - border, y - border);
+				}
+			}
+
+			if (!writeTile(tile, tile_texels.data())) {
+				std::cerr << "Failed to write the face tile file.\n";
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void FaceTiles::dropCache() {
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	std::fill(tile_slots.begin(), tile_slots.end(), -1);
+	lru.splice(lru.end(), pinned);
+	for (Slot& slot : slots)
+		slot.tile = -1;
+}
+
+const u32* FaceTiles::pin(int tile, int& out_slot) const {
+	std::unique_lock<std::mutex> lock(cache_mutex);
+	int slot = tile_slots[tile];
+	if (slot >= 0) {
+		// Tiles still being read are pinned by their reader, so they are
+		// never in lru.
+		if (slots[slot].pins++ == 0)
+			pinned.splice(pinned.end(), lru, slots[slot].lru_pos);
+		loaded_cv.wait(lock, [&] { return slots[slot].ready; });
+		out_slot = slot;
+		return slots[slot].texels.get();
+	}
+
+	if (slots.size() < capacity || lru.empty()) {
+		slot = static_cast<int>(slots.size());
+		slots.emplace_back();
+		slots[slot].texels.reset(new u32[tile_bytes / 4]);
+		slots[slot].lru_pos = pinned.insert(pinned.end(), slot);
+	} else {
+		slot = lru.front();
+		pinned.splice(pinned.end(), lru, lru.begin());
+		if (slots[slot].tile >= 0)
+			tile_slots[slots[slot].tile] = -1;
+	}
+
+	Slot& miss = slots[slot];
+	miss.tile = tile;
+	miss.pins = 1;
+	miss.ready = false;
+	tile_slots[tile] = slot;
+	u32* texels = miss.texels.get();
+	lock.unlock();
+
+	if (!readTile(tile, texels)) {
+		std::fill(texels, texels + tile_bytes / 4, 0);
+		if (!read_failed.exchange(true))
+			std::cerr << "Failed to read the face tile file.\n";
+	}
+	tile_loads.fetch_add(1, std::memory_order_relaxed);
+
+	lock.lock();
+	slots[slot].ready = true;
+	lock.unlock();
+	loaded_cv.notify_all();
+
+	out_slot = slot;
+	return texels;
+}
+
+void FaceTiles::unpin(int slot) const {
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	Slot& released = slots[slot];
+	if (--released.pins == 0)
+		lru.splice(lru.end(), pinned, released.lru_pos);
+}
+
+void FaceTiles::sample(SampleFilter filter, int count, const u8* face, const float* s, const float* t,
+	u32* out_color) const
+{
+	if (!isOpen()) {
+		std::fill(out_color, out_color + count, 0);
+		return;
+	}
+
+	// Runs of samples mostly stay within a few tiles, which stay pinned until
+	// the end of the run or until there are too many.
+	const int max_pinned = 16;
+	int pinned_tiles[max_pinned];
+	int pinned_slots[max_pinned];
+	const u32* pinned_texels[max_pinned];
+	int num_pinned = 0;
+
+	for (int i = 0; i < count; ++i) {
+		const FaceLayout& layout = faces[face[i]];
+		const float x = Cubemap::borderCoord(s[i], layout.width);
+		const float y = Cubemap::borderCoord(t[i], layout.height);
+		const int x_base = static_cast<int>(x);
+		const int y_base = static_cast<int>(y);
+		const int tile_x = x_base / tile_size;
+		const int tile_y = y_base / tile_size;
+		const int tile = layout.first_tile + tile_y * layout.tiles_x + tile_x;
+
+		int k = num_pinned - 1;
+		while (k >= 0 && pinned_tiles[k] != tile)
+			--k;
+		if (k < 0) {
+			if (num_pinned == max_pinned) {
+				for (int j = 0; j < num_pinned; ++j)
+					unpin(pinned_slots[j]);
+				num_pinned = 0;
+			}
+			k = num_pinned++;
+			pinned_tiles[k] = tile;
+			pinned_texels[k] = pin(tile, pinned_slots[k]);
+		}
+
+		const u32* tap = pinned_texels[k] + size_t(y_base - tile_y * tile_size) * tile_row + (x_base - tile_x * tile_size);
+		const u32 taps[4] = { tap[0], tap[1], tap[tile_row], tap[tile_row + 1] };
+		if (filter == FILTER_FIXED)
+			out_color[i] = Cubemap::filterFootprintFixed(taps, fixedWeight(x - x_base), fixedWeight(y - y_base));
+		else if (filter == FILTER_RGBE)
+			out_color[i] = Cubemap::filterFootprint(taps, x - x_base, y - y_base, TEXELS_RGBE).toRgbe();
+		else if (filter == FILTER_SRGB)
+			out_color[i] = Cubemap::filterFootprint(taps, x - x_base, y - y_base, TEXELS_SRGB8).toSrgb();
+		else
+			out_color[i] = Cubemap::filterFootprint(taps, x - x_base, y - y_base, TEXELS_RGBA8).toU32();
+	}
+
+	for (int j = 0; j < num_pinned; ++j)
+		unpin(pinned_slots[j]);
+}
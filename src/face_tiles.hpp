@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "cubemap.hpp"
+#include "sample_kernels.hpp"
+
+// Faces kept in a temporary file on disk and paged into a cache of bounded
+// size, so that inputs larger than memory still render; see -mem-limit.
+// Each tile is tile_size texels square of a face with its border, plus one
+// more column and row repeated from the next tiles over, so that every
+// bilinear footprint lies within a single tile. The file goes away with the
+// FaceTiles.
+class FaceTiles {
+public:
+	static const int tile_size = 256;
+	static const size_t tile_bytes = size_t(tile_size + 1) * (tile_size + 1) * 4;
+
+	FaceTiles();
+	~FaceTiles();
+
+	// Creates the file, in $TMPDIR or /tmp (the user's temp folder on
+	// Windows), and a cache of cache_bytes. Prints why on failure.
+	bool open(u64 cache_bytes);
+	bool isOpen() const;
+
+	// Appends face, width x height texels that read_row produces a row of
+	// at a time, with a border of Cubemap::face_border repeating its edges.
+	// Rows are asked for in order, from top to bottom, some of them twice.
+	// Prints why on failure.
+	typedef std::function<void(int y, u32* out)> RowReader;
+	bool addFace(int face, int width, int height, const RowReader& read_row);
+
+	// Texel (x, y) of face, inside the face rather than its border.
+	u32 texel(int face, int x, int y) const;
+
+	// Rewrites every border texel of face, which must have been added, with
+	// border_texel(x, y). That may read any texel not in a border, but
+	// leaves cached tiles behind, so call dropCache before sampling.
+	bool setBorder(int face, const std::function<u32(int x, int y)>& border_texel);
+	// Forgets every cached tile. Their memory is kept for the next ones.
+	void dropCache();
+
+	// Same results as the sampleFaces, sampleFacesFixed, sampleFacesRgbe and
+	// sampleFacesSrgb kernels on the faces in memory.
+	void sample(SampleFilter filter, int count, const u8* face, const float* s, const float* t, u32* out_color) const;
+
+	// Tiles read from the file so far, and whether one of the reads failed,
+	// which leaves the tile black.
+	u64 tileLoads() const { return tile_loads.load(std::memory_order_relaxed); }
+	bool readFailed() const { return read_failed.load(std::memory_order_relaxed); }
+
+private:
+	FaceTiles(const FaceTiles&);
+	FaceTiles& operator= (const FaceTiles&);
+
+	struct FaceLayout {
+		int width, height;
+		// Tiles across and down, and the index of the top-left one.
+		int tiles_x, tiles_y;
+		int first_tile;
+	};
+
+	struct Slot {
+		int tile;
+		int pins;
+		bool ready;
+		std::unique_ptr<u32[]> texels;
+		std::list<int>::iterator lru_pos;
+	};
+
+	bool readTile(int tile, u32* out) const;
+	bool writeTile(int tile, const u32* texels);
+
+	// Pins tile in the cache, reading it in if needed, and returns its
+	// texels, which stay put until out_slot is unpinned. Waits if another
+	// thread is reading the tile.
+	const u32* pin(int tile, int& out_slot) const;
+	void unpin(int slot) const;
+
+	FaceLayout faces[Cubemap::NUM_FACES];
+	int num_tiles;
+
+#if defined(_WIN32)
+	void* file_handle;
+#else
+	int file_descriptor;
+#endif
+
+	// The cache. Slots are added up to capacity, and past it only while every
+	// one is pinned. lru holds the unpinned slots, least recently used first;
+	// those dropCache emptied have a tile of -1. pinned holds the others, so
+	// that slots move between the two without allocating.
+	size_t capacity;
+	mutable std::vector<Slot> slots;
+	mutable std::vector<int> tile_slots;
+	mutable std::list<int> lru, pinned;
+	mutable std::mutex cache_mutex;
+	mutable std::condition_variable loaded_cv;
+
+	mutable std::atomic<u64> tile_loads;
+	mutable std::atomic<bool> read_failed;
+};
@@ -0,0 +1,542 @@
+#include "gpu_render.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define CL_API_CALL __stdcall
+#else
+#include <dlfcn.h>
+#define CL_API_CALL
+#endif
+
+namespace {
+
+// The part of the OpenCL 1.2 API used here, declared rather than taken from
+// the SDK headers so that building needs no SDK.
+typedef int32_t cl_int;
+typedef uint32_t cl_uint;
+typedef uint64_t cl_bitfield;
+typedef struct ClPlatform* cl_platform_id;
+typedef struct ClDevice* cl_device_id;
+typedef struct ClContext* cl_context;
+typedef struct ClCommandQueue* cl_command_queue;
+typedef struct ClProgram* cl_program;
+typedef struct ClKernel* cl_kernel;
+typedef struct ClMem* cl_mem;
+typedef struct ClEvent* cl_event;
+
+const cl_int CL_SUCCESS = 0;
+const cl_uint CL_TRUE = 1;
+const cl_uint CL_FALSE = 0;
+const cl_bitfield CL_DEVICE_TYPE_GPU = 1 << 2;
+const cl_bitfield CL_MEM_WRITE_ONLY = 1 << 1;
+const cl_bitfield CL_MEM_READ_ONLY = 1 << 2;
+const cl_uint CL_DEVICE_NAME = 0x102B;
+const cl_uint CL_PROGRAM_BUILD_LOG = 0x1183;
+
+struct OpenCl {
+	cl_int (CL_API_CALL* GetPlatformIDs)(cl_uint num_entries, cl_platform_id* platforms, cl_uint* num_platforms);
+	cl_int (CL_API_CALL* GetDeviceIDs)(cl_platform_id platform, cl_bitfield device_type, cl_uint num_entries,
+		cl_device_id* devices, cl_uint* num_devices);
+	cl_int (CL_API_CALL* GetDeviceInfo)(cl_device_id device, cl_uint param_name, size_t param_value_size,
+		void* param_value, size_t* param_value_size_ret);
+	cl_context (CL_API_CALL* CreateContext)(const intptr_t* properties, cl_uint num_devices, const cl_device_id* devices,
+		void (CL_API_CALL* notify)(const char*, const void*, size_t, void*), void* user_data, cl_int* errcode_ret);
+	cl_command_queue (CL_API_CALL* CreateCommandQueue)(cl_context context, cl_device_id device, cl_bitfield properties,
+		cl_int* errcode_ret);
+	cl_program (CL_API_CALL* CreateProgramWithSource)(cl_context context, cl_uint count, const char** strings,
+		const size_t* lengths, cl_int* errcode_ret);
+	cl_int (CL_API_CALL* BuildProgram)(cl_program program, cl_uint num_devices, const cl_device_id* device_list,
+		const char* options, void (CL_API_CALL* notify)(cl_program, void*), void* user_data);
+	cl_int (CL_API_CALL* GetProgramBuildInfo)(cl_program program, cl_device_id device, cl_uint param_name,
+		size_t param_value_size, void* param_value, size_t* param_value_size_ret);
+	cl_kernel (CL_API_CALL* CreateKernel)(cl_program program, const char* kernel_name, cl_int* errcode_ret);
+	cl_mem (CL_API_CALL* CreateBuffer)(cl_context context, cl_bitfield flags, size_t size, void* host_ptr,
+		cl_int* errcode_ret);
+	cl_int (CL_API_CALL* SetKernelArg)(cl_kernel kernel, cl_uint arg_index, size_t arg_size, const void* arg_value);
+	cl_int (CL_API_CALL* EnqueueWriteBuffer)(cl_command_queue queue, cl_mem buffer, cl_uint blocking_write,
+		size_t offset, size_t size, const void* ptr, cl_uint num_events_in_wait_list, const cl_event* event_wait_list,
+		cl_event* event);
+	cl_int (CL_API_CALL* EnqueueReadBuffer)(cl_command_queue queue, cl_mem buffer, cl_uint blocking_read,
+		size_t offset, size_t size, void* ptr, cl_uint num_events_in_wait_list, const cl_event* event_wait_list,
+		cl_event* event);
+	cl_int (CL_API_CALL* EnqueueNDRangeKernel)(cl_command_queue queue, cl_kernel kernel, cl_uint work_dim,
+		const size_t* global_work_offset, const size_t* global_work_size, const size_t* local_work_size,
+		cl_uint num_events_in_wait_list, const cl_event* event_wait_list, cl_event* event);
+	cl_int (CL_API_CALL* WaitForEvents)(cl_uint num_events, const cl_event* event_list);
+	cl_int (CL_API_CALL* Finish)(cl_command_queue queue);
+	cl_int (CL_API_CALL* ReleaseEvent)(cl_event event);
+	cl_int (CL_API_CALL* ReleaseMemObject)(cl_mem buffer);
+	cl_int (CL_API_CALL* ReleaseKernel)(cl_kernel kernel);
+	cl_int (CL_API_CALL* ReleaseProgram)(cl_program program);
+	cl_int (CL_API_CALL* ReleaseCommandQueue)(cl_command_queue queue);
+	cl_int (CL_API_CALL* ReleaseContext)(cl_context context);
+
+	// Loads the library and every function above. The library stays loaded
+	// for the rest of the process, as some drivers don't survive unloading.
+	bool load();
+};
+
+void* openLibrary() {
+#if defined(_WIN32)
+	return LoadLibraryA("OpenCL.dll");
+#elif defined(__APPLE__)
+	return dlopen("/System/Library/Frameworks/OpenCL.framework/OpenCL", RTLD_NOW | RTLD_LOCAL);
+#else
+	void* library = dlopen("libOpenCL.so.1", RTLD_NOW | RTLD_LOCAL);
+	return library != nullptr ? library : dlopen("libOpenCL.so", RTLD_NOW | RTLD_LOCAL);
+#endif
+}
+
+template <typename Function>
+bool loadFunction(void* library, const char* name, Function& out_function) {
+#if defined(_WIN32)
+	out_function = reinterpret_cast<Function>(GetProcAddress(static_cast<HMODULE>(library), name));
+#else
+	out_function = reinterpret_cast<Function>(dlsym(library, name));
+#endif
+	return out_function != nullptr;
+}
+
+bool OpenCl::load() {
+	void* library = openLibrary();
+	return library != nullptr
+		&& loadFunction(library, "clGetPlatformIDs", GetPlatformIDs)
+		&& loadFunction(library, "clGetDeviceIDs", GetDeviceIDs)
+		&& loadFunction(library, "clGetDeviceInfo", GetDeviceInfo)
+		&& loadFunction(library, "clCreateContext", CreateContext)
+		&& loadFunction(library, "clCreateCommandQueue", CreateCommandQueue)
+		&& loadFunction(library, "clCreateProgramWithSource", CreateProgramWithSource)
+		&& loadFunction(library, "clBuildProgram", BuildProgram)
+		&& loadFunction(library, "clGetProgramBuildInfo", GetProgramBuildInfo)
+		&& loadFunction(library, "clCreateKernel", CreateKernel)
+		&& loadFunction(library, "clCreateBuffer", CreateBuffer)
+		&& loadFunction(library, "clSetKernelArg", SetKernelArg)
+		&& loadFunction(library, "clEnqueueWriteBuffer", EnqueueWriteBuffer)
+		&& loadFunction(library, "clEnqueueReadBuffer", EnqueueReadBuffer)
+		&& loadFunction(library, "clEnqueueNDRangeKernel", EnqueueNDRangeKernel)
+		&& loadFunction(library, "clWaitForEvents", WaitForEvents)
+		&& loadFunction(library, "clFinish", Finish)
+		&& loadFunction(library, "clReleaseEvent", ReleaseEvent)
+		&& loadFunction(library, "clReleaseMemObject", ReleaseMemObject)
+		&& loadFunction(library, "clReleaseKernel", ReleaseKernel)
+		&& loadFunction(library, "clReleaseProgram", ReleaseProgram)
+		&& loadFunction(library, "clReleaseCommandQueue", ReleaseCommandQueue)
+		&& loadFunction(library, "clReleaseContext", ReleaseContext);
+}
+
+bool succeeded(cl_int error, const char* call) {
+	if (error == CL_SUCCESS)
+		return true;
+	std::cerr << call << " failed with OpenCL error " << error << ".\n";
+	return false;
+}
+
+// One work item per output pixel, doing what renderRowsFixed does with the
+// scalar kernel: the directions come from the equirect or dome tables,
+// rounded to float, and go through Cubemap::computeTexCoords,
+// Cubemap::sampleFace and averageColors written out again. faces holds the
+// offset into texels, width, height and stride of each face, in texels.
+const char* const kernel_source = R"(
+#pragma OPENCL FP_CONTRACT OFF
+
+int projectCube(float x, float y, float z, float* out_s, float* out_t) {
+	const float ax = fabs(x), ay = fabs(y), az = fabs(z);
+	int face;
+	float s, t, m;
+	if (ax >= ay && ax >= az) {
+		face = x < 0.f ? 1 : 0;
+		s = x < 0.f ? z : -z;
+		t = -y;
+		m = ax;
+	} else if (ay >= ax && ay >= az) {
+		face = y < 0.f ? 3 : 2;
+		s = x;
+		t = y < 0.f ? -z : z;
+		m = ay;
+	} else {
+		face = z < 0.f ? 5 : 4;
+		s = z < 0.f ? -x : x;
+		t = -y;
+		m = az;
+	}
+	*out_s = 0.5f * (s / m + 1.0f);
+	*out_t = 0.5f * (t / m + 1.0f);
+	return face;
+}
+
+float blend(float a, float b, float t) {
+	return a * (1.f - t) + b * t;
+}
+
+float channel(uint texel, int shift) {
+	return (texel >> shift & 0xFF) / 255.f;
+}
+
+uint filterChannel(uint t00, uint t10, uint t01, uint t11, int shift, float x_fract, float y_fract) {
+	const float mix_0 = blend(channel(t00, shift), channel(t10, shift), x_fract);
+	const float mix_1 = blend(channel(t01, shift), channel(t11, shift), x_fract);
+	return (uint)(blend(mix_0, mix_1, y_fract) * 255) << shift;
+}
+
+uint sampleFace(__global const uint* texels, __global const int* face, float s, float t) {
+	const float x = s * face[1] + (FACE_BORDER - 0.5f);
+	const float y = t * face[2] + (FACE_BORDER - 0.5f);
+	const int x_base = (int)x;
+	const int y_base = (int)y;
+	const float x_fract = x - x_base;
+	const float y_fract = y - y_base;
+
+	__global const uint* tap = texels + face[0] + y_base * face[3] + x_base;
+	const uint t00 = tap[0];
+	const uint t10 = tap[1];
+	const uint t01 = tap[face[3]];
+	const uint t11 = tap[face[3] + 1];
+	return filterChannel(t00, t10, t01, t11, 0, x_fract, y_fract) | filterChannel(t00, t10, t01, t11, 8, x_fract, y_fract)
+		| filterChannel(t00, t10, t01, t11, 16, x_fract, y_fract) | 0xFF000000u;
+}
+
+__kernel void renderRows(__global const uint* texels, __global const int* faces,
+	__global const float* cos_theta, __global const float* sin_theta,
+	__global const float* cos_phi, __global const float* sin_phi,
+	int count, int num_samples, int x_begin, int y_begin, __global uint* out)
+{
+	const int x = x_begin + (int)get_global_id(0);
+	const int y = y_begin + (int)get_global_id(1);
+
+	uint sum_rb = 0, sum_g = 0;
+	for (int sample = 0; sample < num_samples; ++sample) {
+		const float cp = cos_phi[sample * count + y];
+		float s, t;
+		const int face = projectCube(cp * cos_theta[sample * count + x], sin_phi[sample * count + y],
+			cp * sin_theta[sample * count + x], &s, &t);
+		const uint color = sampleFace(texels, faces + face * 4, s, t);
+		sum_rb += color & 0x00FF00FF;
+		sum_g += color >> 8 & 0xFF;
+	}
+
+	const uint n = num_samples;
+	out[get_global_id(1) * get_global_size(0) + get_global_id(0)] =
+		(sum_rb & 0xFFFF) / n | sum_g / n << 8 | (sum_rb >> 16) / n << 16 | 0xFF000000u;
+}
+)";
+
+// Output rows rendered and read back at a time. Two strips are in flight, so
+// the GPU works on one while the other is emitted.
+const int gpu_strip_rows = 128;
+
+} // namespace
+
+struct GpuRenderer::State {
+	// A device buffer that only ever grows.
+	struct Buffer {
+		cl_mem mem;
+		size_t size;
+
+		Buffer() : mem(nullptr), size(0) {}
+	};
+
+	OpenCl cl;
+	cl_context context;
+	cl_command_queue queue;
+	cl_program program;
+	cl_kernel kernel;
+
+	Buffer texels, faces;
+	Buffer tables[4];
+	Buffer strips[2];
+
+	// What tables were uploaded from. Tables are rebuilt when the output
+	// size changes, and new ones may take the place of old ones.
+	const DirectionTables* tables_source;
+	int tables_size, tables_samples;
+
+	State() :
+		context(nullptr), queue(nullptr), program(nullptr), kernel(nullptr),
+		tables_source(nullptr), tables_size(0), tables_samples(0)
+	{}
+
+	~State() {
+		for (Buffer* buffer : { &texels, &faces, &tables[0], &tables[1], &tables[2], &tables[3], &strips[0], &strips[1] }) {
+			if (buffer->mem != nullptr)
+				cl.ReleaseMemObject(buffer->mem);
+		}
+		if (kernel != nullptr)
+			cl.ReleaseKernel(kernel);
+		if (program != nullptr)
+			cl.ReleaseProgram(program);
+		if (queue != nullptr)
+			cl.ReleaseCommandQueue(queue);
+		if (context != nullptr)
+			cl.ReleaseContext(context);
+	}
+
+	bool reserve(Buffer& buffer, size_t size, cl_bitfield flags) {
+		if (buffer.size >= size)
+			return true;
+		if (buffer.mem != nullptr)
+			cl.ReleaseMemObject(buffer.mem);
+
+		cl_int error;
+		buffer.mem = cl.CreateBuffer(context, flags, size, nullptr, &error);
+		buffer.size = buffer.mem != nullptr ? size : 0;
+		return succeeded(error, "clCreateBuffer");
+	}
+
+	bool setArg(cl_uint index, const cl_mem& mem) {
+		return succeeded(cl.SetKernelArg(kernel, index, sizeof(cl_mem), &mem), "clSetKernelArg");
+	}
+
+	bool setArg(cl_uint index, cl_int value) {
+		return succeeded(cl.SetKernelArg(kernel, index, sizeof(cl_int), &value), "clSetKernelArg");
+	}
+
+	// Uploads the faces of cubemap, leaving out unused ones.
+	bool uploadFaces(const Cubemap& cubemap);
+
+	// Uploads the equirect or dome tables of directions, unless they already
+	// are on the device.
+	bool uploadTables(const DirectionTables& directions);
+};
+
+bool GpuRenderer::State::uploadFaces(const Cubemap& cubemap) {
+	cl_int face_info[Cubemap::NUM_FACES * 4] = {};
+	size_t total_texels = 0;
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		const Image& img = cubemap.faces[f];
+		if (img.data == nullptr)
+			continue;
+
+		const size_t texels = size_t(img.stride()) * (img.height + 2 * img.border);
+		if (total_texels + texels > size_t(INT_MAX)) {
+			std::cerr << "Faces too large for the GPU.\n";
+			return false;
+		}
+		face_info[f * 4 + 0] = static_cast<cl_int>(total_texels);
+		face_info[f * 4 + 1] = img.width;
+		face_info[f * 4 + 2] = img.height;
+		face_info[f * 4 + 3] = img.stride();
+		total_texels += texels;
+	}
+
+	if (!reserve(texels, std::max<size_t>(total_texels, 1) * 4, CL_MEM_READ_ONLY)
+		|| !reserve(faces, sizeof(face_info), CL_MEM_READ_ONLY))
+	{
+		return false;
+	}
+
+	// Blocking, so the writes are done before the cubemap can go away even
+	// if rendering fails.
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		const Image& img = cubemap.faces[f];
+		if (img.data == nullptr)
+			continue;
+
+		const size_t texels_size = size_t(img.stride()) * (img.height + 2 * img.border) * 4;
+		if (!succeeded(cl.EnqueueWriteBuffer(queue, texels.mem, CL_TRUE, size_t(face_info[f * 4]) * 4, texels_size,
+			img.pixel(-img.border, -img.border), 0, nullptr, nullptr), "clEnqueueWriteBuffer"))
+		{
+			return false;
+		}
+	}
+	return succeeded(cl.EnqueueWriteBuffer(queue, faces.mem, CL_TRUE, 0, sizeof(face_info), face_info, 0, nullptr,
+		nullptr), "clEnqueueWriteBuffer");
+}
+
+bool GpuRenderer::State::uploadTables(const DirectionTables& directions) {
+	if (tables_source == &directions && tables_size == directions.size && tables_samples == directions.num_samples)
+		return true;
+	tables_source = nullptr;
+
+	const std::vector<double>* sources[4] = { &directions.cos_theta, &directions.sin_theta, &directions.cos_phi,
+		&directions.sin_phi };
+	std::vector<float> values;
+	for (int i = 0; i < 4; ++i) {
+		values.assign(sources[i]->begin(), sources[i]->end());
+		if (!reserve(tables[i], values.size() * sizeof(float), CL_MEM_READ_ONLY)
+			|| !succeeded(cl.EnqueueWriteBuffer(queue, tables[i].mem, CL_TRUE, 0, values.size() * sizeof(float),
+				values.data(), 0, nullptr, nullptr), "clEnqueueWriteBuffer"))
+		{
+			return false;
+		}
+	}
+
+	tables_source = &directions;
+	tables_size = directions.size;
+	tables_samples = directions.num_samples;
+	return true;
+}
+
+GpuRenderer::GpuRenderer() {}
+
+GpuRenderer::~GpuRenderer() {}
+
+bool GpuRenderer::open() {
+	std::unique_ptr<State> new_state(new State);
+	OpenCl& cl = new_state->cl;
+	if (!cl.load()) {
+		std::cerr << "No OpenCL library found.\n";
+		return false;
+	}
+
+	cl_uint num_platforms = 0;
+	if (cl.GetPlatformIDs(0, nullptr, &num_platforms) != CL_SUCCESS)
+		num_platforms = 0;
+	std::vector<cl_platform_id> platforms(num_platforms);
+	if (num_platforms > 0 && cl.GetPlatformIDs(num_platforms, platforms.data(), nullptr) != CL_SUCCESS)
+		platforms.clear();
+
+	cl_device_id device = nullptr;
+	for (cl_platform_id platform : platforms) {
+		cl_uint num_devices = 0;
+		if (cl.GetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, &num_devices) == CL_SUCCESS && num_devices > 0)
+			break;
+		device = nullptr;
+	}
+	if (device == nullptr) {
+		std::cerr << "No OpenCL GPU found.\n";
+		return false;
+	}
+
+	size_t name_size = 0;
+	std::vector<char> name;
+	if (cl.GetDeviceInfo(device, CL_DEVICE_NAME, 0, nullptr, &name_size) == CL_SUCCESS && name_size > 0) {
+		name.resize(name_size);
+		if (cl.GetDeviceInfo(device, CL_DEVICE_NAME, name_size, name.data(), nullptr) != CL_SUCCESS)
+			name.clear();
+	}
+
+	cl_int error;
+	new_state->context = cl.CreateContext(nullptr, 1, &device, nullptr, nullptr, &error);
+	if (!succeeded(error, "clCreateContext"))
+		return false;
+	new_state->queue = cl.CreateCommandQueue(new_state->context, device, 0, &error);
+	if (!succeeded(error, "clCreateCommandQueue"))
+		return false;
+
+	const char* source = kernel_source;
+	new_state->program = cl.CreateProgramWithSource(new_state->context, 1, &source, nullptr, &error);
+	if (!succeeded(error, "clCreateProgramWithSource"))
+		return false;
+
+	// Correctly rounded division keeps the texel coordinates those of the
+	// CPU, but not every device offers it.
+	const std::string border_define = "-DFACE_BORDER=" + std::to_string(Cubemap::face_border);
+	error = cl.BuildProgram(new_state->program, 1, &device,
+		(border_define + " -cl-fp32-correctly-rounded-divide-sqrt").c_str(), nullptr, nullptr);
+	if (error != CL_SUCCESS)
+		error = cl.BuildProgram(new_state->program, 1, &device, border_define.c_str(), nullptr, nullptr);
+	if (error != CL_SUCCESS) {
+		size_t log_size = 0;
+		cl.GetProgramBuildInfo(new_state->program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
+		std::vector<char> log(log_size + 1, '\0');
+		cl.GetProgramBuildInfo(new_state->program, device, CL_PROGRAM_BUILD_LOG, log_size, log.data(), nullptr);
+		std::cerr << "Failed to build the OpenCL kernel:\n" << log.data() << "\n";
+		return false;
+	}
+
+	new_state->kernel = cl.CreateKernel(new_state->program, "renderRows", &error);
+	if (!succeeded(error, "clCreateKernel"))
+		return false;
+
+	state = std::move(new_state);
+	device_name.assign(name.begin(), std::find(name.begin(), name.end(), '\0'));
+	return true;
+}
+
+bool GpuRenderer::supports(const RenderSettings& settings) {
+	return settings.source == MAPPING_CUBE && (settings.target == MAPPING_EQUIRECT || settings.target == MAPPING_DOME)
+		&& settings.filter == FILTER_FLOAT && !settings.mipmaps && !settings.adaptive_aa && settings.lut == nullptr
+		&& settings.tile_faces == nullptr;
+}
+
+int GpuRenderer::renderStreamed(const Cubemap& cubemap, const RenderSettings& settings, const RowSink& emit_rows) {
+	assert(isOpen() && supports(settings));
+	State& st = *state;
+	const OpenCl& cl = st.cl;
+	const DirectionTables& directions = *settings.directions;
+
+	const int row_width = settings.region.width;
+	const int region_height = settings.region.height;
+	const int strip_rows = std::min(gpu_strip_rows, region_height);
+	const size_t strip_bytes = size_t(row_width) * strip_rows * 4;
+	if (!st.uploadFaces(cubemap) || !st.uploadTables(directions)
+		|| !st.reserve(st.strips[0], strip_bytes, CL_MEM_WRITE_ONLY) || !st.reserve(st.strips[1], strip_bytes, CL_MEM_WRITE_ONLY)
+		|| !st.setArg(0, st.texels.mem) || !st.setArg(1, st.faces.mem)
+		|| !st.setArg(2, st.tables[0].mem) || !st.setArg(3, st.tables[1].mem)
+		|| !st.setArg(4, st.tables[2].mem) || !st.setArg(5, st.tables[3].mem)
+		|| !st.setArg(6, directions.count) || !st.setArg(7, directions.num_samples) || !st.setArg(8, settings.region.x))
+	{
+		return 0;
+	}
+
+	const int num_strips = (region_height + strip_rows - 1) / strip_rows;
+	std::vector<u32> rows[2] = { std::vector<u32>(size_t(row_width) * strip_rows), std::vector<u32>(size_t(row_width) * strip_rows) };
+	cl_event read_done[2] = { nullptr, nullptr };
+
+	const auto enqueue_strip = [&](int strip) {
+		const int slot = strip % 2;
+		const int y_begin = strip * strip_rows;
+		const size_t global_size[2] = { size_t(row_width), size_t(std::min(strip_rows, region_height - y_begin)) };
+		return st.setArg(9, settings.region.y + y_begin) && st.setArg(10, st.strips[slot].mem)
+			&& succeeded(cl.EnqueueNDRangeKernel(st.queue, st.kernel, 2, nullptr, global_size, nullptr, 0, nullptr, nullptr),
+				"clEnqueueNDRangeKernel")
+			&& succeeded(cl.EnqueueReadBuffer(st.queue, st.strips[slot].mem, CL_FALSE, 0, global_size[0] * global_size[1] * 4,
+				rows[slot].data(), 0, nullptr, &read_done[slot]), "clEnqueueReadBuffer");
+	};
+
+	int rows_emitted = 0;
+	if (enqueue_strip(0)) {
+		for (int strip = 0; strip < num_strips; ++strip) {
+			const int slot = strip % 2;
+			const bool next_queued = strip + 1 < num_strips && enqueue_strip(strip + 1);
+			const bool read = succeeded(cl.WaitForEvents(1, &read_done[slot]), "clWaitForEvents");
+			cl.ReleaseEvent(read_done[slot]);
+			read_done[slot] = nullptr;
+			if (!read)
+				break;
+
+			const int y_end = std::min(rows_emitted + strip_rows, region_height);
+			emit_rows(rows_emitted, y_end, rows[slot].data());
+			rows_emitted = y_end;
+			if (!next_queued)
+				break;
+		}
+	}
+
+	// Whatever is still queued reads into rows, so it has to finish first.
+	cl.Finish(st.queue);
+	for (cl_event event : read_done) {
+		if (event != nullptr)
+			cl.ReleaseEvent(event);
+	}
+	return rows_emitted;
+}
+
+bool renderImageStreamed(GpuRenderer* gpu, ThreadPool& thread_pool, const Cubemap& input_cubemap,
+	const RenderSettings& settings, const RowSink& emit_rows)
+{
+	int gpu_rows = 0;
+	if (gpu != nullptr && GpuRenderer::supports(settings) && input_cubemap.paged_faces == nullptr
+		&& input_cubemap.finishLoading())
+	{
+		gpu_rows = gpu->renderStreamed(input_cubemap, settings, emit_rows);
+		if (gpu_rows == settings.region.height)
+			return true;
+		std::cerr << "Rendering the rest on the CPU.\n";
+	}
+
+	RenderSettings rest = settings;
+	rest.region.y += gpu_rows;
+	rest.region.height -= gpu_rows;
+	renderImageStreamed(thread_pool, input_cubemap, rest, [&](int y_begin, int y_end, const u32* rows) {
+		emit_rows(gpu_rows + y_begin, gpu_rows + y_end, rows);
+	});
+	return false;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "render.hpp"
+
+// Renders on an OpenCL GPU, for -backend gpu. The OpenCL library is looked
+// up at run time, so nothing needs it to build or run. Covers cube faces to
+// equirect and dome outputs with float filtering, without adaptive AA,
+// mipmaps or a LUT, and matches the CPU path within a step per channel:
+// samples differ only where the directions, which the GPU takes in single
+// precision, round differently.
+class GpuRenderer {
+public:
+	GpuRenderer();
+	~GpuRenderer();
+
+	// Loads OpenCL and sets up the first GPU it lists. Prints why on failure.
+	bool open();
+	bool isOpen() const { return state != nullptr; }
+	const std::string& deviceName() const { return device_name; }
+
+	// Whether renderStreamed takes settings.
+	static bool supports(const RenderSettings& settings);
+
+	// Renders settings.region of cubemap, which must be done loading, and
+	// hands its rows to emit_rows like renderImageStreamed, from the calling
+	// thread. Returns how many rows from the top of the region were emitted:
+	// all of them unless an OpenCL call failed, which is printed.
+	int renderStreamed(const Cubemap& cubemap, const RenderSettings& settings, const RowSink& emit_rows);
+
+private:
+	GpuRenderer(const GpuRenderer&);
+	GpuRenderer& operator= (const GpuRenderer&);
+
+	struct State;
+	std::unique_ptr<State> state;
+	std::string device_name;
+};
+
+// renderImageStreamed, on gpu if it is set and supports settings and the
+// faces aren't paged, and otherwise on the thread pool. Whatever the GPU fails to render is finished
+// on the CPU. Returns whether the GPU rendered all of it.
+bool renderImageStreamed(GpuRenderer* gpu, ThreadPool& thread_pool, const Cubemap& input_cubemap,
+	const RenderSettings& settings, const RowSink& emit_rows);
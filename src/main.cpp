@@ -1,242 +1,988 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
-#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
-#include "stb_image.hpp"
-#include "stb_image_write.hpp"
+#include "buffer_pool.hpp"
+#include "cubemap.hpp"
+#include "cubemap_cache.hpp"
+#include "face_tiles.hpp"
+#include "projection_lut.hpp"
+#include "render.hpp"
+#include "render_cache.hpp"
+#include "row_writer.hpp"
+#include "sample_kernels.hpp"
+#include "spheremap_converter.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "tile_merge.hpp"
 
-typedef uint8_t u8;
-typedef uint32_t u32;
+// The arguments after argv[0], taken front to back.
+struct ArgumentCursor {
+	char** next;
+	char** end;
 
-inline void splitColor(u32 col, u8& r, u8& g, u8& b) {
-	r = col >> 0  & 0xFF;
-	g = col >> 8  & 0xFF;
-	b = col >> 16 & 0xFF;
+	bool empty() const { return next == end; }
+};
+
+// The next argument, or an empty string past the last.
+inline std::string pop_from(ArgumentCursor& args) {
+	return args.empty() ? std::string() : std::string(*args.next++);
 }
 
-inline u32 makeColor(u8 r, u8 g, u8 b) {
-	return r | g << 8 | b << 16 | 0xFF << 24;
+// The counters a job's allocation stats are the growth of.
+struct AllocationCounts {
+	u64 pooled, reused, unpooled;
+
+	explicit AllocationCounts(const BufferPool& pool) :
+		pooled(pool.allocations()), reused(pool.reuses()), unpooled(BufferPool::directAllocations())
+	{}
+};
+
+void recordAllocations(const AllocationCounts& job_start, const BufferPool& pool, JobStats& stats) {
+	const AllocationCounts now(pool);
+	stats.pool_allocations = now.pooled - job_start.pooled;
+	stats.pool_reuses = now.reused - job_start.reused;
+	stats.unpooled_allocations = now.unpooled - job_start.unpooled;
 }
 
-inline float lerp(float a, float b, float t) {
-	return a * (1.f - t) + b * t;
+void printProgramUsage() {
+	std::cerr <<
+		"SpheremapTool v.GIT\n"
+		"\n"
+		"Usage:\n"
+		"  SpheremapTool [opts] [-] input_prefix input_extension\n"
+		"  SpheremapTool [opts] -batch <manifest>|-\n"
+		"  SpheremapTool [opts] -serve\n"
+		"  SpheremapTool [-to <mapping>] [-hdr] -merge <manifest>|- -o <filename>\n"
+		"\n"
+		"Faces are read from <input_prefix>1.<input_extension> through\n"
+		"<input_prefix>6.<input_extension>, in the order +X -X +Y -Y +Z -Z, and\n"
+		"other input mappings from <input_prefix>.<input_extension>.\n"
+		"Uncompressed TGA and BMP files and raw files (8-bit RGBA, no header, square)\n"
+		"are memory-mapped and skip decoding.\n"
+		"\n"
+		"Available options:\n"
+		"  -aa 1|5|16|adaptive\n"
+		"                   Specify number of AA samples. adaptive takes 4 corner samples\n"
+		"                   per pixel and only uses 16 where they differ; not available\n"
+		"                   with -to cube. (Default: 1)\n"
+		"  -aa-threshold <int>\n"
+		"                   Largest channel difference (0-255) between corner samples\n"
+		"                   that adaptive AA leaves unrefined. (Default: 8)\n"
+		"  -size <int>|auto Specifies output image size, the width of each face. auto\n"
+		"                   picks the smallest size at which no part of the output is\n"
+		"                   coarser than the input. (Default: auto for octahedral and\n"
+		"                   dual-paraboloid output, 1024 otherwise)\n"
+		"  -size <int>,<int>,...\n"
+		"                   Writes the output at each size from one decode of the faces,\n"
+		"                   with _<size> before the extension of each file name (and a _\n"
+		"                   after it for cube output). A size half of another is averaged\n"
+		"                   down from that one, 2x2 pixels each, as its rows come in; the\n"
+		"                   others are rendered. For -batch jobs that give no size.\n"
+		"                   Not available with -region, -tile, -cache or -serve.\n"
+		"  -from <mapping>  Input mapping: cube, equirect, dome, octahedral or\n"
+		"                   dual-paraboloid. (Default: cube)\n"
+		"  -to <mapping>    Output mapping, as for -from. Cube output writes six faces\n"
+		"                   named like cube input, numbered before the extension of the\n"
+		"                   output file. Dual-paraboloid output is twice as tall as wide,\n"
+		"                   the upper hemisphere on top. (Default: equirect)\n"
+		"  -dome            Same as -to dome: maps only the upper (+Y) hemisphere. Useful\n"
+		"                   for texturing skydomes. The -Y face of a cube is only read\n"
+		"                   with -aa adaptive or -lut together with -mipmap.\n"
+		"  -threads <int>   Number of worker threads. (Default: number of CPU cores)\n"
+		"  -kernel <name>   Sampling kernel: auto, scalar, sse2, avx2 or neon. (Default: auto)\n"
+		"  -backend cpu|gpu Where to render. gpu renders on the first OpenCL GPU, for cube\n"
+		"                   input to equirect or dome output with -filter float and without\n"
+		"                   -mipmap, -aa adaptive, -lut, -cache or -mem-limit, and falls back\n"
+		"                   to the CPU for anything else or without a GPU. (Default: cpu)\n"
+		"  -filter float|fixed|srgb\n"
+		"                   Bilinear filtering in float or in 8.8 fixed point, which is\n"
+		"                   faster and within one step per channel of float. srgb treats\n"
+		"                   8-bit faces as sRGB and filters and averages them in linear\n"
+		"                   light, which keeps edges and downscaled detail from darkening.\n"
+		"                   (Default: float)\n"
+		"  -mipmap          Builds mip levels of every face and filters trilinearly from\n"
+		"                   the level matching each sample's footprint, so large faces\n"
+		"                   downscale without aliasing even at -aa 1.\n"
+		"  -mem-limit <MB>  Keeps the decoded faces within about that many megabytes, for\n"
+		"                   inputs larger than memory. Faces are decoded one at a time into\n"
+		"                   tiles in a temporary file in $TMPDIR (or /tmp) and read back\n"
+		"                   through a cache of that size, and the output renders in blocks\n"
+		"                   that reuse the cached tiles. Uncompressed TGA, BMP and raw faces\n"
+		"                   stream in and are never in memory whole; other formats need one\n"
+		"                   decoded face at a time. Jobs of a -batch no longer overlap. Not\n"
+		"                   available with -mipmap.\n"
+		"  -hdr             Reads faces as floating point (Radiance .hdr, or 8-bit formats\n"
+		"                   linearized with gamma 2.2) and filters without clamping.\n"
+		"                   Output goes to .hdr, or to .raw as 32-bit float RGB. Not\n"
+		"                   available with -filter fixed, -filter srgb or -aa adaptive.\n"
+		"  -lut             Precomputes where every output sample lands and reuses it for\n"
+		"                   all jobs of the same size. Not available with -aa adaptive.\n"
+		"  -lut-file <file> Like -lut, but loads the table from file if it matches the size\n"
+		"                   and AA mode, and otherwise builds it and saves it there.\n"
+		"  -stats           Prints a line of JSON per job to stdout with wall and CPU time\n"
+		"                   per stage, bytes read and written, samples per face, peak\n"
+		"                   memory use, pool buffers allocated and reused, pool requests\n"
+		"                   served straight from the system (not other heap allocations)\n"
+		"                   and, with -mem-limit, face tiles read from disk.\n"
+		"  -o <filename>    Manually specifies output file. .bmp, .png, .qoi and .raw (8-bit\n"
+		"                   RGBA, no header) select those formats, anything else is written\n"
+		"                   as TGA. PNG and QOI are compressed on all threads.\n"
+		"                   (Default: \"<input_prefix>.tga\", or .hdr with -hdr)\n"
+		"  -compression <0-9>\n"
+		"                   PNG deflate level, from 0 (store only) and 1 (fastest) to 9\n"
+		"                   (smallest). (Default: 6)\n"
+		"  -batch <file>    Converts every job listed in file (- reads stdin), one per line as\n"
+		"                   \"input_prefix input_extension [output_file [size|auto]]\". Jobs share\n"
+		"                   the worker threads and overlap decoding, rendering and writing.\n"
+		"  -serve           Stays running and converts the requests it reads from stdin, one\n"
+		"                   per line as \"id priority input_prefix input_extension [output_file\n"
+		"                   [size|auto]]\", until stdin closes. Each is answered on stdout\n"
+		"                   with a line of JSON once done: {\"id\", \"ok\", \"input\" (cached,\n"
+		"                   prefetched or decoded), \"queued_s\", \"wall_s\"}. Waiting requests\n"
+		"                   run highest priority first, then in order, each on all worker\n"
+		"                   threads while the faces of the next decode. Threads, LUTs and\n"
+		"                   recently decoded inputs stay warm between requests. Takes no\n"
+		"                   input prefix, extension, -o, -batch, -region, -tile, -merge or\n"
+		"                   -cache.\n"
+		"  -serve-cache <MB>\n"
+		"                   Megabytes of decoded inputs -serve keeps for later requests,\n"
+		"                   least recently used going first. Inputs are decoded again once\n"
+		"                   a file changes size or modification time; with -mem-limit, they\n"
+		"                   always are. (Default: 1024)\n"
+		"  -region <x> <y> <w> <h>\n"
+		"                   Renders only that rectangle of the output, counted in pixels\n"
+		"                   from its top-left corner, into a w x h file. Cube outputs count\n"
+		"                   rows through all six faces. Only the cube faces the rectangle\n"
+		"                   samples are loaded.\n"
+		"  -tile <index> <count>\n"
+		"                   Like -region for strip index (from 0) of count equal strips\n"
+		"                   of whole rows, top to bottom.\n"
+		"  -merge <file>    Stitches rendered regions listed in file (- reads stdin), one\n"
+		"                   per line as \"tile_file [x y]\", into the -o file. Tiles without\n"
+		"                   a position go below the one before, as -tile strips do. -to\n"
+		"                   cube splits the result into faces. TGA and BMP tiles are\n"
+		"                   streamed from memory-mapped files.\n"
+		"  -cache <file>    Records in file which input faces each 64x64 tile of the output\n"
+		"                   reads, and a hash of every face. When run again with the same\n"
+		"                   settings, only tiles reading faces that changed are rendered\n"
+		"                   and patched into the output. Needs a single .tga, .bmp or\n"
+		"                   .png output and no -batch.\n"
+		"  -h / -help       Print this help text.\n"
+		"\n";
 }
 
-struct Image {
-	int width, height;
-	std::unique_ptr<u8, std::function<void(u8*)>> data;
+// Stands for the size given by matchingSize until the inputs are known.
+const int auto_size = 0;
+// Stands for every size of a -size list until the job is split up by them.
+const int listed_sizes = -2;
 
-	Image() :
-		width(-1), height(-1)
-	{}
+// A smaller copy of a job's whole output, each pixel the average of 2x2 of
+// the output or copy before it, which is twice the size; see
+// RowDownsampler.
+struct DownsampledOutput {
+	std::string output_fname;
+	RowWriter::Format output_format = RowWriter::FORMAT_TGA;
+	int output_size;
+};
 
-	Image(const std::string& filename) :
-		data(stbi_load(filename.c_str(), &width, &height, nullptr, 4), stbi_image_free)
-	{
-		if (data == nullptr)
-			std::cerr << "Failed to open " << filename << ".\n";
+struct ConvertJob {
+	std::string fname_prefix;
+	std::string fname_extension;
+	std::string output_fname;
+	RowWriter::Format output_format = RowWriter::FORMAT_TGA;
+	int output_size;
+	// The part of the output to render. Anything less than the whole output
+	// goes to a single file, even for cube outputs.
+	OutputRegion region;
+	// Only for whole outputs, each half the size of the one before.
+	std::vector<DownsampledOutput> downsampled;
+
+	bool wholeOutput(Mapping target) const { return region == ::wholeOutput(target, output_size); }
+
+	// Output files: one per face for whole cube outputs, else one.
+	int numOutputFiles(Mapping target) const { return wholeOutput(target) ? mappingFaces(target) : 1; }
+};
+
+// Faces that rendering job reads from. For regions, the sizes of the faces
+// are taken from the file headers.
+unsigned jobFaces(SpheremapConverter& converter, const ConvertJob& job) {
+	const Mapping source = converter.options().source;
+	if (job.wholeOutput(converter.options().target))
+		return converter.wholeOutputFaces();
+
+	int face_width[Cubemap::NUM_FACES], face_height[Cubemap::NUM_FACES];
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		if (f >= mappingFaces(source)
+			|| !Image::readSize(Cubemap::inputFilename(job.fname_prefix, job.fname_extension, source, f), face_width[f], face_height[f]))
+		{
+			face_width[f] = face_height[f] = 0;
+		}
+	}
+	return regionFaces(converter.threadPool(), converter.settingsFor(job.output_size, job.region), face_width, face_height);
+}
+
+// Picks the output format for filename, or fails if it can't hold the
+// samples filter produces: RGBE only goes to .hdr and float .raw, 8-bit
+// color to anything but .hdr.
+bool outputFormat(const std::string& filename, SampleFilter filter, RowWriter::Format& out_format) {
+	const RowWriter::Format format = RowWriter::formatFromFilename(filename);
+	if (filter != FILTER_RGBE) {
+		out_format = format;
+		return format != RowWriter::FORMAT_HDR;
 	}
 
-	Image& operator= (Image&& o) {
-		width = o.width;
-		height = o.height;
-		data.swap(o.data);
+	if (format == RowWriter::FORMAT_RAW)
+		out_format = RowWriter::FORMAT_RAW_FLOAT;
+	else
+		out_format = format;
+	return out_format == RowWriter::FORMAT_HDR || out_format == RowWriter::FORMAT_RAW_FLOAT;
+}
 
-		return *this;
+// Reads the rest of a job line after the input prefix, which is already in
+// job:
+//   input_extension [output_file [size]]
+// Outputs default to the input prefix plus default_extension. A size of
+// "auto" becomes auto_size. Errors are printed after location.
+bool readJobFields(std::istream& fields, const std::string& location, int default_size,
+	const std::string& default_extension, ConvertJob& job)
+{
+	std::string size_field;
+	if (!(fields >> job.fname_extension)) {
+		std::cerr << location << ": Missing input extension.\n";
+		return false;
 	}
+	fields >> job.output_fname >> size_field;
 
-private:
-	Image& operator= (const Image&);
-};
+	if (job.output_fname.empty())
+		job.output_fname = job.fname_prefix + default_extension;
 
-struct Colorf {
-	float r, g, b;
+	job.output_size = default_size;
+	if (size_field == "auto") {
+		job.output_size = auto_size;
+	} else if (!size_field.empty()) {
+		char* size_end;
+		job.output_size = static_cast<int>(std::strtol(size_field.c_str(), &size_end, 10));
+		if (*size_end != '\0' || job.output_size < 1) {
+			std::cerr << location << ": Invalid size " << size_field << ".\n";
+			return false;
+		}
+	}
+	return true;
+}
 
-	Colorf() { }
-	Colorf(float r, float g, float b) : r(r), g(g), b(b) { }
+// Reads a batch manifest: one job per line, given as
+//   input_prefix input_extension [output_file [size]]
+// Blank lines and lines starting with # are skipped.
+bool readJobManifest(std::istream& in, const std::string& source_name, int default_size,
+	const std::string& default_extension, std::vector<ConvertJob>& out_jobs)
+{
+	std::string line;
+	for (int line_number = 1; std::getline(in, line); ++line_number) {
+		std::istringstream fields(line);
+		ConvertJob job;
+		if (!(fields >> job.fname_prefix) || job.fname_prefix[0] == '#')
+			continue;
 
-	explicit Colorf(u32 col) {
-		u8 rb, gb, bb;
-		splitColor(col, rb, gb, bb);
-		r = rb / 255.f;
-		g = gb / 255.f;
-		b = bb / 255.f;
+		if (!readJobFields(fields, source_name + ":" + std::to_string(line_number), default_size, default_extension, job))
+			return false;
+		out_jobs.push_back(job);
 	}
+	return true;
+}
 
-	u32 toU32() const {
-		return makeColor(
-			static_cast<u8>(r * 255),
-			static_cast<u8>(g * 255),
-			static_cast<u8>(b * 255));
+// Picks the format of output file filename of job, in num_files files, and
+// checks that none of them is also an input; inputs are mapped and read
+// while the output is written. Prints why on failure.
+bool checkOutput(const ConvertJob& job, const std::string& filename, int num_files, Mapping source, SampleFilter filter,
+	RowWriter::Format& out_format)
+{
+	if (!outputFormat(filename, filter, out_format)) {
+		std::cerr << filename << (filter == FILTER_RGBE ? ": -hdr only writes .hdr and .raw.\n"
+			: ": .hdr output needs -hdr.\n");
+		return false;
 	}
 
-	static Colorf mix(const Colorf& a, const Colorf& b, float t) {
-		return Colorf(
-			lerp(a.r, b.r, t),
-			lerp(a.g, b.g, t),
-			lerp(a.b, b.b, t));
+	for (int out_face = 0; out_face < num_files; ++out_face) {
+		const std::string out_name = OutputWriter::faceFilename(filename, num_files, out_face);
+		for (int in_face = 0; in_face < mappingFaces(source); ++in_face) {
+			if (out_name == Cubemap::inputFilename(job.fname_prefix, job.fname_extension, source, in_face)) {
+				std::cerr << out_name << " is also an input. Use -o.\n";
+				return false;
+			}
+		}
 	}
-};
+	return true;
+}
 
-struct Cubemap {
-	enum CubeFace {
-		FACE_POS_X, FACE_NEG_X,
-		FACE_POS_Y, FACE_NEG_Y,
-		FACE_POS_Z, FACE_NEG_Z,
-		NUM_FACES
-	};
+// filename with _<size> before its extension, for one size of a -size
+// list. Outputs of several files get another _ after it, which sets the
+// face numbers apart and makes <name>_<size>_ their input prefix.
+std::string sizedFilename(const std::string& filename, int size, bool face_files) {
+	const std::string::size_type dot = filename.rfind('.');
+	const std::string::size_type slash = filename.find_last_of("/\\");
+	const std::string::size_type split = dot == std::string::npos || (slash != std::string::npos && dot < slash)
+		? filename.size() : dot;
+	return filename.substr(0, split) + "_" + std::to_string(size) + (face_files ? "_" : "") + filename.substr(split);
+}
+
+// Settles the size, region and output format of a job just read, and
+// checks that it doesn't overwrite its inputs. A region of width 0 renders
+// the whole output, or with tile_count set strip tile_index of that many.
+// Prints why on failure.
+bool prepareJob(ConvertJob& job, Mapping source, Mapping target, SampleFilter filter, const OutputRegion& region,
+	int tile_index, int tile_count)
+{
+	if (job.output_size == auto_size) {
+		const std::string first_input = Cubemap::inputFilename(job.fname_prefix, job.fname_extension, source, 0);
+		int width, height;
+		if (!Image::readSize(first_input, width, height)) {
+			std::cerr << "Failed to open " << first_input << ".\n";
+			return false;
+		}
+		job.output_size = matchingSize(source, width, height, target);
+	}
 
-	Image faces[NUM_FACES];
+	const OutputRegion whole = wholeOutput(target, job.output_size);
+	job.region = whole;
+	if (region.width != 0) {
+		if (region.x + region.width > whole.width || region.y + region.height > whole.height) {
+			std::cerr << job.output_fname << ": -region lies outside the " << whole.width << "x" << whole.height << " output.\n";
+			return false;
+		}
+		job.region = region;
+	} else if (tile_count != 0) {
+		// Strips of whole rows, which stream out in order.
+		const int tile_rows = (whole.height + tile_count - 1) / tile_count;
+		job.region.y = std::min(tile_index * tile_rows, whole.height);
+		job.region.height = std::min(tile_rows, whole.height - job.region.y);
+		if (job.region.height < 1) {
+			std::cerr << job.output_fname << ": The " << whole.height << " rows of the output don't make "
+				<< tile_count << " tiles.\n";
+			return false;
+		}
+	}
 
-	Cubemap(const std::string& fname_prefix, const std::string& fname_extension) {
-		faces[FACE_POS_X] = Image("1." + fname_extension);
-		faces[FACE_NEG_X] = Image("2." + fname_extension);
-		faces[FACE_POS_Y] = Image("3." + fname_extension);
-		faces[FACE_NEG_Y] = Image("4." + fname_extension);
-		faces[FACE_POS_Z] = Image("5." + fname_extension);
-		faces[FACE_NEG_Z] = Image("6." + fname_extension);
+	if (!checkOutput(job, job.output_fname, job.numOutputFiles(target), source, filter, job.output_format))
+		return false;
+	for (DownsampledOutput& level : job.downsampled) {
+		if (!checkOutput(job, level.output_fname, mappingFaces(target), source, filter, level.output_format))
+			return false;
 	}
+	return true;
+}
 
-	u32 readTexel(CubeFace face, int x, int y) {
-		assert(face < NUM_FACES);
-		const Image& face_img = faces[face];
+// Splits a job of listed_sizes up by sizes, largest first, with each size
+// in its output file names; see sizedFilename. Sizes half of another become
+// downsampled outputs of the job making that one, and the others jobs of
+// their own, which runJobs renders from the same decoded faces.
+void addSizedJobs(const ConvertJob& job, const std::vector<int>& sizes, Mapping target, std::vector<ConvertJob>& out_jobs) {
+	const size_t first_job = out_jobs.size();
+	for (int size : sizes) {
+		const std::string output_fname = sizedFilename(job.output_fname, size, mappingFaces(target) > 1);
 
-		assert(x < face_img.width);
-		assert(y < face_img.height);
+		auto source = out_jobs.begin() + first_job;
+		for (; source != out_jobs.end(); ++source) {
+			const int smallest = source->downsampled.empty() ? source->output_size : source->downsampled.back().output_size;
+			if (smallest == size * 2)
+				break;
+		}
 
-		const u32* img_data = reinterpret_cast<const u32*>(face_img.data.get());
-		return img_data[y * face_img.width + x];
+		if (source != out_jobs.end()) {
+			DownsampledOutput level;
+			level.output_fname = output_fname;
+			level.output_size = size;
+			source->downsampled.push_back(level);
+		} else {
+			ConvertJob sized = job;
+			sized.output_fname = output_fname;
+			sized.output_size = size;
+			out_jobs.push_back(sized);
+		}
 	}
+}
 
-	void computeTexCoords(float x, float y, float z, CubeFace& out_face, float& out_s, float& out_t) {
-		int major_axis;
+// Fills in the parts of stats that describe the job, its settings, decoding
+// and the render counters, once input_cubemap is done loading.
+void recordJobStats(const ConvertJob& job, const RenderSettings& settings, int num_threads, const Cubemap& input_cubemap,
+	const RenderCounters& counters, JobStats& stats)
+{
+	input_cubemap.finishLoading();
 
-		float v[3] = { x, y, z };
-		float a[3] = { std::abs(x), std::abs(y), std::abs(z) };
+	stats.input = settings.source == MAPPING_CUBE ? job.fname_prefix + "*." + job.fname_extension
+		: Cubemap::inputFilename(job.fname_prefix, job.fname_extension, settings.source, 0);
+	stats.output = job.output_fname;
+	stats.output_size = job.output_size;
+	stats.num_aa_samples = settings.num_aa_samples;
+	stats.kernel = settings.kernel->name;
+	stats.filter = settings.filter == FILTER_FIXED ? "fixed" : settings.filter == FILTER_RGBE ? "rgbe"
+		: settings.filter == FILTER_SRGB ? "srgb" : "float";
+	stats.num_threads = num_threads;
 
-		if (a[0] >= a[1] && a[0] >= a[2]) {
-			major_axis = 0;
-		} else if (a[1] >= a[0] && a[1] >= a[2]) {
-			major_axis = 1;
-		} else if (a[2] >= a[0] && a[2] >= a[1]) {
-			major_axis = 2;
-		}
+	for (const Cubemap::FaceLoadStats& face : input_cubemap.load_stats) {
+		stats.decode_wall_seconds = std::max(stats.decode_wall_seconds, face.wall_seconds);
+		stats.decode_cpu_seconds += face.cpu_seconds;
+		stats.bytes_read += face.file_bytes;
+	}
 
-		if (v[major_axis] < 0.0f)
-			major_axis = major_axis * 2 + 1;
-		else
-			major_axis *= 2;
+	stats.render_cpu_seconds = counters.cpu_nanoseconds * 1e-9;
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f)
+		stats.face_hits[f] = counters.face_hits[f];
+	stats.peak_rss_bytes = peakRssBytes();
+	if (input_cubemap.paged_faces != nullptr)
+		stats.tile_loads = input_cubemap.paged_faces->tileLoads();
+}
+
+// Renders job from input_cubemap, which may still be loading, through the
+// converter's thread pool, or its GPU once all the faces are in. Output
+// rows are written out as soon as they're done, encoded on encode's pool,
+// and go on to make the job's downsampled outputs as they come. With stats
+// set, fills in everything but the job's wall time and
+// allocations. Returns whether the job succeeded.
+bool runJob(SpheremapConverter& converter, const ConvertJob& job, const Cubemap& input_cubemap,
+	const EncodeOptions& encode, JobStats* stats)
+{
+	typedef std::chrono::steady_clock Clock;
+
+	ThreadPool& thread_pool = converter.threadPool();
+	RenderSettings settings = converter.settingsFor(job.output_size, job.region);
+
+	RenderCounters counters;
+	if (stats != nullptr)
+		settings.counters = &counters;
 
-		float tmp_s, tmp_t, m;
-		switch (major_axis) {
-			/* +X */ case 0: tmp_s = -z; tmp_t = -y; m = a[0]; break;
-			/* -X */ case 1: tmp_s =  z; tmp_t = -y; m = a[0]; break;
-			/* +Y */ case 2: tmp_s =  x; tmp_t =  z; m = a[1]; break;
-			/* -Y */ case 3: tmp_s =  x; tmp_t = -z; m = a[1]; break;
-			/* +Z */ case 4: tmp_s =  x; tmp_t = -y; m = a[2]; break;
-			/* -Z */ case 5: tmp_s = -x; tmp_t = -y; m = a[2]; break;
+	bool ok = true;
+	bool on_gpu = false;
+	const Clock::time_point render_start = Clock::now();
+	double render_wall_seconds = 0;
+	double write_wall_seconds = 0, write_cpu_seconds = 0;
+
+	// The output, then its downsampled copies, each of those fed by the one
+	// before.
+	const size_t num_outputs = 1 + job.downsampled.size();
+	std::unique_ptr<OutputWriter[]> writers(new OutputWriter[num_outputs]);
+	std::vector<std::unique_ptr<RowDownsampler>> downsamplers(num_outputs);
+	bool opened = writers[0].open(job.output_fname, job.output_format, job.region.width, job.region.height,
+		job.numOutputFiles(settings.target), encode);
+	for (size_t i = 1; i < num_outputs && opened; ++i) {
+		const DownsampledOutput& level = job.downsampled[i - 1];
+		opened = writers[i].open(level.output_fname, level.output_format, level.output_size,
+			mappingRows(settings.target, level.output_size), mappingFaces(settings.target), encode);
+	}
+	for (size_t i = num_outputs - 1; i > 0; --i) {
+		OutputWriter& level_writer = writers[i];
+		RowDownsampler* next = downsamplers[i].get();
+		const int width = i == 1 ? job.output_size : job.downsampled[i - 2].output_size;
+		downsamplers[i - 1].reset(new RowDownsampler(settings.filter, width,
+			[&level_writer, next](int y_begin, int y_end, const u32* rows) {
+				level_writer.writeRows(rows, y_end - y_begin);
+				if (next != nullptr)
+					next->addRows(y_begin, y_end, rows);
+			}));
+	}
+	const auto write_rows = [&](int y_begin, int y_end, const u32* rows) {
+		writers[0].writeRows(rows, y_end - y_begin);
+		if (downsamplers[0] != nullptr)
+			downsamplers[0]->addRows(y_begin, y_end, rows);
+	};
+
+	if (opened) {
+		on_gpu = renderImageStreamed(converter.gpuRenderer(), thread_pool, input_cubemap, settings,
+			[&](int y_begin, int y_end, const u32* rows) {
+				if (stats == nullptr) {
+					write_rows(y_begin, y_end, rows);
+					return;
+				}
+
+				const Clock::time_point write_start = Clock::now();
+				const double cpu_start = threadCpuSeconds();
+				write_rows(y_begin, y_end, rows);
+				write_cpu_seconds += threadCpuSeconds() - cpu_start;
+				write_wall_seconds += std::chrono::duration<double>(Clock::now() - write_start).count();
+			});
+		render_wall_seconds = std::chrono::duration<double>(Clock::now() - render_start).count();
+
+		// Rows are already on disk by now, so drop the files for faces that
+		// didn't load rather than leave a placeholder-filled image behind.
+		if (!input_cubemap.finishLoading()) {
+			for (size_t i = 0; i < num_outputs; ++i)
+				writers[i].discard();
+			ok = false;
+		} else {
+			for (size_t i = 0; i < num_outputs; ++i)
+				ok &= writers[i].close();
 		}
+	} else {
+		// The one that failed to open has removed its files already.
+		for (size_t i = 0; i < num_outputs; ++i)
+			writers[i].discard();
+		ok = false;
+	}
 
-		out_face = CubeFace(major_axis);
-		out_s = 0.5f * (tmp_s / m + 1.0f);
-		out_t = 0.5f * (tmp_t / m + 1.0f);
+	if (stats != nullptr) {
+		recordJobStats(job, settings, thread_pool.size(), input_cubemap, counters, *stats);
+		if (on_gpu)
+			stats->kernel = "gpu";
+		stats->ok = ok;
+		stats->render_wall_seconds = render_wall_seconds;
+		stats->write_wall_seconds = write_wall_seconds;
+		stats->write_cpu_seconds = write_cpu_seconds;
+		for (size_t i = 0; i < num_outputs; ++i)
+			stats->bytes_written += writers[i].bytesWritten();
 	}
+	return ok;
+}
+
+// Runs jobs one after another and pipelines them: the next job's faces are
+// decoding while the current one renders, unless they are the same faces,
+// and rows are written while the rest of the job renders, PNG and QOI
+// compressed on a pool of their own. Tables and LUTs are shared through the
+// converter. A non-zero mem_limit
+// pages the faces of each job (see Cubemap), and then the next job only
+// starts loading once the current one is done. With print_stats, a JSON line
+// of JobStats goes to stdout after each job. Returns the number of failed
+// jobs.
+int runJobs(SpheremapConverter& converter, const std::vector<ConvertJob>& jobs, int compression_level, bool print_stats,
+	u64 mem_limit)
+{
+	typedef std::chrono::steady_clock Clock;
 
-	u32 readTexelClamped(CubeFace face, int x, int y) {
-		const Image& face_img = faces[face];
+	int num_failed = 0;
+	if (jobs.empty())
+		return 0;
 
-		x = std::max(std::min(x, face_img.width  - 1), 0);
-		y = std::max(std::min(y, face_img.height - 1), 0);
-		return readTexel(face, x, y);
+	const ConverterOptions& options = converter.options();
+
+	// Rendering keeps the converter's pool busy while rows are written, so
+	// encoding gets its own workers; they only run while the writer waits on
+	// them.
+	ThreadPool encode_pool(converter.threadPool().size());
+	EncodeOptions encode;
+	encode.compression_level = compression_level;
+	encode.thread_pool = &encode_pool;
+
+	const auto load = [&](const ConvertJob& job) {
+		return new Cubemap(job.fname_prefix, job.fname_extension, options.mipmaps, converter.texelFormat(),
+			options.source, jobFaces(converter, job), mem_limit);
+	};
+	// Whole outputs of the same input, such as the sizes of a -size list,
+	// render from the same cubemap.
+	const auto sharesInput = [&](const ConvertJob& a, const ConvertJob& b) {
+		return a.fname_prefix == b.fname_prefix && a.fname_extension == b.fname_extension
+			&& a.wholeOutput(options.target) && b.wholeOutput(options.target);
+	};
+	std::shared_ptr<Cubemap> next_cubemap(load(jobs[0]));
+
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		const ConvertJob& job = jobs[i];
+		const Clock::time_point job_start = Clock::now();
+		const AllocationCounts job_allocations(converter.bufferPool());
+
+		const bool shared_input = i > 0 && sharesInput(jobs[i - 1], job);
+		std::shared_ptr<Cubemap> input_cubemap(std::move(next_cubemap));
+		if (input_cubemap == nullptr)
+			input_cubemap.reset(load(job));
+		if (i + 1 < jobs.size() && sharesInput(job, jobs[i + 1]))
+			next_cubemap = input_cubemap;
+		else if (i + 1 < jobs.size() && mem_limit == 0)
+			next_cubemap.reset(load(jobs[i + 1]));
+
+		JobStats stats;
+		if (!runJob(converter, job, *input_cubemap, encode, print_stats ? &stats : nullptr))
+			++num_failed;
+
+		if (print_stats) {
+			// Decoding was the job before's.
+			if (shared_input) {
+				stats.decode_wall_seconds = stats.decode_cpu_seconds = 0;
+				stats.bytes_read = 0;
+			}
+			recordAllocations(job_allocations, converter.bufferPool(), stats);
+			stats.wall_seconds = std::chrono::duration<double>(Clock::now() - job_start).count();
+			writeJsonLine(std::cout, stats);
+		}
 	}
 
-	u32 sampleFace(CubeFace face, float s, float t) {
-		const Image& face_img = faces[face];
+	return num_failed;
+}
 
-		const float x = s * face_img.width;
-		const float y = t * face_img.height;
+// A -serve request, with its job checked and ready to run.
+struct ServeRequest {
+	std::string id;
+	int priority;
+	// Arrival order, among requests of the same priority.
+	u64 sequence;
+	std::chrono::steady_clock::time_point received;
+	ConvertJob job;
+};
 
-		const int x_base = static_cast<int>(x);
-		const int y_base = static_cast<int>(y);
-		const float x_fract = x - x_base;
-		const float y_fract = y - y_base;
+// Requests waiting to run, highest priority first and then in the order
+// they came in. Filled by one thread while another runs them.
+class RequestQueue {
+public:
+	RequestQueue() : next_sequence(0), closed(false) {}
 
-		const Colorf sample_00(readTexelClamped(face, x_base,     y_base));
-		const Colorf sample_10(readTexelClamped(face, x_base + 1, y_base));
-		const Colorf sample_01(readTexelClamped(face, x_base,     y_base + 1));
-		const Colorf sample_11(readTexelClamped(face, x_base + 1, y_base + 1));
+	void push(ServeRequest request) {
+		std::lock_guard<std::mutex> lock(mutex);
+		request.sequence = next_sequence++;
+		requests.push(std::move(request));
+		ready_cv.notify_one();
+	}
 
-		const Colorf mix_0 = Colorf::mix(sample_00, sample_10, x_fract);
-		const Colorf mix_1 = Colorf::mix(sample_01, sample_11, x_fract);
+	// No more requests are coming.
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		ready_cv.notify_one();
+	}
 
-		const Colorf mix_final = Colorf::mix(mix_0, mix_1, y_fract);
-		return mix_final.toU32();
+	// Takes the next request, waiting for one. Fails once the queue is closed
+	// and empty.
+	bool pop(ServeRequest& out_request) {
+		std::unique_lock<std::mutex> lock(mutex);
+		ready_cv.wait(lock, [&] { return !requests.empty() || closed; });
+		if (requests.empty())
+			return false;
+		out_request = requests.top();
+		requests.pop();
+		return true;
 	}
+
+	// The request pop would take now, without taking it or waiting.
+	bool peek(ServeRequest& out_request) const {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (requests.empty())
+			return false;
+		out_request = requests.top();
+		return true;
+	}
+
+private:
+	RequestQueue(const RequestQueue&);
+	RequestQueue& operator= (const RequestQueue&);
+
+	struct RunsLater {
+		bool operator() (const ServeRequest& a, const ServeRequest& b) const {
+			return a.priority != b.priority ? a.priority < b.priority : a.sequence > b.sequence;
+		}
+	};
+
+	mutable std::mutex mutex;
+	std::condition_variable ready_cv;
+	std::priority_queue<ServeRequest, std::vector<ServeRequest>, RunsLater> requests;
+	u64 next_sequence;
+	bool closed;
 };
 
-inline float unlerp(int val, int max) {
-	return (val + 0.5f) / max;
-}
+// -serve: reads requests from stdin until it closes, one per line as
+//   id priority input_prefix input_extension [output_file [size]]
+// with the last fields as in a batch manifest, and runs them like runJobs,
+// queued by priority. Each is answered on stdout with a line of JSON once
+// done, after its JobStats line with print_stats:
+//   {"id":...,"ok":...,"input":"cached"|"prefetched"|"decoded","queued_s":...,"wall_s":...}
+// Requests that don't parse or check out are answered right away with
+// just id and ok, and the reason on stderr. Decoded inputs are kept in a
+// CubemapCache of cache_bytes; paged ones, with mem_limit, are not. Returns
+// the number of failed requests.
+int serveRequests(SpheremapConverter& converter, int default_size, const std::string& default_extension,
+	int compression_level, bool print_stats, u64 mem_limit, u64 cache_bytes)
+{
+	typedef std::chrono::steady_clock Clock;
+
+	const ConverterOptions& options = converter.options();
+	// Shared by the reader and the request loop.
+	std::mutex reply_mutex;
+	int num_failed = 0;
+
+	const auto reply = [&](const std::string& line) {
+		std::lock_guard<std::mutex> lock(reply_mutex);
+		std::cout << line << std::endl;
+	};
+	const auto reject = [&](const std::string& id) {
+		{
+			std::lock_guard<std::mutex> lock(reply_mutex);
+			++num_failed;
+		}
+		reply("{\"id\":" + jsonString(id) + ",\"ok\":false}");
+	};
+
+	const OutputRegion whole_output = { 0, 0, 0, 0 };
+	RequestQueue queue;
+	std::thread reader([&] {
+		std::string line;
+		for (int line_number = 1; std::getline(std::cin, line); ++line_number) {
+			std::istringstream fields(line);
+			ServeRequest request;
+			if (!(fields >> request.id) || request.id[0] == '#')
+				continue;
+
+			const std::string location = "<stdin>:" + std::to_string(line_number);
+			if (!(fields >> request.priority >> request.job.fname_prefix)) {
+				std::cerr << location << ": Missing priority or input prefix.\n";
+				reject(request.id);
+				continue;
+			}
+			if (!readJobFields(fields, location, default_size, default_extension, request.job)
+				|| !prepareJob(request.job, options.source, options.target, options.filter, whole_output, 0, 0))
+			{
+				reject(request.id);
+				continue;
+			}
+
+			request.received = Clock::now();
+			queue.push(std::move(request));
+		}
+		queue.close();
+	});
+
+	ThreadPool encode_pool(converter.threadPool().size());
+	EncodeOptions encode;
+	encode.compression_level = compression_level;
+	encode.thread_pool = &encode_pool;
+
+	CubemapCache cache(options.source, cache_bytes);
+	const auto describe = [&](const ConvertJob& job) {
+		return cache.describe(job.fname_prefix, job.fname_extension, jobFaces(converter, job));
+	};
+	const auto load = [&](const CubemapCache::Input& input) {
+		return std::shared_ptr<const Cubemap>(new Cubemap(input.fname_prefix, input.fname_extension, options.mipmaps,
+			converter.texelFormat(), options.source, input.face_mask, mem_limit));
+	};
+
+	// The input of the request expected to run next, decoding while the
+	// current one renders.
+	CubemapCache::Input prefetched_input;
+	std::shared_ptr<const Cubemap> prefetched;
+
+	ServeRequest request;
+	while (queue.pop(request)) {
+		const Clock::time_point start = Clock::now();
+		const AllocationCounts job_allocations(converter.bufferPool());
+
+		const CubemapCache::Input input = describe(request.job);
+		std::shared_ptr<const Cubemap> input_cubemap;
+		bool decoded = false;
+		const char* input_source = "cached";
+		if (prefetched != nullptr && CubemapCache::covers(prefetched_input, input)) {
+			input_cubemap = std::move(prefetched);
+			decoded = true;
+			input_source = "prefetched";
+		} else {
+			// A request of higher priority came in after the prefetch started;
+			// the one it was for is still queued.
+			if (prefetched != nullptr)
+				cache.insert(prefetched_input, prefetched);
+			input_cubemap = cache.find(input);
+			if (input_cubemap == nullptr) {
+				input_cubemap = load(input);
+				decoded = true;
+				input_source = "decoded";
+			}
+		}
+		prefetched.reset();
+
+		ServeRequest next;
+		if (mem_limit == 0 && queue.peek(next)) {
+			prefetched_input = describe(next.job);
+			if (!CubemapCache::covers(input, prefetched_input) && cache.find(prefetched_input) == nullptr)
+				prefetched = load(prefetched_input);
+		}
+
+		JobStats stats;
+		const bool ok = runJob(converter, request.job, *input_cubemap, encode, print_stats ? &stats : nullptr);
+		if (ok && decoded)
+			cache.insert(input, input_cubemap);
+		input_cubemap.reset();
 
-template <typename T>
-inline typename T::value_type pop_from(T& container) {
-	typename T::value_type val = container.back();
-	container.pop_back();
-	return val;
+		const Clock::time_point end = Clock::now();
+		if (print_stats) {
+			recordAllocations(job_allocations, converter.bufferPool(), stats);
+			stats.wall_seconds = std::chrono::duration<double>(end - start).count();
+			std::lock_guard<std::mutex> lock(reply_mutex);
+			writeJsonLine(std::cout, stats);
+		}
+
+		std::ostringstream line;
+		line << std::setprecision(6) << "{\"id\":" << jsonString(request.id)
+			<< ",\"ok\":" << (ok ? "true" : "false")
+			<< ",\"input\":\"" << input_source << "\""
+			<< ",\"queued_s\":" << std::chrono::duration<double>(start - request.received).count()
+			<< ",\"wall_s\":" << std::chrono::duration<double>(end - start).count() << "}";
+		if (!ok) {
+			std::lock_guard<std::mutex> lock(reply_mutex);
+			++num_failed;
+		}
+		reply(line.str());
+	}
+
+	reader.join();
+	return num_failed;
 }
 
-void printProgramUsage() {
-	std::cerr <<
-		"SpheremapTool v.GIT\n"
-		"\n"
-		"Usage:\n"
-		"  SpheremapTool [opts] [-] input_prefix input_extension\n"
-		"\n"
-		"Available options:\n"
-		"  -aa 1|5|16       Specify number of AA samples. (Default: 1)\n"
-		"  -size <int>      Specifies output image size. (Default: 1024)\n"
-		"  -dome            Maps only the front hemisphere. Useful for texturing skydomes.\n"
-		"  -o <filename>    Manually specifies output file. (Default: \"<input_prefix>_spheremap.bmp\")\n"
-		"  -h / -help       Print this help text.\n"
-		"\n";
+// Reads the width x height image that RowWriter wrote to filename.
+bool readOutput(const std::string& filename, TexelFormat texel_format, int width, int height,
+	std::vector<u32>& out_pixels)
+{
+	TileSource source;
+	if (!source.open(filename, texel_format) || source.width != width || source.height != height)
+		return false;
+
+	out_pixels.resize(size_t(width) * height);
+	for (int y = 0; y < height; ++y)
+		source.readRow(y, &out_pixels[size_t(y) * width]);
+	return true;
 }
 
-static const float aa_pattern_none[] = { 0.f, 0.f };
-static const float aa_pattern_5x[] = {
-	0.0f   , 0.0f   ,
-	-.1875f, -.375f ,
-	0.375f , -.1875f,
-	0.1875f, 0.375f ,
-	-.375f , 0.1875f,
-};
+// Runs a single job like runJobs, keeping a RenderCache in cache_fname. If
+// the cache matches the settings and the output file is still the one it
+// was saved with, only the tiles that read faces changed since then are
+// rendered again and patched into that output, which is left alone if no
+// tile needs it. Otherwise the whole region is rendered and the cache
+// started anew. Returns whether the job succeeded.
+bool runCachedJob(SpheremapConverter& converter, const ConvertJob& job, const std::string& cache_fname,
+	int compression_level, bool print_stats, u64 mem_limit)
+{
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point job_start = Clock::now();
+	const AllocationCounts job_allocations(converter.bufferPool());
 
-static const float aa_pattern_16x[] = {
-	-.375, -.375,
-	-.375, -.175,
-	-.375, 0.175,
-	-.375, 0.375,
-
-	-.175, -.375,
-	-.175, -.175,
-	-.175, 0.175,
-	-.175, 0.375,
-
-	0.125, -.375,
-	0.125, -.175,
-	0.125, 0.175,
-	0.125, 0.375,
-
-	0.375, -.375,
-	0.375, -.175,
-	0.375, 0.175,
-	0.375, 0.375,
-};
+	const ConverterOptions& options = converter.options();
+	ThreadPool& thread_pool = converter.threadPool();
+
+	u64 face_hashes[Cubemap::NUM_FACES] = {};
+	for (int f = 0; f < mappingFaces(options.source); ++f) {
+		const std::string filename = Cubemap::inputFilename(job.fname_prefix, job.fname_extension, options.source, f);
+		if (!hashFile(filename, face_hashes[f])) {
+			std::cerr << "Failed to open " << filename << ".\n";
+			return false;
+		}
+	}
+
+	RenderSettings settings = converter.settingsFor(job.output_size, job.region);
+	RenderCounters counters;
+	if (print_stats)
+		settings.counters = &counters;
+	TileFaceRecorder tile_faces(settings, RenderCache::tile_size);
+	settings.tile_faces = &tile_faces;
+
+	const int width = job.region.width;
+	const int height = job.region.height;
+	std::vector<u32> pixels;
+	RenderCache cache;
+	u64 output_hash = 0;
+	const bool patch = cache.load(cache_fname) && cache.matches(settings) && hashFile(job.output_fname, output_hash)
+		&& output_hash == cache.outputHash() && readOutput(job.output_fname, converter.texelFormat(), width, height, pixels);
+
+	std::vector<int> tiles;
+	unsigned load_faces = 0;
+	if (patch) {
+		const unsigned changed = cache.changedFaces(face_hashes);
+		for (int i = 0; i < cache.numTiles(); ++i) {
+			if (cache.tileFaces(i) & changed) {
+				tiles.push_back(i);
+				load_faces |= cache.tileFaces(i);
+			}
+		}
+	} else {
+		load_faces = jobFaces(converter, job);
+		pixels.resize(size_t(width) * height);
+	}
+
+	const Cubemap input_cubemap(job.fname_prefix, job.fname_extension, options.mipmaps, converter.texelFormat(),
+		options.source, load_faces, mem_limit);
+
+	JobStats stats;
+	const Clock::time_point render_start = Clock::now();
+	if (!patch) {
+		renderImage(thread_pool, input_cubemap, settings, pixels.data());
+	} else if (input_cubemap.finishLoading()) {
+		const RowRenderer render_rows = rowRenderer(settings);
+		thread_pool.parallelFor(static_cast<int>(tiles.size()), [&](int i, int) {
+			const double cpu_start = print_stats ? threadCpuSeconds() : 0;
+			RenderSettings tile_settings = settings;
+			tile_settings.region = cache.tile(tiles[i]);
+			const OutputRegion& tile = tile_settings.region;
+
+			std::vector<u32> rows(size_t(tile.width) * tile.height);
+			for (int y = tile.y; y < tile.y + tile.height; y += band_height) {
+				render_rows(input_cubemap, tile_settings, y, std::min(y + band_height, tile.y + tile.height),
+					&rows[size_t(y - tile.y) * tile.width]);
+			}
+			for (int y = 0; y < tile.height; ++y) {
+				std::copy(&rows[size_t(y) * tile.width], &rows[size_t(y) * tile.width] + tile.width,
+					&pixels[size_t(tile.y - job.region.y + y) * width + (tile.x - job.region.x)]);
+			}
+
+			if (print_stats)
+				counters.cpu_nanoseconds += static_cast<u64>((threadCpuSeconds() - cpu_start) * 1e9);
+		});
+	}
+	stats.render_wall_seconds = std::chrono::duration<double>(Clock::now() - render_start).count();
+
+	bool ok = input_cubemap.finishLoading();
+	const bool write_output = !patch || !tiles.empty();
+	OutputWriter writer;
+	if (ok && write_output) {
+		// Rendering is done, so encoding can have the render workers.
+		EncodeOptions encode;
+		encode.compression_level = compression_level;
+		encode.thread_pool = &thread_pool;
+
+		const Clock::time_point write_start = Clock::now();
+		const double cpu_start = threadCpuSeconds();
+		ok = writer.open(job.output_fname, job.output_format, width, height, 1, encode);
+		if (ok) {
+			writer.writeRows(pixels.data(), height);
+			ok = writer.close();
+		}
+		stats.write_cpu_seconds = threadCpuSeconds() - cpu_start;
+		stats.write_wall_seconds = std::chrono::duration<double>(Clock::now() - write_start).count();
+	}
+
+	if (ok) {
+		if (patch)
+			cache.update(tiles, face_hashes, tile_faces);
+		else
+			cache.build(settings, face_hashes, tile_faces);
+
+		if (write_output && !hashFile(job.output_fname, output_hash)) {
+			std::cerr << "Failed to open " << job.output_fname << ".\n";
+			ok = false;
+		}
+		cache.setOutputHash(output_hash);
+		if (ok && !cache.save(cache_fname))
+			std::cerr << "Failed to write " << cache_fname << ".\n";
+	}
+
+	if (print_stats) {
+		recordJobStats(job, settings, thread_pool.size(), input_cubemap, counters, stats);
+		recordAllocations(job_allocations, converter.bufferPool(), stats);
+		stats.ok = ok;
+		stats.num_tiles = cache.numTiles();
+		stats.tiles_rendered = patch ? static_cast<int>(tiles.size()) : cache.numTiles();
+		stats.bytes_written = writer.bytesWritten();
+		stats.wall_seconds = std::chrono::duration<double>(Clock::now() - job_start).count();
+		writeJsonLine(std::cout, stats);
+	}
+	return ok;
+}
 
 int main(int argc, char* argv[]) {
 	if (argc < 1) {
@@ -245,41 +991,168 @@ int main(int argc, char* argv[]) {
 	}
 
 	int num_aa_samples = 1;
-	const float* aa_sample_pattern = aa_pattern_none;
-	int output_size = 1024;
-	bool dome = false;
+	bool adaptive_aa = false;
+	int aa_threshold = 8;
+	// Defaults to auto_size for the compact mappings and to 1024 otherwise.
+	int output_size = -1;
+	// All sizes of a -size list, largest first; output_size is listed_sizes
+	// then.
+	std::vector<int> output_sizes;
+	Mapping source = MAPPING_CUBE;
+	Mapping target = MAPPING_EQUIRECT;
+	int num_threads = ThreadPool::defaultThreadCount();
+	const SampleKernel* kernel = &bestSampleKernel();
+	bool use_gpu = false;
+	SampleFilter filter = FILTER_FLOAT;
+	bool hdr = false;
+	bool mipmaps = false;
+	// -mem-limit in bytes, or 0 to keep the faces in memory.
+	u64 mem_limit = 0;
 	std::string output_fname;
+	std::string batch_manifest;
+	bool serve = false;
+	// -serve-cache in bytes.
+	u64 serve_cache_bytes = u64(1024) << 20;
+	bool use_lut = false;
+	bool print_stats = false;
+	std::string lut_fname;
+	// -region, or a width of 0 for the whole output.
+	OutputRegion region = { 0, 0, 0, 0 };
+	int tile_index = 0, tile_count = 0;
+	std::string merge_manifest;
+	std::string cache_fname;
+	int compression_level = EncodeOptions().compression_level;
 	std::vector<std::string> positional_params;
 
 	{
-		std::vector<std::string> input_params(std::reverse_iterator<char**>(argv+argc), std::reverse_iterator<char**>(argv+1));
+		ArgumentCursor input_params = { argv + 1, argv + argc };
 
 		while (!input_params.empty()) {
 			std::string opt = pop_from(input_params);
 
 			if (!opt.empty() && opt[0] == '-') {
 				if (opt == "-") {
-					std::copy(input_params.rbegin(), input_params.rend(), std::back_inserter(positional_params));
+					positional_params.insert(positional_params.end(), input_params.next, input_params.end);
 					break;
 				} else if (opt == "-aa") {
-					num_aa_samples = std::stoi(pop_from(input_params));
-					switch (num_aa_samples) {
-					case 1:
-						aa_sample_pattern = aa_pattern_none; break;
-					case 5:
-						aa_sample_pattern = aa_pattern_5x; break;
-					case 16:
-						aa_sample_pattern = aa_pattern_16x; break;
-					default:
+					std::string aa_mode = pop_from(input_params);
+					adaptive_aa = aa_mode == "adaptive";
+					num_aa_samples = adaptive_aa ? 16 : std::stoi(aa_mode);
+					if (aaSamplePattern(num_aa_samples) == nullptr) {
 						std::cerr << "Invalid AA sample pattern.\n";
 						return 1;
 					}
+				} else if (opt == "-aa-threshold") {
+					aa_threshold = std::stoi(pop_from(input_params));
 				} else if (opt == "-size") {
-					output_size = std::stoi(pop_from(input_params));
+					std::istringstream size_names(pop_from(input_params));
+					output_sizes.clear();
+					for (std::string size_name; std::getline(size_names, size_name, ','); )
+						output_sizes.push_back(size_name == "auto" ? auto_size : std::stoi(size_name));
+					std::sort(output_sizes.begin(), output_sizes.end(), std::greater<int>());
+					output_sizes.erase(std::unique(output_sizes.begin(), output_sizes.end()), output_sizes.end());
+					if (output_sizes.empty() || output_sizes.back() < 0
+						|| (output_sizes.size() > 1 && output_sizes.back() == auto_size))
+					{
+						std::cerr << "Invalid size.\n";
+						return 1;
+					}
+					output_size = output_sizes.size() > 1 ? listed_sizes : output_sizes[0];
+				} else if (opt == "-threads") {
+					num_threads = std::stoi(pop_from(input_params));
+					if (num_threads < 1) {
+						std::cerr << "Invalid thread count.\n";
+						return 1;
+					}
+				} else if (opt == "-kernel") {
+					kernel = findSampleKernel(pop_from(input_params));
+					if (kernel == nullptr) {
+						std::cerr << "Unknown or unsupported sampling kernel.\n";
+						return 1;
+					}
+				} else if (opt == "-backend") {
+					const std::string backend = pop_from(input_params);
+					use_gpu = backend == "gpu";
+					if (!use_gpu && backend != "cpu") {
+						std::cerr << "Invalid backend.\n";
+						return 1;
+					}
+				} else if (opt == "-filter") {
+					std::string filter_name = pop_from(input_params);
+					if (filter_name == "float") {
+						filter = FILTER_FLOAT;
+					} else if (filter_name == "fixed") {
+						filter = FILTER_FIXED;
+					} else if (filter_name == "srgb") {
+						filter = FILTER_SRGB;
+					} else {
+						std::cerr << "Invalid filter.\n";
+						return 1;
+					}
+				} else if (opt == "-hdr") {
+					hdr = true;
+				} else if (opt == "-mipmap") {
+					mipmaps = true;
+				} else if (opt == "-mem-limit") {
+					const long long megabytes = std::stoll(pop_from(input_params));
+					if (megabytes < 1) {
+						std::cerr << "Invalid memory limit.\n";
+						return 1;
+					}
+					mem_limit = u64(megabytes) << 20;
+				} else if (opt == "-from" || opt == "-to") {
+					if (!findMapping(pop_from(input_params), opt == "-from" ? source : target)) {
+						std::cerr << "Unknown mapping for " << opt << ".\n";
+						return 1;
+					}
 				} else if (opt == "-dome") {
-					dome = true;
+					target = MAPPING_DOME;
+				} else if (opt == "-lut") {
+					use_lut = true;
+				} else if (opt == "-lut-file") {
+					use_lut = true;
+					lut_fname = pop_from(input_params);
+				} else if (opt == "-stats") {
+					print_stats = true;
+				} else if (opt == "-region") {
+					region.x = std::stoi(pop_from(input_params));
+					region.y = std::stoi(pop_from(input_params));
+					region.width = std::stoi(pop_from(input_params));
+					region.height = std::stoi(pop_from(input_params));
+					if (region.x < 0 || region.y < 0 || region.width < 1 || region.height < 1) {
+						std::cerr << "Invalid region.\n";
+						return 1;
+					}
+				} else if (opt == "-tile") {
+					tile_index = std::stoi(pop_from(input_params));
+					tile_count = std::stoi(pop_from(input_params));
+					if (tile_count < 1 || tile_index < 0 || tile_index >= tile_count) {
+						std::cerr << "Invalid tile.\n";
+						return 1;
+					}
+				} else if (opt == "-merge") {
+					merge_manifest = pop_from(input_params);
+				} else if (opt == "-compression") {
+					compression_level = std::stoi(pop_from(input_params));
+					if (compression_level < 0 || compression_level > 9) {
+						std::cerr << "Compression level must be 0 to 9.\n";
+						return 1;
+					}
 				} else if (opt == "-o") {
 					output_fname = pop_from(input_params);
+				} else if (opt == "-batch") {
+					batch_manifest = pop_from(input_params);
+				} else if (opt == "-serve") {
+					serve = true;
+				} else if (opt == "-serve-cache") {
+					const long long megabytes = std::stoll(pop_from(input_params));
+					if (megabytes < 0) {
+						std::cerr << "Invalid -serve-cache size.\n";
+						return 1;
+					}
+					serve_cache_bytes = u64(megabytes) << 20;
+				} else if (opt == "-cache") {
+					cache_fname = pop_from(input_params);
 				} else if (opt == "-h" || opt == "-help") {
 					printProgramUsage();
 					return 0;
@@ -293,65 +1166,173 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
-	if (positional_params.size() != 2) {
-		printProgramUsage();
+	if (use_lut && adaptive_aa) {
+		std::cerr << "-lut can't be combined with -aa adaptive.\n";
+		return 1;
+	}
+
+	if (mem_limit != 0 && mipmaps) {
+		std::cerr << "-mem-limit can't be combined with -mipmap.\n";
+		return 1;
+	}
+
+	if (adaptive_aa && target == MAPPING_CUBE) {
+		std::cerr << "-aa adaptive can't be combined with -to cube.\n";
 		return 1;
 	}
 
-	std::string fname_prefix = positional_params[0];
-	std::string fname_extension = positional_params[1];
-	if (output_fname.empty())
-		output_fname = fname_prefix + ".tga";
+	if (hdr) {
+		if (filter == FILTER_FIXED || filter == FILTER_SRGB || adaptive_aa) {
+			std::cerr << "-hdr can't be combined with -filter fixed, -filter srgb or -aa adaptive.\n";
+			return 1;
+		}
+		filter = FILTER_RGBE;
+	}
+	const std::string default_extension = hdr ? ".hdr" : ".tga";
 
-	float output_pixel_size = 1.f / output_size;
-	int output_size_x = output_size;
-	float output_pixel_size_x = 1.f / output_size_x;
-	std::vector<u32> out_data(output_size_x * output_size);
+	if (output_size == listed_sizes && (region.width != 0 || tile_count != 0 || !cache_fname.empty() || serve)) {
+		std::cerr << "A -size list can't be combined with -region, -tile, -cache or -serve.\n";
+		return 1;
+	}
+	if (output_size == -1)
+		output_size = target == MAPPING_OCTAHEDRAL || target == MAPPING_DUAL_PARABOLOID ? auto_size : 1024;
+
+	if (region.width != 0 && tile_count != 0) {
+		std::cerr << "-region can't be combined with -tile.\n";
+		return 1;
+	}
 
+	if (serve && (!positional_params.empty() || !output_fname.empty() || !batch_manifest.empty() || !merge_manifest.empty()
+		|| !cache_fname.empty() || region.width != 0 || tile_count != 0))
 	{
-		Cubemap input_cubemap(fname_prefix, fname_extension);
-		for (int y = 0; y < output_size; ++y) {
-			for (int x = 0; x < output_size; ++x) {
-				float center_s = unlerp(x, output_size);
-				float center_t = unlerp(y, output_size);
-
-				u32 sample_r = 0, sample_g = 0, sample_b = 0;
-
-				for (int sample = 0; sample < num_aa_samples; ++sample) {
-					float s = center_s + aa_sample_pattern[sample*2 + 0] * output_pixel_size;
-					float t = center_t + aa_sample_pattern[sample*2 + 1] * output_pixel_size;
-
-					float vx, vy, vz;
-
-					float m_pi = acos(-1.f);
-					float scx = (float)x / (float)output_size * 2 - 1;
-					float scy = 1 - (float)y / (float)output_size * 2;
-					float theta = scx * m_pi;
-					float phi = scy * m_pi / 2.f;
-					vx = cos(phi) * cos(theta);
-					vy = sin(phi);
-					vz = cos(phi) * sin(theta);
-
-					Cubemap::CubeFace cube_face;
-					float tex_s, tex_t;
-					input_cubemap.computeTexCoords(vx, vy, vz, cube_face, tex_s, tex_t);
-					u32 sample_color = input_cubemap.sampleFace(cube_face, tex_s, tex_t);
-
-					u8 r, g, b;
-					splitColor(sample_color, r, g, b);
-					sample_r += r;
-					sample_g += g;
-					sample_b += b;
-				}
+		std::cerr << "-serve takes no input prefix, extension, -o, -batch, -merge, -cache, -region or -tile.\n";
+		return 1;
+	}
+
+	if (!merge_manifest.empty()) {
+		if (!positional_params.empty() || !batch_manifest.empty() || output_fname.empty()) {
+			std::cerr << "-merge takes -o and no input prefix, extension or -batch.\n";
+			return 1;
+		}
+
+		RowWriter::Format format;
+		if (!outputFormat(output_fname, filter, format)) {
+			std::cerr << output_fname << (hdr ? ": -hdr only writes .hdr and .raw.\n" : ": .hdr output needs -hdr.\n");
+			return 1;
+		}
 
-				sample_r /= num_aa_samples;
-				sample_g /= num_aa_samples;
-				sample_b /= num_aa_samples;
+		std::vector<MergeTile> tiles;
+		bool manifest_ok;
+		if (merge_manifest == "-") {
+			manifest_ok = readTileManifest(std::cin, "<stdin>", tiles);
+		} else {
+			std::ifstream manifest(merge_manifest);
+			if (!manifest) {
+				std::cerr << "Failed to open " << merge_manifest << ".\n";
+				return 1;
+			}
+			manifest_ok = readTileManifest(manifest, merge_manifest, tiles);
+		}
+
+		if (!manifest_ok)
+			return 1;
+		ThreadPool encode_pool(num_threads);
+		EncodeOptions encode;
+		encode.compression_level = compression_level;
+		encode.thread_pool = &encode_pool;
+		return mergeTiles(tiles, output_fname, format, mappingFaces(target), hdr ? TEXELS_RGBE : TEXELS_RGBA8, encode)
+			? 0 : 1;
+	}
+
+	std::vector<ConvertJob> jobs;
+
+	if (!batch_manifest.empty()) {
+		if (!positional_params.empty() || !output_fname.empty()) {
+			std::cerr << "-batch doesn't take an input prefix, extension or -o.\n";
+			return 1;
+		}
 
-				out_data[y * output_size + x] = makeColor(sample_r, sample_g, sample_b);
+		bool manifest_ok;
+		if (batch_manifest == "-") {
+			manifest_ok = readJobManifest(std::cin, "<stdin>", output_size, default_extension, jobs);
+		} else {
+			std::ifstream manifest(batch_manifest);
+			if (!manifest) {
+				std::cerr << "Failed to open " << batch_manifest << ".\n";
+				return 1;
 			}
+			manifest_ok = readJobManifest(manifest, batch_manifest, output_size, default_extension, jobs);
 		}
+
+		if (!manifest_ok)
+			return 1;
+	} else if (!serve) {
+		if (positional_params.size() != 2) {
+			printProgramUsage();
+			return 1;
+		}
+
+		ConvertJob job;
+		job.fname_prefix = positional_params[0];
+		job.fname_extension = positional_params[1];
+		job.output_fname = output_fname.empty() ? job.fname_prefix + default_extension : output_fname;
+		job.output_size = output_size;
+		jobs.push_back(job);
+	}
+
+	if (output_size == listed_sizes) {
+		std::vector<ConvertJob> sized_jobs;
+		for (const ConvertJob& job : jobs) {
+			if (job.output_size == listed_sizes)
+				addSizedJobs(job, output_sizes, target, sized_jobs);
+			else
+				sized_jobs.push_back(job);
+		}
+		jobs.swap(sized_jobs);
+	}
+
+	for (ConvertJob& job : jobs) {
+		if (!prepareJob(job, source, target, filter, region, tile_index, tile_count))
+			return 1;
 	}
 
-	stbi_write_tga(output_fname.c_str(), output_size_x, output_size, 4, out_data.data());
+	if (!cache_fname.empty()) {
+		if (!batch_manifest.empty()) {
+			std::cerr << "-cache can't be combined with -batch.\n";
+			return 1;
+		}
+		const RowWriter::Format format = jobs[0].output_format;
+		if (jobs[0].numOutputFiles(target) != 1
+			|| (format != RowWriter::FORMAT_TGA && format != RowWriter::FORMAT_BMP && format != RowWriter::FORMAT_PNG))
+		{
+			std::cerr << "-cache needs a single .tga, .bmp or .png output file.\n";
+			return 1;
+		}
+	}
+
+	ConverterOptions options;
+	options.source = source;
+	options.target = target;
+	options.num_aa_samples = num_aa_samples;
+	options.adaptive_aa = adaptive_aa;
+	options.aa_threshold = aa_threshold;
+	options.kernel = kernel;
+	options.filter = filter;
+	options.mipmaps = mipmaps;
+	options.use_lut = use_lut;
+	options.lut_filename = lut_fname;
+	options.num_threads = num_threads;
+	options.use_gpu = use_gpu;
+
+	SpheremapConverter converter(options);
+	// Faces, decode buffers and output windows all come from the converter's
+	// pool, so that jobs of the same sizes reuse them.
+	const BufferPool::Scope pool_scope(&converter.bufferPool());
+	if (serve) {
+		return serveRequests(converter, output_size, default_extension, compression_level, print_stats, mem_limit,
+			serve_cache_bytes) == 0 ? 0 : 1;
+	}
+	if (!cache_fname.empty())
+		return runCachedJob(converter, jobs[0], cache_fname, compression_level, print_stats, mem_limit) ? 0 : 1;
+	return runJobs(converter, jobs, compression_level, print_stats, mem_limit) == 0 ? 0 : 1;
 }
@@ -0,0 +1,204 @@
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+unsigned read16(const u8* p) {
+	return p[0] | p[1] << 8;
+}
+
+u32 read32(const u8* p) {
+	return read16(p) | u32(read16(p + 2)) << 16;
+}
+
+bool viewRaw(const u8* file, size_t file_size, PixelView& out) {
+	const int side = static_cast<int>(std::sqrt(double(file_size / 4)) + 0.5);
+	if (side <= 0 || size_t(side) * side * 4 != file_size)
+		return false;
+
+	out.top_row = file;
+	out.row_pitch = std::ptrdiff_t(side) * 4;
+	out.width = out.height = side;
+	out.bytes_per_pixel = 4;
+	out.bgr = false;
+	return true;
+}
+
+// Only accepts unmapped true-color images stored left to right, which is
+// what RowWriter writes. Others go through stb_image.
+bool viewTga(const u8* file, size_t file_size, PixelView& out) {
+	if (file_size < 18 || file[1] != 0 || file[2] != 2 || (file[16] != 24 && file[16] != 32) || (file[17] & 0x10))
+		return false;
+
+	out.width = read16(file + 12);
+	out.height = read16(file + 14);
+	out.bytes_per_pixel = file[16] / 8;
+	out.bgr = true;
+
+	const size_t pixels_offset = 18 + file[0];
+	const std::ptrdiff_t pitch = std::ptrdiff_t(out.width) * out.bytes_per_pixel;
+	if (out.width == 0 || out.height == 0 || pixels_offset + size_t(pitch) * out.height > file_size)
+		return false;
+
+	const bool top_down = (file[17] & 0x20) != 0;
+	out.top_row = file + pixels_offset + (top_down ? 0 : pitch * (out.height - 1));
+	out.row_pitch = top_down ? pitch : -pitch;
+	return true;
+}
+
+bool viewBmp(const u8* file, size_t file_size, PixelView& out) {
+	if (file_size < 54 || file[0] != 'B' || file[1] != 'M' || read32(file + 14) < 40)
+		return false;
+
+	const unsigned bpp = read16(file + 28);
+	if ((bpp != 24 && bpp != 32) || read32(file + 30) != 0)
+		return false;
+
+	const int32_t height = static_cast<int32_t>(read32(file + 22));
+	out.width = static_cast<int32_t>(read32(file + 18));
+	out.height = height < 0 ? -height : height;
+	out.bytes_per_pixel = bpp / 8;
+	out.bgr = true;
+
+	const size_t pixels_offset = read32(file + 10);
+	const std::ptrdiff_t pitch = (std::ptrdiff_t(out.width) * out.bytes_per_pixel + 3) & ~3;
+	if (out.width <= 0 || out.height <= 0 || pixels_offset + size_t(pitch) * out.height > file_size)
+		return false;
+
+	// Positive heights are stored bottom-up.
+	out.top_row = file + pixels_offset + (height < 0 ? 0 : pitch * (out.height - 1));
+	out.row_pitch = height < 0 ? pitch : -pitch;
+	return true;
+}
+
+} // namespace
+
+MappedFile::MappedFile() :
+	view(nullptr), view_size(0)
+#if defined(_WIN32)
+	, file_handle(INVALID_HANDLE_VALUE), mapping_handle(nullptr)
+#endif
+{}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+bool MappedFile::open(const std::string& filename) {
+	close();
+
+#if defined(_WIN32)
+	file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) {
+		close();
+		return false;
+	}
+
+	mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_handle == nullptr) {
+		close();
+		return false;
+	}
+
+	view = static_cast<const u8*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+	if (view == nullptr) {
+		close();
+		return false;
+	}
+	view_size = size_t(file_size.QuadPart);
+#else
+	const int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0) {
+		::close(fd);
+		return false;
+	}
+
+	// The mapping keeps the file alive on its own.
+	void* mapping = mmap(nullptr, size_t(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	madvise(mapping, size_t(file_stat.st_size), MADV_SEQUENTIAL);
+	view = static_cast<const u8*>(mapping);
+	view_size = size_t(file_stat.st_size);
+#endif
+	return true;
+}
+
+void MappedFile::close() {
+#if defined(_WIN32)
+	if (view != nullptr)
+		UnmapViewOfFile(view);
+	if (mapping_handle != nullptr)
+		CloseHandle(mapping_handle);
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+	mapping_handle = nullptr;
+	file_handle = INVALID_HANDLE_VALUE;
+#else
+	if (view != nullptr)
+		munmap(const_cast<u8*>(view), view_size);
+#endif
+	view = nullptr;
+	view_size = 0;
+}
+
+void MappedFile::evict() const {
+	if (view == nullptr)
+		return;
+
+#if defined(_WIN32)
+	// Unlocking pages that aren't locked takes them out of the working set.
+	VirtualUnlock(const_cast<u8*>(view), view_size);
+#else
+	madvise(const_cast<u8*>(view), view_size, MADV_DONTNEED);
+#endif
+}
+
+bool PixelView::open(const std::string& filename, const MappedFile& file) {
+	if (hasExtension(filename, "raw"))
+		return viewRaw(file.data(), file.size(), *this);
+	if (hasExtension(filename, "tga"))
+		return viewTga(file.data(), file.size(), *this);
+	if (hasExtension(filename, "bmp"))
+		return viewBmp(file.data(), file.size(), *this);
+	return false;
+}
+
+void PixelView::readRow(int y, u32* out) const {
+	const u8* src = top_row + row_pitch * y;
+	u8* dst = reinterpret_cast<u8*>(out);
+
+	if (!bgr) {
+		std::copy(src, src + size_t(width) * 4, dst);
+		return;
+	}
+	for (int x = 0; x < width; ++x, src += bytes_per_pixel, dst += 4) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = bytes_per_pixel == 4 ? src[3] : 0xFF;
+	}
+}
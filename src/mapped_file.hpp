@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "cubemap.hpp"
+
+// Read-only mapping of a whole file. The pages come straight from the OS
+// file cache, so jobs that read the same file share them.
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Fails silently on files that can't be opened or are empty; callers fall
+	// back to regular reads.
+	bool open(const std::string& filename);
+	void close();
+
+	const u8* data() const { return view; }
+	size_t size() const { return view_size; }
+
+	// Hands the pages read so far back to the OS, for files streamed through
+	// once. They stay in the file cache, and reading them again maps them
+	// back in.
+	void evict() const;
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator= (const MappedFile&);
+
+	const u8* view;
+	size_t view_size;
+#if defined(_WIN32)
+	void* file_handle;
+	void* mapping_handle;
+#endif
+};
+
+// Non-owning view of the pixels of an uncompressed image file: raw
+// (headerless 8-bit RGBA with square dimensions), true-color TGA stored left
+// to right, which is what RowWriter writes, and uncompressed 24- or 32-bit
+// BMP.
+struct PixelView {
+	const u8* top_row;
+	// Bytes from one row to the next one down; negative for bottom-up files.
+	std::ptrdiff_t row_pitch;
+	int width, height;
+	int bytes_per_pixel;
+	// Channel order is BGR(A) rather than RGBA.
+	bool bgr;
+
+	// Picks the format from the extension of filename, whose contents file
+	// maps. Fails on anything else, which needs decoding.
+	bool open(const std::string& filename, const MappedFile& file);
+
+	// Copies row y to out as RGBA texels, opaque if the file has no alpha.
+	void readRow(int y, u32* out) const;
+};
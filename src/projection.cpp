@@ -0,0 +1,125 @@
+#include "projection.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "cubemap.hpp"
+
+namespace {
+
+const char* const mapping_names[NUM_MAPPINGS] = { "cube", "equirect", "dome", "octahedral", "dual-paraboloid" };
+
+const float m_pi = 3.14159265358979f;
+
+} // namespace
+
+const char* mappingName(Mapping mapping) {
+	return mapping_names[mapping];
+}
+
+bool findMapping(const std::string& name, Mapping& out_mapping) {
+	for (int i = 0; i < NUM_MAPPINGS; ++i) {
+		if (name == mapping_names[i]) {
+			out_mapping = Mapping(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+void mappingDirection(Mapping mapping, int face, float s, float t, float& out_x, float& out_y, float& out_z) {
+	switch (mapping) {
+	case MAPPING_CUBE:
+		mappingDirectionOf<MAPPING_CUBE>(face, s, t, out_x, out_y, out_z);
+		break;
+	case MAPPING_EQUIRECT:
+	case MAPPING_DOME: {
+		const float theta = (2.f * s - 1.f) * m_pi;
+		const float phi = mapping == MAPPING_DOME ? (1.f - t) * m_pi / 2.f : (1.f - 2.f * t) * m_pi / 2.f;
+		out_x = std::cos(phi) * std::cos(theta);
+		out_y = std::sin(phi);
+		out_z = std::cos(phi) * std::sin(theta);
+		break;
+	}
+	case MAPPING_DUAL_PARABOLOID:
+		mappingDirectionOf<MAPPING_DUAL_PARABOLOID>(face, s, t, out_x, out_y, out_z);
+		break;
+	default:
+		mappingDirectionOf<MAPPING_OCTAHEDRAL>(face, s, t, out_x, out_y, out_z);
+		break;
+	}
+}
+
+void mappingCoords(Mapping mapping, float x, float y, float z, int& out_face, float& out_s, float& out_t) {
+	switch (mapping) {
+	case MAPPING_CUBE: {
+		Cubemap::CubeFace face;
+		Cubemap::computeTexCoords(x, y, z, face, out_s, out_t);
+		out_face = face;
+		return;
+	}
+	case MAPPING_EQUIRECT:
+	case MAPPING_DOME: {
+		const float theta = std::atan2(z, x);
+		const float phi = std::atan2(y, std::sqrt(x * x + z * z));
+		out_face = 0;
+		out_s = std::min(std::max(0.5f * (theta / m_pi + 1.f), 0.f), 1.f);
+		out_t = mapping == MAPPING_DOME ? 1.f - std::max(phi, 0.f) * (2.f / m_pi) : 0.5f - phi / m_pi;
+		out_t = std::min(std::max(out_t, 0.f), 1.f);
+		return;
+	}
+	case MAPPING_DUAL_PARABOLOID: {
+		const float length = std::sqrt(x * x + y * y + z * z);
+		const bool lower = y < 0.f;
+		const float scale = 1.f / (length + std::abs(y));
+		const float u = x * scale;
+		const float v = (lower ? -z : z) * scale;
+		out_face = 0;
+		out_s = std::min(std::max(0.5f * (u + 1.f), 0.f), 1.f);
+		out_t = std::min(std::max(0.25f * (v + (lower ? 3.f : 1.f)), lower ? 0.5f : 0.f), lower ? 1.f : 0.5f);
+		return;
+	}
+	default: {
+		const float l1 = std::abs(x) + std::abs(y) + std::abs(z);
+		float u = x / l1;
+		float v = z / l1;
+		if (y < 0.f)
+			foldOctahedron(u, v);
+		out_face = 0;
+		out_s = std::min(std::max(0.5f * (u + 1.f), 0.f), 1.f);
+		out_t = std::min(std::max(0.5f * (v + 1.f), 0.f), 1.f);
+		return;
+	}
+	}
+}
+
+float coarsestPixelAngle(Mapping mapping, int width, int height) {
+	// Largest pixel solid angle times the pixel count, at the centre of a
+	// cube face, on the equator of the equirect mappings, at the centres of
+	// the octahedron's faces and at the poles of the paraboloids.
+	float area;
+	switch (mapping) {
+	case MAPPING_CUBE:             area = 4.f; break;
+	case MAPPING_EQUIRECT:         area = 2.f * m_pi * m_pi; break;
+	case MAPPING_DOME:             area = m_pi * m_pi; break;
+	case MAPPING_OCTAHEDRAL:       area = 12.f * std::sqrt(3.f); break;
+	default:                       area = 32.f; break;
+	}
+	return std::sqrt(area / (float(width) * height));
+}
+
+int matchingSize(Mapping source, int width, int height, Mapping target) {
+	const float source_angle = coarsestPixelAngle(source, width, height);
+	const float unit_angle = coarsestPixelAngle(target, 1, mappingRows(target, 1) / mappingFaces(target));
+	return std::max(static_cast<int>(std::ceil(unit_angle / source_angle - 1e-3f)), 1);
+}
+
+void projectDirections(Mapping mapping, int count, const float* vx, const float* vy, const float* vz,
+	uint8_t* out_face, float* out_s, float* out_t)
+{
+	for (int i = 0; i < count; ++i) {
+		int face;
+		mappingCoords(mapping, vx[i], vy[i], vz[i], face, out_s[i], out_t[i]);
+		out_face[i] = static_cast<uint8_t>(face);
+	}
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+// Ways of laying out the sphere of directions in images. Any of them can be
+// the input (see Cubemap::layout) or the output (see DirectionTables) of a
+// conversion. Images are addressed by face and by s and t in [0, 1] from the
+// top-left corner; every mapping but the cube has a single face.
+enum Mapping {
+	// Six square faces in the order +X -X +Y -Y +Z -Z.
+	MAPPING_CUBE,
+	// Longitude across, from -180 degrees at the left edge, and latitude
+	// down, from +Y at the top edge to -Y at the bottom.
+	MAPPING_EQUIRECT,
+	// The upper half of the equirect mapping: +Y at the top edge, the
+	// horizon at the bottom.
+	MAPPING_DOME,
+	// The sphere projected onto the octahedron |x| + |y| + |z| = 1 and
+	// unfolded into a square, +Y at the centre and -Y at the corners.
+	MAPPING_OCTAHEDRAL,
+	// Two paraboloid discs in an image twice as tall as it is wide: the
+	// upper hemisphere seen from above in the top half and the lower one
+	// mirrored below it, so both discs touch +Z where they meet. The
+	// corners outside the discs continue into the other hemisphere.
+	MAPPING_DUAL_PARABOLOID,
+	NUM_MAPPINGS
+};
+
+const char* mappingName(Mapping mapping);
+
+// Looks up a mapping by the name mappingName gives it.
+bool findMapping(const std::string& name, Mapping& out_mapping);
+
+inline int mappingFaces(Mapping mapping) {
+	return mapping == MAPPING_CUBE ? 6 : 1;
+}
+
+// Image rows of a mapping whose faces are size pixels across, all faces
+// stacked top to bottom in face order.
+inline int mappingRows(Mapping mapping, int size) {
+	return mapping == MAPPING_DUAL_PARABOLOID ? 2 * size : size * mappingFaces(mapping);
+}
+
+// Square root of the largest solid angle any pixel covers in a face of the
+// mapping with width x height pixels: the angular resolution where it is
+// coarsest.
+float coarsestPixelAngle(Mapping mapping, int width, int height);
+
+// The smallest face size for target that is nowhere coarser than a source
+// with faces of width x height pixels, so that converting loses no detail.
+int matchingSize(Mapping source, int width, int height, Mapping target);
+
+// A point in the direction through (s, t) of face. s and t may lie past the
+// edges, where cube faces continue their plane and the other mappings
+// continue their formulas, which for the equirect and dome mappings run over
+// the poles, for the octahedral one folds back along the edges and for the
+// paraboloids curves into the other hemisphere, so projecting the point
+// again lands on the texel across the edge. The point is not normalized.
+void mappingDirection(Mapping mapping, int face, float s, float t, float& out_x, float& out_y, float& out_z);
+
+// Moves the part of the octahedron below y = 0 out to the corners of the
+// square and back; the fold is its own inverse.
+inline void foldOctahedron(float& u, float& v) {
+	const float folded_u = (1.f - std::abs(v)) * (u < 0.f ? -1.f : 1.f);
+	const float folded_v = (1.f - std::abs(u)) * (v < 0.f ? -1.f : 1.f);
+	u = folded_u;
+	v = folded_v;
+}
+
+// mappingDirection for a mapping fixed at compile time, so that loops over
+// many directions can inline it. The equirect and dome mappings call into
+// libm anyway and stay out of line.
+template <Mapping M>
+inline void mappingDirectionOf(int face, float s, float t, float& out_x, float& out_y, float& out_z) {
+	mappingDirection(M, face, s, t, out_x, out_y, out_z);
+}
+
+template <>
+inline void mappingDirectionOf<MAPPING_CUBE>(int face, float s, float t, float& out_x, float& out_y, float& out_z) {
+	const float sc = 2.f * s - 1.f;
+	const float tc = 2.f * t - 1.f;
+	switch (face) {
+	case 0:  out_x =  1.f; out_y = -tc; out_z = -sc; break; // +X
+	case 1:  out_x = -1.f; out_y = -tc; out_z =  sc; break; // -X
+	case 2:  out_x =  sc; out_y =  1.f; out_z =  tc; break; // +Y
+	case 3:  out_x =  sc; out_y = -1.f; out_z = -tc; break; // -Y
+	case 4:  out_x =  sc; out_y = -tc; out_z =  1.f; break; // +Z
+	default: out_x = -sc; out_y = -tc; out_z = -1.f; break; // -Z
+	}
+}
+
+template <>
+inline void mappingDirectionOf<MAPPING_OCTAHEDRAL>(int, float s, float t, float& out_x, float& out_y, float& out_z) {
+	float u = 2.f * s - 1.f;
+	float v = 2.f * t - 1.f;
+	out_y = 1.f - std::abs(u) - std::abs(v);
+	if (out_y < 0.f)
+		foldOctahedron(u, v);
+	out_x = u;
+	out_z = v;
+}
+
+template <>
+inline void mappingDirectionOf<MAPPING_DUAL_PARABOLOID>(int, float s, float t, float& out_x, float& out_y, float& out_z) {
+	// Points on the paraboloid 1/2 - (u^2 + v^2) / 2 over the unit disc,
+	// which past its rim curves on into the other hemisphere.
+	const bool lower = t >= 0.5f;
+	const float u = 2.f * s - 1.f;
+	const float v = lower ? 4.f * t - 3.f : 4.f * t - 1.f;
+	const float r2 = u * u + v * v;
+	out_x = u;
+	out_y = lower ? -0.5f * (1.f - r2) : 0.5f * (1.f - r2);
+	out_z = lower ? -v : v;
+}
+
+// Inverse of mappingDirection for s and t within the image. Takes any non-zero
+// length. For the dome mapping, directions below the horizon land on its
+// bottom edge.
+void mappingCoords(Mapping mapping, float x, float y, float z, int& out_face, float& out_s, float& out_t);
+
+// mappingCoords over count directions. Cube projection is what the sample
+// kernels vectorize; this is the scalar path for the other mappings.
+void projectDirections(Mapping mapping, int count, const float* vx, const float* vy, const float* vz,
+	uint8_t* out_face, float* out_s, float* out_t);
@@ -0,0 +1,150 @@
+#include "projection_lut.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+namespace {
+
+const char lut_magic[8] = { 'S', 'M', 'A', 'P', 'L', 'U', 'T', '3' };
+const u32 byte_order_mark = 0x01020304;
+
+struct LutFileHeader {
+	char magic[8];
+	u32 byte_order;
+	u32 output_size;
+	u32 num_samples;
+	u32 source;
+	u32 target;
+	u32 region_x, region_y;
+	u32 region_width, region_height;
+};
+
+} // namespace
+
+ProjectionLut::ProjectionLut() :
+	output_size(0), num_samples(0), source(MAPPING_CUBE), target(MAPPING_EQUIRECT), region()
+{}
+
+void ProjectionLut::build(ThreadPool& thread_pool, const RenderSettings& settings) {
+	output_size = settings.output_size;
+	num_samples = settings.num_aa_samples;
+	source = settings.source;
+	target = settings.target;
+	region = settings.region;
+	entries.resize(size_t(region.width) * region.height * num_samples * 2);
+
+	const int num_bands = (region.height + band_height - 1) / band_height;
+	band_faces.assign(num_bands, 0);
+
+	thread_pool.parallelFor(num_bands, [&](int band, int) {
+		const int row_samples = region.width * num_samples;
+		SampleBuffers buffers(row_samples);
+
+		const int y_begin = region.y + band * band_height;
+		const int y_end = std::min(y_begin + band_height, region.y + region.height);
+		unsigned faces = 0;
+
+		for (int y = y_begin; y < y_end; ++y) {
+			settings.directions->generate(y, region.x, region.x + region.width,
+				buffers.dir_x.data(), buffers.dir_y.data(), buffers.dir_z.data());
+			buffers.project(*settings.kernel, source, row_samples);
+			faces |= buffers.faceMask(row_samples);
+
+			u32* entry = &entries[size_t(y - region.y) * row_samples * 2];
+			for (int i = 0; i < row_samples; ++i, entry += 2) {
+				entry[0] = u32(buffers.face[i]) << coord_bits | quantize(buffers.s[i]);
+				entry[1] = quantize(buffers.t[i]);
+			}
+		}
+
+		band_faces[band] = static_cast<u8>(faces);
+	});
+}
+
+bool ProjectionLut::load(const std::string& filename, int new_output_size, int new_num_samples, Mapping new_source,
+	Mapping new_target, const OutputRegion& new_region)
+{
+	if (new_output_size <= 0 || new_num_samples <= 0 || new_region.x < 0 || new_region.y < 0
+		|| new_region.width <= 0 || new_region.height <= 0
+		|| u64(new_region.x) + u64(new_region.width) > u64(new_output_size)
+		|| u64(new_region.y) + u64(new_region.height) > u64(mappingRows(new_target, new_output_size)))
+	{
+		return false;
+	}
+
+	std::ifstream f(filename, std::ios::binary);
+	if (!f)
+		return false;
+
+	LutFileHeader header;
+	if (!f.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		return false;
+
+	if (!std::equal(lut_magic, lut_magic + sizeof(lut_magic), header.magic) || header.byte_order != byte_order_mark)
+		return false;
+
+	// Anything but the table asked for is stale, however well-formed.
+	if (header.output_size != u32(new_output_size) || header.num_samples != u32(new_num_samples)
+		|| header.source != u32(new_source) || header.target != u32(new_target)
+		|| header.region_x != u32(new_region.x) || header.region_y != u32(new_region.y)
+		|| header.region_width != u32(new_region.width) || header.region_height != u32(new_region.height))
+	{
+		return false;
+	}
+
+	// The file must hold exactly the header and the entries.
+	const u64 num_entries = u64(new_region.width) * u64(new_region.height) * u64(new_num_samples) * 2;
+	f.seekg(0, std::ios::end);
+	if (!f || u64(f.tellg()) != sizeof(header) + num_entries * sizeof(u32))
+		return false;
+	f.seekg(sizeof(header));
+
+	std::vector<u32> new_entries(num_entries);
+	if (!f.read(reinterpret_cast<char*>(new_entries.data()), new_entries.size() * sizeof(u32)))
+		return false;
+
+	for (size_t i = 0; i < new_entries.size(); i += 2) {
+		if ((new_entries[i] >> coord_bits) >= u32(mappingFaces(new_source)))
+			return false;
+	}
+
+	output_size = new_output_size;
+	num_samples = new_num_samples;
+	source = new_source;
+	target = new_target;
+	region = new_region;
+	entries.swap(new_entries);
+	computeBandFaces();
+	return true;
+}
+
+bool ProjectionLut::save(const std::string& filename) const {
+	std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+	if (!f)
+		return false;
+
+	LutFileHeader header;
+	std::copy(lut_magic, lut_magic + sizeof(lut_magic), header.magic);
+	header.byte_order = byte_order_mark;
+	header.output_size = output_size;
+	header.num_samples = num_samples;
+	header.source = source;
+	header.target = target;
+	header.region_x = region.x;
+	header.region_y = region.y;
+	header.region_width = region.width;
+	header.region_height = region.height;
+
+	f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	f.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(u32));
+	return f.good();
+}
+
+void ProjectionLut::computeBandFaces() {
+	const int num_bands = (region.height + band_height - 1) / band_height;
+	const size_t band_words = size_t(band_height) * region.width * num_samples * 2;
+	band_faces.assign(num_bands, 0);
+
+	for (size_t i = 0; i < entries.size(); i += 2)
+		band_faces[i / band_words] |= 1u << (entries[i] >> coord_bits);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "cubemap.hpp"
+#include "render.hpp"
+#include "thread_pool.hpp"
+
+// Precomputed mapping from every output sample to the (face, s, t) it reads.
+// The mapping only depends on the output size and region, the AA pattern and
+// the source and target mappings, never on the input faces, so one table
+// serves any number of inputs and rendering with it is just a gather and
+// blend per sample. That also takes the scalar projection of the non-cube
+// sources out of the render.
+//
+// Every sample takes two words: the face in the top 8 bits of the first word
+// and s and t as 24-bit unsigned fractions in the low bits of the two words.
+// 24 bits keep more sub-texel precision than the filter can use even for 16k
+// faces; output may still differ from direct projection by one LSB now and
+// then.
+class ProjectionLut {
+public:
+	ProjectionLut();
+
+	int outputSize() const { return output_size; }
+	int numSamples() const { return num_samples; }
+
+	bool matches(int output_size, int num_samples, Mapping source, Mapping target, const OutputRegion& region) const {
+		return this->output_size == output_size && this->num_samples == num_samples
+			&& this->source == source && this->target == target && this->region == region;
+	}
+
+	// Projects every sample of settings.region described by
+	// settings.directions.
+	void build(ThreadPool& thread_pool, const RenderSettings& settings);
+
+	// Reads a table written by save, which must be the one the arguments
+	// describe. Fails on I/O errors, malformed files and tables of any other
+	// output, before allocating anything for them.
+	bool load(const std::string& filename, int output_size, int num_samples, Mapping source, Mapping target,
+		const OutputRegion& region);
+	bool save(const std::string& filename) const;
+
+	// Faces referenced by any sample of a band of band_height rows, counted
+	// from the top of the region.
+	unsigned bandFaces(int band) const { return band_faces[band]; }
+
+	// Decodes the samples of pixels [x_begin, x_end) in row y, in the order
+	// DirectionTables::generate produces them. The pixels must lie in the
+	// region.
+	void unpack(int y, int x_begin, int x_end, u8* out_face, float* out_s, float* out_t) const {
+		const size_t first = (size_t(y - region.y) * region.width + (x_begin - region.x)) * num_samples;
+		const int count = (x_end - x_begin) * num_samples;
+		const u32* entry = &entries[first * 2];
+
+		for (int i = 0; i < count; ++i, entry += 2) {
+			out_face[i] = static_cast<u8>(entry[0] >> coord_bits);
+			out_s[i] = (entry[0] & coord_max) * (1.f / coord_max);
+			out_t[i] = (entry[1] & coord_max) * (1.f / coord_max);
+		}
+	}
+
+private:
+	static const int coord_bits = 24;
+	static const u32 coord_max = (1u << coord_bits) - 1;
+
+	static u32 quantize(float coord) {
+		const float scaled = coord * coord_max + 0.5f;
+		if (scaled <= 0.f)
+			return 0;
+
+		const u32 q = static_cast<u32>(scaled);
+		return q < coord_max ? q : coord_max;
+	}
+
+	void computeBandFaces();
+
+	int output_size;
+	int num_samples;
+	Mapping source, target;
+	OutputRegion region;
+	std::vector<u32> entries;
+	std::vector<u8> band_faces;
+};
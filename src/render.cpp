@@ -0,0 +1,974 @@
+#include "render.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "buffer_pool.hpp"
+#include "projection_lut.hpp"
+#include "stats.hpp"
+
+constexpr float aa_pattern_none[2] = { 0.f, 0.f };
+constexpr float aa_pattern_5x[5 * 2] = {
+	0.0f   , 0.0f   ,
+	-.1875f, -.375f ,
+	0.375f , -.1875f,
+	0.1875f, 0.375f ,
+	-.375f , 0.1875f,
+};
+
+constexpr float aa_pattern_16x[16 * 2] = {
+	-.375, -.375,
+	-.375, -.175,
+	-.375, 0.175,
+	-.375, 0.375,
+
+	-.175, -.375,
+	-.175, -.175,
+	-.175, 0.175,
+	-.175, 0.375,
+
+	0.125, -.375,
+	0.125, -.175,
+	0.125, 0.175,
+	0.125, 0.375,
+
+	0.375, -.375,
+	0.375, -.175,
+	0.375, 0.175,
+	0.375, 0.375,
+};
+
+constexpr float aa_pattern_corner[2] = { -.5f, -.5f };
+
+const float* aaSamplePattern(int num_samples) {
+	switch (num_samples) {
+	case 1:  return aa_pattern_none;
+	case 5:  return aa_pattern_5x;
+	case 16: return aa_pattern_16x;
+	default: return nullptr;
+	}
+}
+
+namespace {
+
+// The standard pattern of NumSamples samples, as a constant expression. 0
+// stands for any count, whose pattern is only known at run time.
+template <int NumSamples> constexpr const float* standardPattern();
+template <> constexpr const float* standardPattern<0>() { return nullptr; }
+template <> constexpr const float* standardPattern<1>() { return aa_pattern_none; }
+template <> constexpr const float* standardPattern<5>() { return aa_pattern_5x; }
+template <> constexpr const float* standardPattern<16>() { return aa_pattern_16x; }
+
+} // namespace
+
+template <int NumSamples>
+void DirectionTables::generateTables(int y, int x_begin, int x_end, float* out_x, float* out_y, float* out_z) const {
+	const int samples = NumSamples > 0 ? NumSamples : num_samples;
+
+	int i = 0;
+	for (int x = x_begin; x < x_end; ++x) {
+		for (int sample = 0; sample < samples; ++sample, ++i) {
+			const double cp = cos_phi[sample * count + y];
+			out_x[i] = static_cast<float>(cp * cos_theta[sample * count + x]);
+			out_y[i] = static_cast<float>(sin_phi[sample * count + y]);
+			out_z[i] = static_cast<float>(cp * sin_theta[sample * count + x]);
+		}
+	}
+}
+
+template <Mapping M, int NumSamples>
+void DirectionTables::generateUnwrapped(int y, int x_begin, int x_end, float* out_x, float* out_y, float* out_z) const {
+	const int samples = NumSamples > 0 ? NumSamples : num_samples;
+	const float* pattern = NumSamples > 0 ? standardPattern<NumSamples>() : offsets.data();
+
+	const int face_rows = mappingRows(M, size) / mappingFaces(M);
+	const int face = std::min(y / face_rows, mappingFaces(M) - 1);
+	const float face_y = float(y - face * face_rows);
+	const float output_pixel_size = 1.f / size;
+	const float output_row_size = 1.f / face_rows;
+
+	int i = 0;
+	for (int x = x_begin; x < x_end; ++x) {
+		for (int sample = 0; sample < samples; ++sample, ++i) {
+			const float s = (x + 0.5f + pattern[sample * 2 + 0]) * output_pixel_size;
+			const float t = (face_y + 0.5f + pattern[sample * 2 + 1]) * output_row_size;
+			mappingDirectionOf<M>(face, s, t, out_x[i], out_y[i], out_z[i]);
+		}
+	}
+}
+
+DirectionTables::DirectionTables(Mapping mapping, int size, int count, int num_samples, const float* sample_pattern) :
+	mapping(mapping), size(size), count(count), num_samples(num_samples)
+{
+	if (mapping != MAPPING_EQUIRECT && mapping != MAPPING_DOME) {
+		offsets.assign(sample_pattern, sample_pattern + num_samples * 2);
+
+		// Indexed [mapping][1, 5, 16 or other samples]; the equirect and dome
+		// rows are never used.
+		static const Generator unwrapped[NUM_MAPPINGS][4] = {
+			{ &DirectionTables::generateUnwrapped<MAPPING_CUBE, 1>, &DirectionTables::generateUnwrapped<MAPPING_CUBE, 5>,
+				&DirectionTables::generateUnwrapped<MAPPING_CUBE, 16>, &DirectionTables::generateUnwrapped<MAPPING_CUBE, 0> },
+			{ nullptr, nullptr, nullptr, nullptr },
+			{ nullptr, nullptr, nullptr, nullptr },
+			{ &DirectionTables::generateUnwrapped<MAPPING_OCTAHEDRAL, 1>, &DirectionTables::generateUnwrapped<MAPPING_OCTAHEDRAL, 5>,
+				&DirectionTables::generateUnwrapped<MAPPING_OCTAHEDRAL, 16>, &DirectionTables::generateUnwrapped<MAPPING_OCTAHEDRAL, 0> },
+			{ &DirectionTables::generateUnwrapped<MAPPING_DUAL_PARABOLOID, 1>, &DirectionTables::generateUnwrapped<MAPPING_DUAL_PARABOLOID, 5>,
+				&DirectionTables::generateUnwrapped<MAPPING_DUAL_PARABOLOID, 16>, &DirectionTables::generateUnwrapped<MAPPING_DUAL_PARABOLOID, 0> },
+		};
+		const int pattern_index = sample_pattern != aaSamplePattern(num_samples) ? 3
+			: num_samples == 1 ? 0 : num_samples == 5 ? 1 : 2;
+		generator = unwrapped[mapping][pattern_index];
+		return;
+	}
+
+	switch (num_samples) {
+	case 1:  generator = &DirectionTables::generateTables<1>; break;
+	case 5:  generator = &DirectionTables::generateTables<5>; break;
+	case 16: generator = &DirectionTables::generateTables<16>; break;
+	default: generator = &DirectionTables::generateTables<0>; break;
+	}
+
+	cos_theta.resize(count * num_samples);
+	sin_theta.resize(count * num_samples);
+	cos_phi.resize(count * num_samples);
+	sin_phi.resize(count * num_samples);
+
+	const float m_pi = static_cast<float>(std::acos(-1.0));
+	const float output_pixel_size = 1.f / size;
+
+	for (int sample = 0; sample < num_samples; ++sample) {
+		for (int i = 0; i < count; ++i) {
+			float s = unlerp(i, size) + sample_pattern[sample*2 + 0] * output_pixel_size;
+			float t = unlerp(i, size) + sample_pattern[sample*2 + 1] * output_pixel_size;
+
+			float scx = s * 2 - 1;
+			float scy = 1 - t * 2;
+			float theta = scx * m_pi;
+			float phi = mapping == MAPPING_DOME ? (1 - t) * m_pi / 2.f : scy * m_pi / 2.f;
+
+			cos_theta[sample * count + i] = std::cos(double(theta));
+			sin_theta[sample * count + i] = std::sin(double(theta));
+			cos_phi[sample * count + i] = std::cos(double(phi));
+			sin_phi[sample * count + i] = std::sin(double(phi));
+		}
+	}
+}
+
+float DirectionTables::pixelSolidAngle(float x, float row) const {
+	const float m_pi = static_cast<float>(std::acos(-1.0));
+	if (mapping == MAPPING_EQUIRECT)
+		return ::pixelSolidAngle(size, row);
+	if (mapping == MAPPING_DOME)
+		return std::cos((1.f - row / size) * m_pi / 2.f) * (2.f * m_pi / size) * (m_pi / 2.f / size);
+
+	// The other mappings have no simple closed form once the octahedron is
+	// folded, so take the area spanned by the directions half a pixel to
+	// either side of the centre.
+	const int face_rows = mappingRows(mapping, size) / mappingFaces(mapping);
+	const int face = std::min(static_cast<int>(row) / face_rows, mappingFaces(mapping) - 1);
+	const float face_row = row - face * face_rows;
+
+	float d[4][3];
+	const float points[4][2] = { { x - 0.5f, face_row }, { x + 0.5f, face_row }, { x, face_row - 0.5f }, { x, face_row + 0.5f } };
+	for (int i = 0; i < 4; ++i) {
+		mappingDirection(mapping, face, points[i][0] / size, points[i][1] / face_rows, d[i][0], d[i][1], d[i][2]);
+		const float inv_length = 1.f / std::sqrt(d[i][0] * d[i][0] + d[i][1] * d[i][1] + d[i][2] * d[i][2]);
+		for (float& c : d[i])
+			c *= inv_length;
+	}
+
+	const float a[3] = { d[1][0] - d[0][0], d[1][1] - d[0][1], d[1][2] - d[0][2] };
+	const float b[3] = { d[3][0] - d[2][0], d[3][1] - d[2][1], d[3][2] - d[2][2] };
+	const float cross[3] = { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+	return std::sqrt(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+}
+
+// Pixels whose samples go through the kernels together. Small enough for the
+// per-sample scratch arrays to stay in L1 even at 16x AA.
+//
+// Bands are walked one chunk column at a time, all of the band's rows before
+// moving right. Vertically adjacent pixels reuse most of each other's texels,
+// and a band_height x render_chunk_pixels block touches little enough of
+// the faces to stay in L2, where a whole row of a large output would not.
+static const int render_chunk_pixels = 64;
+
+// Chunks start at multiples of render_chunk_pixels wherever the region
+// begins, and mip footprints are taken at the centre of the whole chunk, so
+// a region gets exactly the pixels rendering all of the output would.
+static int chunkEnd(int chunk_x, int x_end) {
+	return std::min((chunk_x / render_chunk_pixels + 1) * render_chunk_pixels, x_end);
+}
+
+static float chunkCentre(int chunk_x, int row_size) {
+	const int chunk_start = chunk_x / render_chunk_pixels * render_chunk_pixels;
+	return (chunk_start + std::min(chunk_start + render_chunk_pixels, row_size)) * 0.5f;
+}
+
+// Solid angle each of samples_per_pixel samples covers in a pixel at
+// position (x, row), or 0 when not using mip levels.
+static float sampleFootprint(const RenderSettings& settings, float x, float row, int samples_per_pixel) {
+	return settings.mipmaps ? settings.directions->pixelSolidAngle(x, row) / samples_per_pixel : 0.f;
+}
+
+static inline int colorDifference(u32 a, u32 b) {
+	u8 ar, ag, ab, br, bg, bb;
+	splitColor(a, ar, ag, ab);
+	splitColor(b, br, bg, bb);
+	return std::max(std::abs(ar - br), std::max(std::abs(ag - bg), std::abs(ab - bb)));
+}
+
+namespace {
+
+// Adds the faces that the bilinear footprint of a sample at (s, t) of a cube
+// face reads to mask: the face itself and, where taps reach into its border,
+// the faces Cubemap::fillBorder copies those border texels from.
+void addFootprintFaces(int face, float s, float t, int width, int height, unsigned& mask) {
+	mask |= 1u << face;
+
+	const int tap_x = static_cast<int>(Cubemap::borderCoord(s, width)) - Cubemap::face_border;
+	const int tap_y = static_cast<int>(Cubemap::borderCoord(t, height)) - Cubemap::face_border;
+	if (tap_x >= 0 && tap_x + 1 < width && tap_y >= 0 && tap_y + 1 < height)
+		return;
+
+	for (int y = tap_y; y <= tap_y + 1; ++y) {
+		for (int x = tap_x; x <= tap_x + 1; ++x) {
+			if (x >= 0 && x < width && y >= 0 && y < height)
+				continue;
+
+			float dir_x, dir_y, dir_z;
+			mappingDirection(MAPPING_CUBE, face, (x + 0.5f) / width, (y + 0.5f) / height, dir_x, dir_y, dir_z);
+			int src_face;
+			float src_s, src_t;
+			mappingCoords(MAPPING_CUBE, dir_x, dir_y, dir_z, src_face, src_s, src_t);
+			mask |= 1u << src_face;
+		}
+	}
+}
+
+// What a band renders with besides its output. Every thread keeps its own
+// from one band to the next, and from job to job, so that rendering stops
+// allocating once each worker has done a band of the largest kind.
+struct BandScratch {
+	SampleBuffers samples, corner_samples;
+	// Corners of a row for adaptive AA, and its pixels that need more samples.
+	std::vector<u32> corners_top, corners_bottom;
+	std::vector<int> refine_x;
+	// Corner samples projected to guess the faces of a band that waits for
+	// faces to load.
+	SampleBuffers hint_samples;
+	// A block of a paged render, before it is copied into its output row.
+	std::vector<u32> block;
+
+	BandScratch() : samples(0), corner_samples(0), hint_samples(0) {}
+
+	static BandScratch& forThread() {
+		static thread_local BandScratch scratch;
+		return scratch;
+	}
+};
+
+// Gathers the faces that runs of pixels read for settings.tile_faces and
+// hands them over a tile at a time.
+struct TileFaceCollector {
+	TileFaceRecorder* recorder;
+	const Cubemap& cubemap;
+	int tile;
+	unsigned faces;
+
+	TileFaceCollector(const RenderSettings& settings, const Cubemap& cubemap) :
+		recorder(settings.tile_faces), cubemap(cubemap), tile(-1), faces(0)
+	{}
+
+	// Counts samples [first, first + count) of buffers for pixel (x, y).
+	void add(int x, int y, const SampleBuffers& buffers, int first, int count) {
+		const int pixel_tile = recorder->tileAt(x, y);
+		if (pixel_tile != tile) {
+			flush();
+			tile = pixel_tile;
+		}
+
+		for (int i = first; i < first + count; ++i)
+			faces |= 1u << buffers.face[i];
+		if (!recorder->recordsBorders() || cubemap.layout != MAPPING_CUBE)
+			return;
+
+		// The same test as addFootprintFaces, without leaving floats for the
+		// many samples whose taps are all inside the face.
+		for (int i = first; i < first + count; ++i) {
+			const int face = buffers.face[i];
+			const Image& img = cubemap.faces[face];
+			const float x = Cubemap::borderCoord(buffers.s[i], img.width);
+			const float y = Cubemap::borderCoord(buffers.t[i], img.height);
+			if (x < 1.f || x >= img.width || y < 1.f || y >= img.height)
+				addFootprintFaces(face, buffers.s[i], buffers.t[i], img.width, img.height, faces);
+		}
+	}
+
+	void flush() {
+		if (faces != 0)
+			recorder->add(tile, faces);
+		faces = 0;
+	}
+
+private:
+	TileFaceCollector(const TileFaceCollector&);
+	TileFaceCollector& operator= (const TileFaceCollector&);
+};
+
+} // namespace
+
+TileFaceRecorder::TileFaceRecorder(const RenderSettings& settings, int tile_size) :
+	region(settings.region), tile_size(tile_size),
+	tiles_x((region.width + tile_size - 1) / tile_size), tiles_y((region.height + tile_size - 1) / tile_size),
+	mipmaps(settings.mipmaps),
+	whole_faces(wholeOutputFaces(settings.source, settings.target, settings.mipmaps,
+		settings.adaptive_aa || settings.lut != nullptr)),
+	masks(new std::atomic<unsigned>[size_t(tiles_x) * tiles_y])
+{
+	for (int tile = 0; tile < numTiles(); ++tile)
+		masks[tile] = 0;
+}
+
+// The faces mipmapped sampling of the faces in mask may read. Every mip
+// level's border takes from the same level of the neighbours, and coarse
+// levels reach far enough that any of them may be read.
+static unsigned addMipNeighbours(unsigned mask) {
+	unsigned faces = mask;
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		if (mask & Cubemap::faceBit(Cubemap::CubeFace(f)))
+			faces |= Cubemap::all_faces & ~Cubemap::faceBit(Cubemap::CubeFace(f ^ 1));
+	}
+	return faces;
+}
+
+unsigned TileFaceRecorder::tileFaces(int tile) const {
+	const unsigned faces = masks[tile];
+	return (mipmaps ? addMipNeighbours(faces) : faces) & whole_faces;
+}
+
+template <int NumSamples, SampleFilter Filter>
+static void renderRowsFixed(const Cubemap& input_cubemap, const RenderSettings& settings, int y_begin, int y_end, u32* out_rows) {
+	const int output_size = settings.output_size;
+	const int num_aa_samples = NumSamples > 0 ? NumSamples : settings.num_aa_samples;
+	const int x_begin = settings.region.x;
+	const int x_end = x_begin + settings.region.width;
+	const int row_width = settings.region.width;
+
+	SampleBuffers& buffers = BandScratch::forThread().samples;
+	buffers.reset(render_chunk_pixels * num_aa_samples, settings.counters != nullptr);
+	TileFaceCollector tile_faces(settings, input_cubemap);
+
+	for (int chunk_x = x_begin; chunk_x < x_end; chunk_x = chunkEnd(chunk_x, x_end)) {
+		const int chunk_end = chunkEnd(chunk_x, x_end);
+
+		for (int y = y_begin; y < y_end; ++y) {
+			settings.directions->generate(y, chunk_x, chunk_end, buffers.dir_x.data(), buffers.dir_y.data(), buffers.dir_z.data());
+			buffers.sample(input_cubemap, *settings.kernel, Filter, (chunk_end - chunk_x) * num_aa_samples,
+				sampleFootprint(settings, chunkCentre(chunk_x, output_size), y + 0.5f, num_aa_samples));
+
+			for (int x = chunk_x; x < chunk_end; ++x)
+				out_rows[(y - y_begin) * row_width + (x - x_begin)] = averageSamples(Filter, &buffers.color[(x - chunk_x) * num_aa_samples], num_aa_samples);
+
+			if (settings.tile_faces != nullptr) {
+				for (int x = chunk_x; x < chunk_end; ++x)
+					tile_faces.add(x, y, buffers, (x - chunk_x) * num_aa_samples, num_aa_samples);
+			}
+		}
+	}
+
+	if (settings.counters != nullptr)
+		buffers.flushFaceHits(*settings.counters);
+	if (settings.tile_faces != nullptr)
+		tile_faces.flush();
+}
+
+template <int NumSamples, SampleFilter Filter>
+static void renderRowsAdaptive(const Cubemap& input_cubemap, const RenderSettings& settings, int y_begin, int y_end, u32* out_rows) {
+	const int output_size = settings.output_size;
+	const int num_aa_samples = NumSamples > 0 ? NumSamples : settings.num_aa_samples;
+	const int x_begin = settings.region.x;
+	const int x_end = x_begin + settings.region.width;
+	const int row_width = settings.region.width;
+
+	BandScratch& scratch = BandScratch::forThread();
+	SampleBuffers& corner_buffers = scratch.corner_samples;
+	SampleBuffers& buffers = scratch.samples;
+	corner_buffers.reset(render_chunk_pixels, settings.counters != nullptr);
+	buffers.reset(render_chunk_pixels * num_aa_samples, settings.counters != nullptr);
+	// Corners x_begin through x_end of a row.
+	std::vector<u32>& corners_top = scratch.corners_top;
+	std::vector<u32>& corners_bottom = scratch.corners_bottom;
+	corners_top.resize(row_width + 1);
+	corners_bottom.resize(row_width + 1);
+	std::vector<int>& refine_x = scratch.refine_x;
+	refine_x.reserve(render_chunk_pixels);
+	TileFaceCollector tile_faces(settings, input_cubemap);
+
+	// A chunk at a time, like the pixels, so footprints can follow mappings
+	// whose pixels change size along a row.
+	const auto sample_corner_row = [&](int corner_y, std::vector<u32>& out_corners) {
+		for (int chunk_x = x_begin; chunk_x <= x_end; chunk_x = chunkEnd(chunk_x, x_end + 1)) {
+			const int chunk_end = chunkEnd(chunk_x, x_end + 1);
+			settings.corner_directions->generate(corner_y, chunk_x, chunk_end,
+				corner_buffers.dir_x.data(), corner_buffers.dir_y.data(), corner_buffers.dir_z.data());
+			// Each pixel averages four corners that are each shared by four
+			// pixels, so a corner sample stands for a whole pixel.
+			corner_buffers.sample(input_cubemap, *settings.kernel, Filter, chunk_end - chunk_x,
+				sampleFootprint(settings, chunkCentre(chunk_x, output_size + 1), float(corner_y), 1));
+			std::copy(corner_buffers.color.begin(), corner_buffers.color.begin() + (chunk_end - chunk_x),
+				out_corners.begin() + (chunk_x - x_begin));
+
+			// A corner counts for the up to four pixels around it.
+			if (settings.tile_faces == nullptr)
+				continue;
+			for (int y = std::max(corner_y - 1, y_begin); y <= std::min(corner_y, y_end - 1); ++y) {
+				for (int corner_x = chunk_x; corner_x < chunk_end; ++corner_x) {
+					for (int x = std::max(corner_x - 1, x_begin); x <= std::min(corner_x, x_end - 1); ++x)
+						tile_faces.add(x, y, corner_buffers, corner_x - chunk_x, 1);
+				}
+			}
+		}
+	};
+
+	sample_corner_row(y_begin, corners_top);
+
+	for (int y = y_begin; y < y_end; ++y) {
+		sample_corner_row(y + 1, corners_bottom);
+
+		for (int chunk_x = x_begin; chunk_x < x_end; chunk_x = chunkEnd(chunk_x, x_end)) {
+			const int chunk_end = chunkEnd(chunk_x, x_end);
+
+			refine_x.clear();
+			for (int x = chunk_x; x < chunk_end; ++x) {
+				const int i = x - x_begin;
+				const u32 corners[4] = { corners_top[i], corners_top[i + 1], corners_bottom[i], corners_bottom[i + 1] };
+
+				int difference = 0;
+				for (int i = 1; i < 4; ++i) {
+					for (int j = 0; j < i; ++j)
+						difference = std::max(difference, colorDifference(corners[i], corners[j]));
+				}
+
+				if (difference > settings.aa_threshold)
+					refine_x.push_back(x);
+				else
+					out_rows[(y - y_begin) * row_width + i] = averageSamples(Filter, corners, 4);
+			}
+
+			if (refine_x.empty())
+				continue;
+
+			for (size_t i = 0; i < refine_x.size(); ++i) {
+				const int offset = static_cast<int>(i) * num_aa_samples;
+				settings.directions->generate(y, refine_x[i], refine_x[i] + 1,
+					&buffers.dir_x[offset], &buffers.dir_y[offset], &buffers.dir_z[offset]);
+			}
+			buffers.sample(input_cubemap, *settings.kernel, Filter, static_cast<int>(refine_x.size()) * num_aa_samples,
+				sampleFootprint(settings, chunkCentre(chunk_x, output_size), y + 0.5f, num_aa_samples));
+
+			for (size_t i = 0; i < refine_x.size(); ++i)
+				out_rows[(y - y_begin) * row_width + (refine_x[i] - x_begin)] = averageSamples(Filter, &buffers.color[i * num_aa_samples], num_aa_samples);
+
+			if (settings.tile_faces != nullptr) {
+				for (size_t i = 0; i < refine_x.size(); ++i)
+					tile_faces.add(refine_x[i], y, buffers, static_cast<int>(i) * num_aa_samples, num_aa_samples);
+			}
+		}
+
+		corners_top.swap(corners_bottom);
+	}
+
+	if (settings.counters != nullptr) {
+		corner_buffers.flushFaceHits(*settings.counters);
+		buffers.flushFaceHits(*settings.counters);
+	}
+	if (settings.tile_faces != nullptr)
+		tile_faces.flush();
+}
+
+template <int NumSamples, SampleFilter Filter>
+static void renderRowsLut(const Cubemap& input_cubemap, const RenderSettings& settings, int y_begin, int y_end, u32* out_rows) {
+	const int output_size = settings.output_size;
+	const int num_aa_samples = NumSamples > 0 ? NumSamples : settings.num_aa_samples;
+	const int x_begin = settings.region.x;
+	const int x_end = x_begin + settings.region.width;
+	const int row_width = settings.region.width;
+
+	SampleBuffers& buffers = BandScratch::forThread().samples;
+	buffers.reset(render_chunk_pixels * num_aa_samples, settings.counters != nullptr);
+	TileFaceCollector tile_faces(settings, input_cubemap);
+
+	for (int chunk_x = x_begin; chunk_x < x_end; chunk_x = chunkEnd(chunk_x, x_end)) {
+		const int chunk_end = chunkEnd(chunk_x, x_end);
+
+		for (int y = y_begin; y < y_end; ++y) {
+			settings.lut->unpack(y, chunk_x, chunk_end, buffers.face.data(), buffers.s.data(), buffers.t.data());
+			buffers.sampleProjected(input_cubemap, *settings.kernel, Filter, (chunk_end - chunk_x) * num_aa_samples,
+				sampleFootprint(settings, chunkCentre(chunk_x, output_size), y + 0.5f, num_aa_samples));
+
+			for (int x = chunk_x; x < chunk_end; ++x)
+				out_rows[(y - y_begin) * row_width + (x - x_begin)] = averageSamples(Filter, &buffers.color[(x - chunk_x) * num_aa_samples], num_aa_samples);
+
+			if (settings.tile_faces != nullptr) {
+				for (int x = chunk_x; x < chunk_end; ++x)
+					tile_faces.add(x, y, buffers, (x - chunk_x) * num_aa_samples, num_aa_samples);
+			}
+		}
+	}
+
+	if (settings.counters != nullptr)
+		buffers.flushFaceHits(*settings.counters);
+	if (settings.tile_faces != nullptr)
+		tile_faces.flush();
+}
+
+// rowRenderer picks the template arguments one at a time. A NumSamples of 0
+// renders whatever count settings has, for patterns other than the standard
+// ones.
+template <int NumSamples, SampleFilter Filter>
+static RowRenderer modeRenderer(const RenderSettings& settings) {
+	if (settings.lut != nullptr)
+		return renderRowsLut<NumSamples, Filter>;
+	if (settings.adaptive_aa)
+		return renderRowsAdaptive<NumSamples, Filter>;
+	return renderRowsFixed<NumSamples, Filter>;
+}
+
+template <int NumSamples>
+static RowRenderer filterRenderer(const RenderSettings& settings) {
+	switch (settings.filter) {
+	case FILTER_FIXED: return modeRenderer<NumSamples, FILTER_FIXED>(settings);
+	case FILTER_RGBE:  return modeRenderer<NumSamples, FILTER_RGBE>(settings);
+	case FILTER_SRGB:  return modeRenderer<NumSamples, FILTER_SRGB>(settings);
+	default:           return modeRenderer<NumSamples, FILTER_FLOAT>(settings);
+	}
+}
+
+RowRenderer rowRenderer(const RenderSettings& settings) {
+	switch (settings.num_aa_samples) {
+	case 1:  return filterRenderer<1>(settings);
+	case 5:  return filterRenderer<5>(settings);
+	case 16: return filterRenderer<16>(settings);
+	default: return filterRenderer<0>(settings);
+	}
+}
+
+void renderRows(const Cubemap& input_cubemap, const RenderSettings& settings, int y_begin, int y_end, u32* out_rows) {
+	rowRenderer(settings)(input_cubemap, settings, y_begin, y_end, out_rows);
+}
+
+namespace {
+
+// Adds the CPU time the calling thread spends in this scope to counters, if
+// there are any.
+struct ScopedCpuTime {
+	RenderCounters* counters;
+	double start;
+
+	explicit ScopedCpuTime(RenderCounters* counters) :
+		counters(counters), start(counters != nullptr ? threadCpuSeconds() : 0)
+	{}
+
+	~ScopedCpuTime() {
+		if (counters != nullptr)
+			counters->cpu_nanoseconds += static_cast<u64>((threadCpuSeconds() - start) * 1e9);
+	}
+
+private:
+	ScopedCpuTime(const ScopedCpuTime&);
+	ScopedCpuTime& operator= (const ScopedCpuTime&);
+};
+
+} // namespace
+
+// Faces hit by the top and bottom corner rows of a band. In equirect output
+// faces cover contiguous latitude ranges, so this is nearly always exactly
+// the set the band needs; other mappings may miss some. It is only used to
+// order work, SampleBuffers::sample still waits for whatever a chunk really
+// touches.
+static unsigned estimateBandFaces(const RenderSettings& settings, int y_begin, int y_end, SampleBuffers& buffers) {
+	const int corner_row_size = settings.region.width + 1;
+
+	unsigned mask = 0;
+	for (int corner_y : { y_begin, y_end }) {
+		settings.corner_directions->generate(corner_y, settings.region.x, settings.region.x + corner_row_size,
+			buffers.dir_x.data(), buffers.dir_y.data(), buffers.dir_z.data());
+		buffers.project(*settings.kernel, settings.source, corner_row_size);
+		mask |= buffers.faceMask(corner_row_size);
+	}
+	return mask;
+}
+
+void renderImage(ThreadPool& thread_pool, const Cubemap& input_cubemap, const RenderSettings& settings, u32* out_data) {
+	const int row_width = settings.region.width;
+	const int region_end = settings.region.y + settings.region.height;
+	const int num_bands = (settings.region.height + band_height - 1) / band_height;
+
+	std::atomic<int> next_band(0);
+	std::mutex deferred_mutex;
+	std::vector<std::pair<int, unsigned>> deferred_bands;
+
+	const RowRenderer render_rows = rowRenderer(settings);
+	const auto render_band = [&](int band) {
+		int y_begin = settings.region.y + band * band_height;
+		int y_end = std::min(y_begin + band_height, region_end);
+		render_rows(input_cubemap, settings, y_begin, y_end, out_data + size_t(band) * band_height * row_width);
+	};
+
+	thread_pool.run([&](int) {
+		const ScopedCpuTime cpu_time(settings.counters);
+		SampleBuffers& hint_buffers = BandScratch::forThread().hint_samples;
+		hint_buffers.reset(row_width + 1, false);
+
+		for (;;) {
+			const int band = next_band.fetch_add(1);
+			if (band < num_bands) {
+				if (input_cubemap.readyFaces() == Cubemap::all_faces) {
+					render_band(band);
+					continue;
+				}
+
+				int y_begin = settings.region.y + band * band_height;
+				int y_end = std::min(y_begin + band_height, region_end);
+				unsigned needed = settings.lut != nullptr ? settings.lut->bandFaces(band)
+					: estimateBandFaces(settings, y_begin, y_end, hint_buffers);
+
+				if ((input_cubemap.readyFaces() & needed) == needed) {
+					render_band(band);
+				} else {
+					std::lock_guard<std::mutex> lock(deferred_mutex);
+					deferred_bands.push_back(std::make_pair(band, needed));
+				}
+				continue;
+			}
+
+			const unsigned ready = input_cubemap.readyFaces();
+			int deferred_band = -1;
+			{
+				std::lock_guard<std::mutex> lock(deferred_mutex);
+				if (deferred_bands.empty())
+					return;
+
+				for (size_t i = 0; i < deferred_bands.size(); ++i) {
+					if ((ready & deferred_bands[i].second) == deferred_bands[i].second) {
+						deferred_band = deferred_bands[i].first;
+						deferred_bands.erase(deferred_bands.begin() + i);
+						break;
+					}
+				}
+			}
+
+			if (deferred_band >= 0)
+				render_band(deferred_band);
+			else
+				input_cubemap.waitForMoreFaces(ready);
+		}
+	});
+}
+
+namespace {
+
+// Paged faces are read a tile at a time, which full-width bands would walk
+// through all of before coming back for the next band. Instead the region
+// renders in square blocks, a row of them at a time and every other row
+// from right to left, so the tiles a block reads are mostly still cached for
+// the next one and those at the end of a row for the start of the next.
+const int paged_block_size = 128;
+
+void renderBlocksStreamed(ThreadPool& thread_pool, const Cubemap& input_cubemap, const RenderSettings& settings,
+	const RowSink& emit_rows)
+{
+	const OutputRegion& region = settings.region;
+	// Blocks are aligned to the whole output, which keeps them aligned to the
+	// chunks.
+	const int first_column = region.x / paged_block_size;
+	const int blocks_x = (region.x + region.width - 1) / paged_block_size - first_column + 1;
+	const int num_rows = (region.height + paged_block_size - 1) / paged_block_size;
+	const size_t row_pixels = size_t(paged_block_size) * region.width;
+
+	// Block row r renders into slot r % 2 once row r - 2 is written.
+	PooledArray<u32> slots(row_pixels * 2);
+	int blocks_done[2] = { 0, 0 };
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	int next_block = 0;
+	int rows_written = 0;
+
+	const RowRenderer render_rows = rowRenderer(settings);
+	std::thread writer([&] {
+		for (int row = 0; row < num_rows; ++row) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] { return blocks_done[row % 2] == blocks_x; });
+			}
+
+			const int y_begin = row * paged_block_size;
+			const int y_end = std::min(y_begin + paged_block_size, region.height);
+			emit_rows(y_begin, y_end, &slots[row % 2 * row_pixels]);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				blocks_done[row % 2] = 0;
+				rows_written = row + 1;
+			}
+			cv.notify_all();
+		}
+	});
+
+	thread_pool.run([&](int) {
+		const ScopedCpuTime cpu_time(settings.counters);
+		std::vector<u32>& block = BandScratch::forThread().block;
+		block.resize(size_t(paged_block_size) * paged_block_size);
+
+		for (;;) {
+			int index;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (next_block >= num_rows * blocks_x)
+					return;
+
+				index = next_block++;
+				cv.wait(lock, [&] { return index / blocks_x < rows_written + 2; });
+			}
+
+			const int row = index / blocks_x;
+			const int column = first_column + (row % 2 == 0 ? index % blocks_x : blocks_x - 1 - index % blocks_x);
+			RenderSettings block_settings = settings;
+			OutputRegion& block_region = block_settings.region;
+			block_region.x = std::max(column * paged_block_size, region.x);
+			block_region.width = std::min((column + 1) * paged_block_size, region.x + region.width) - block_region.x;
+			block_region.y = region.y + row * paged_block_size;
+			block_region.height = std::min(paged_block_size, region.y + region.height - block_region.y);
+
+			const int y_end = block_region.y + block_region.height;
+			for (int y = block_region.y; y < y_end; y += band_height) {
+				render_rows(input_cubemap, block_settings, y, std::min(y + band_height, y_end),
+					&block[size_t(y - block_region.y) * block_region.width]);
+			}
+
+			u32* slot = &slots[row % 2 * row_pixels];
+			for (int y = 0; y < block_region.height; ++y) {
+				const u32* src = &block[size_t(y) * block_region.width];
+				std::copy(src, src + block_region.width, &slot[size_t(y) * region.width + (block_region.x - region.x)]);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				++blocks_done[row % 2];
+			}
+			cv.notify_all();
+		}
+	});
+
+	writer.join();
+}
+
+} // namespace
+
+void renderImageStreamed(ThreadPool& thread_pool, const Cubemap& input_cubemap, const RenderSettings& settings,
+	const RowSink& emit_rows)
+{
+	if (input_cubemap.paged_faces != nullptr) {
+		renderBlocksStreamed(thread_pool, input_cubemap, settings, emit_rows);
+		return;
+	}
+
+	const int region_height = settings.region.height;
+	const int num_bands = (region_height + band_height - 1) / band_height;
+	const size_t band_pixels = size_t(band_height) * settings.region.width;
+
+	// Band b renders into slot b % window once band b - window is written.
+	const int window = std::min(num_bands, 2 * thread_pool.size() + 1);
+	PooledArray<u32> slots(band_pixels * window);
+	std::vector<bool> slot_done(window, false);
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	int next_band = 0;
+	int bands_written = 0;
+
+	const RowRenderer render_rows = rowRenderer(settings);
+	std::thread writer([&] {
+		for (int band = 0; band < num_bands; ++band) {
+			const int slot = band % window;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] { return slot_done[slot]; });
+			}
+
+			int y_begin = band * band_height;
+			int y_end = std::min(y_begin + band_height, region_height);
+			emit_rows(y_begin, y_end, &slots[slot * band_pixels]);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				slot_done[slot] = false;
+				bands_written = band + 1;
+			}
+			cv.notify_all();
+		}
+	});
+
+	thread_pool.run([&](int) {
+		const ScopedCpuTime cpu_time(settings.counters);
+
+		for (;;) {
+			int band;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (next_band >= num_bands)
+					return;
+
+				band = next_band++;
+				cv.wait(lock, [&] { return band < bands_written + window; });
+			}
+
+			const int slot = band % window;
+			int y_begin = settings.region.y + band * band_height;
+			int y_end = std::min(y_begin + band_height, settings.region.y + region_height);
+			render_rows(input_cubemap, settings, y_begin, y_end, &slots[slot * band_pixels]);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				slot_done[slot] = true;
+			}
+			cv.notify_all();
+		}
+	});
+
+	writer.join();
+}
+
+RowDownsampler::RowDownsampler(SampleFilter filter, int width, const RowSink& emit_rows) :
+	filter(filter), width(width), emit_rows(emit_rows), pending(width), has_pending(false), out_y(0)
+{}
+
+void RowDownsampler::addRows(int y_begin, int y_end, const u32* rows) {
+	out_rows.clear();
+	for (int y = y_begin; y < y_end; ++y) {
+		const u32* row = rows + size_t(y - y_begin) * width;
+		if (has_pending) {
+			emitRow(pending.data(), row);
+			has_pending = false;
+		} else if (y + 1 < y_end) {
+			emitRow(row, row + width);
+			++y;
+		} else {
+			std::copy(row, row + width, pending.begin());
+			has_pending = true;
+		}
+	}
+
+	if (!out_rows.empty()) {
+		const int count = static_cast<int>(out_rows.size()) / (width / 2);
+		emit_rows(out_y, out_y + count, out_rows.data());
+		out_y += count;
+	}
+}
+
+void RowDownsampler::emitRow(const u32* top, const u32* bottom) {
+	for (int x = 0; x + 1 < width; x += 2) {
+		const u32 block[4] = { top[x], top[x + 1], bottom[x], bottom[x + 1] };
+		out_rows.push_back(averageSamples(filter, block, 4));
+	}
+}
+
+unsigned wholeOutputFaces(Mapping source, Mapping target, bool mipmaps, bool on_horizon) {
+	const unsigned used = Cubemap::all_faces & ~Cubemap::unusedFaces(source);
+	if (source != MAPPING_CUBE || target != MAPPING_DOME)
+		return used;
+
+	// Samples above the horizon stay in the upper half of the side faces, so
+	// even the 1x1 mip level only reads the top border. On the horizon, a
+	// coarse level's bottom border may get some weight.
+	if (mipmaps && on_horizon)
+		return used;
+	return used & ~Cubemap::faceBit(Cubemap::FACE_NEG_Y);
+}
+
+unsigned regionFaces(ThreadPool& thread_pool, const RenderSettings& settings,
+	const int (&face_width)[Cubemap::NUM_FACES], const int (&face_height)[Cubemap::NUM_FACES])
+{
+	const unsigned whole_faces = wholeOutputFaces(settings.source, settings.target, settings.mipmaps,
+		settings.adaptive_aa || settings.lut != nullptr);
+	if (settings.source != MAPPING_CUBE)
+		return whole_faces;
+
+	// Samples on a face of unknown size may reach through any of its edges.
+	unsigned unknown_mask = 0;
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		if (face_width[f] < 1 || face_height[f] < 1)
+			unknown_mask |= Cubemap::faceBit(Cubemap::CubeFace(f));
+	}
+	if (unknown_mask == Cubemap::all_faces)
+		return whole_faces;
+
+	const OutputRegion& region = settings.region;
+	const int num_bands = (region.height + band_height - 1) / band_height;
+	std::vector<unsigned> worker_masks(thread_pool.size(), 0);
+
+	thread_pool.parallelFor(num_bands, [&](int band, int worker) {
+		const int num_samples = settings.num_aa_samples;
+		SampleBuffers& buffers = BandScratch::forThread().samples;
+		buffers.reset(std::max(render_chunk_pixels * num_samples, render_chunk_pixels + 1), false);
+		unsigned mask = 0;
+
+		const auto add_samples = [&](int count) {
+			for (int i = 0; i < count; ++i) {
+				const int face = buffers.face[i];
+				if (unknown_mask & Cubemap::faceBit(Cubemap::CubeFace(face))) {
+					mask |= Cubemap::all_faces & ~Cubemap::faceBit(Cubemap::CubeFace(face ^ 1));
+					continue;
+				}
+				addFootprintFaces(face, buffers.s[i], buffers.t[i], face_width[face], face_height[face], mask);
+			}
+		};
+
+		const int y_begin = region.y + band * band_height;
+		const int y_end = std::min(y_begin + band_height, region.y + region.height);
+		for (int y = y_begin; y < y_end; ++y) {
+			for (int chunk_x = region.x; chunk_x < region.x + region.width; chunk_x += render_chunk_pixels) {
+				const int chunk_end = std::min(chunk_x + render_chunk_pixels, region.x + region.width);
+				const int count = (chunk_end - chunk_x) * num_samples;
+				if (settings.lut != nullptr) {
+					settings.lut->unpack(y, chunk_x, chunk_end, buffers.face.data(), buffers.s.data(), buffers.t.data());
+				} else {
+					settings.directions->generate(y, chunk_x, chunk_end, buffers.dir_x.data(), buffers.dir_y.data(), buffers.dir_z.data());
+					buffers.project(*settings.kernel, settings.source, count);
+				}
+				add_samples(count);
+			}
+
+			// Adaptive AA samples the corners of every pixel too, the row
+			// below the band's last one included.
+			if (!settings.adaptive_aa)
+				continue;
+			for (int corner_y = y; corner_y <= (y + 1 == y_end ? y + 1 : y); ++corner_y) {
+				for (int chunk_x = region.x; chunk_x <= region.x + region.width; chunk_x += render_chunk_pixels + 1) {
+					const int chunk_end = std::min(chunk_x + render_chunk_pixels + 1, region.x + region.width + 1);
+					settings.corner_directions->generate(corner_y, chunk_x, chunk_end,
+						buffers.dir_x.data(), buffers.dir_y.data(), buffers.dir_z.data());
+					buffers.project(*settings.kernel, settings.source, chunk_end - chunk_x);
+					add_samples(chunk_end - chunk_x);
+				}
+			}
+		}
+
+		worker_masks[worker] |= mask;
+	});
+
+	unsigned mask = 0;
+	for (unsigned worker_mask : worker_masks)
+		mask |= worker_mask;
+
+	if (settings.mipmaps)
+		mask = addMipNeighbours(mask);
+	return mask & whole_faces;
+}
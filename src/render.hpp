@@ -0,0 +1,463 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "cubemap.hpp"
+#include "face_tiles.hpp"
+#include "projection.hpp"
+#include "sample_kernels.hpp"
+#include "thread_pool.hpp"
+
+class ProjectionLut;
+
+inline float unlerp(int val, int max) {
+	return (val + 0.5f) / max;
+}
+
+// Solid angle of an equirect output pixel whose centre lies at row position
+// row, counted in pixels from the top edge. Longitude steps are 2 pi / size
+// and latitude steps pi / size, shrunk by the cosine of the latitude.
+inline float pixelSolidAngle(int size, float row) {
+	const float m_pi = static_cast<float>(std::acos(-1.0));
+	const float phi = (1.f - 2.f * row / size) * m_pi / 2.f;
+	return std::cos(phi) * (2.f * m_pi / size) * (m_pi / size);
+}
+
+// Sample offsets from the pixel center, in pixels, as x, y pairs. They are
+// constexpr where render.cpp defines them, so directions generated for the
+// pattern of a known sample count take the offsets as constants.
+extern const float aa_pattern_none[2];
+extern const float aa_pattern_5x[5 * 2];
+extern const float aa_pattern_16x[16 * 2];
+
+// The pattern for 1, 5 or 16 samples, or nullptr for any other count.
+const float* aaSamplePattern(int num_samples);
+
+// Offset of a pixel's top-left corner from its center, as a one-entry
+// pattern. Used to build the corner grid for adaptive AA.
+extern const float aa_pattern_corner[2];
+
+// Directions through the samples of every output pixel of a mapping.
+//
+// The equirect and dome mappings use separable sin/cos tables. The longitude
+// (theta) only depends on the output column and the latitude (phi) only on
+// the row, so a direction is composed from one column and one row entry
+// instead of calling into libm for every sample. Each AA pattern entry gets
+// its own pair of tables, indexed [sample * count + column/row], with the
+// entry's jitter offset already folded into the angles. The tables are kept
+// in double precision, matching the libm calls they replace.
+//
+// Octahedral, paraboloid and cube directions take a few adds and no libm
+// calls, so they are computed on the fly. Either way generate goes through a
+// loop specialized for the mapping and sample count, picked once when the
+// tables are built.
+struct DirectionTables {
+	Mapping mapping;
+	int size;
+	int count;
+	int num_samples;
+	std::vector<double> cos_theta, sin_theta;
+	std::vector<double> cos_phi, sin_phi;
+	std::vector<float> offsets;
+
+	// Covers the first count columns of the output's faces, which are size
+	// pixels across, and their first count rows. count may be size + 1 to
+	// cover the far edges with corner samples; for the cube, the extra row
+	// only lies below the last face.
+	DirectionTables(Mapping mapping, int size, int count, int num_samples, const float* sample_pattern);
+
+	// Writes the num_samples directions of every pixel in [x_begin, x_end) of
+	// row y, pixel-major.
+	void generate(int y, int x_begin, int x_end, float* out_x, float* out_y, float* out_z) const {
+		(this->*generator)(y, x_begin, x_end, out_x, out_y, out_z);
+	}
+
+	// Solid angle of the output pixel centred at (x, row), in pixels from
+	// the top-left corner.
+	float pixelSolidAngle(float x, float row) const;
+
+private:
+	typedef void (DirectionTables::*Generator)(int y, int x_begin, int x_end, float* out_x, float* out_y, float* out_z) const;
+
+	// The loops behind generate, unrolled over the samples of a pixel. The
+	// tables only need NumSamples to match num_samples; computed directions
+	// also take their offsets from the standard pattern of that count. A
+	// NumSamples of 0 reads both at run time, for any other count or pattern.
+	template <int NumSamples>
+	void generateTables(int y, int x_begin, int x_end, float* out_x, float* out_y, float* out_z) const;
+	template <Mapping M, int NumSamples>
+	void generateUnwrapped(int y, int x_begin, int x_end, float* out_x, float* out_y, float* out_z) const;
+
+	// Picked when the tables are built.
+	Generator generator;
+
+	DirectionTables(const DirectionTables&);
+	DirectionTables& operator= (const DirectionTables&);
+};
+
+// Filled in while rendering when RenderSettings::counters is set, for -stats.
+// Workers accumulate into their own buffers and only add them in here once
+// per band, so the counters are cheap even when shared.
+struct RenderCounters {
+	std::atomic<u64> face_hits[Cubemap::NUM_FACES];
+	std::atomic<u64> cpu_nanoseconds;
+
+	RenderCounters() : cpu_nanoseconds(0) {
+		for (std::atomic<u64>& hits : face_hits)
+			hits = 0;
+	}
+
+private:
+	RenderCounters(const RenderCounters&);
+	RenderCounters& operator= (const RenderCounters&);
+};
+
+// A rectangle of an output image, in pixels from its top-left corner. For
+// cube outputs, rows run through all six faces stacked top to bottom.
+struct OutputRegion {
+	int x, y;
+	int width, height;
+
+	bool operator== (const OutputRegion& o) const {
+		return x == o.x && y == o.y && width == o.width && height == o.height;
+	}
+	bool operator!= (const OutputRegion& o) const { return !(*this == o); }
+};
+
+// The whole of an output of mapping whose faces are size pixels across.
+inline OutputRegion wholeOutput(Mapping mapping, int size) {
+	const OutputRegion region = { 0, 0, size, mappingRows(mapping, size) };
+	return region;
+}
+
+struct RenderSettings;
+
+// Filled in while rendering when RenderSettings::tile_faces is set: the
+// faces each tile_size square of region takes texels from, with tiles
+// counted row by row from the region's top-left corner. Every pixel comes
+// out the same however the output is cut up, so a tile reads just these
+// faces when it is rendered on its own too.
+class TileFaceRecorder {
+public:
+	// Covers settings.region, rendered with settings.
+	TileFaceRecorder(const RenderSettings& settings, int tile_size);
+
+	int numTiles() const { return tiles_x * tiles_y; }
+	int tileAt(int x, int y) const { return (y - region.y) / tile_size * tiles_x + (x - region.x) / tile_size; }
+
+	// With mipmaps, only the faces the samples land on are recorded: any mip
+	// level's border may be read, so tileFaces adds their neighbours.
+	bool recordsBorders() const { return !mipmaps; }
+
+	void add(int tile, unsigned faces) {
+		if ((masks[tile].load(std::memory_order_relaxed) & faces) != faces)
+			masks[tile].fetch_or(faces, std::memory_order_relaxed);
+	}
+
+	unsigned tileFaces(int tile) const;
+
+private:
+	TileFaceRecorder(const TileFaceRecorder&);
+	TileFaceRecorder& operator= (const TileFaceRecorder&);
+
+	OutputRegion region;
+	int tile_size;
+	int tiles_x, tiles_y;
+	bool mipmaps;
+	unsigned whole_faces;
+	std::unique_ptr<std::atomic<unsigned>[]> masks;
+};
+
+struct RenderSettings {
+	// Faces of the output are output_size pixels across; see mappingRows.
+	int output_size;
+	// The part of the output that is rendered. Rows are handed out region.width
+	// pixels wide, starting with row region.y.
+	OutputRegion region;
+	// Layouts of the cubemap's faces and of the output. directions must have
+	// been built for target.
+	Mapping source;
+	Mapping target;
+	int num_aa_samples;
+	const DirectionTables* directions;
+	const SampleKernel* kernel;
+	// FILTER_RGBE exactly when the cubemap holds TEXELS_RGBE, and then output
+	// pixels are RGBE too; likewise FILTER_SRGB and TEXELS_SRGB8.
+	SampleFilter filter;
+
+	// Trilinear filtering from the cubemap's mip levels, picked from the area
+	// each sample covers. The cubemap must have been built with them.
+	bool mipmaps;
+
+	// Samples at the pixel corners; size + 1 entries in each direction.
+	const DirectionTables* corner_directions;
+
+	// Adaptive AA: each pixel first takes the four samples at its corners
+	// (shared with its neighbours) and only falls back to the full directions
+	// pattern if any channel of those differs by more than aa_threshold.
+	bool adaptive_aa;
+	int aa_threshold;
+
+	// When set, samples are taken from this precomputed projection instead of
+	// directions; see projection_lut.hpp.
+	const ProjectionLut* lut;
+
+	// Optional; nullptr skips all counting.
+	RenderCounters* counters;
+
+	// Optional; nullptr records nothing.
+	TileFaceRecorder* tile_faces;
+
+	int outputRows() const { return mappingRows(target, output_size); }
+};
+
+// Rows handed to a worker at a time. Every pixel is computed independently,
+// so the output doesn't depend on how many workers share the bands.
+const int band_height = 8;
+
+inline u32 averageColors(const u32* colors, int count) {
+	// Red and blue are summed side by side in the 16-bit halves of one word,
+	// which can't carry into each other for fewer than 257 samples.
+	u32 sum_rb = 0, sum_g = 0;
+
+	for (int i = 0; i < count; ++i) {
+		sum_rb += colors[i] & 0x00FF00FF;
+		sum_g += colors[i] >> 8 & 0xFF;
+	}
+
+	return makeColor((sum_rb & 0xFFFF) / count, sum_g / count, (sum_rb >> 16) / count);
+}
+
+inline u32 averageRgbe(const u32* colors, int count) {
+	Colorf sum(0.f, 0.f, 0.f);
+	for (int i = 0; i < count; ++i) {
+		const Colorf col = Colorf::fromRgbe(colors[i]);
+		sum = Colorf(sum.r + col.r, sum.g + col.g, sum.b + col.b);
+	}
+
+	const float scale = 1.f / count;
+	return makeRgbe(sum.r * scale, sum.g * scale, sum.b * scale);
+}
+
+inline u32 averageSrgb(const u32* colors, int count) {
+	Colorf sum(0.f, 0.f, 0.f);
+	for (int i = 0; i < count; ++i) {
+		const Colorf col = Colorf::fromSrgb(colors[i]);
+		sum = Colorf(sum.r + col.r, sum.g + col.g, sum.b + col.b);
+	}
+
+	const float scale = 1.f / count;
+	return Colorf(sum.r * scale, sum.g * scale, sum.b * scale).toSrgb();
+}
+
+// Averages the samples of a pixel in whatever format filter produces.
+inline u32 averageSamples(SampleFilter filter, const u32* colors, int count) {
+	switch (filter) {
+	case FILTER_RGBE: return averageRgbe(colors, count);
+	case FILTER_SRGB: return averageSrgb(colors, count);
+	default:          return averageColors(colors, count);
+	}
+}
+
+// Per-band scratch space for the direction -> (face, s, t) -> color pipeline.
+struct SampleBuffers {
+	std::vector<float> dir_x, dir_y, dir_z;
+	std::vector<u8> face;
+	std::vector<float> s, t;
+	std::vector<float> lod;
+	std::vector<u32> color;
+
+	// Samples taken per face, if count_face_hits is set.
+	bool count_face_hits;
+	u64 face_hits[Cubemap::NUM_FACES];
+
+	explicit SampleBuffers(int capacity, bool count_face_hits = false) :
+		dir_x(capacity), dir_y(capacity), dir_z(capacity),
+		face(capacity), s(capacity), t(capacity), lod(capacity), color(capacity),
+		count_face_hits(count_face_hits)
+	{
+		for (u64& hits : face_hits)
+			hits = 0;
+	}
+
+	// Makes room for at least capacity samples, keeping the allocations if
+	// there already is, and zeroes face_hits.
+	void reset(int capacity, bool count_hits) {
+		if (color.size() < size_t(capacity)) {
+			dir_x.resize(capacity);
+			dir_y.resize(capacity);
+			dir_z.resize(capacity);
+			face.resize(capacity);
+			s.resize(capacity);
+			t.resize(capacity);
+			lod.resize(capacity);
+			color.resize(capacity);
+		}
+		count_face_hits = count_hits;
+		for (u64& hits : face_hits)
+			hits = 0;
+	}
+
+	// Moves face_hits over to counters.
+	void flushFaceHits(RenderCounters& counters) {
+		for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+			counters.face_hits[f] += face_hits[f];
+			face_hits[f] = 0;
+		}
+	}
+
+	// Projects and samples the first count directions into color.
+	void sample(const Cubemap& cubemap, const SampleKernel& kernel, SampleFilter filter, int count,
+		float footprint = 0.f)
+	{
+		project(kernel, cubemap.layout, count);
+		sampleProjected(cubemap, kernel, filter, count, footprint);
+	}
+
+	// Only cube projection is vectorized; the other layouts take the scalar
+	// path, which a ProjectionLut skips entirely.
+	void project(const SampleKernel& kernel, Mapping layout, int count) {
+		if (layout == MAPPING_CUBE)
+			kernel.projectDirections(count, dir_x.data(), dir_y.data(), dir_z.data(), face.data(), s.data(), t.data());
+		else
+			projectDirections(layout, count, dir_x.data(), dir_y.data(), dir_z.data(), face.data(), s.data(), t.data());
+	}
+
+	// Samples the first count (face, s, t) entries into color. Waits for any
+	// face that is hit but still loading. A non-zero footprint is the solid
+	// angle each sample covers and selects trilinear filtering from the mip
+	// levels, which only the scalar path does; runs where no sample needs
+	// anything below the full-size faces still go to the kernel. Paged faces
+	// are sampled through their tile cache instead of any kernel.
+	void sampleProjected(const Cubemap& cubemap, const SampleKernel& kernel, SampleFilter filter, int count,
+		float footprint = 0.f)
+	{
+		if (cubemap.readyFaces() != Cubemap::all_faces)
+			cubemap.waitForFaces(faceMask(count));
+
+		if (count_face_hits) {
+			for (int i = 0; i < count; ++i)
+				++face_hits[face[i]];
+		}
+
+		if (cubemap.paged_faces != nullptr) {
+			cubemap.paged_faces->sample(filter, count, face.data(), s.data(), t.data(), color.data());
+			return;
+		}
+
+		if (footprint > 0.f) {
+			bool minified = false;
+			for (int i = 0; i < count; ++i) {
+				lod[i] = cubemap.mipLevel(Cubemap::CubeFace(face[i]), s[i], t[i], footprint);
+				minified |= lod[i] > 0.f;
+			}
+
+			if (minified) {
+				for (int i = 0; i < count; ++i) {
+					const Cubemap::CubeFace f = Cubemap::CubeFace(face[i]);
+					color[i] = filter == FILTER_FIXED ? cubemap.sampleFaceTrilinearFixed(f, s[i], t[i], lod[i])
+						: cubemap.sampleFaceTrilinear(f, s[i], t[i], lod[i]);
+				}
+				return;
+			}
+		}
+
+		if (filter == FILTER_FIXED)
+			kernel.sampleFacesFixed(cubemap, count, face.data(), s.data(), t.data(), color.data());
+		else if (filter == FILTER_RGBE)
+			kernel.sampleFacesRgbe(cubemap, count, face.data(), s.data(), t.data(), color.data());
+		else if (filter == FILTER_SRGB)
+			kernel.sampleFacesSrgb(cubemap, count, face.data(), s.data(), t.data(), color.data());
+		else
+			kernel.sampleFaces(cubemap, count, face.data(), s.data(), t.data(), color.data());
+	}
+
+	unsigned faceMask(int count) const {
+		unsigned mask = 0;
+		for (int i = 0; i < count; ++i)
+			mask |= 1u << face[i];
+		return mask;
+	}
+};
+
+// Renders rows [y_begin, y_end) of the output into out_rows, which holds
+// just the region's part of those rows.
+void renderRows(const Cubemap& input_cubemap, const RenderSettings& settings, int y_begin, int y_end, u32* out_rows);
+
+typedef void (*RowRenderer)(const Cubemap& input_cubemap, const RenderSettings& settings, int y_begin, int y_end, u32* out_rows);
+
+// What renderRows runs for settings: its loops compiled for the AA mode,
+// sample count and filter, with the per-pixel sample loops unrolled. Jobs
+// look it up once instead of for every band.
+RowRenderer rowRenderer(const RenderSettings& settings);
+
+// Renders the output region into out_data while the cubemap may still be
+// loading. Bands are
+// taken in order, but one whose faces aren't decoded yet is set aside so the
+// worker can move on; set-aside bands are picked up as their faces arrive.
+void renderImage(ThreadPool& thread_pool, const Cubemap& input_cubemap, const RenderSettings& settings, u32* out_data);
+
+// Receives rows [y_begin, y_end) of the region, counted from its top row;
+// y_begin == previous y_end.
+typedef std::function<void(int y_begin, int y_end, const u32* rows)> RowSink;
+
+// Renders the region band by band and hands the bands to emit_rows strictly
+// top to bottom, from a separate thread so output overlaps rendering. Only a
+// window of a few bands per worker is ever in memory. Bands aren't set aside
+// while faces are loading as in renderImage; a worker just waits for what
+// its band needs. Paged cubemaps render in square blocks instead, a whole
+// row of them before it is handed over, to make the most of the tile cache.
+// The window comes from the calling thread's BufferPool.
+void renderImageStreamed(ThreadPool& thread_pool, const Cubemap& input_cubemap, const RenderSettings& settings,
+	const RowSink& emit_rows);
+
+// Halves the rows handed to it, each of its pixels the average of a 2x2
+// block in whatever format filter produces, and hands those on to
+// emit_rows: a copy of an output at half the size, made as the output
+// streams out. Whole outputs of every mapping halve exactly when their size
+// is even. Rows must come in order, as a RowSink gets them; a row waits for
+// the one after it.
+class RowDownsampler {
+public:
+	RowDownsampler(SampleFilter filter, int width, const RowSink& emit_rows);
+
+	void addRows(int y_begin, int y_end, const u32* rows);
+
+private:
+	RowDownsampler(const RowDownsampler&);
+	RowDownsampler& operator= (const RowDownsampler&);
+
+	void emitRow(const u32* top, const u32* bottom);
+
+	SampleFilter filter;
+	int width;
+	RowSink emit_rows;
+
+	// The top row of a pair whose bottom row hasn't come in yet.
+	std::vector<u32> pending;
+	bool has_pending;
+
+	std::vector<u32> out_rows;
+	int out_y;
+};
+
+// The faces a whole target output reads, worked out from the mappings
+// alone: all faces the source layout uses, except that a dome never looks
+// below the horizon and so leaves out the -Y face of a cube. on_horizon
+// says whether samples may land on the horizon itself, as adaptive AA
+// corners and LUT coordinates do.
+unsigned wholeOutputFaces(Mapping source, Mapping target, bool mipmaps, bool on_horizon);
+
+// The faces of a cube source that rendering settings.region reads any texel
+// of, including border texels the bilinear footprints at the face edges
+// take from neighbouring faces, and with mipmaps every face the borders of
+// those take from; never more than wholeOutputFaces. Face i is
+// face_width[i] x face_height[i]; a face of unknown size counts as read
+// along with every face but the opposite one. Projects every sample of the
+// region once, or reads them from settings.lut.
+unsigned regionFaces(ThreadPool& thread_pool, const RenderSettings& settings,
+	const int (&face_width)[Cubemap::NUM_FACES], const int (&face_height)[Cubemap::NUM_FACES]);
@@ -0,0 +1,180 @@
+#include "render_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+const char cache_magic[8] = { 'S', 'M', 'A', 'P', 'R', 'C', 'C', '1' };
+const u32 byte_order_mark = 0x01020304;
+
+struct CacheFileHeader {
+	char magic[8];
+	u64 settings_key;
+	u64 face_hashes[Cubemap::NUM_FACES];
+	u64 output_hash;
+	u32 byte_order;
+	u32 tile_size;
+	u32 region_x, region_y;
+	u32 region_width, region_height;
+	u32 num_tiles;
+};
+
+// FNV-1a taken a 64-bit word at a time, with a shift to mix the high bits
+// back down. Plenty to notice an edited file, and about as fast as reading it.
+struct Hasher {
+	u64 state;
+
+	Hasher() : state(0xcbf29ce484222325ull) {}
+
+	void add(const u8* data, size_t size) {
+		const u64 prime = 0x100000001b3ull;
+		for (; size >= 8; data += 8, size -= 8) {
+			u64 word;
+			std::memcpy(&word, data, 8);
+			state = (state ^ word) * prime;
+			state ^= state >> 29;
+		}
+		for (; size > 0; ++data, --size)
+			state = (state ^ *data) * prime;
+	}
+};
+
+} // namespace
+
+bool hashFile(const std::string& filename, u64& out_hash) {
+	std::ifstream f(filename, std::ios::binary);
+	if (!f)
+		return false;
+
+	Hasher hasher;
+	std::vector<char> buffer(1 << 16);
+	while (f.read(buffer.data(), buffer.size()) || f.gcount() > 0)
+		hasher.add(reinterpret_cast<const u8*>(buffer.data()), size_t(f.gcount()));
+	if (f.bad())
+		return false;
+
+	out_hash = hasher.state;
+	return true;
+}
+
+RenderCache::RenderCache() :
+	settings_key(0), region(), output_hash(0)
+{
+	for (u64& hash : face_hashes)
+		hash = 0;
+}
+
+u64 RenderCache::settingsKey(const RenderSettings& settings) {
+	std::ostringstream key;
+	key << settings.output_size << ' ' << settings.source << ' ' << settings.target << ' ' << settings.num_aa_samples
+		<< ' ' << settings.kernel->name << ' ' << settings.filter << ' ' << settings.mipmaps << ' ' << settings.adaptive_aa
+		<< ' ' << settings.aa_threshold << ' ' << (settings.lut != nullptr);
+
+	Hasher hasher;
+	const std::string text = key.str();
+	hasher.add(reinterpret_cast<const u8*>(text.data()), text.size());
+	return hasher.state;
+}
+
+bool RenderCache::matches(const RenderSettings& settings) const {
+	return !tile_faces.empty() && settings_key == settingsKey(settings) && region == settings.region;
+}
+
+OutputRegion RenderCache::tile(int index) const {
+	const int tiles_x = (region.width + tile_size - 1) / tile_size;
+	const int x = index % tiles_x * tile_size;
+	const int y = index / tiles_x * tile_size;
+	const int size = tile_size;
+	const OutputRegion tile = { region.x + x, region.y + y, std::min(size, region.width - x), std::min(size, region.height - y) };
+	return tile;
+}
+
+unsigned RenderCache::changedFaces(const u64 (&new_hashes)[Cubemap::NUM_FACES]) const {
+	unsigned changed = 0;
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+		if (new_hashes[f] != face_hashes[f])
+			changed |= Cubemap::faceBit(Cubemap::CubeFace(f));
+	}
+	return changed;
+}
+
+void RenderCache::build(const RenderSettings& settings, const u64 (&new_hashes)[Cubemap::NUM_FACES],
+	const TileFaceRecorder& recorded)
+{
+	settings_key = settingsKey(settings);
+	region = settings.region;
+	std::copy(new_hashes, new_hashes + Cubemap::NUM_FACES, face_hashes);
+	output_hash = 0;
+
+	tile_faces.resize(recorded.numTiles());
+	for (int tile = 0; tile < recorded.numTiles(); ++tile)
+		tile_faces[tile] = static_cast<u8>(recorded.tileFaces(tile));
+}
+
+void RenderCache::update(const std::vector<int>& tiles, const u64 (&new_hashes)[Cubemap::NUM_FACES],
+	const TileFaceRecorder& recorded)
+{
+	std::copy(new_hashes, new_hashes + Cubemap::NUM_FACES, face_hashes);
+	for (int tile : tiles)
+		tile_faces[tile] = static_cast<u8>(recorded.tileFaces(tile));
+}
+
+bool RenderCache::load(const std::string& filename) {
+	std::ifstream f(filename, std::ios::binary);
+	if (!f)
+		return false;
+
+	CacheFileHeader header;
+	if (!f.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		return false;
+
+	if (!std::equal(cache_magic, cache_magic + sizeof(cache_magic), header.magic) || header.byte_order != byte_order_mark
+		|| header.tile_size != u32(tile_size) || header.region_width == 0 || header.region_height == 0)
+	{
+		return false;
+	}
+
+	const OutputRegion new_region = { int(header.region_x), int(header.region_y),
+		int(header.region_width), int(header.region_height) };
+	const u64 tiles_x = (header.region_width + tile_size - 1) / tile_size;
+	const u64 tiles_y = (header.region_height + tile_size - 1) / tile_size;
+	if (header.num_tiles != tiles_x * tiles_y)
+		return false;
+
+	std::vector<u8> new_tile_faces(header.num_tiles);
+	if (!f.read(reinterpret_cast<char*>(new_tile_faces.data()), new_tile_faces.size()))
+		return false;
+
+	settings_key = header.settings_key;
+	region = new_region;
+	std::copy(header.face_hashes, header.face_hashes + Cubemap::NUM_FACES, face_hashes);
+	output_hash = header.output_hash;
+	tile_faces.swap(new_tile_faces);
+	return true;
+}
+
+bool RenderCache::save(const std::string& filename) const {
+	std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+	if (!f)
+		return false;
+
+	CacheFileHeader header = CacheFileHeader();
+	std::copy(cache_magic, cache_magic + sizeof(cache_magic), header.magic);
+	header.settings_key = settings_key;
+	std::copy(face_hashes, face_hashes + Cubemap::NUM_FACES, header.face_hashes);
+	header.output_hash = output_hash;
+	header.byte_order = byte_order_mark;
+	header.tile_size = tile_size;
+	header.region_x = region.x;
+	header.region_y = region.y;
+	header.region_width = region.width;
+	header.region_height = region.height;
+	header.num_tiles = static_cast<u32>(tile_faces.size());
+
+	f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	f.write(reinterpret_cast<const char*>(tile_faces.data()), tile_faces.size());
+	return f.good();
+}
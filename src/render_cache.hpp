@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "render.hpp"
+
+// 64-bit hash of the contents of a file, for telling whether it changed.
+// Fails if it can't be read.
+bool hashFile(const std::string& filename, u64& out_hash);
+
+// What an earlier render of an output read: a hash of each input face and,
+// for each tile of the output, the faces its pixels take texels from. After
+// some faces change, only the tiles reading those need rendering again and
+// the rest of the earlier output can stay; see -cache.
+class RenderCache {
+public:
+	// Tiles are tile_size pixels square, row by row from the top-left corner
+	// of the region, which keeps them aligned to the renderer's chunks.
+	static const int tile_size = 64;
+
+	RenderCache();
+
+	// Whether the cache was made with settings, and so describes the same
+	// tiles rendered the same way.
+	bool matches(const RenderSettings& settings) const;
+
+	int numTiles() const { return static_cast<int>(tile_faces.size()); }
+	OutputRegion tile(int index) const;
+	unsigned tileFaces(int index) const { return tile_faces[index]; }
+
+	// The faces whose hashes differ from face_hashes.
+	unsigned changedFaces(const u64 (&face_hashes)[Cubemap::NUM_FACES]) const;
+
+	// Hash of the output file the cache goes with.
+	u64 outputHash() const { return output_hash; }
+
+	// Starts a cache for settings with what rendering all of its region
+	// recorded. recorded must have tile_size tiles.
+	void build(const RenderSettings& settings, const u64 (&face_hashes)[Cubemap::NUM_FACES],
+		const TileFaceRecorder& recorded);
+
+	// Takes new face hashes after the given tiles were rendered again, and
+	// what that recorded, as the faces a tile reads change with their sizes.
+	void update(const std::vector<int>& tiles, const u64 (&face_hashes)[Cubemap::NUM_FACES],
+		const TileFaceRecorder& recorded);
+
+	void setOutputHash(u64 hash) { output_hash = hash; }
+
+	// Reads a cache written by save. Fails on I/O errors and malformed files.
+	bool load(const std::string& filename);
+	bool save(const std::string& filename) const;
+
+private:
+	// Fingerprint of everything besides the input faces that decides the
+	// output pixels.
+	static u64 settingsKey(const RenderSettings& settings);
+
+	u64 settings_key;
+	OutputRegion region;
+	u64 face_hashes[Cubemap::NUM_FACES];
+	u64 output_hash;
+	std::vector<u8> tile_faces;
+};
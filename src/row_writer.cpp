@@ -0,0 +1,547 @@
+#include "row_writer.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "deflate.hpp"
+
+namespace {
+
+// Raw RGBA bytes per PNG or QOI chunk, which is what one encoding task
+// takes on. Big enough that starting over without a dictionary or index at
+// each chunk costs nothing noticeable.
+const size_t chunk_target_bytes = 1 << 19;
+
+// QOI decoding starts from opaque black with a zeroed index.
+const u32 qoi_initial_pixel = 0xFF000000;
+
+void put16(u8*& p, unsigned v) {
+	*p++ = v & 0xFF;
+	*p++ = v >> 8 & 0xFF;
+}
+
+void put32(u8*& p, u32 v) {
+	put16(p, v & 0xFFFF);
+	put16(p, v >> 16);
+}
+
+void putBig32(u8*& p, u32 v) {
+	*p++ = v >> 24 & 0xFF;
+	*p++ = v >> 16 & 0xFF;
+	*p++ = v >> 8 & 0xFF;
+	*p++ = v & 0xFF;
+}
+
+int bmpRowPadding(int width) {
+	return (-width * 3) & 3;
+}
+
+// Appends a PNG chunk with its length and CRC.
+void appendPngChunk(const char* tag, const u8* data, u32 size, std::vector<u8>& out) {
+	u8 length[4];
+	u8* p = length;
+	putBig32(p, size);
+	out.insert(out.end(), length, length + 4);
+
+	const size_t crc_start = out.size();
+	out.insert(out.end(), tag, tag + 4);
+	out.insert(out.end(), data, data + size);
+
+	u8 crc[4];
+	p = crc;
+	putBig32(p, crc32(&out[crc_start], out.size() - crc_start));
+	out.insert(out.end(), crc, crc + 4);
+}
+
+u8 paethPredictor(int a, int b, int c) {
+	const int p = a + b - c;
+	const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+	return static_cast<u8>(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Writes row through PNG filter type into out, prior being the row above.
+// The first pixel has no left neighbour and is done apart, which leaves
+// loops the compiler can vectorize.
+void applyPngFilter(int type, const u8* row, const u8* prior, int row_bytes, u8* out) {
+	const int bpp = 4;
+	switch (type) {
+	case 0:
+		std::memcpy(out, row, row_bytes);
+		break;
+	case 1:
+		std::memcpy(out, row, bpp);
+		for (int i = bpp; i < row_bytes; ++i)
+			out[i] = static_cast<u8>(row[i] - row[i - bpp]);
+		break;
+	case 2:
+		for (int i = 0; i < row_bytes; ++i)
+			out[i] = static_cast<u8>(row[i] - prior[i]);
+		break;
+	case 3:
+		for (int i = 0; i < bpp; ++i)
+			out[i] = static_cast<u8>(row[i] - (prior[i] >> 1));
+		for (int i = bpp; i < row_bytes; ++i)
+			out[i] = static_cast<u8>(row[i] - ((row[i - bpp] + prior[i]) >> 1));
+		break;
+	default:
+		// With no left neighbour Paeth predicts from above.
+		for (int i = 0; i < bpp; ++i)
+			out[i] = static_cast<u8>(row[i] - prior[i]);
+		for (int i = bpp; i < row_bytes; ++i)
+			out[i] = static_cast<u8>(row[i] - paethPredictor(row[i - bpp], prior[i], prior[i - bpp]));
+		break;
+	}
+}
+
+// Filters a row into out, its filter type byte followed by the filtered
+// bytes. The type is the one whose bytes, read as signed, add up smallest,
+// the usual guess at what deflates best. scratch holds a row.
+void filterPngRow(const u8* row, const u8* prior, int row_bytes, u8* scratch, u8* out) {
+	u64 best_sum = ~u64(0);
+	for (int type = 0; type < 5; ++type) {
+		applyPngFilter(type, row, prior, row_bytes, scratch);
+		u64 sum = 0;
+		for (int i = 0; i < row_bytes; ++i)
+			sum += std::abs(static_cast<int>(static_cast<signed char>(scratch[i])));
+		if (sum < best_sum) {
+			best_sum = sum;
+			out[0] = static_cast<u8>(type);
+			std::copy(scratch, scratch + row_bytes, out + 1);
+		}
+	}
+}
+
+// Appends QOI ops for count RGBA pixels, following previous. The decoder's
+// index is only relied on where this call filled it in, or everywhere with
+// index_known, which holds at the start of the image; that way chunks can
+// be encoded independently and still decode as one stream.
+void encodeQoi(const u8* pixels, size_t count, u32 previous, bool index_known, std::vector<u8>& out) {
+	u32 index[64] = { 0 };
+	u64 known = index_known ? ~u64(0) : 0;
+	int run = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		const u8* p = pixels + i * 4;
+		const u32 px = p[0] | p[1] << 8 | p[2] << 16 | u32(p[3]) << 24;
+		if (px == previous) {
+			if (++run == 62) {
+				out.push_back(0xC0 | 61);
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0) {
+			out.push_back(static_cast<u8>(0xC0 | (run - 1)));
+			run = 0;
+		}
+
+		const int hash = (p[0] * 3 + p[1] * 5 + p[2] * 7 + p[3] * 11) & 63;
+		if ((known >> hash & 1) && index[hash] == px) {
+			out.push_back(static_cast<u8>(hash));
+		} else if (p[3] != previous >> 24) {
+			const u8 op[5] = { 0xFF, p[0], p[1], p[2], p[3] };
+			out.insert(out.end(), op, op + 5);
+		} else {
+			const int dr = static_cast<signed char>(p[0] - (previous & 0xFF));
+			const int dg = static_cast<signed char>(p[1] - (previous >> 8 & 0xFF));
+			const int db = static_cast<signed char>(p[2] - (previous >> 16 & 0xFF));
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+				out.push_back(static_cast<u8>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+			} else if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7) {
+				out.push_back(static_cast<u8>(0x80 | (dg + 32)));
+				out.push_back(static_cast<u8>((dr - dg + 8) << 4 | (db - dg + 8)));
+			} else {
+				const u8 op[4] = { 0xFE, p[0], p[1], p[2] };
+				out.insert(out.end(), op, op + 4);
+			}
+		}
+
+		index[hash] = px;
+		known |= u64(1) << hash;
+		previous = px;
+	}
+
+	if (run > 0)
+		out.push_back(static_cast<u8>(0xC0 | (run - 1)));
+}
+
+} // namespace
+
+RowWriter::Format RowWriter::formatFromFilename(const std::string& filename) {
+	if (hasExtension(filename, "bmp"))
+		return FORMAT_BMP;
+	if (hasExtension(filename, "raw"))
+		return FORMAT_RAW;
+	if (hasExtension(filename, "hdr"))
+		return FORMAT_HDR;
+	if (hasExtension(filename, "png"))
+		return FORMAT_PNG;
+	if (hasExtension(filename, "qoi"))
+		return FORMAT_QOI;
+	return FORMAT_TGA;
+}
+
+RowWriter::RowWriter() :
+	file(nullptr), format(FORMAT_TGA), width(0), height(0), rows_written(0), bytes_written(0), failed(false),
+	pending_rows(0), chunk_rows(0), batch_rows(0), rows_encoded(0), adler(1)
+{}
+
+RowWriter::~RowWriter() {
+	if (file != nullptr)
+		std::fclose(file);
+}
+
+bool RowWriter::open(const std::string& filename, Format format, int width, int height, const EncodeOptions& encode) {
+	if (file != nullptr)
+		close();
+
+	this->filename = filename;
+	this->format = format;
+	this->width = width;
+	this->height = height;
+	this->encode = encode;
+	rows_written = 0;
+	bytes_written = 0;
+	failed = false;
+	pending_rows = 0;
+	rows_encoded = 0;
+	adler = 1;
+
+	file = std::fopen(filename.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+
+	u8 header[64];
+	u8* p = header;
+
+	switch (format) {
+	case FORMAT_TGA:
+		*p++ = 0; // no image ID
+		*p++ = 0; // no palette
+		*p++ = 2; // uncompressed true-color
+		put16(p, 0); put16(p, 0); *p++ = 0; // palette spec
+		put16(p, 0); put16(p, 0); // origin
+		put16(p, width);
+		put16(p, height);
+		*p++ = 32;
+		*p++ = 0x20 | 8; // top-left origin, 8 alpha bits
+		row_buffer.resize(size_t(width) * 4);
+		break;
+	case FORMAT_BMP: {
+		const u32 row_size = width * 3 + bmpRowPadding(width);
+		*p++ = 'B'; *p++ = 'M';
+		put32(p, 14 + 40 + row_size * height);
+		put32(p, 0);
+		put32(p, 14 + 40);
+		put32(p, 40);
+		put32(p, width);
+		put32(p, static_cast<u32>(-height)); // negative height: rows run top-down
+		put16(p, 1);
+		put16(p, 24);
+		for (int i = 0; i < 6; ++i)
+			put32(p, 0);
+		row_buffer.assign(row_size, 0);
+		break;
+	}
+	case FORMAT_RAW:
+		row_buffer.resize(size_t(width) * 4);
+		break;
+	case FORMAT_HDR:
+		// Readers take a scanline starting with 2, 2 and a byte below 128 for
+		// run-length encoded, but a normalized RGBE pixel with two mantissas
+		// of 2 has a third of at least 128.
+		p += std::snprintf(reinterpret_cast<char*>(p), sizeof(header),
+			"#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", height, width);
+		row_buffer.resize(size_t(width) * 4);
+		break;
+	case FORMAT_RAW_FLOAT:
+		row_buffer.resize(size_t(width) * 3 * sizeof(float));
+		break;
+	case FORMAT_PNG: {
+		const u8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		u8 ihdr[13];
+		u8* q = ihdr;
+		putBig32(q, width);
+		putBig32(q, height);
+		*q++ = 8; // bits per channel
+		*q++ = 6; // RGBA
+		*q++ = 0; // deflate
+		*q++ = 0; // standard filters
+		*q++ = 0; // not interlaced
+
+		std::vector<u8> chunk;
+		appendPngChunk("IHDR", ihdr, sizeof(ihdr), chunk);
+		p = std::copy(signature, signature + 8, p);
+		p = std::copy(chunk.begin(), chunk.end(), p);
+		break;
+	}
+	case FORMAT_QOI:
+		*p++ = 'q'; *p++ = 'o'; *p++ = 'i'; *p++ = 'f';
+		putBig32(p, width);
+		putBig32(p, height);
+		*p++ = 4; // RGBA
+		*p++ = 0; // sRGB
+		break;
+	}
+
+	if (isCompressed()) {
+		const size_t row_bytes = size_t(width) * 4;
+		const int num_workers = encode.thread_pool != nullptr ? encode.thread_pool->size() : 1;
+		chunk_rows = static_cast<int>(std::max<size_t>(chunk_target_bytes / row_bytes, 1));
+		chunk_rows = std::min(chunk_rows, height);
+		batch_rows = std::min(chunk_rows * num_workers, height);
+		pending.resize(row_bytes * batch_rows);
+		previous_row.assign(row_bytes, 0);
+	}
+
+	const size_t header_size = p - header;
+	if (header_size != 0 && std::fwrite(header, 1, header_size, file) != header_size)
+		failed = true;
+	bytes_written = header_size;
+	return true;
+}
+
+void RowWriter::writeRows(const u32* rows, int count) {
+	if (file == nullptr || failed)
+		return;
+
+	for (int y = 0; y < count; ++y) {
+		const u32* row = rows + size_t(y) * width;
+		u8* p = isCompressed() ? &pending[size_t(pending_rows) * width * 4] : row_buffer.data();
+
+		for (int x = 0; x < width; ++x) {
+			u8 r, g, b;
+			splitColor(row[x], r, g, b);
+			const u8 a = row[x] >> 24;
+
+			switch (format) {
+			case FORMAT_TGA:
+				*p++ = b; *p++ = g; *p++ = r; *p++ = a;
+				break;
+			case FORMAT_BMP:
+				*p++ = b; *p++ = g; *p++ = r;
+				break;
+			case FORMAT_RAW:
+			case FORMAT_HDR:
+			case FORMAT_PNG:
+			case FORMAT_QOI:
+				*p++ = r; *p++ = g; *p++ = b; *p++ = a;
+				break;
+			case FORMAT_RAW_FLOAT: {
+				const Colorf col = Colorf::fromRgbe(row[x]);
+				const float channels[3] = { col.r, col.g, col.b };
+				std::memcpy(p, channels, sizeof(channels));
+				p += sizeof(channels);
+				break;
+			}
+			}
+		}
+
+		if (isCompressed()) {
+			if (++pending_rows == batch_rows)
+				encodePending();
+			continue;
+		}
+
+		// BMP padding bytes past p were zeroed by open and are never touched.
+		if (std::fwrite(row_buffer.data(), 1, row_buffer.size(), file) != row_buffer.size()) {
+			failed = true;
+			return;
+		}
+		bytes_written += row_buffer.size();
+	}
+	rows_written += count;
+}
+
+void RowWriter::encodePending() {
+	if (pending_rows == 0 || failed)
+		return;
+
+	const int row_bytes = width * 4;
+	const int num_chunks = (pending_rows + chunk_rows - 1) / chunk_rows;
+	const bool image_start = rows_encoded == 0;
+	encoded_chunks.resize(num_chunks);
+	std::vector<u32> chunk_adler(num_chunks);
+
+	auto encode_chunk = [&](int chunk, int) {
+		const int y_begin = chunk * chunk_rows;
+		const int y_end = std::min(y_begin + chunk_rows, pending_rows);
+		const u8* chunk_rows_begin = &pending[size_t(y_begin) * row_bytes];
+		const u8* prior = y_begin == 0 ? previous_row.data() : chunk_rows_begin - row_bytes;
+		const bool stream_start = image_start && chunk == 0;
+		std::vector<u8>& out = encoded_chunks[chunk];
+		out.clear();
+
+		if (format == FORMAT_QOI) {
+			const u8* last = prior + row_bytes - 4;
+			const u32 previous = stream_start ? qoi_initial_pixel : last[0] | last[1] << 8 | last[2] << 16 | u32(last[3]) << 24;
+			encodeQoi(chunk_rows_begin, size_t(y_end - y_begin) * width, previous, stream_start, out);
+			return;
+		}
+
+		// Filtered rows are checksummed here and deflated into an IDAT chunk
+		// of their own; the zlib header goes in front of the first.
+		std::vector<u8> filtered(size_t(y_end - y_begin) * (row_bytes + 1));
+		std::vector<u8> scratch(row_bytes);
+		for (int y = y_begin; y < y_end; ++y) {
+			const u8* row = &pending[size_t(y) * row_bytes];
+			u8* dst = &filtered[size_t(y - y_begin) * (row_bytes + 1)];
+			if (encode.compression_level == 0) {
+				dst[0] = 0;
+				std::memcpy(dst + 1, row, row_bytes);
+			} else {
+				filterPngRow(row, y == y_begin ? prior : row - row_bytes, row_bytes, scratch.data(), dst);
+			}
+		}
+		chunk_adler[chunk] = adler32(filtered.data(), filtered.size());
+
+		out.resize(8);
+		std::memcpy(&out[4], "IDAT", 4);
+		if (stream_start) {
+			out.push_back(0x78); // deflate with a 32K window
+			out.push_back(0x01); // no dictionary, check bits
+		}
+		deflateChunk(filtered.data(), filtered.size(), encode.compression_level, out);
+
+		u8* p = out.data();
+		putBig32(p, static_cast<u32>(out.size() - 8));
+		u8 crc[4];
+		p = crc;
+		putBig32(p, crc32(&out[4], out.size() - 4));
+		out.insert(out.end(), crc, crc + 4);
+	};
+
+	if (encode.thread_pool != nullptr && num_chunks > 1) {
+		encode.thread_pool->parallelFor(num_chunks, encode_chunk);
+	} else {
+		for (int chunk = 0; chunk < num_chunks; ++chunk)
+			encode_chunk(chunk, 0);
+	}
+
+	for (int chunk = 0; chunk < num_chunks; ++chunk) {
+		const std::vector<u8>& out = encoded_chunks[chunk];
+		if (std::fwrite(out.data(), 1, out.size(), file) != out.size()) {
+			failed = true;
+			return;
+		}
+		bytes_written += out.size();
+
+		const int chunk_height = std::min(chunk_rows, pending_rows - chunk * chunk_rows);
+		if (format == FORMAT_PNG)
+			adler = adler32Combine(adler, chunk_adler[chunk], u64(chunk_height) * (row_bytes + 1));
+	}
+
+	std::copy(&pending[size_t(pending_rows - 1) * row_bytes], &pending[size_t(pending_rows) * row_bytes],
+		previous_row.begin());
+	rows_encoded += pending_rows;
+	pending_rows = 0;
+}
+
+bool RowWriter::close() {
+	if (file == nullptr)
+		return false;
+
+	if (isCompressed() && !failed) {
+		encodePending();
+
+		std::vector<u8> trailer;
+		if (format == FORMAT_PNG) {
+			u8 end_of_stream[6];
+			u8* p = std::copy(deflate_end_of_stream, deflate_end_of_stream + 2, end_of_stream);
+			putBig32(p, adler);
+			appendPngChunk("IDAT", end_of_stream, sizeof(end_of_stream), trailer);
+			appendPngChunk("IEND", nullptr, 0, trailer);
+		} else {
+			const u8 end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+			trailer.assign(end_marker, end_marker + 8);
+		}
+
+		if (std::fwrite(trailer.data(), 1, trailer.size(), file) != trailer.size())
+			failed = true;
+		bytes_written += trailer.size();
+	}
+
+	if (std::fclose(file) != 0)
+		failed = true;
+	file = nullptr;
+	return !failed && rows_written == height;
+}
+
+void RowWriter::discard() {
+	if (file != nullptr) {
+		std::fclose(file);
+		file = nullptr;
+	}
+	std::remove(filename.c_str());
+}
+
+std::string OutputWriter::faceFilename(const std::string& filename, int num_files, int face) {
+	if (num_files == 1)
+		return filename;
+
+	const std::string::size_type dot = filename.rfind('.');
+	const std::string::size_type slash = filename.find_last_of("/\\");
+	const std::string::size_type split = dot == std::string::npos || (slash != std::string::npos && dot < slash)
+		? filename.size() : dot;
+	return filename.substr(0, split) + char('1' + face) + filename.substr(split);
+}
+
+OutputWriter::OutputWriter() :
+	num_files(0), width(0), face_rows(0), rows_written(0)
+{}
+
+bool OutputWriter::open(const std::string& filename, RowWriter::Format format, int width, int height, int num_files,
+	const EncodeOptions& encode)
+{
+	assert(num_files >= 1 && num_files <= Cubemap::NUM_FACES && height % num_files == 0);
+	this->filename = filename;
+	this->num_files = 0;
+	this->width = width;
+	face_rows = height / num_files;
+	rows_written = 0;
+
+	for (int f = 0; f < num_files; ++f) {
+		if (!writers[f].open(faceFilename(filename, num_files, f), format, width, face_rows, encode)) {
+			std::cerr << "Failed to write " << faceFilename(filename, num_files, f) << ".\n";
+			discard();
+			return false;
+		}
+		this->num_files = f + 1;
+	}
+	return true;
+}
+
+void OutputWriter::writeRows(const u32* rows, int count) {
+	while (count > 0) {
+		const int face = std::min(rows_written / face_rows, num_files - 1);
+		const int run = face == num_files - 1 ? count : std::min(count, (face + 1) * face_rows - rows_written);
+		writers[face].writeRows(rows, run);
+		rows += size_t(run) * width;
+		rows_written += run;
+		count -= run;
+	}
+}
+
+bool OutputWriter::close() {
+	bool ok = true;
+	for (int f = 0; f < num_files; ++f) {
+		if (!writers[f].close()) {
+			std::cerr << "Failed to write " << faceFilename(filename, num_files, f) << ".\n";
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+void OutputWriter::discard() {
+	for (int f = 0; f < num_files; ++f)
+		writers[f].discard();
+}
+
+u64 OutputWriter::bytesWritten() const {
+	u64 bytes = 0;
+	for (int f = 0; f < num_files; ++f)
+		bytes += writers[f].bytesWritten();
+	return bytes;
+}
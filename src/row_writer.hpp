@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "cubemap.hpp"
+#include "thread_pool.hpp"
+
+// How RowWriter compresses PNG and QOI output.
+struct EncodeOptions {
+	// PNG deflate level: 0 only stores, 1 is fastest and 9 smallest.
+	int compression_level;
+	// Encodes the chunks of a batch of rows in parallel on this pool if set.
+	// It must not be a pool that is busy producing the rows.
+	ThreadPool* thread_pool;
+
+	EncodeOptions() : compression_level(6), thread_pool(nullptr) {}
+};
+
+// Writes an image to disk a few rows at a time, top to bottom, so the whole
+// image never has to be in memory. The uncompressed formats are laid out
+// top-down so rows can go straight to the file: TGA with a top-left origin,
+// BMP with a negative height and raw, which is headerless 8-bit RGBA. HDR
+// rows are RGBE and go to Radiance .hdr with flat scanlines, or to raw float,
+// which is headerless native-endian 32-bit float RGB.
+//
+// PNG and QOI, both 8-bit RGBA, are collected into batches of rows that are
+// split into chunks of about half a megabyte and encoded independently, in
+// parallel with EncodeOptions::thread_pool. A PNG chunk is filtered and
+// deflated into an IDAT chunk of its own, with the Adler-32s combined at the
+// end; a QOI chunk starts over with an unknown index.
+class RowWriter {
+public:
+	enum Format {
+		FORMAT_TGA,
+		FORMAT_BMP,
+		FORMAT_RAW,
+		FORMAT_HDR,
+		FORMAT_RAW_FLOAT,
+		FORMAT_PNG,
+		FORMAT_QOI
+	};
+
+	// Picks the format from the extension of filename. Anything that isn't
+	// .bmp, .raw, .hdr, .png or .qoi is written as TGA. Raw float is never
+	// picked, since it shares .raw.
+	static Format formatFromFilename(const std::string& filename);
+
+	RowWriter();
+	~RowWriter();
+
+	// Creates filename and writes the header.
+	bool open(const std::string& filename, Format format, int width, int height,
+		const EncodeOptions& encode = EncodeOptions());
+
+	// Appends count rows of width pixels each. Errors are remembered and
+	// reported by close.
+	void writeRows(const u32* rows, int count);
+
+	// Returns false if any write failed or fewer than height rows were
+	// written.
+	bool close();
+
+	// Closes and deletes the file, for outputs that turned out to be unusable.
+	void discard();
+
+	u64 bytesWritten() const { return bytes_written; }
+
+private:
+	RowWriter(const RowWriter&);
+	RowWriter& operator= (const RowWriter&);
+
+	bool isCompressed() const { return format == FORMAT_PNG || format == FORMAT_QOI; }
+
+	// Encodes and writes the pending rows.
+	void encodePending();
+
+	std::FILE* file;
+	std::string filename;
+	Format format;
+	int width, height;
+	int rows_written;
+	u64 bytes_written;
+	bool failed;
+	std::vector<u8> row_buffer;
+
+	// PNG and QOI rows as RGBA bytes waiting for a full batch, and the last
+	// row of the batch before, which the next one is predicted from.
+	EncodeOptions encode;
+	std::vector<u8> pending;
+	std::vector<u8> previous_row;
+	int pending_rows;
+	int chunk_rows, batch_rows;
+	int rows_encoded;
+	u32 adler;
+	std::vector<std::vector<u8>> encoded_chunks;
+};
+
+// An output image in one file, or split top to bottom into faces of equal
+// height with a file each, as cube outputs are.
+class OutputWriter {
+public:
+	// filename itself for a single file, or with the face number, 1 to
+	// num_files, before the extension, so cube faces can be read back as
+	// input with the same prefix and extension.
+	static std::string faceFilename(const std::string& filename, int num_files, int face);
+
+	OutputWriter();
+
+	// Opens num_files files of width x height / num_files pixels. On failure
+	// prints which file couldn't be created and removes the ones that were.
+	bool open(const std::string& filename, RowWriter::Format format, int width, int height, int num_files,
+		const EncodeOptions& encode = EncodeOptions());
+
+	// Appends count rows of width pixels; rows run on from one face file to
+	// the next.
+	void writeRows(const u32* rows, int count);
+
+	// Closes every file and prints the ones that failed.
+	bool close();
+
+	void discard();
+
+	u64 bytesWritten() const;
+
+private:
+	OutputWriter(const OutputWriter&);
+	OutputWriter& operator= (const OutputWriter&);
+
+	RowWriter writers[Cubemap::NUM_FACES];
+	std::string filename;
+	int num_files;
+	int width;
+	int face_rows;
+	int rows_written;
+};
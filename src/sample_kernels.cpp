@@ -0,0 +1,147 @@
+#include "sample_kernels.hpp"
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#endif
+
+namespace {
+
+void projectDirectionsScalar(int count, const float* vx, const float* vy, const float* vz,
+	u8* out_face, float* out_s, float* out_t)
+{
+	for (int i = 0; i < count; ++i) {
+		Cubemap::CubeFace face;
+		Cubemap::computeTexCoords(vx[i], vy[i], vz[i], face, out_s[i], out_t[i]);
+		out_face[i] = static_cast<u8>(face);
+	}
+}
+
+void sampleFacesScalar(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	for (int i = 0; i < count; ++i)
+		out_color[i] = cubemap.sampleFace(Cubemap::CubeFace(face[i]), s[i], t[i]);
+}
+
+void sampleFacesFixedScalar(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	for (int i = 0; i < count; ++i)
+		out_color[i] = cubemap.sampleFaceFixed(Cubemap::CubeFace(face[i]), s[i], t[i]);
+}
+
+void sampleFacesRgbeScalar(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	for (int i = 0; i < count; ++i)
+		out_color[i] = cubemap.sampleFaceRgbe(Cubemap::CubeFace(face[i]), s[i], t[i]);
+}
+
+void sampleFacesSrgbScalar(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	for (int i = 0; i < count; ++i)
+		out_color[i] = cubemap.sampleFaceSrgb(Cubemap::CubeFace(face[i]), s[i], t[i]);
+}
+
+enum CpuFeature {
+	CPU_SSE2,
+	CPU_AVX2,
+	CPU_NEON
+};
+
+bool cpuHasFeature(CpuFeature feature) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	switch (feature) {
+	case CPU_SSE2: return __builtin_cpu_supports("sse2") != 0;
+	case CPU_AVX2: return __builtin_cpu_supports("avx2") != 0;
+	default: return false;
+	}
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	int regs[4];
+	__cpuid(regs, 0);
+	const int max_leaf = regs[0];
+
+	__cpuid(regs, 1);
+	const bool has_sse2 = (regs[3] & (1 << 26)) != 0;
+	const bool has_osxsave = (regs[2] & (1 << 27)) != 0;
+	const bool has_avx = (regs[2] & (1 << 28)) != 0;
+
+	switch (feature) {
+	case CPU_SSE2:
+		return has_sse2;
+	case CPU_AVX2:
+		if (max_leaf < 7 || !has_osxsave || !has_avx || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(regs, 7, 0);
+		return (regs[1] & (1 << 5)) != 0;
+	default:
+		return false;
+	}
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	// NEON is mandatory on AArch64.
+	return feature == CPU_NEON;
+#else
+	(void)feature;
+	return false;
+#endif
+}
+
+} // namespace
+
+const SampleKernel sample_kernel_scalar = {
+	"scalar",
+	projectDirectionsScalar,
+	sampleFacesScalar,
+	sampleFacesFixedScalar,
+	sampleFacesRgbeScalar,
+	sampleFacesSrgbScalar
+};
+
+bool isSampleKernelSupported(const SampleKernel& kernel) {
+	if (kernel.projectDirections == nullptr || kernel.sampleFaces == nullptr || kernel.sampleFacesFixed == nullptr
+		|| kernel.sampleFacesRgbe == nullptr || kernel.sampleFacesSrgb == nullptr)
+	{
+		return false;
+	}
+
+	if (&kernel == &sample_kernel_sse2)
+		return cpuHasFeature(CPU_SSE2);
+	if (&kernel == &sample_kernel_avx2)
+		return cpuHasFeature(CPU_AVX2);
+	if (&kernel == &sample_kernel_neon)
+		return cpuHasFeature(CPU_NEON);
+	return true;
+}
+
+const SampleKernel& bestSampleKernel() {
+	static const SampleKernel* const widest_first[] = {
+		&sample_kernel_avx2,
+		&sample_kernel_sse2,
+		&sample_kernel_neon
+	};
+
+	for (const SampleKernel* kernel : widest_first) {
+		if (isSampleKernelSupported(*kernel))
+			return *kernel;
+	}
+	return sample_kernel_scalar;
+}
+
+const SampleKernel* findSampleKernel(const std::string& name) {
+	if (name == "auto")
+		return &bestSampleKernel();
+
+	static const SampleKernel* const all_kernels[] = {
+		&sample_kernel_scalar,
+		&sample_kernel_sse2,
+		&sample_kernel_avx2,
+		&sample_kernel_neon
+	};
+
+	for (const SampleKernel* kernel : all_kernels) {
+		if (name == kernel->name)
+			return isSampleKernelSupported(*kernel) ? kernel : nullptr;
+	}
+	return nullptr;
+}
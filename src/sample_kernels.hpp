@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+
+#include "cubemap.hpp"
+
+// Batched versions of Cubemap::computeTexCoords, Cubemap::sampleFace,
+// Cubemap::sampleFaceFixed, Cubemap::sampleFaceRgbe and
+// Cubemap::sampleFaceSrgb. All kernels produce bit-identical results to the
+// scalar Cubemap methods; the vector ones just process several samples per
+// instruction.
+struct SampleKernel {
+	const char* name;
+
+	// Projects count directions onto the cube, producing a face index and
+	// face-relative texture coordinates for each.
+	void (*projectDirections)(int count, const float* vx, const float* vy, const float* vz,
+		u8* out_face, float* out_s, float* out_t);
+
+	// Bilinearly samples count (face, s, t) coordinates.
+	void (*sampleFaces)(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+		u32* out_color);
+
+	// sampleFaces with 8.8 fixed-point blending instead of float.
+	void (*sampleFacesFixed)(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+		u32* out_color);
+
+	// sampleFaces on RGBE faces, filtering in float and producing RGBE.
+	void (*sampleFacesRgbe)(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+		u32* out_color);
+
+	// sampleFaces on sRGB faces, filtering in linear light and producing
+	// sRGB; see SrgbTables.
+	void (*sampleFacesSrgb)(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+		u32* out_color);
+};
+
+enum SampleFilter {
+	FILTER_FLOAT,
+	FILTER_FIXED,
+	// The only filter for RGBE cubemaps, and only for those.
+	FILTER_RGBE,
+	// Float filtering of TEXELS_SRGB8 cubemaps, and only of those, in linear
+	// light. AA samples average in linear light too.
+	FILTER_SRGB
+};
+
+extern const SampleKernel sample_kernel_scalar;
+extern const SampleKernel sample_kernel_sse2;
+extern const SampleKernel sample_kernel_avx2;
+extern const SampleKernel sample_kernel_neon;
+
+// Returns whether the kernel was compiled in and is supported by this CPU.
+bool isSampleKernelSupported(const SampleKernel& kernel);
+
+// Returns the widest kernel supported by this CPU.
+const SampleKernel& bestSampleKernel();
+
+// Looks up a kernel by name ("auto" selects bestSampleKernel()). Returns
+// nullptr if the name is unknown or the kernel can't run on this machine.
+const SampleKernel* findSampleKernel(const std::string& name);
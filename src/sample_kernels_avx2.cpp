@@ -0,0 +1,358 @@
+#include "sample_kernels.hpp"
+
+// Only the functions below are compiled for AVX2, through the target attribute
+// rather than a per-file -mavx2. That way inline functions from the headers
+// are never emitted as AVX2 code that the linker could pick for other files.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define AVX2_FUNCTION
+#endif
+
+#ifdef AVX2_FUNCTION
+#include <immintrin.h>
+
+namespace {
+
+AVX2_FUNCTION inline __m256 mix(__m256 a, __m256 b, __m256 t) {
+	return _mm256_add_ps(_mm256_mul_ps(a, _mm256_sub_ps(_mm256_set1_ps(1.f), t)), _mm256_mul_ps(b, t));
+}
+
+// Mirrors Colorf(u32): separates the channels and maps them to [0, 1].
+AVX2_FUNCTION inline void unpackColor(__m256i col, __m256& r, __m256& g, __m256& b) {
+	const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+	const __m256 scale = _mm256_set1_ps(255.f);
+	r = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(col, byte_mask)), scale);
+	g = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(col, 8), byte_mask)), scale);
+	b = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(col, 16), byte_mask)), scale);
+}
+
+// Mirrors Colorf::toU32.
+AVX2_FUNCTION inline __m256i packColor(__m256 r, __m256 g, __m256 b) {
+	const __m256 scale = _mm256_set1_ps(255.f);
+	__m256i ri = _mm256_cvttps_epi32(_mm256_mul_ps(r, scale));
+	__m256i gi = _mm256_cvttps_epi32(_mm256_mul_ps(g, scale));
+	__m256i bi = _mm256_cvttps_epi32(_mm256_mul_ps(b, scale));
+	__m256i col = _mm256_or_si256(ri, _mm256_or_si256(_mm256_slli_epi32(gi, 8), _mm256_slli_epi32(bi, 16)));
+	return _mm256_or_si256(col, _mm256_set1_epi32(0xFF << 24));
+}
+
+// Mirrors Colorf::fromRgbe.
+AVX2_FUNCTION inline void unpackRgbe(__m256i texel, __m256& r, __m256& g, __m256& b) {
+	const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+	const __m256i exponent = _mm256_srli_epi32(texel, 24);
+	const __m256i normal = _mm256_cmpgt_epi32(exponent, _mm256_set1_epi32(9));
+	const __m256 scale = _mm256_castsi256_ps(_mm256_and_si256(normal,
+		_mm256_slli_epi32(_mm256_sub_epi32(exponent, _mm256_set1_epi32(9)), 23)));
+	r = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(texel, byte_mask)), scale);
+	g = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 8), byte_mask)), scale);
+	b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 16), byte_mask)), scale);
+}
+
+// Mirrors makeRgbe.
+AVX2_FUNCTION inline __m256i packRgbe(__m256 r, __m256 g, __m256 b) {
+	const __m256 v = _mm256_max_ps(r, _mm256_max_ps(g, b));
+	const __m256i visible = _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_set1_ps(1e-32f), _CMP_GE_OQ));
+	const __m256i exponent_field = _mm256_srli_epi32(_mm256_castps_si256(v), 23);
+	const __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_sub_epi32(_mm256_set1_epi32(261), exponent_field), 23));
+
+	const __m256i ri = _mm256_cvttps_epi32(_mm256_mul_ps(r, scale));
+	const __m256i gi = _mm256_cvttps_epi32(_mm256_mul_ps(g, scale));
+	const __m256i bi = _mm256_cvttps_epi32(_mm256_mul_ps(b, scale));
+	const __m256i ei = _mm256_add_epi32(exponent_field, _mm256_set1_epi32(2));
+	const __m256i col = _mm256_or_si256(_mm256_or_si256(ri, _mm256_slli_epi32(gi, 8)),
+		_mm256_or_si256(_mm256_slli_epi32(bi, 16), _mm256_slli_epi32(ei, 24)));
+	return _mm256_and_si256(col, visible);
+}
+
+// Mirrors Colorf::fromSrgb with a gather per channel.
+AVX2_FUNCTION inline void unpackSrgb(__m256i col, __m256& r, __m256& g, __m256& b) {
+	const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+	const float* to_linear = srgb_tables.to_linear;
+	r = _mm256_i32gather_ps(to_linear, _mm256_and_si256(col, byte_mask), 4);
+	g = _mm256_i32gather_ps(to_linear, _mm256_and_si256(_mm256_srli_epi32(col, 8), byte_mask), 4);
+	b = _mm256_i32gather_ps(to_linear, _mm256_and_si256(_mm256_srli_epi32(col, 16), byte_mask), 4);
+}
+
+// Mirrors linearToSrgb. The bucket codes are gathered four bytes at a time,
+// which their padding allows, and masked down to one.
+AVX2_FUNCTION inline __m256i encodeSrgb(__m256 v) {
+	const __m256 clamped = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.f));
+	const __m256i bucket = _mm256_cvttps_epi32(_mm256_min_ps(
+		_mm256_mul_ps(clamped, _mm256_set1_ps(float(SrgbTables::num_buckets))), _mm256_set1_ps(SrgbTables::num_buckets - 1.f)));
+	const __m256i code = _mm256_and_si256(_mm256_i32gather_epi32(
+		reinterpret_cast<const int*>(srgb_tables.bucket_codes), bucket, 1), _mm256_set1_epi32(0xFF));
+	const __m256 next_boundary = _mm256_i32gather_ps(srgb_tables.boundaries + 1, code, 4);
+	// The comparison is all ones, -1, where the next code is nearer.
+	return _mm256_sub_epi32(code, _mm256_castps_si256(_mm256_cmp_ps(clamped, next_boundary, _CMP_GE_OQ)));
+}
+
+// Mirrors Colorf::toSrgb.
+AVX2_FUNCTION inline __m256i packSrgb(__m256 r, __m256 g, __m256 b) {
+	const __m256i col = _mm256_or_si256(encodeSrgb(r),
+		_mm256_or_si256(_mm256_slli_epi32(encodeSrgb(g), 8), _mm256_slli_epi32(encodeSrgb(b), 16)));
+	return _mm256_or_si256(col, _mm256_set1_epi32(0xFF << 24));
+}
+
+AVX2_FUNCTION void projectDirectionsAvx2(int count, const float* vx, const float* vy, const float* vz,
+	u8* out_face, float* out_s, float* out_t)
+{
+	const __m256 sign_mask = _mm256_set1_ps(-0.f);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 one = _mm256_set1_ps(1.f);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const __m256 x = _mm256_loadu_ps(vx + i);
+		const __m256 y = _mm256_loadu_ps(vy + i);
+		const __m256 z = _mm256_loadu_ps(vz + i);
+
+		const __m256 ax = _mm256_andnot_ps(sign_mask, x);
+		const __m256 ay = _mm256_andnot_ps(sign_mask, y);
+		const __m256 az = _mm256_andnot_ps(sign_mask, z);
+
+		// Same tie-breaking order as computeTexCoords: X, then Y, then Z.
+		const __m256 is_x = _mm256_and_ps(_mm256_cmp_ps(ax, ay, _CMP_GE_OQ), _mm256_cmp_ps(ax, az, _CMP_GE_OQ));
+		const __m256 is_y = _mm256_andnot_ps(is_x,
+			_mm256_and_ps(_mm256_cmp_ps(ay, ax, _CMP_GE_OQ), _mm256_cmp_ps(ay, az, _CMP_GE_OQ)));
+		const __m256 is_z = _mm256_andnot_ps(_mm256_or_ps(is_x, is_y), _mm256_cmp_ps(x, x, _CMP_EQ_OQ));
+
+		const __m256 major = _mm256_blendv_ps(_mm256_blendv_ps(z, y, is_y), x, is_x);
+		const __m256 m = _mm256_blendv_ps(_mm256_blendv_ps(az, ay, is_y), ax, is_x);
+		const __m256 is_neg = _mm256_cmp_ps(major, _mm256_setzero_ps(), _CMP_LT_OQ);
+		const __m256 neg_sign = _mm256_and_ps(is_neg, sign_mask);
+
+		const __m256 neg_y = _mm256_xor_ps(y, sign_mask);
+		const __m256 s_x = _mm256_xor_ps(z, _mm256_xor_ps(sign_mask, neg_sign)); // -z on +X, z on -X
+		const __m256 s_z = _mm256_xor_ps(x, neg_sign);                           //  x on +Z, -x on -Z
+		const __m256 t_y = _mm256_xor_ps(z, neg_sign);                           //  z on +Y, -z on -Y
+
+		const __m256 tmp_s = _mm256_blendv_ps(_mm256_blendv_ps(s_z, x, is_y), s_x, is_x);
+		const __m256 tmp_t = _mm256_blendv_ps(neg_y, t_y, is_y);
+
+		_mm256_storeu_ps(out_s + i, _mm256_mul_ps(half, _mm256_add_ps(_mm256_div_ps(tmp_s, m), one)));
+		_mm256_storeu_ps(out_t + i, _mm256_mul_ps(half, _mm256_add_ps(_mm256_div_ps(tmp_t, m), one)));
+
+		__m256i face = _mm256_and_si256(_mm256_castps_si256(is_z), _mm256_set1_epi32(4));
+		face = _mm256_or_si256(face, _mm256_and_si256(_mm256_castps_si256(is_y), _mm256_set1_epi32(2)));
+		face = _mm256_or_si256(face, _mm256_and_si256(_mm256_castps_si256(is_neg), _mm256_set1_epi32(1)));
+
+		__m128i face_packed = _mm_packs_epi32(_mm256_castsi256_si128(face), _mm256_extracti128_si256(face, 1));
+		face_packed = _mm_packus_epi16(face_packed, face_packed);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out_face + i), face_packed);
+	}
+
+	sample_kernel_scalar.projectDirections(count - i, vx + i, vy + i, vz + i, out_face + i, out_s + i, out_t + i);
+}
+
+// Widths and heights of the faces for the gathers below. Faces that are still
+// loading can't be touched, but they also won't be referenced by any of the
+// samples.
+struct FaceSizes {
+	int widths[Cubemap::NUM_FACES];
+	int heights[Cubemap::NUM_FACES];
+
+	explicit FaceSizes(const Cubemap& cubemap) {
+		const unsigned ready_faces = cubemap.readyFaces();
+		for (int f = 0; f < Cubemap::NUM_FACES; ++f) {
+			const bool ready = (ready_faces & Cubemap::faceBit(Cubemap::CubeFace(f))) != 0;
+			widths[f] = ready ? cubemap.faces[f].width : 0;
+			heights[f] = ready ? cubemap.faces[f].height : 0;
+		}
+	}
+};
+
+// Fetches the four bilinear taps of the next 8 samples and their fractional
+// positions between the taps, as Cubemap::sampleFace does.
+AVX2_FUNCTION inline void fetchTexels(const Cubemap& cubemap, const FaceSizes& sizes,
+	const u8* face, const float* s, const float* t, __m256i* out_texels, __m256& out_x_fract, __m256& out_y_fract)
+{
+	const __m256i face_index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(face)));
+	const __m256 width = _mm256_cvtepi32_ps(_mm256_i32gather_epi32(sizes.widths, face_index, 4));
+	const __m256 height = _mm256_cvtepi32_ps(_mm256_i32gather_epi32(sizes.heights, face_index, 4));
+
+	// Mirrors Cubemap::borderCoord.
+	const __m256 offset = _mm256_set1_ps(Cubemap::face_border - 0.5f);
+	const __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(s), width), offset);
+	const __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(t), height), offset);
+	const __m256i x_base = _mm256_cvttps_epi32(x);
+	const __m256i y_base = _mm256_cvttps_epi32(y);
+	out_x_fract = _mm256_sub_ps(x, _mm256_cvtepi32_ps(x_base));
+	out_y_fract = _mm256_sub_ps(y, _mm256_cvtepi32_ps(y_base));
+
+	int xb[8], yb[8];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(xb), x_base);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(yb), y_base);
+
+	// Faces are separate allocations, so the texel fetch can't be a single
+	// 32-bit-indexed hardware gather; do it per lane instead.
+	u32 texels[4][8];
+	for (int k = 0; k < 8; ++k) {
+		u32 taps[4];
+		cubemap.readFootprint(Cubemap::CubeFace(face[k]), xb[k], yb[k], taps);
+		for (int tap = 0; tap < 4; ++tap)
+			texels[tap][k] = taps[tap];
+	}
+
+	for (int k = 0; k < 4; ++k)
+		out_texels[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(texels[k]));
+}
+
+AVX2_FUNCTION void sampleFacesAvx2(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	const FaceSizes sizes(cubemap);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i texels[4];
+		__m256 x_fract, y_fract;
+		fetchTexels(cubemap, sizes, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		__m256 r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackColor(texels[k], r[k], g[k], b[k]);
+
+		const __m256 r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const __m256 g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const __m256 b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		const __m256i col = packColor(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out_color + i), col);
+	}
+
+	sample_kernel_scalar.sampleFaces(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+AVX2_FUNCTION void sampleFacesRgbeAvx2(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	const FaceSizes sizes(cubemap);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i texels[4];
+		__m256 x_fract, y_fract;
+		fetchTexels(cubemap, sizes, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		__m256 r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackRgbe(texels[k], r[k], g[k], b[k]);
+
+		const __m256 r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const __m256 g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const __m256 b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		const __m256i col = packRgbe(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out_color + i), col);
+	}
+
+	sample_kernel_scalar.sampleFacesRgbe(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+AVX2_FUNCTION void sampleFacesSrgbAvx2(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	const FaceSizes sizes(cubemap);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i texels[4];
+		__m256 x_fract, y_fract;
+		fetchTexels(cubemap, sizes, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		__m256 r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackSrgb(texels[k], r[k], g[k], b[k]);
+
+		const __m256 r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const __m256 g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const __m256 b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		const __m256i col = packSrgb(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out_color + i), col);
+	}
+
+	sample_kernel_scalar.sampleFacesSrgb(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+// Mirrors fixedWeight.
+AVX2_FUNCTION inline __m256i fixedWeights(__m256 fract) {
+	return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(fract, _mm256_set1_ps(65535.f)), _mm256_set1_ps(0.5f)));
+}
+
+// Spreads the 32-bit weights over the four 16-bit channel lanes of their
+// sample, matching the in-lane byte unpacks: Lo covers samples 0, 1, 4 and 5,
+// Hi samples 2, 3, 6 and 7.
+AVX2_FUNCTION inline __m256i spreadWeightsLo(__m256i w) {
+	const __m256i pairs = _mm256_unpacklo_epi32(w, w);
+	return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pairs, _MM_SHUFFLE(0, 0, 0, 0)), _MM_SHUFFLE(0, 0, 0, 0));
+}
+
+AVX2_FUNCTION inline __m256i spreadWeightsHi(__m256i w) {
+	const __m256i pairs = _mm256_unpackhi_epi32(w, w);
+	return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pairs, _MM_SHUFFLE(0, 0, 0, 0)), _MM_SHUFFLE(0, 0, 0, 0));
+}
+
+// Mirrors mixFixed on 16-bit lanes.
+AVX2_FUNCTION inline __m256i mixFixed(__m256i a, __m256i b, __m256i w) {
+	const __m256i w_a = _mm256_sub_epi16(_mm256_set1_epi16(-1), w);
+	return _mm256_add_epi16(_mm256_mulhi_epu16(a, w_a), _mm256_mulhi_epu16(b, w));
+}
+
+// Blends four samples' worth of 8.8 channels and rounds them back to 8 bits.
+AVX2_FUNCTION inline __m256i blendFixed(const __m256i* taps, __m256i x_weight, __m256i y_weight) {
+	const __m256i mix_0 = mixFixed(taps[0], taps[1], x_weight);
+	const __m256i mix_1 = mixFixed(taps[2], taps[3], x_weight);
+	const __m256i mix_final = mixFixed(mix_0, mix_1, y_weight);
+	return _mm256_srli_epi16(_mm256_add_epi16(mix_final, _mm256_set1_epi16(0x80)), 8);
+}
+
+AVX2_FUNCTION void sampleFacesFixedAvx2(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	const FaceSizes sizes(cubemap);
+	const __m256i zero = _mm256_setzero_si256();
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i texels[4];
+		__m256 x_fract, y_fract;
+		fetchTexels(cubemap, sizes, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		const __m256i x_weight = fixedWeights(x_fract);
+		const __m256i y_weight = fixedWeights(y_fract);
+
+		// Putting the zero byte first leaves every channel scaled to 8.8.
+		__m256i taps_lo[4], taps_hi[4];
+		for (int k = 0; k < 4; ++k) {
+			taps_lo[k] = _mm256_unpacklo_epi8(zero, texels[k]);
+			taps_hi[k] = _mm256_unpackhi_epi8(zero, texels[k]);
+		}
+
+		// The in-lane pack puts the samples back in order.
+		const __m256i col_lo = blendFixed(taps_lo, spreadWeightsLo(x_weight), spreadWeightsLo(y_weight));
+		const __m256i col_hi = blendFixed(taps_hi, spreadWeightsHi(x_weight), spreadWeightsHi(y_weight));
+		const __m256i col = _mm256_or_si256(_mm256_packus_epi16(col_lo, col_hi), _mm256_set1_epi32(0xFF << 24));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out_color + i), col);
+	}
+
+	sample_kernel_scalar.sampleFacesFixed(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+} // namespace
+
+const SampleKernel sample_kernel_avx2 = {
+	"avx2",
+	projectDirectionsAvx2,
+	sampleFacesAvx2,
+	sampleFacesFixedAvx2,
+	sampleFacesRgbeAvx2,
+	sampleFacesSrgbAvx2
+};
+
+#else
+
+const SampleKernel sample_kernel_avx2 = { "avx2", nullptr, nullptr, nullptr, nullptr, nullptr };
+
+#endif
@@ -0,0 +1,332 @@
+#include "sample_kernels.hpp"
+
+// Needs vdivq_f32 to stay bit-identical with the scalar path, which only
+// exists on AArch64.
+#if defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+
+namespace {
+
+inline float32x4_t mix(float32x4_t a, float32x4_t b, float32x4_t t) {
+	return vaddq_f32(vmulq_f32(a, vsubq_f32(vdupq_n_f32(1.f), t)), vmulq_f32(b, t));
+}
+
+// Mirrors Colorf(u32): separates the channels and maps them to [0, 1].
+inline void unpackColor(uint32x4_t col, float32x4_t& r, float32x4_t& g, float32x4_t& b) {
+	const uint32x4_t byte_mask = vdupq_n_u32(0xFF);
+	const float32x4_t scale = vdupq_n_f32(255.f);
+	r = vdivq_f32(vcvtq_f32_u32(vandq_u32(col, byte_mask)), scale);
+	g = vdivq_f32(vcvtq_f32_u32(vandq_u32(vshrq_n_u32(col, 8), byte_mask)), scale);
+	b = vdivq_f32(vcvtq_f32_u32(vandq_u32(vshrq_n_u32(col, 16), byte_mask)), scale);
+}
+
+// Mirrors Colorf::toU32.
+inline uint32x4_t packColor(float32x4_t r, float32x4_t g, float32x4_t b) {
+	const float32x4_t scale = vdupq_n_f32(255.f);
+	uint32x4_t ri = vcvtq_u32_f32(vmulq_f32(r, scale));
+	uint32x4_t gi = vcvtq_u32_f32(vmulq_f32(g, scale));
+	uint32x4_t bi = vcvtq_u32_f32(vmulq_f32(b, scale));
+	uint32x4_t col = vorrq_u32(ri, vorrq_u32(vshlq_n_u32(gi, 8), vshlq_n_u32(bi, 16)));
+	return vorrq_u32(col, vdupq_n_u32(0xFFu << 24));
+}
+
+// Mirrors Colorf::fromRgbe.
+inline void unpackRgbe(uint32x4_t texel, float32x4_t& r, float32x4_t& g, float32x4_t& b) {
+	const uint32x4_t byte_mask = vdupq_n_u32(0xFF);
+	const uint32x4_t exponent = vshrq_n_u32(texel, 24);
+	const uint32x4_t normal = vcgtq_u32(exponent, vdupq_n_u32(9));
+	const float32x4_t scale = vreinterpretq_f32_u32(vandq_u32(normal, vshlq_n_u32(vsubq_u32(exponent, vdupq_n_u32(9)), 23)));
+	r = vmulq_f32(vcvtq_f32_u32(vandq_u32(texel, byte_mask)), scale);
+	g = vmulq_f32(vcvtq_f32_u32(vandq_u32(vshrq_n_u32(texel, 8), byte_mask)), scale);
+	b = vmulq_f32(vcvtq_f32_u32(vandq_u32(vshrq_n_u32(texel, 16), byte_mask)), scale);
+}
+
+// Mirrors makeRgbe.
+inline uint32x4_t packRgbe(float32x4_t r, float32x4_t g, float32x4_t b) {
+	const float32x4_t v = vmaxq_f32(r, vmaxq_f32(g, b));
+	const uint32x4_t visible = vcgeq_f32(v, vdupq_n_f32(1e-32f));
+	const uint32x4_t exponent_field = vshrq_n_u32(vreinterpretq_u32_f32(v), 23);
+	const float32x4_t scale = vreinterpretq_f32_u32(vshlq_n_u32(vsubq_u32(vdupq_n_u32(261), exponent_field), 23));
+
+	const uint32x4_t ri = vcvtq_u32_f32(vmulq_f32(r, scale));
+	const uint32x4_t gi = vcvtq_u32_f32(vmulq_f32(g, scale));
+	const uint32x4_t bi = vcvtq_u32_f32(vmulq_f32(b, scale));
+	const uint32x4_t ei = vaddq_u32(exponent_field, vdupq_n_u32(2));
+	const uint32x4_t col = vorrq_u32(vorrq_u32(ri, vshlq_n_u32(gi, 8)), vorrq_u32(vshlq_n_u32(bi, 16), vshlq_n_u32(ei, 24)));
+	return vandq_u32(col, visible);
+}
+
+// Mirrors Colorf::fromSrgb. NEON has no gathers, so the lookups are scalar.
+inline void unpackSrgb(uint32x4_t col, float32x4_t& r, float32x4_t& g, float32x4_t& b) {
+	u32 texels[4];
+	vst1q_u32(texels, col);
+	const float* to_linear = srgb_tables.to_linear;
+	float channels[3][4];
+	for (int k = 0; k < 4; ++k) {
+		channels[0][k] = to_linear[texels[k] & 0xFF];
+		channels[1][k] = to_linear[texels[k] >> 8 & 0xFF];
+		channels[2][k] = to_linear[texels[k] >> 16 & 0xFF];
+	}
+	r = vld1q_f32(channels[0]);
+	g = vld1q_f32(channels[1]);
+	b = vld1q_f32(channels[2]);
+}
+
+// Mirrors linearToSrgb.
+inline uint32x4_t encodeSrgb(float32x4_t v) {
+	const float32x4_t clamped = vminq_f32(vmaxq_f32(v, vdupq_n_f32(0.f)), vdupq_n_f32(1.f));
+	const uint32x4_t bucket = vcvtq_u32_f32(vminq_f32(vmulq_f32(clamped, vdupq_n_f32(float(SrgbTables::num_buckets))),
+		vdupq_n_f32(SrgbTables::num_buckets - 1.f)));
+
+	float values[4];
+	u32 buckets[4], codes[4];
+	vst1q_f32(values, clamped);
+	vst1q_u32(buckets, bucket);
+	for (int k = 0; k < 4; ++k) {
+		const u32 code = srgb_tables.bucket_codes[buckets[k]];
+		codes[k] = values[k] >= srgb_tables.boundaries[code + 1] ? code + 1 : code;
+	}
+	return vld1q_u32(codes);
+}
+
+// Mirrors Colorf::toSrgb.
+inline uint32x4_t packSrgb(float32x4_t r, float32x4_t g, float32x4_t b) {
+	const uint32x4_t col = vorrq_u32(encodeSrgb(r), vorrq_u32(vshlq_n_u32(encodeSrgb(g), 8), vshlq_n_u32(encodeSrgb(b), 16)));
+	return vorrq_u32(col, vdupq_n_u32(0xFFu << 24));
+}
+
+void projectDirectionsNeon(int count, const float* vx, const float* vy, const float* vz,
+	u8* out_face, float* out_s, float* out_t)
+{
+	const float32x4_t half = vdupq_n_f32(0.5f);
+	const float32x4_t one = vdupq_n_f32(1.f);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const float32x4_t x = vld1q_f32(vx + i);
+		const float32x4_t y = vld1q_f32(vy + i);
+		const float32x4_t z = vld1q_f32(vz + i);
+
+		const float32x4_t ax = vabsq_f32(x);
+		const float32x4_t ay = vabsq_f32(y);
+		const float32x4_t az = vabsq_f32(z);
+
+		// Same tie-breaking order as computeTexCoords: X, then Y, then Z.
+		const uint32x4_t is_x = vandq_u32(vcgeq_f32(ax, ay), vcgeq_f32(ax, az));
+		const uint32x4_t is_y = vbicq_u32(vandq_u32(vcgeq_f32(ay, ax), vcgeq_f32(ay, az)), is_x);
+		const uint32x4_t is_z = vmvnq_u32(vorrq_u32(is_x, is_y));
+
+		const float32x4_t major = vbslq_f32(is_x, x, vbslq_f32(is_y, y, z));
+		const float32x4_t m = vbslq_f32(is_x, ax, vbslq_f32(is_y, ay, az));
+		const uint32x4_t is_neg = vcltq_f32(major, vdupq_n_f32(0.f));
+
+		const float32x4_t neg_x = vnegq_f32(x);
+		const float32x4_t neg_y = vnegq_f32(y);
+		const float32x4_t neg_z = vnegq_f32(z);
+		const float32x4_t s_x = vbslq_f32(is_neg, z, neg_z); // -z on +X, z on -X
+		const float32x4_t s_z = vbslq_f32(is_neg, neg_x, x); //  x on +Z, -x on -Z
+		const float32x4_t t_y = vbslq_f32(is_neg, neg_z, z); //  z on +Y, -z on -Y
+
+		const float32x4_t tmp_s = vbslq_f32(is_x, s_x, vbslq_f32(is_y, x, s_z));
+		const float32x4_t tmp_t = vbslq_f32(is_y, t_y, neg_y);
+
+		vst1q_f32(out_s + i, vmulq_f32(half, vaddq_f32(vdivq_f32(tmp_s, m), one)));
+		vst1q_f32(out_t + i, vmulq_f32(half, vaddq_f32(vdivq_f32(tmp_t, m), one)));
+
+		uint32x4_t face = vandq_u32(is_z, vdupq_n_u32(4));
+		face = vorrq_u32(face, vandq_u32(is_y, vdupq_n_u32(2)));
+		face = vorrq_u32(face, vandq_u32(is_neg, vdupq_n_u32(1)));
+
+		u32 faces[4];
+		vst1q_u32(faces, face);
+		for (int k = 0; k < 4; ++k)
+			out_face[i + k] = static_cast<u8>(faces[k]);
+	}
+
+	sample_kernel_scalar.projectDirections(count - i, vx + i, vy + i, vz + i, out_face + i, out_s + i, out_t + i);
+}
+
+// Fetches the four bilinear taps of the next 4 samples and their fractional
+// positions between the taps, as Cubemap::sampleFace does.
+inline void fetchTexels(const Cubemap& cubemap, const u8* face, const float* s, const float* t,
+	uint32x4_t* out_texels, float32x4_t& out_x_fract, float32x4_t& out_y_fract)
+{
+	int widths[4], heights[4];
+	for (int k = 0; k < 4; ++k) {
+		widths[k] = cubemap.faces[face[k]].width;
+		heights[k] = cubemap.faces[face[k]].height;
+	}
+
+	// Mirrors Cubemap::borderCoord.
+	const float32x4_t offset = vdupq_n_f32(Cubemap::face_border - 0.5f);
+	const float32x4_t x = vaddq_f32(vmulq_f32(vld1q_f32(s), vcvtq_f32_s32(vld1q_s32(widths))), offset);
+	const float32x4_t y = vaddq_f32(vmulq_f32(vld1q_f32(t), vcvtq_f32_s32(vld1q_s32(heights))), offset);
+	const int32x4_t x_base = vcvtq_s32_f32(x);
+	const int32x4_t y_base = vcvtq_s32_f32(y);
+	out_x_fract = vsubq_f32(x, vcvtq_f32_s32(x_base));
+	out_y_fract = vsubq_f32(y, vcvtq_f32_s32(y_base));
+
+	int xb[4], yb[4];
+	vst1q_s32(xb, x_base);
+	vst1q_s32(yb, y_base);
+
+	u32 texels[4][4];
+	for (int k = 0; k < 4; ++k) {
+		u32 taps[4];
+		cubemap.readFootprint(Cubemap::CubeFace(face[k]), xb[k], yb[k], taps);
+		for (int tap = 0; tap < 4; ++tap)
+			texels[tap][k] = taps[tap];
+	}
+
+	for (int k = 0; k < 4; ++k)
+		out_texels[k] = vld1q_u32(texels[k]);
+}
+
+void sampleFacesNeon(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint32x4_t texels[4];
+		float32x4_t x_fract, y_fract;
+		fetchTexels(cubemap, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		float32x4_t r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackColor(texels[k], r[k], g[k], b[k]);
+
+		const float32x4_t r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const float32x4_t g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const float32x4_t b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		vst1q_u32(out_color + i, packColor(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract)));
+	}
+
+	sample_kernel_scalar.sampleFaces(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+void sampleFacesRgbeNeon(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint32x4_t texels[4];
+		float32x4_t x_fract, y_fract;
+		fetchTexels(cubemap, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		float32x4_t r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackRgbe(texels[k], r[k], g[k], b[k]);
+
+		const float32x4_t r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const float32x4_t g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const float32x4_t b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		vst1q_u32(out_color + i, packRgbe(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract)));
+	}
+
+	sample_kernel_scalar.sampleFacesRgbe(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+void sampleFacesSrgbNeon(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint32x4_t texels[4];
+		float32x4_t x_fract, y_fract;
+		fetchTexels(cubemap, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		float32x4_t r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackSrgb(texels[k], r[k], g[k], b[k]);
+
+		const float32x4_t r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const float32x4_t g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const float32x4_t b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		vst1q_u32(out_color + i, packSrgb(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract)));
+	}
+
+	sample_kernel_scalar.sampleFacesSrgb(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+// Mirrors fixedWeight.
+inline uint16x4_t fixedWeights(float32x4_t fract) {
+	return vmovn_u32(vcvtq_u32_f32(vaddq_f32(vmulq_f32(fract, vdupq_n_f32(65535.f)), vdupq_n_f32(0.5f))));
+}
+
+// Spreads the weights of two samples over the four 16-bit channel lanes of
+// each.
+inline uint16x8_t spreadWeightsLo(uint16x4_t w) {
+	return vcombine_u16(vdup_lane_u16(w, 0), vdup_lane_u16(w, 1));
+}
+
+inline uint16x8_t spreadWeightsHi(uint16x4_t w) {
+	return vcombine_u16(vdup_lane_u16(w, 2), vdup_lane_u16(w, 3));
+}
+
+inline uint16x8_t mulhi(uint16x8_t a, uint16x8_t b) {
+	const uint32x4_t lo = vmull_u16(vget_low_u16(a), vget_low_u16(b));
+	const uint32x4_t hi = vmull_u16(vget_high_u16(a), vget_high_u16(b));
+	return vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16));
+}
+
+// Mirrors mixFixed on 16-bit lanes.
+inline uint16x8_t mixFixed(uint16x8_t a, uint16x8_t b, uint16x8_t w) {
+	return vaddq_u16(mulhi(a, vmvnq_u16(w)), mulhi(b, w));
+}
+
+// Blends two samples' worth of 8.8 channels and rounds them back to 8 bits.
+inline uint8x8_t blendFixed(const uint16x8_t* taps, uint16x8_t x_weight, uint16x8_t y_weight) {
+	const uint16x8_t mix_0 = mixFixed(taps[0], taps[1], x_weight);
+	const uint16x8_t mix_1 = mixFixed(taps[2], taps[3], x_weight);
+	const uint16x8_t mix_final = mixFixed(mix_0, mix_1, y_weight);
+	return vshrn_n_u16(vaddq_u16(mix_final, vdupq_n_u16(0x80)), 8);
+}
+
+void sampleFacesFixedNeon(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint32x4_t texels[4];
+		float32x4_t x_fract, y_fract;
+		fetchTexels(cubemap, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		const uint16x4_t x_weight = fixedWeights(x_fract);
+		const uint16x4_t y_weight = fixedWeights(y_fract);
+
+		// Widening by a shift of 8 scales every channel to 8.8.
+		uint16x8_t taps_lo[4], taps_hi[4];
+		for (int k = 0; k < 4; ++k) {
+			const uint8x16_t bytes = vreinterpretq_u8_u32(texels[k]);
+			taps_lo[k] = vshll_n_u8(vget_low_u8(bytes), 8);
+			taps_hi[k] = vshll_n_u8(vget_high_u8(bytes), 8);
+		}
+
+		const uint8x8_t col_lo = blendFixed(taps_lo, spreadWeightsLo(x_weight), spreadWeightsLo(y_weight));
+		const uint8x8_t col_hi = blendFixed(taps_hi, spreadWeightsHi(x_weight), spreadWeightsHi(y_weight));
+		const uint32x4_t col = vreinterpretq_u32_u8(vcombine_u8(col_lo, col_hi));
+		vst1q_u32(out_color + i, vorrq_u32(col, vdupq_n_u32(0xFFu << 24)));
+	}
+
+	sample_kernel_scalar.sampleFacesFixed(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+} // namespace
+
+const SampleKernel sample_kernel_neon = {
+	"neon",
+	projectDirectionsNeon,
+	sampleFacesNeon,
+	sampleFacesFixedNeon,
+	sampleFacesRgbeNeon,
+	sampleFacesSrgbNeon
+};
+
+#else
+
+const SampleKernel sample_kernel_neon = { "neon", nullptr, nullptr, nullptr, nullptr, nullptr };
+
+#endif
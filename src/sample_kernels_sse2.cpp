@@ -0,0 +1,337 @@
+#include "sample_kernels.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+namespace {
+
+inline __m128 select(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+inline __m128 mix(__m128 a, __m128 b, __m128 t) {
+	return _mm_add_ps(_mm_mul_ps(a, _mm_sub_ps(_mm_set1_ps(1.f), t)), _mm_mul_ps(b, t));
+}
+
+// Mirrors Colorf(u32): separates the channels and maps them to [0, 1].
+inline void unpackColor(__m128i col, __m128& r, __m128& g, __m128& b) {
+	const __m128i byte_mask = _mm_set1_epi32(0xFF);
+	const __m128 scale = _mm_set1_ps(255.f);
+	r = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(col, byte_mask)), scale);
+	g = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(col, 8), byte_mask)), scale);
+	b = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(col, 16), byte_mask)), scale);
+}
+
+// Mirrors Colorf::toU32.
+inline __m128i packColor(__m128 r, __m128 g, __m128 b) {
+	const __m128 scale = _mm_set1_ps(255.f);
+	__m128i ri = _mm_cvttps_epi32(_mm_mul_ps(r, scale));
+	__m128i gi = _mm_cvttps_epi32(_mm_mul_ps(g, scale));
+	__m128i bi = _mm_cvttps_epi32(_mm_mul_ps(b, scale));
+	__m128i col = _mm_or_si128(ri, _mm_or_si128(_mm_slli_epi32(gi, 8), _mm_slli_epi32(bi, 16)));
+	return _mm_or_si128(col, _mm_set1_epi32(0xFF << 24));
+}
+
+// Mirrors Colorf::fromRgbe.
+inline void unpackRgbe(__m128i texel, __m128& r, __m128& g, __m128& b) {
+	const __m128i byte_mask = _mm_set1_epi32(0xFF);
+	const __m128i exponent = _mm_srli_epi32(texel, 24);
+	const __m128i normal = _mm_cmpgt_epi32(exponent, _mm_set1_epi32(9));
+	const __m128 scale = _mm_castsi128_ps(_mm_and_si128(normal, _mm_slli_epi32(_mm_sub_epi32(exponent, _mm_set1_epi32(9)), 23)));
+	r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(texel, byte_mask)), scale);
+	g = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texel, 8), byte_mask)), scale);
+	b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texel, 16), byte_mask)), scale);
+}
+
+// Mirrors makeRgbe.
+inline __m128i packRgbe(__m128 r, __m128 g, __m128 b) {
+	const __m128 v = _mm_max_ps(r, _mm_max_ps(g, b));
+	const __m128i visible = _mm_castps_si128(_mm_cmpge_ps(v, _mm_set1_ps(1e-32f)));
+	const __m128i exponent_field = _mm_srli_epi32(_mm_castps_si128(v), 23);
+	const __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(261), exponent_field), 23));
+
+	const __m128i ri = _mm_cvttps_epi32(_mm_mul_ps(r, scale));
+	const __m128i gi = _mm_cvttps_epi32(_mm_mul_ps(g, scale));
+	const __m128i bi = _mm_cvttps_epi32(_mm_mul_ps(b, scale));
+	const __m128i ei = _mm_add_epi32(exponent_field, _mm_set1_epi32(2));
+	const __m128i col = _mm_or_si128(_mm_or_si128(ri, _mm_slli_epi32(gi, 8)), _mm_or_si128(_mm_slli_epi32(bi, 16), _mm_slli_epi32(ei, 24)));
+	return _mm_and_si128(col, visible);
+}
+
+// Mirrors Colorf::fromSrgb. SSE2 has no gathers, so the lookups are scalar.
+inline void unpackSrgb(__m128i col, __m128& r, __m128& g, __m128& b) {
+	u32 texels[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(texels), col);
+	const float* to_linear = srgb_tables.to_linear;
+	r = _mm_setr_ps(to_linear[texels[0] & 0xFF], to_linear[texels[1] & 0xFF],
+		to_linear[texels[2] & 0xFF], to_linear[texels[3] & 0xFF]);
+	g = _mm_setr_ps(to_linear[texels[0] >> 8 & 0xFF], to_linear[texels[1] >> 8 & 0xFF],
+		to_linear[texels[2] >> 8 & 0xFF], to_linear[texels[3] >> 8 & 0xFF]);
+	b = _mm_setr_ps(to_linear[texels[0] >> 16 & 0xFF], to_linear[texels[1] >> 16 & 0xFF],
+		to_linear[texels[2] >> 16 & 0xFF], to_linear[texels[3] >> 16 & 0xFF]);
+}
+
+// Mirrors linearToSrgb.
+inline __m128i encodeSrgb(__m128 v) {
+	const __m128 clamped = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.f));
+	const __m128i bucket = _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(clamped, _mm_set1_ps(float(SrgbTables::num_buckets))),
+		_mm_set1_ps(SrgbTables::num_buckets - 1.f)));
+
+	float values[4];
+	int buckets[4], codes[4];
+	_mm_storeu_ps(values, clamped);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(buckets), bucket);
+	for (int k = 0; k < 4; ++k) {
+		const u32 code = srgb_tables.bucket_codes[buckets[k]];
+		codes[k] = values[k] >= srgb_tables.boundaries[code + 1] ? code + 1 : code;
+	}
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes));
+}
+
+// Mirrors Colorf::toSrgb.
+inline __m128i packSrgb(__m128 r, __m128 g, __m128 b) {
+	const __m128i col = _mm_or_si128(encodeSrgb(r),
+		_mm_or_si128(_mm_slli_epi32(encodeSrgb(g), 8), _mm_slli_epi32(encodeSrgb(b), 16)));
+	return _mm_or_si128(col, _mm_set1_epi32(0xFF << 24));
+}
+
+void projectDirectionsSse2(int count, const float* vx, const float* vy, const float* vz,
+	u8* out_face, float* out_s, float* out_t)
+{
+	const __m128 sign_mask = _mm_set1_ps(-0.f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 one = _mm_set1_ps(1.f);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const __m128 x = _mm_loadu_ps(vx + i);
+		const __m128 y = _mm_loadu_ps(vy + i);
+		const __m128 z = _mm_loadu_ps(vz + i);
+
+		const __m128 ax = _mm_andnot_ps(sign_mask, x);
+		const __m128 ay = _mm_andnot_ps(sign_mask, y);
+		const __m128 az = _mm_andnot_ps(sign_mask, z);
+
+		// Same tie-breaking order as computeTexCoords: X, then Y, then Z.
+		const __m128 is_x = _mm_and_ps(_mm_cmpge_ps(ax, ay), _mm_cmpge_ps(ax, az));
+		const __m128 is_y = _mm_andnot_ps(is_x, _mm_and_ps(_mm_cmpge_ps(ay, ax), _mm_cmpge_ps(ay, az)));
+		const __m128 is_z = _mm_andnot_ps(_mm_or_ps(is_x, is_y), _mm_cmpeq_ps(x, x));
+
+		const __m128 major = select(is_x, x, select(is_y, y, z));
+		const __m128 m = select(is_x, ax, select(is_y, ay, az));
+		const __m128 is_neg = _mm_cmplt_ps(major, _mm_setzero_ps());
+		const __m128 neg_sign = _mm_and_ps(is_neg, sign_mask);
+
+		const __m128 neg_y = _mm_xor_ps(y, sign_mask);
+		const __m128 s_x = _mm_xor_ps(z, _mm_xor_ps(sign_mask, neg_sign)); // -z on +X, z on -X
+		const __m128 s_z = _mm_xor_ps(x, neg_sign);                        //  x on +Z, -x on -Z
+		const __m128 t_y = _mm_xor_ps(z, neg_sign);                        //  z on +Y, -z on -Y
+
+		const __m128 tmp_s = select(is_x, s_x, select(is_y, x, s_z));
+		const __m128 tmp_t = select(is_y, t_y, neg_y);
+
+		_mm_storeu_ps(out_s + i, _mm_mul_ps(half, _mm_add_ps(_mm_div_ps(tmp_s, m), one)));
+		_mm_storeu_ps(out_t + i, _mm_mul_ps(half, _mm_add_ps(_mm_div_ps(tmp_t, m), one)));
+
+		__m128i face = _mm_and_si128(_mm_castps_si128(is_z), _mm_set1_epi32(4));
+		face = _mm_or_si128(face, _mm_and_si128(_mm_castps_si128(is_y), _mm_set1_epi32(2)));
+		face = _mm_or_si128(face, _mm_and_si128(_mm_castps_si128(is_neg), _mm_set1_epi32(1)));
+		face = _mm_packs_epi32(face, face);
+		face = _mm_packus_epi16(face, face);
+
+		const int packed_faces = _mm_cvtsi128_si32(face);
+		for (int k = 0; k < 4; ++k)
+			out_face[i + k] = static_cast<u8>(packed_faces >> (k * 8));
+	}
+
+	sample_kernel_scalar.projectDirections(count - i, vx + i, vy + i, vz + i, out_face + i, out_s + i, out_t + i);
+}
+
+// Fetches the four bilinear taps of the next 4 samples and their fractional
+// positions between the taps, as Cubemap::sampleFace does.
+inline void fetchTexels(const Cubemap& cubemap, const u8* face, const float* s, const float* t,
+	__m128i* out_texels, __m128& out_x_fract, __m128& out_y_fract)
+{
+	const Image* face_img[4];
+	for (int k = 0; k < 4; ++k)
+		face_img[k] = &cubemap.faces[face[k]];
+
+	const __m128 width = _mm_cvtepi32_ps(_mm_setr_epi32(
+		face_img[0]->width, face_img[1]->width, face_img[2]->width, face_img[3]->width));
+	const __m128 height = _mm_cvtepi32_ps(_mm_setr_epi32(
+		face_img[0]->height, face_img[1]->height, face_img[2]->height, face_img[3]->height));
+
+	// Mirrors Cubemap::borderCoord.
+	const __m128 offset = _mm_set1_ps(Cubemap::face_border - 0.5f);
+	const __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(s), width), offset);
+	const __m128 y = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(t), height), offset);
+	const __m128i x_base = _mm_cvttps_epi32(x);
+	const __m128i y_base = _mm_cvttps_epi32(y);
+	out_x_fract = _mm_sub_ps(x, _mm_cvtepi32_ps(x_base));
+	out_y_fract = _mm_sub_ps(y, _mm_cvtepi32_ps(y_base));
+
+	int xb[4], yb[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(xb), x_base);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(yb), y_base);
+
+	u32 texels[4][4];
+	for (int k = 0; k < 4; ++k) {
+		u32 taps[4];
+		cubemap.readFootprint(Cubemap::CubeFace(face[k]), xb[k], yb[k], taps);
+		for (int tap = 0; tap < 4; ++tap)
+			texels[tap][k] = taps[tap];
+	}
+
+	for (int k = 0; k < 4; ++k)
+		out_texels[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(texels[k]));
+}
+
+void sampleFacesSse2(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i texels[4];
+		__m128 x_fract, y_fract;
+		fetchTexels(cubemap, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		__m128 r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackColor(texels[k], r[k], g[k], b[k]);
+
+		const __m128 r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const __m128 g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const __m128 b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		const __m128i col = packColor(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out_color + i), col);
+	}
+
+	sample_kernel_scalar.sampleFaces(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+void sampleFacesRgbeSse2(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i texels[4];
+		__m128 x_fract, y_fract;
+		fetchTexels(cubemap, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		__m128 r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackRgbe(texels[k], r[k], g[k], b[k]);
+
+		const __m128 r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const __m128 g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const __m128 b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		const __m128i col = packRgbe(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out_color + i), col);
+	}
+
+	sample_kernel_scalar.sampleFacesRgbe(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+void sampleFacesSrgbSse2(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i texels[4];
+		__m128 x_fract, y_fract;
+		fetchTexels(cubemap, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		__m128 r[4], g[4], b[4];
+		for (int k = 0; k < 4; ++k)
+			unpackSrgb(texels[k], r[k], g[k], b[k]);
+
+		const __m128 r0 = mix(r[0], r[1], x_fract), r1 = mix(r[2], r[3], x_fract);
+		const __m128 g0 = mix(g[0], g[1], x_fract), g1 = mix(g[2], g[3], x_fract);
+		const __m128 b0 = mix(b[0], b[1], x_fract), b1 = mix(b[2], b[3], x_fract);
+
+		const __m128i col = packSrgb(mix(r0, r1, y_fract), mix(g0, g1, y_fract), mix(b0, b1, y_fract));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out_color + i), col);
+	}
+
+	sample_kernel_scalar.sampleFacesSrgb(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+// Mirrors fixedWeight.
+inline __m128i fixedWeights(__m128 fract) {
+	return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(fract, _mm_set1_ps(65535.f)), _mm_set1_ps(0.5f)));
+}
+
+// Spreads the 32-bit weights of samples 0 and 1 (or 2 and 3) over the four
+// 16-bit channel lanes of each sample.
+inline __m128i spreadWeightsLo(__m128i w) {
+	const __m128i pairs = _mm_unpacklo_epi32(w, w);
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(pairs, _MM_SHUFFLE(0, 0, 0, 0)), _MM_SHUFFLE(0, 0, 0, 0));
+}
+
+inline __m128i spreadWeightsHi(__m128i w) {
+	const __m128i pairs = _mm_unpackhi_epi32(w, w);
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(pairs, _MM_SHUFFLE(0, 0, 0, 0)), _MM_SHUFFLE(0, 0, 0, 0));
+}
+
+// Mirrors mixFixed on 16-bit lanes.
+inline __m128i mixFixed(__m128i a, __m128i b, __m128i w) {
+	const __m128i w_a = _mm_sub_epi16(_mm_set1_epi16(-1), w);
+	return _mm_add_epi16(_mm_mulhi_epu16(a, w_a), _mm_mulhi_epu16(b, w));
+}
+
+// Blends two samples' worth of 8.8 channels and rounds them back to 8 bits.
+inline __m128i blendFixed(const __m128i* taps, __m128i x_weight, __m128i y_weight) {
+	const __m128i mix_0 = mixFixed(taps[0], taps[1], x_weight);
+	const __m128i mix_1 = mixFixed(taps[2], taps[3], x_weight);
+	const __m128i mix_final = mixFixed(mix_0, mix_1, y_weight);
+	return _mm_srli_epi16(_mm_add_epi16(mix_final, _mm_set1_epi16(0x80)), 8);
+}
+
+void sampleFacesFixedSse2(const Cubemap& cubemap, int count, const u8* face, const float* s, const float* t,
+	u32* out_color)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i texels[4];
+		__m128 x_fract, y_fract;
+		fetchTexels(cubemap, face + i, s + i, t + i, texels, x_fract, y_fract);
+
+		const __m128i x_weight = fixedWeights(x_fract);
+		const __m128i y_weight = fixedWeights(y_fract);
+
+		// Putting the zero byte first leaves every channel scaled to 8.8.
+		__m128i taps_lo[4], taps_hi[4];
+		for (int k = 0; k < 4; ++k) {
+			taps_lo[k] = _mm_unpacklo_epi8(zero, texels[k]);
+			taps_hi[k] = _mm_unpackhi_epi8(zero, texels[k]);
+		}
+
+		const __m128i col_lo = blendFixed(taps_lo, spreadWeightsLo(x_weight), spreadWeightsLo(y_weight));
+		const __m128i col_hi = blendFixed(taps_hi, spreadWeightsHi(x_weight), spreadWeightsHi(y_weight));
+		const __m128i col = _mm_or_si128(_mm_packus_epi16(col_lo, col_hi), _mm_set1_epi32(0xFF << 24));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out_color + i), col);
+	}
+
+	sample_kernel_scalar.sampleFacesFixed(cubemap, count - i, face + i, s + i, t + i, out_color + i);
+}
+
+} // namespace
+
+const SampleKernel sample_kernel_sse2 = {
+	"sse2",
+	projectDirectionsSse2,
+	sampleFacesSse2,
+	sampleFacesFixedSse2,
+	sampleFacesRgbeSse2,
+	sampleFacesSrgbSse2
+};
+
+#else
+
+const SampleKernel sample_kernel_sse2 = { "sse2", nullptr, nullptr, nullptr, nullptr, nullptr };
+
+#endif
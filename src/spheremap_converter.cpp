@@ -0,0 +1,261 @@
+#include "spheremap_converter.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+bool isFloatFormat(PixelFormat format) {
+	return format == PIXELS_RGB_FLOAT;
+}
+
+bool littleEndian() {
+	const u32 probe = 1;
+	u8 first;
+	std::memcpy(&first, &probe, 1);
+	return first == 1;
+}
+
+// Copies the texels of face into the interior of img, which has the same
+// dimensions, as texel_format.
+void copyFace(const FaceBuffer& face, TexelFormat texel_format, Image& img) {
+	const int bytes = pixelFormatBytes(face.format);
+	const bool bgr = face.format == PIXELS_BGRA8 || face.format == PIXELS_BGR8;
+
+	for (int y = 0; y < face.height; ++y) {
+		const u8* src = static_cast<const u8*>(face.pixels) + face.stride * y;
+		u32* dst = img.pixel(0, y);
+
+		if (isFloatFormat(face.format)) {
+			for (int x = 0; x < face.width; ++x, src += bytes) {
+				float rgb[3];
+				std::memcpy(rgb, src, sizeof(rgb));
+				dst[x] = makeRgbe(rgb[0], rgb[1], rgb[2]);
+			}
+			continue;
+		}
+
+		for (int x = 0; x < face.width; ++x, src += bytes) {
+			const u32 alpha = bytes == 4 ? src[3] : 0xFF;
+			dst[x] = bgr ? src[2] | src[1] << 8 | src[0] << 16 | alpha << 24
+				: src[0] | src[1] << 8 | src[2] << 16 | alpha << 24;
+		}
+	}
+
+	if (texel_format == TEXELS_RGBE && !isFloatFormat(face.format))
+		linearizeToRgbe(img);
+}
+
+// Writes count rendered pixels, 8-bit RGBA or RGBE, to dst as format.
+void convertRow(const u32* src, int count, PixelFormat format, u8* dst) {
+	const int bytes = pixelFormatBytes(format);
+	const bool bgr = format == PIXELS_BGRA8 || format == PIXELS_BGR8;
+
+	for (int x = 0; x < count; ++x, dst += bytes) {
+		if (isFloatFormat(format)) {
+			const Colorf col = Colorf::fromRgbe(src[x]);
+			const float rgb[3] = { col.r, col.g, col.b };
+			std::memcpy(dst, rgb, sizeof(rgb));
+			continue;
+		}
+
+		u8 r, g, b;
+		splitColor(src[x], r, g, b);
+		dst[0] = bgr ? b : r;
+		dst[1] = g;
+		dst[2] = bgr ? r : b;
+		if (bytes == 4)
+			dst[3] = static_cast<u8>(src[x] >> 24);
+	}
+}
+
+} // namespace
+
+ConverterOptions::ConverterOptions() :
+	source(MAPPING_CUBE), target(MAPPING_EQUIRECT),
+	num_aa_samples(1), adaptive_aa(false), aa_threshold(8),
+	kernel(&bestSampleKernel()), filter(FILTER_FLOAT), mipmaps(false),
+	use_lut(false), num_threads(ThreadPool::defaultThreadCount()), use_gpu(false)
+{}
+
+SpheremapConverter::SpheremapConverter(const ConverterOptions& options) :
+	opts(options), aa_sample_pattern(aaSamplePattern(options.num_aa_samples)),
+	thread_pool(options.num_threads), tables_size(0), gpu_checked(false)
+{
+	assert(aa_sample_pattern != nullptr);
+	assert(!opts.adaptive_aa || (!opts.use_lut && opts.target != MAPPING_CUBE && opts.filter != FILTER_RGBE));
+}
+
+GpuRenderer* SpheremapConverter::gpuRenderer() {
+	if (!opts.use_gpu || gpu_checked)
+		return gpu.get();
+	gpu_checked = true;
+
+	if (opts.source != MAPPING_CUBE || (opts.target != MAPPING_EQUIRECT && opts.target != MAPPING_DOME)
+		|| opts.filter != FILTER_FLOAT || opts.mipmaps || opts.adaptive_aa || opts.use_lut)
+	{
+		std::cerr << "The GPU only renders cubes to equirect or dome outputs with float filtering, without mipmaps, "
+			"adaptive AA or a LUT. Rendering on the CPU.\n";
+		return nullptr;
+	}
+
+	gpu.reset(new GpuRenderer);
+	if (!gpu->open()) {
+		gpu.reset();
+		std::cerr << "Rendering on the CPU.\n";
+	}
+	return gpu.get();
+}
+
+RenderSettings SpheremapConverter::settingsFor(int output_size, const OutputRegion& region) {
+	if (output_size != tables_size) {
+		tables_size = output_size;
+		directions.reset(new DirectionTables(opts.target, output_size, output_size, opts.num_aa_samples,
+			aa_sample_pattern));
+		corner_directions.reset(new DirectionTables(opts.target, output_size, output_size + 1, 1, aa_pattern_corner));
+	}
+
+	RenderSettings settings;
+	settings.output_size = output_size;
+	settings.region = region;
+	settings.source = opts.source;
+	settings.target = opts.target;
+	settings.num_aa_samples = opts.num_aa_samples;
+	settings.directions = directions.get();
+	settings.kernel = opts.kernel;
+	settings.filter = opts.filter;
+	settings.mipmaps = opts.mipmaps;
+	settings.corner_directions = corner_directions.get();
+	settings.adaptive_aa = opts.adaptive_aa;
+	settings.aa_threshold = opts.aa_threshold;
+	settings.lut = nullptr;
+	settings.counters = nullptr;
+	settings.tile_faces = nullptr;
+
+	if (opts.use_lut) {
+		ProjectionLut& lut = luts[output_size];
+		if (!lut.matches(output_size, settings.num_aa_samples, settings.source, settings.target, region)) {
+			const std::string& lut_fname = opts.lut_filename;
+			if (lut_fname.empty()
+				|| !lut.load(lut_fname, output_size, settings.num_aa_samples, settings.source, settings.target, region))
+			{
+				lut.build(thread_pool, settings);
+				if (!lut_fname.empty() && !lut.save(lut_fname))
+					std::cerr << "Failed to write " << lut_fname << ".\n";
+			}
+		}
+		settings.lut = &lut;
+	}
+
+	return settings;
+}
+
+bool SpheremapConverter::checkBuffers(const FaceBuffer* faces, unsigned face_mask, int output_size,
+	const OutputRegion& region, const void* out_pixels, std::ptrdiff_t out_stride, PixelFormat out_format) const
+{
+	const bool hdr = opts.filter == FILTER_RGBE;
+
+	for (int i = 0; i < mappingFaces(opts.source); ++i) {
+		if ((face_mask & Cubemap::faceBit(Cubemap::CubeFace(i))) == 0)
+			continue;
+
+		const FaceBuffer& face = faces[i];
+		const std::ptrdiff_t row_bytes = std::ptrdiff_t(face.width) * pixelFormatBytes(face.format);
+		if (face.pixels == nullptr || face.width < 1 || face.height < 1
+			|| (face.stride < 0 ? -face.stride : face.stride) < row_bytes)
+		{
+			std::cerr << "Face " << i + 1 << " has no pixels or overlapping rows.\n";
+			return false;
+		}
+		if (isFloatFormat(face.format) && !hdr) {
+			std::cerr << "Float faces need HDR filtering.\n";
+			return false;
+		}
+	}
+
+	if (output_size < 1 || region.x < 0 || region.y < 0 || region.width < 1 || region.height < 1
+		|| region.x + region.width > output_size || region.y + region.height > outputHeight(output_size))
+	{
+		std::cerr << "Output region lies outside the output.\n";
+		return false;
+	}
+
+	if (out_pixels == nullptr
+		|| (out_stride < 0 ? -out_stride : out_stride) < std::ptrdiff_t(region.width) * pixelFormatBytes(out_format))
+	{
+		std::cerr << "Output buffer has no pixels or overlapping rows.\n";
+		return false;
+	}
+	if (isFloatFormat(out_format) != hdr) {
+		std::cerr << (hdr ? "HDR output must be float.\n" : "Float output needs HDR filtering.\n");
+		return false;
+	}
+	return true;
+}
+
+bool SpheremapConverter::convert(const FaceBuffer* faces, int output_size, void* out_pixels, std::ptrdiff_t out_stride,
+	PixelFormat out_format, const OutputRegion* region)
+{
+	const OutputRegion whole = wholeOutput(opts.target, output_size);
+	const unsigned face_mask = wholeOutputFaces();
+	if (!checkBuffers(faces, face_mask, output_size, region != nullptr ? *region : whole, out_pixels, out_stride,
+		out_format))
+	{
+		return false;
+	}
+
+	const BufferPool::Scope scope(&buffer_pool);
+
+	// Faces that are never read stay empty, which Cubemap leaves out.
+	const int num_faces = mappingFaces(opts.source);
+	thread_pool.parallelFor(num_faces, [&](int i, int) {
+		const BufferPool::Scope worker_scope(&buffer_pool);
+		Image& img = face_storage[i];
+		if ((face_mask & Cubemap::faceBit(Cubemap::CubeFace(i))) == 0) {
+			img = Image();
+			return;
+		}
+		if (img.width != faces[i].width || img.height != faces[i].height || img.border != Cubemap::face_border)
+			img = Image(faces[i].width, faces[i].height, Cubemap::face_border);
+		copyFace(faces[i], texelFormat(), img);
+	});
+
+	const RenderSettings settings = settingsFor(output_size, region != nullptr ? *region : whole);
+	const int row_width = settings.region.width;
+	const int output_rows = settings.region.height;
+	{
+		Cubemap cubemap(face_storage, opts.mipmaps, texelFormat(), opts.source);
+
+		// 8-bit RGBA is what the renderer produces, so a tightly packed
+		// buffer can take the rows as they are.
+		const bool direct = out_format == PIXELS_RGBA8 && out_stride == std::ptrdiff_t(row_width) * 4
+			&& reinterpret_cast<std::uintptr_t>(out_pixels) % alignof(u32) == 0 && littleEndian();
+		u32* rows = static_cast<u32*>(out_pixels);
+		if (!direct) {
+			output_scratch.resize(size_t(row_width) * output_rows);
+			rows = output_scratch.data();
+		}
+
+		GpuRenderer* gpu_renderer = gpuRenderer();
+		if (gpu_renderer != nullptr && GpuRenderer::supports(settings)) {
+			renderImageStreamed(gpu_renderer, thread_pool, cubemap, settings, [&](int y_begin, int y_end, const u32* band) {
+				std::copy(band, band + size_t(y_end - y_begin) * row_width, rows + size_t(y_begin) * row_width);
+			});
+		} else {
+			renderImage(thread_pool, cubemap, settings, rows);
+		}
+
+		if (!direct) {
+			thread_pool.parallelFor(output_rows, [&](int y, int) {
+				convertRow(&output_scratch[size_t(y) * row_width], row_width, out_format,
+					static_cast<u8*>(out_pixels) + out_stride * y);
+			});
+		}
+
+		for (int i = 0; i < num_faces; ++i)
+			face_storage[i] = std::move(cubemap.faces[i]);
+	}
+	return true;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "cubemap.hpp"
+#include "gpu_render.hpp"
+#include "projection.hpp"
+#include "projection_lut.hpp"
+#include "render.hpp"
+#include "sample_kernels.hpp"
+#include "thread_pool.hpp"
+
+// Layouts of pixels in caller-owned buffers. The 8-bit formats store one
+// byte per channel in the order named; RGB_FLOAT stores three native-endian
+// 32-bit floats.
+enum PixelFormat {
+	PIXELS_RGBA8,
+	PIXELS_BGRA8,
+	PIXELS_RGB8,
+	PIXELS_BGR8,
+	PIXELS_RGB_FLOAT
+};
+
+inline int pixelFormatBytes(PixelFormat format) {
+	switch (format) {
+	case PIXELS_RGB8:
+	case PIXELS_BGR8:      return 3;
+	case PIXELS_RGB_FLOAT: return 12;
+	default:               return 4;
+	}
+}
+
+// An input face in memory. stride is the distance in bytes from one row to
+// the next and may be negative for bottom-up images.
+struct FaceBuffer {
+	const void* pixels;
+	int width, height;
+	std::ptrdiff_t stride;
+	PixelFormat format;
+};
+
+// Everything about a conversion that stays the same from one call to the
+// next. The same combinations the command line rejects are invalid here:
+// adaptive AA with use_lut or a cube target, and FILTER_RGBE with adaptive
+// AA.
+struct ConverterOptions {
+	Mapping source;
+	Mapping target;
+	// 1, 5 or 16.
+	int num_aa_samples;
+	bool adaptive_aa;
+	int aa_threshold;
+	const SampleKernel* kernel;
+	// FILTER_RGBE converts HDR: float inputs at full range, 8-bit ones
+	// linearized, and float output. FILTER_SRGB reads and writes 8-bit sRGB
+	// and filters in linear light.
+	SampleFilter filter;
+	bool mipmaps;
+	bool use_lut;
+	// With use_lut, the table is loaded from and saved to this file if set.
+	std::string lut_filename;
+	int num_threads;
+	// Renders on an OpenCL GPU if there is one and GpuRenderer covers the
+	// options, and on the CPU otherwise.
+	bool use_gpu;
+
+	// The command line defaults: cube to equirect at 1x AA with the best
+	// kernel on every core.
+	ConverterOptions();
+};
+
+// The conversion pipeline as a library. A converter owns the worker threads,
+// the direction tables and the projection LUTs, which all only depend on the
+// options and the output size and are built on first use, so that a
+// long-lived converter pays for them once rather than on every call. It
+// also owns the BufferPool its calls take face and scratch memory from,
+// which is reused for as long as sizes stay the same.
+//
+// Calls must not overlap; use one converter per thread to convert
+// concurrently.
+class SpheremapConverter {
+public:
+	explicit SpheremapConverter(const ConverterOptions& options);
+
+	const ConverterOptions& options() const { return opts; }
+	TexelFormat texelFormat() const {
+		return opts.filter == FILTER_RGBE ? TEXELS_RGBE : opts.filter == FILTER_SRGB ? TEXELS_SRGB8 : TEXELS_RGBA8;
+	}
+	ThreadPool& threadPool() { return thread_pool; }
+	// For Cubemaps and renders outside convert to allocate from too; see
+	// BufferPool::Scope.
+	BufferPool& bufferPool() { return buffer_pool; }
+
+	// The GPU to render on, opened on first use, or nullptr if the options
+	// don't ask for one or it can't be used, which the first call prints.
+	GpuRenderer* gpuRenderer();
+
+	// Rows of an output whose faces are output_size pixels across. Cube
+	// output has its six faces stacked top to bottom in face order.
+	int outputHeight(int output_size) const { return mappingRows(opts.target, output_size); }
+
+	// The smallest output size that is nowhere coarser than input faces of
+	// width x height.
+	int autoSize(int width, int height) const { return matchingSize(opts.source, width, height, opts.target); }
+
+	// Render settings for region of outputs of output_size, pointing at
+	// tables that stay valid until the next call with a different size.
+	// counters is left unset.
+	RenderSettings settingsFor(int output_size, const OutputRegion& region);
+
+	RenderSettings settingsFor(int output_size) {
+		return settingsFor(output_size, wholeOutput(opts.target, output_size));
+	}
+
+	// The faces any whole output reads; the others are never sampled.
+	unsigned wholeOutputFaces() const {
+		return ::wholeOutputFaces(opts.source, opts.target, opts.mipmaps, opts.adaptive_aa || opts.use_lut);
+	}
+
+	// Converts the mappingFaces(source) faces in faces into out_pixels, which
+	// must hold outputHeight(output_size) rows of output_size pixels, rows
+	// out_stride bytes apart, or with region set just that part of the
+	// output. out_format must be PIXELS_RGB_FLOAT exactly when filtering is
+	// FILTER_RGBE; float inputs need FILTER_RGBE too. Faces outside
+	// wholeOutputFaces are never read and may have null pixels. Fails with a
+	// message on std::cerr if the buffers don't fit that.
+	bool convert(const FaceBuffer* faces, int output_size, void* out_pixels, std::ptrdiff_t out_stride,
+		PixelFormat out_format, const OutputRegion* region = nullptr);
+
+private:
+	SpheremapConverter(const SpheremapConverter&);
+	SpheremapConverter& operator= (const SpheremapConverter&);
+
+	bool checkBuffers(const FaceBuffer* faces, unsigned face_mask, int output_size, const OutputRegion& region,
+		const void* out_pixels, std::ptrdiff_t out_stride, PixelFormat out_format) const;
+
+	ConverterOptions opts;
+	const float* aa_sample_pattern;
+	ThreadPool thread_pool;
+
+	int tables_size;
+	std::unique_ptr<DirectionTables> directions, corner_directions;
+	std::map<int, ProjectionLut> luts;
+
+	bool gpu_checked;
+	std::unique_ptr<GpuRenderer> gpu;
+
+	// Declared ahead of everything that holds its blocks.
+	BufferPool buffer_pool;
+
+	// Kept between calls so inputs and outputs of the same size reuse their
+	// allocations.
+	Image face_storage[Cubemap::NUM_FACES];
+	std::vector<u32> output_scratch;
+};
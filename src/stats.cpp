@@ -0,0 +1,143 @@
+#include "stats.hpp"
+
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+double threadCpuSeconds() {
+#if defined(_WIN32)
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+		return 0;
+
+	// FILETIMEs count 100 ns ticks.
+	const u64 kernel_ticks = u64(kernel_time.dwHighDateTime) << 32 | kernel_time.dwLowDateTime;
+	const u64 user_ticks = u64(user_time.dwHighDateTime) << 32 | user_time.dwLowDateTime;
+	return (kernel_ticks + user_ticks) * 1e-7;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+	timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+	return 0;
+#endif
+}
+
+u64 peakRssBytes() {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return u64(usage.ru_maxrss);
+#else
+	return u64(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+JobStats::JobStats() :
+	ok(false), output_size(0), num_aa_samples(0), num_threads(0),
+	wall_seconds(0),
+	decode_wall_seconds(0), decode_cpu_seconds(0), bytes_read(0),
+	render_wall_seconds(0), render_cpu_seconds(0),
+	write_wall_seconds(0), write_cpu_seconds(0), bytes_written(0),
+	peak_rss_bytes(0), num_tiles(0), tiles_rendered(0), tile_loads(0),
+	pool_allocations(0), pool_reuses(0), unpooled_allocations(0)
+{
+	for (u64& hits : face_hits)
+		hits = 0;
+}
+
+std::string jsonString(const std::string& s) {
+	std::string out = "\"";
+	for (char c : s) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20) {
+				char escaped[8];
+				std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+				out += escaped;
+			} else {
+				out += c;
+			}
+		}
+	}
+	return out + "\"";
+}
+
+namespace {
+
+// Throughput that stays valid JSON even for stages too short to time.
+double perSecond(double amount, double seconds) {
+	return seconds > 0 ? amount / seconds : 0;
+}
+
+} // namespace
+
+void writeJsonLine(std::ostream& out, const JobStats& stats) {
+	u64 num_samples = 0;
+	for (u64 hits : stats.face_hits)
+		num_samples += hits;
+
+	std::ostringstream line;
+	line << std::setprecision(6)
+		<< "{\"input\":" << jsonString(stats.input)
+		<< ",\"output\":" << jsonString(stats.output)
+		<< ",\"ok\":" << (stats.ok ? "true" : "false")
+		<< ",\"output_size\":" << stats.output_size
+		<< ",\"aa_samples\":" << stats.num_aa_samples
+		<< ",\"kernel\":" << jsonString(stats.kernel)
+		<< ",\"filter\":" << jsonString(stats.filter)
+		<< ",\"threads\":" << stats.num_threads
+		<< ",\"wall_s\":" << stats.wall_seconds
+		<< ",\"decode\":{\"wall_s\":" << stats.decode_wall_seconds
+		<< ",\"cpu_s\":" << stats.decode_cpu_seconds
+		<< ",\"bytes_read\":" << stats.bytes_read << "}"
+		<< ",\"render\":{\"wall_s\":" << stats.render_wall_seconds
+		<< ",\"cpu_s\":" << stats.render_cpu_seconds
+		<< ",\"samples\":" << num_samples
+		<< ",\"samples_per_s\":" << perSecond(double(num_samples), stats.render_wall_seconds)
+		<< ",\"face_hits\":[";
+	for (int f = 0; f < Cubemap::NUM_FACES; ++f)
+		line << (f == 0 ? "" : ",") << stats.face_hits[f];
+	line << "]}"
+		<< ",\"write\":{\"wall_s\":" << stats.write_wall_seconds
+		<< ",\"cpu_s\":" << stats.write_cpu_seconds
+		<< ",\"bytes_written\":" << stats.bytes_written << "}"
+		<< ",\"peak_rss_bytes\":" << stats.peak_rss_bytes
+		<< ",\"allocations\":{\"pooled\":" << stats.pool_allocations
+		<< ",\"reused\":" << stats.pool_reuses
+		<< ",\"unpooled\":" << stats.unpooled_allocations << "}";
+	if (stats.num_tiles > 0)
+		line << ",\"tiles\":{\"total\":" << stats.num_tiles << ",\"rendered\":" << stats.tiles_rendered << "}";
+	if (stats.tile_loads > 0)
+		line << ",\"tile_loads\":" << stats.tile_loads;
+	line << "}\n";
+
+	// One write per line keeps lines whole if several writers share a pipe.
+	out << line.str() << std::flush;
+}
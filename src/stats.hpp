@@ -0,0 +1,71 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+
+#include "cubemap.hpp"
+
+// CPU time consumed by the calling thread so far, or 0 where the platform
+// can't tell.
+double threadCpuSeconds();
+
+// Largest resident set the process has had, or 0 where unknown.
+u64 peakRssBytes();
+
+// Everything -stats reports about one job. Times are in seconds.
+struct JobStats {
+	std::string input;
+	std::string output;
+	bool ok;
+
+	int output_size;
+	int num_aa_samples;
+	// The sampling kernel, or "gpu" for jobs the GPU rendered, which count no
+	// face hits or render CPU time.
+	std::string kernel;
+	std::string filter;
+	int num_threads;
+
+	double wall_seconds;
+
+	// Faces decode concurrently, so decode wall time is until the last face
+	// is done and its CPU time is summed over the faces.
+	double decode_wall_seconds;
+	double decode_cpu_seconds;
+	u64 bytes_read;
+
+	double render_wall_seconds;
+	double render_cpu_seconds;
+	u64 face_hits[Cubemap::NUM_FACES];
+
+	double write_wall_seconds;
+	double write_cpu_seconds;
+	u64 bytes_written;
+
+	u64 peak_rss_bytes;
+
+	// Output tiles of a -cache job and how many of them were rendered; both
+	// 0 without -cache.
+	int num_tiles;
+	int tiles_rendered;
+
+	// Face tiles read from disk with -mem-limit; 0 without.
+	u64 tile_loads;
+
+	// Blocks the converter's BufferPool took from the system and handed out
+	// again, and pool requests served straight from the system instead (see
+	// BufferPool::directAllocations), all during the job. Heap allocations
+	// that don't go through the pool aren't counted. With the next job's
+	// faces decoding meanwhile, that takes in some of its allocations too.
+	u64 pool_allocations;
+	u64 pool_reuses;
+	u64 unpooled_allocations;
+
+	JobStats();
+};
+
+// s as a quoted JSON string.
+std::string jsonString(const std::string& s);
+
+// Writes stats as one line of JSON.
+void writeJsonLine(std::ostream& out, const JobStats& stats);
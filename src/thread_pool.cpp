@@ -0,0 +1,151 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+namespace {
+
+inline uint64_t packRange(uint32_t begin, uint32_t end) {
+	return uint64_t(begin) << 32 | end;
+}
+
+inline uint32_t rangeBegin(uint64_t range) {
+	return uint32_t(range >> 32);
+}
+
+inline uint32_t rangeEnd(uint64_t range) {
+	return uint32_t(range);
+}
+
+} // namespace
+
+ThreadPool::ThreadPool(int num_threads) :
+	num_threads(std::max(num_threads, 1)),
+	job(nullptr), job_generation(0), workers_busy(0), shutting_down(false),
+	ranges(new std::atomic<uint64_t>[std::max(num_threads, 1)])
+{
+	for (int i = 0; i < this->num_threads; ++i)
+		ranges[i].store(0);
+
+	for (int i = 1; i < this->num_threads; ++i)
+		threads.emplace_back(&ThreadPool::workerMain, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		shutting_down = true;
+	}
+	work_cv.notify_all();
+
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+int ThreadPool::defaultThreadCount() {
+	unsigned int hw_threads = std::thread::hardware_concurrency();
+	return hw_threads != 0 ? static_cast<int>(hw_threads) : 1;
+}
+
+void ThreadPool::run(const std::function<void(int)>& fn) {
+	if (num_threads > 1) {
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &fn;
+		++job_generation;
+		workers_busy = num_threads - 1;
+	}
+	work_cv.notify_all();
+
+	fn(0);
+
+	if (num_threads > 1) {
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock, [this] { return workers_busy == 0; });
+		job = nullptr;
+	}
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int, int)>& fn) {
+	if (count <= 0)
+		return;
+
+	for (int i = 0; i < num_threads; ++i) {
+		uint32_t begin = uint32_t(int64_t(count) * i / num_threads);
+		uint32_t end = uint32_t(int64_t(count) * (i + 1) / num_threads);
+		ranges[i].store(packRange(begin, end));
+	}
+
+	run([&](int worker_index) {
+		int index;
+		do {
+			while (popIndex(worker_index, index))
+				fn(index, worker_index);
+		} while (stealRange(worker_index));
+	});
+}
+
+void ThreadPool::workerMain(int worker_index) {
+	uint64_t seen_generation = 0;
+
+	for (;;) {
+		const std::function<void(int)>* current_job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			work_cv.wait(lock, [&] { return shutting_down || job_generation != seen_generation; });
+			if (shutting_down)
+				return;
+
+			seen_generation = job_generation;
+			current_job = job;
+		}
+
+		(*current_job)(worker_index);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--workers_busy;
+		}
+		done_cv.notify_one();
+	}
+}
+
+bool ThreadPool::popIndex(int worker_index, int& out_index) {
+	std::atomic<uint64_t>& range = ranges[worker_index];
+	uint64_t cur = range.load();
+
+	while (rangeBegin(cur) < rangeEnd(cur)) {
+		if (range.compare_exchange_weak(cur, packRange(rangeBegin(cur) + 1, rangeEnd(cur)))) {
+			out_index = static_cast<int>(rangeBegin(cur));
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::stealRange(int worker_index) {
+	for (;;) {
+		int victim = -1;
+		uint32_t victim_size = 0;
+		for (int i = 0; i < num_threads; ++i) {
+			uint64_t cur = ranges[i].load();
+			uint32_t size = rangeEnd(cur) > rangeBegin(cur) ? rangeEnd(cur) - rangeBegin(cur) : 0;
+			if (i != worker_index && size > victim_size) {
+				victim = i;
+				victim_size = size;
+			}
+		}
+
+		if (victim < 0)
+			return false;
+
+		uint64_t cur = ranges[victim].load();
+		uint32_t begin = rangeBegin(cur), end = rangeEnd(cur);
+		if (begin >= end)
+			continue;
+
+		uint32_t mid = begin + (end - begin) / 2;
+		if (ranges[victim].compare_exchange_strong(cur, packRange(begin, mid))) {
+			ranges[worker_index].store(packRange(mid, end));
+			return true;
+		}
+	}
+}
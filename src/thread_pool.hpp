@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads. The calling thread always takes part in
+// the work as worker 0, so a pool of size 1 never spawns any threads.
+class ThreadPool {
+public:
+	explicit ThreadPool(int num_threads);
+	~ThreadPool();
+
+	int size() const { return num_threads; }
+
+	// Calls fn(worker_index) once on every worker and waits for all of them.
+	void run(const std::function<void(int)>& fn);
+
+	// Calls fn(index, worker_index) for every index in [0, count). Indices are
+	// initially split into one contiguous range per worker; workers that run
+	// out steal the upper half of the largest remaining range.
+	void parallelFor(int count, const std::function<void(int, int)>& fn);
+
+	static int defaultThreadCount();
+
+private:
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator= (const ThreadPool&);
+
+	void workerMain(int worker_index);
+	bool popIndex(int worker_index, int& out_index);
+	bool stealRange(int worker_index);
+
+	int num_threads;
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable work_cv;
+	std::condition_variable done_cv;
+	const std::function<void(int)>* job;
+	uint64_t job_generation;
+	int workers_busy;
+	bool shutting_down;
+
+	// Per-worker [begin, end) ranges used by parallelFor, packed into one word
+	// so the owner and thieves can update them with a single CAS.
+	std::unique_ptr<std::atomic<uint64_t>[]> ranges;
+};
@@ -0,0 +1,124 @@
+#include "tile_merge.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+namespace {
+
+// Output rows assembled at a time.
+const int merge_band_height = 64;
+
+} // namespace
+
+bool TileSource::open(const std::string& filename, TexelFormat texel_format) {
+	if (texel_format == TEXELS_RGBE && !hasExtension(filename, "hdr")) {
+		std::cerr << filename << ": -hdr merges .hdr tiles only.\n";
+		return false;
+	}
+
+	mapped = texel_format == TEXELS_RGBA8 && file.open(filename) && view.open(filename, file);
+	if (mapped) {
+		width = view.width;
+		height = view.height;
+		return true;
+	}
+
+	image = Image(filename, 0, texel_format);
+	width = image.width;
+	height = image.height;
+	return image.loaded();
+}
+
+bool readTileManifest(std::istream& in, const std::string& source_name, std::vector<MergeTile>& out_tiles) {
+	std::string line;
+	for (int line_number = 1; std::getline(in, line); ++line_number) {
+		std::istringstream fields(line);
+		MergeTile tile;
+		if (!(fields >> tile.filename) || tile.filename[0] == '#')
+			continue;
+
+		tile.x = tile.y = -1;
+		std::string x_field, y_field;
+		if (fields >> x_field) {
+			char* x_end;
+			char* y_end;
+			fields >> y_field;
+			tile.x = static_cast<int>(std::strtol(x_field.c_str(), &x_end, 10));
+			tile.y = static_cast<int>(std::strtol(y_field.c_str(), &y_end, 10));
+			if (y_field.empty() || *x_end != '\0' || *y_end != '\0' || tile.x < 0 || tile.y < 0) {
+				std::cerr << source_name << ":" << line_number << ": Invalid tile position.\n";
+				return false;
+			}
+		}
+
+		out_tiles.push_back(tile);
+	}
+	return true;
+}
+
+bool mergeTiles(std::vector<MergeTile> tiles, const std::string& output_fname, RowWriter::Format format, int num_files,
+	TexelFormat texel_format, const EncodeOptions& encode)
+{
+	if (tiles.empty()) {
+		std::cerr << "No tiles to merge.\n";
+		return false;
+	}
+
+	std::vector<std::unique_ptr<TileSource>> sources;
+	int width = 0, height = 0;
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		std::unique_ptr<TileSource> source(new TileSource);
+		if (!source->open(tiles[i].filename, texel_format))
+			return false;
+
+		source->x = tiles[i].x >= 0 ? tiles[i].x : 0;
+		source->y = tiles[i].y >= 0 ? tiles[i].y : i == 0 ? 0 : sources.back()->y + sources.back()->height;
+		width = std::max(width, source->x + source->width);
+		height = std::max(height, source->y + source->height);
+		sources.push_back(std::move(source));
+	}
+
+	if (height % num_files != 0) {
+		std::cerr << "Merged height " << height << " doesn't split into " << num_files << " faces.\n";
+		return false;
+	}
+
+	// Counting by row only misses a gap and an overlap that cancel out within
+	// the same rows.
+	std::vector<int> row_coverage(height, 0);
+	for (const std::unique_ptr<TileSource>& source : sources) {
+		for (int y = source->y; y < source->y + source->height; ++y)
+			row_coverage[y] += source->width;
+	}
+	for (int y = 0; y < height; ++y) {
+		if (row_coverage[y] != width) {
+			std::cerr << "Tiles don't cover row " << y << " of the " << width << "x" << height << " output exactly once.\n";
+			return false;
+		}
+	}
+
+	OutputWriter writer;
+	if (!writer.open(output_fname, format, width, height, num_files, encode))
+		return false;
+
+	std::vector<u32> band(size_t(width) * merge_band_height);
+	for (int band_y = 0; band_y < height; band_y += merge_band_height) {
+		const int band_end = std::min(band_y + merge_band_height, height);
+		for (const std::unique_ptr<TileSource>& source : sources) {
+			const int y_begin = std::max(band_y, source->y);
+			const int y_end = std::min(band_end, source->y + source->height);
+			for (int y = y_begin; y < y_end; ++y)
+				source->readRow(y - source->y, &band[size_t(y - band_y) * width + source->x]);
+		}
+		writer.writeRows(band.data(), band_end - band_y);
+	}
+
+	if (!writer.close()) {
+		writer.discard();
+		return false;
+	}
+	return true;
+}
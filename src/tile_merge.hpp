@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "cubemap.hpp"
+#include "mapped_file.hpp"
+#include "row_writer.hpp"
+
+// A rendered region in its own image file, to be placed with its top-left
+// corner at (x, y) of the merged output. Negative coordinates place it at
+// the left edge right below the tile before it, which is where consecutive
+// -tile strips go.
+struct MergeTile {
+	std::string filename;
+	int x, y;
+};
+
+// The pixels of a tile or of any other image RowWriter wrote, mapped where
+// the format allows and decoded otherwise. x and y are where the tile goes.
+struct TileSource {
+	int x, y;
+	int width, height;
+	bool mapped;
+	MappedFile file;
+	PixelView view;
+	Image image;
+
+	TileSource() : x(0), y(0), width(0), height(0), mapped(false) {}
+
+	// With TEXELS_RGBE, filename must be a Radiance .hdr file. Prints what
+	// went wrong on failure.
+	bool open(const std::string& filename, TexelFormat texel_format);
+
+	void readRow(int row, u32* out) const {
+		if (mapped)
+			view.readRow(row, out);
+		else
+			std::copy(image.pixel(0, row), image.pixel(0, row) + width, out);
+	}
+
+private:
+	TileSource(const TileSource&);
+	TileSource& operator= (const TileSource&);
+};
+
+// Reads a merge manifest: one tile per line, given as
+//   tile_file [x y]
+// Blank lines and lines starting with # are skipped.
+bool readTileManifest(std::istream& in, const std::string& source_name, std::vector<MergeTile>& out_tiles);
+
+// Stitches tiles into an output as large as their extent, which they must
+// cover exactly once, and writes it like OutputWriter with num_files face
+// files. Rows are streamed top to bottom: uncompressed TGA and BMP tiles are
+// read straight from mapped files, other tiles are decoded whole. With
+// TEXELS_RGBE the tiles must be Radiance .hdr files. Prints what went wrong
+// on failure.
+bool mergeTiles(std::vector<MergeTile> tiles, const std::string& output_fname, RowWriter::Format format, int num_files,
+	TexelFormat texel_format, const EncodeOptions& encode = EncodeOptions());